@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "chat_cliente.h"
+
+// Mede a memória residente do servidor por conexão ociosa: abre as sessões, espera todas serem aprovadas
+// e compara o VmRSS do processo do servidor antes e depois. As sessões ficam paradas, sem enviar mensagens
+//
+// Uso: bench_conexoes -p pid_do_servidor [-n conexoes] [-u caminho_unix]
+
+#define SERVER_IP "127.0.0.1"
+#define SERVER_PORT 12345
+#define CONEXOES_PADRAO 900
+#define PRAZO_APROVACAO_MS 30000 // desiste se as sessões não forem aprovadas nesse prazo
+#define ESPERA_ESTABILIZAR_MS 500 // tempo para o servidor concluir o que ainda estiver pendente
+
+long long agora_ms()
+{
+    struct timespec agora;
+
+    clock_gettime(CLOCK_MONOTONIC, &agora);
+
+    return (long long)agora.tv_sec * 1000 + agora.tv_nsec / 1000000;
+}
+
+// Lê o VmRSS do processo, em kB. Retorna -1 se o processo não existe
+long le_residente_kb(int pid)
+{
+    char caminho[64], linha[256];
+    long residente = -1;
+    FILE *status;
+
+    snprintf(caminho, sizeof(caminho), "/proc/%d/status", pid);
+
+    status = fopen(caminho, "r");
+    if (status == NULL)
+    {
+        return -1;
+    }
+
+    while (fgets(linha, sizeof(linha), status) != NULL)
+    {
+        if (sscanf(linha, "VmRSS: %ld", &residente) == 1)
+        {
+            break;
+        }
+    }
+
+    fclose(status);
+
+    return residente;
+}
+
+// Conduz todas as sessões até a aprovação. Retorna quantas foram aprovadas
+int aguarda_aprovacao(ChatCliente *sessoes[], int total)
+{
+    int i, aprovadas = 0, eventos;
+    long long prazo = agora_ms() + PRAZO_APROVACAO_MS;
+    struct pollfd *descritores = calloc(total, sizeof(struct pollfd));
+
+    while (agora_ms() < prazo)
+    {
+        aprovadas = 0;
+
+        for (i = 0; i < total; i++)
+        {
+            descritores[i].fd = -1;
+            descritores[i].events = 0;
+
+            if (chat_estado(sessoes[i]) == CHAT_APROVADO && !(chat_eventos(sessoes[i]) & CHAT_ESCREVER))
+            {
+                aprovadas++;
+                continue;
+            }
+
+            if (chat_estado(sessoes[i]) == CHAT_ENCERRADO)
+            {
+                continue;
+            }
+
+            eventos = chat_eventos(sessoes[i]);
+            descritores[i].fd = chat_descritor(sessoes[i]);
+            descritores[i].events = (eventos & CHAT_LER ? POLLIN : 0) | (eventos & CHAT_ESCREVER ? POLLOUT : 0);
+        }
+
+        if (aprovadas == total)
+        {
+            break;
+        }
+
+        if (poll(descritores, total, 100) < 0)
+        {
+            break;
+        }
+
+        for (i = 0; i < total; i++)
+        {
+            if (descritores[i].fd >= 0 && descritores[i].revents != 0)
+            {
+                chat_processa(sessoes[i], (descritores[i].revents & (POLLIN | POLLHUP | POLLERR) ? CHAT_LER : 0) | (descritores[i].revents & POLLOUT ? CHAT_ESCREVER : 0));
+            }
+        }
+    }
+
+    free(descritores);
+
+    return aprovadas;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, opcao, pid = 0, total = CONEXOES_PADRAO, aprovadas;
+    long antes_kb, depois_kb;
+    char *caminho_unix = NULL;
+    char nome[32];
+    ChatCliente **sessoes;
+    struct rlimit limite;
+
+    while ((opcao = getopt(argc, argv, "p:n:u:")) != -1)
+    {
+        switch (opcao)
+        {
+        case 'p':
+            pid = atoi(optarg);
+            break;
+
+        case 'n':
+            total = atoi(optarg);
+            break;
+
+        case 'u':
+            caminho_unix = optarg;
+            break;
+
+        default:
+            fprintf(stderr, "Uso: %s -p pid_do_servidor [-n conexoes] [-u caminho_unix]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    antes_kb = le_residente_kb(pid);
+    if (pid <= 0 || antes_kb < 0 || total <= 0)
+    {
+        fprintf(stderr, "Uso: %s -p pid_do_servidor [-n conexoes] [-u caminho_unix]\n", argv[0]);
+        exit(1);
+    }
+
+    // Cada sessão ocupa um descritor neste processo
+    if (getrlimit(RLIMIT_NOFILE, &limite) == 0 && limite.rlim_cur < (rlim_t)total + 16)
+    {
+        limite.rlim_cur = limite.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limite);
+    }
+
+    sessoes = calloc(total, sizeof(ChatCliente *));
+
+    for (i = 0; i < total; i++)
+    {
+        snprintf(nome, sizeof(nome), "ocioso%d", i);
+        sessoes[i] = chat_cria(nome, NULL, NULL);
+
+        if (sessoes[i] == NULL || (caminho_unix != NULL ? chat_conecta_unix(sessoes[i], caminho_unix) : chat_conecta_tcp(sessoes[i], SERVER_IP, SERVER_PORT)) < 0)
+        {
+            perror("\n Erro ao conectar");
+            exit(1);
+        }
+    }
+
+    aprovadas = aguarda_aprovacao(sessoes, total);
+    usleep(ESPERA_ESTABILIZAR_MS * 1000);
+
+    depois_kb = le_residente_kb(pid);
+
+    printf("conexões aprovadas: %d de %d\n", aprovadas, total);
+    printf("residente antes:    %ld kB\n", antes_kb);
+    printf("residente depois:   %ld kB\n", depois_kb);
+
+    if (aprovadas > 0)
+    {
+        printf("acréscimo por conexão ociosa: %ld bytes\n", (depois_kb - antes_kb) * 1024 / aprovadas);
+        printf("residente total por conexão: %ld bytes\n", depois_kb * 1024 / aprovadas);
+    }
+
+    for (i = 0; i < total; i++)
+    {
+        chat_destroi(sessoes[i]);
+    }
+
+    free(sessoes);
+
+    return aprovadas == total ? 0 : 1;
+}
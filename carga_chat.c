@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "chat_cliente.h"
+
+// Gerador de carga: as sessões entram na sala padrão e enviam mensagens num ritmo fixo, cada uma com o
+// instante do envio. Toda sessão que recebe a mensagem calcula a latência de ponta a ponta (envio, servidor,
+// entrega); ao final são exibidos a vazão e os percentis das latências. Como remetentes e destinatários
+// estão no mesmo processo, o relógio é o mesmo nas duas pontas
+//
+// Uso: carga_chat [-n sessoes] [-r mensagens_por_segundo] [-d segundos] [-u caminho_unix]
+
+#define SERVER_IP "127.0.0.1"
+#define SERVER_PORT 12345
+#define SESSOES_PADRAO 50
+#define RITMO_PADRAO 20           // mensagens por segundo de cada sessão
+#define DURACAO_PADRAO 10         // segundos de medição
+#define PRAZO_APROVACAO_MS 30000  // desiste se as sessões não forem aprovadas nesse prazo
+#define DRENAGEM_MS 500           // tempo para receber as últimas mensagens depois do fim dos envios
+#define MARCA_CARGA "carga "      // prefixo das mensagens do gerador, seguido do instante do envio em ns
+
+// Latências medidas, em nanossegundos
+typedef struct amostras
+{
+    long long *valores;
+    long total;
+    long capacidade;
+} Amostras;
+
+long long agora_ns()
+{
+    struct timespec agora;
+
+    clock_gettime(CLOCK_MONOTONIC, &agora);
+
+    return (long long)agora.tv_sec * 1000000000LL + agora.tv_nsec;
+}
+
+// Função chamada pela biblioteca para cada mensagem recebida: registra a latência das mensagens do gerador
+void registra_latencia(ChatCliente *cliente, const char *mensagem, int tamanho, void *contexto)
+{
+    Amostras *amostras = contexto;
+    long long enviada;
+
+    if (strncmp(mensagem, MARCA_CARGA, strlen(MARCA_CARGA)) || sscanf(mensagem + strlen(MARCA_CARGA), "%lld", &enviada) != 1)
+    {
+        return;
+    }
+
+    if (amostras->total == amostras->capacidade)
+    {
+        amostras->capacidade = amostras->capacidade ? amostras->capacidade * 2 : 65536;
+        amostras->valores = realloc(amostras->valores, amostras->capacidade * sizeof(long long));
+    }
+
+    amostras->valores[amostras->total++] = agora_ns() - enviada;
+}
+
+int compara_latencias(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Latência do percentil, em microssegundos
+double percentil_us(Amostras *amostras, double percentil)
+{
+    long posicao = (long)(percentil / 100.0 * (amostras->total - 1));
+
+    return amostras->valores[posicao] / 1000.0;
+}
+
+// Avança as sessões com os eventos prontos, esperando no máximo espera_ms. Retorna quantas estão aprovadas
+int processa_sessoes(ChatCliente *sessoes[], struct pollfd descritores[], int total, int espera_ms)
+{
+    int i, eventos, aprovadas = 0;
+
+    for (i = 0; i < total; i++)
+    {
+        eventos = chat_estado(sessoes[i]) == CHAT_ENCERRADO ? 0 : chat_eventos(sessoes[i]);
+        descritores[i].fd = eventos ? chat_descritor(sessoes[i]) : -1;
+        descritores[i].events = (eventos & CHAT_LER ? POLLIN : 0) | (eventos & CHAT_ESCREVER ? POLLOUT : 0);
+    }
+
+    if (poll(descritores, total, espera_ms) < 0)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < total; i++)
+    {
+        if (descritores[i].fd >= 0 && descritores[i].revents != 0)
+        {
+            chat_processa(sessoes[i], (descritores[i].revents & (POLLIN | POLLHUP | POLLERR) ? CHAT_LER : 0) | (descritores[i].revents & POLLOUT ? CHAT_ESCREVER : 0));
+        }
+
+        if (chat_estado(sessoes[i]) == CHAT_APROVADO)
+        {
+            aprovadas++;
+        }
+    }
+
+    return aprovadas;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, opcao, total = SESSOES_PADRAO, ritmo = RITMO_PADRAO, duracao = DURACAO_PADRAO, aprovadas = 0, espera_ms;
+    long enviadas = 0;
+    long long inicio, fim, intervalo, agora, proximo, *proximos;
+    char *caminho_unix = NULL;
+    char nome[32], mensagem[64];
+    ChatCliente **sessoes;
+    struct pollfd *descritores;
+    struct rlimit limite;
+    Amostras amostras = {NULL, 0, 0};
+
+    while ((opcao = getopt(argc, argv, "n:r:d:u:")) != -1)
+    {
+        switch (opcao)
+        {
+        case 'n':
+            total = atoi(optarg);
+            break;
+
+        case 'r':
+            ritmo = atoi(optarg);
+            break;
+
+        case 'd':
+            duracao = atoi(optarg);
+            break;
+
+        case 'u':
+            caminho_unix = optarg;
+            break;
+
+        default:
+            fprintf(stderr, "Uso: %s [-n sessoes] [-r mensagens_por_segundo] [-d segundos] [-u caminho_unix]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (total <= 0 || ritmo <= 0 || duracao <= 0)
+    {
+        fprintf(stderr, "Uso: %s [-n sessoes] [-r mensagens_por_segundo] [-d segundos] [-u caminho_unix]\n", argv[0]);
+        exit(1);
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &limite) == 0 && limite.rlim_cur < (rlim_t)total + 16)
+    {
+        limite.rlim_cur = limite.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limite);
+    }
+
+    sessoes = calloc(total, sizeof(ChatCliente *));
+    descritores = calloc(total, sizeof(struct pollfd));
+    proximos = calloc(total, sizeof(long long));
+
+    for (i = 0; i < total; i++)
+    {
+        snprintf(nome, sizeof(nome), "carga%d", i);
+        sessoes[i] = chat_cria(nome, registra_latencia, &amostras);
+
+        if (sessoes[i] == NULL || (caminho_unix != NULL ? chat_conecta_unix(sessoes[i], caminho_unix) : chat_conecta_tcp(sessoes[i], SERVER_IP, SERVER_PORT)) < 0)
+        {
+            perror("\n Erro ao conectar");
+            exit(1);
+        }
+    }
+
+    fim = agora_ns() + PRAZO_APROVACAO_MS * 1000000LL;
+    while (aprovadas < total && agora_ns() < fim)
+    {
+        aprovadas = processa_sessoes(sessoes, descritores, total, 100);
+    }
+
+    if (aprovadas < total)
+    {
+        fprintf(stderr, "Apenas %d de %d sessões aprovadas\n", aprovadas, total);
+        exit(1);
+    }
+
+    // Sem o algoritmo de Nagle, a latência medida é a do servidor, e não a da espera pelo ACK atrasado
+    for (i = 0; i < total; i++)
+    {
+        opcao = 1;
+        setsockopt(chat_descritor(sessoes[i]), IPPROTO_TCP, TCP_NODELAY, &opcao, sizeof(opcao));
+    }
+
+    // Os envios de cada sessão são espalhados pelo intervalo, para não chegarem todos juntos
+    intervalo = 1000000000LL / ritmo;
+    inicio = agora_ns();
+    fim = inicio + duracao * 1000000000LL;
+
+    for (i = 0; i < total; i++)
+    {
+        proximos[i] = inicio + intervalo * i / total;
+    }
+
+    while ((agora = agora_ns()) < fim + DRENAGEM_MS * 1000000LL)
+    {
+        for (i = 0; i < total && agora < fim; i++)
+        {
+            if (proximos[i] > agora)
+            {
+                continue;
+            }
+
+            snprintf(mensagem, sizeof(mensagem), MARCA_CARGA "%lld", agora_ns());
+            chat_envia(sessoes[i], mensagem, strlen(mensagem));
+            chat_descarrega(sessoes[i]);
+            proximos[i] += intervalo;
+            enviadas++;
+        }
+
+        // Espera até o próximo envio, em milissegundos inteiros, ou até o fim da drenagem
+        proximo = agora < fim ? fim : fim + DRENAGEM_MS * 1000000LL;
+        for (i = 0; i < total; i++)
+        {
+            proximo = proximos[i] < proximo ? proximos[i] : proximo;
+        }
+
+        espera_ms = (proximo - agora_ns()) / 1000000;
+        processa_sessoes(sessoes, descritores, total, espera_ms > 0 ? espera_ms : 0);
+    }
+
+    printf("sessões: %d, mensagens enviadas: %ld (%.0f/s), entregas: %ld (%.0f/s)\n", total, enviadas, enviadas / (double)duracao,
+           amostras.total, amostras.total / (double)duracao);
+
+    if (amostras.total > 0)
+    {
+        qsort(amostras.valores, amostras.total, sizeof(long long), compara_latencias);
+
+        printf("latência (us): p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f  máxima %.0f\n", percentil_us(&amostras, 50), percentil_us(&amostras, 90),
+               percentil_us(&amostras, 99), percentil_us(&amostras, 99.9), percentil_us(&amostras, 100));
+    }
+
+    for (i = 0; i < total; i++)
+    {
+        chat_destroi(sessoes[i]);
+    }
+
+    free(sessoes);
+    free(descritores);
+    free(proximos);
+    free(amostras.valores);
+
+    return 0;
+}
@@ -0,0 +1,1310 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>
+
+#ifdef COM_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#endif
+
+#include "chat_cliente.h"
+
+#define TAMANHO_NOME 101
+#define TAMANHO_INICIAL_BUFFER 512
+#define TAMANHO_CAMINHO 256
+#define TAMANHO_CONTROLE 128
+#define MARCA_SESSAO "\001SESSAO"     // pedido de sessão retomável e resposta com token e sequência atual
+#define MARCA_RETOMAR "\001RETOMAR "  // retomada da sessão, enviada no lugar do nome
+#define MARCA_EXPIRADA "\001EXPIRADA" // a sessão não pode ser retomada e o nome deve ser enviado
+#define MARCA_MENSAGEM "\001MSG "     // mensagem da sala com a sua sequência
+#define MARCA_CONFIRMACAO "\001ACK "  // confirmação cumulativa da maior sequência processada
+#define MARCA_EVENTO "\001EVENTO "    // evento efêmero enviado ao servidor
+#define MARCA_EVENTOS "\001EVENTOS "  // lote de eventos da sala, uma linha "nome\testado" por usuário
+#define MARCA_ENVIA "\001ENVIA "      // conexão de dados do remetente, no lugar do nome
+#define MARCA_RECEBE "\001RECEBE "    // conexão de dados do destinatário, no lugar do nome
+#define MARCA_ARQUIVO "\001ARQUIVO "  // arquivo oferecido por outro usuário
+#define MARCA_DESDE "\001DESDE "      // deslocamento a partir do qual seguem os bytes do arquivo
+#define MARCA_CONCLUIDA "\001CONCLUIDA" // o destinatário recebeu o arquivo inteiro
+#define MARCA_RECUSADA "\001RECUSADA " // transferência recusada pelo servidor
+#define TAMANHO_BLOCO_ARQUIVO 65536
+
+// Buffer de bytes que cresce sob demanda; os dados válidos ficam entre inicio e inicio + tamanho
+typedef struct chat_buffer
+{
+    char *dados;
+    int inicio;
+    int tamanho;
+    int capacidade;
+} ChatBuffer;
+
+struct chat_cliente
+{
+    int socket;
+    int estado;
+    char nome[TAMANHO_NOME];
+    ChatAoReceber ao_receber;
+    void *contexto;
+    ChatAoEvento ao_evento;
+    void *contexto_evento;
+    ChatAoArquivo ao_arquivo;
+    void *contexto_arquivo;
+    ChatBuffer entrada; // bytes recebidos ainda não entregues como mensagens
+    ChatBuffer saida;   // mensagens já no formato da rede aguardando envio
+    ChatBuffer espera;  // mensagens enviadas antes da aprovação
+    int encerrar_envio;
+    int envio_encerrado;
+    unsigned long long token;      // token de retomada recebido do servidor; 0 enquanto não houver
+    unsigned long long ultima_seq; // sequência da última mensagem da sala processada pelo callback
+    unsigned long long ultimo_ack; // maior sequência já confirmada ao servidor
+    int intervalo_ack_ms;          // intervalo mínimo entre confirmações; 0 desativa as confirmações
+    long long proximo_ack_ms;      // instante a partir do qual a próxima confirmação pode seguir
+    int retomando;                 // pedido de retomada enviado, aguardando a resposta
+    struct sockaddr_storage endereco; // endereço da conexão, usado por chat_reconecta
+    socklen_t tamanho_endereco;
+#ifdef COM_TLS
+    int usar_tls;
+    int tls_quer;  // evento que o handshake TLS aguarda
+    char arquivo_sessao[TAMANHO_CAMINHO];
+    SSL_CTX *contexto_tls;
+    SSL *tls;
+#endif
+};
+
+// Garante espaço para mais bytes no fim do buffer, descartando antes o que já foi consumido
+static int buffer_reserva(ChatBuffer *buffer, int adicional)
+{
+    int capacidade;
+    char *dados;
+
+    if (buffer->inicio > 0)
+    {
+        memmove(buffer->dados, buffer->dados + buffer->inicio, buffer->tamanho);
+        buffer->inicio = 0;
+    }
+
+    if (buffer->tamanho + adicional <= buffer->capacidade)
+    {
+        return 0;
+    }
+
+    capacidade = buffer->capacidade ? buffer->capacidade : TAMANHO_INICIAL_BUFFER;
+    while (capacidade < buffer->tamanho + adicional)
+    {
+        capacidade *= 2;
+    }
+
+    dados = realloc(buffer->dados, capacidade);
+    if (dados == NULL)
+    {
+        return -1;
+    }
+
+    buffer->dados = dados;
+    buffer->capacidade = capacidade;
+
+    return 0;
+}
+
+// Acrescenta uma mensagem no formato da rede: tamanho seguido do conteúdo
+static int buffer_acrescenta_mensagem(ChatBuffer *buffer, const char *mensagem, int tamanho)
+{
+    if (buffer_reserva(buffer, sizeof(int) + tamanho) < 0)
+    {
+        return -1;
+    }
+
+    memcpy(buffer->dados + buffer->tamanho, &tamanho, sizeof(int));
+    memcpy(buffer->dados + buffer->tamanho + sizeof(int), mensagem, tamanho);
+    buffer->tamanho += sizeof(int) + tamanho;
+
+    return 0;
+}
+
+// Move todo o conteúdo de um buffer para o fim de outro
+static int buffer_transfere(ChatBuffer *destino, ChatBuffer *origem)
+{
+    if (origem->tamanho == 0)
+    {
+        return 0;
+    }
+
+    if (buffer_reserva(destino, origem->tamanho) < 0)
+    {
+        return -1;
+    }
+
+    memcpy(destino->dados + destino->tamanho, origem->dados + origem->inicio, origem->tamanho);
+    destino->tamanho += origem->tamanho;
+    origem->inicio = 0;
+    origem->tamanho = 0;
+
+    return 0;
+}
+
+static void buffer_libera(ChatBuffer *buffer)
+{
+    free(buffer->dados);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+// Retorna o tempo monotônico atual em milissegundos
+static long long agora_ms()
+{
+    struct timespec agora;
+
+    clock_gettime(CLOCK_MONOTONIC, &agora);
+
+    return (long long)agora.tv_sec * 1000 + agora.tv_nsec / 1000000;
+}
+
+// Lê do socket sem bloquear. Retorna -1 com errno EAGAIN quando não há dados
+static int le_socket(ChatCliente *cliente, void *buffer, int tamanho)
+{
+#ifdef COM_TLS
+    int lidos;
+
+    if (cliente->tls != NULL && !BIO_get_ktls_recv(SSL_get_rbio(cliente->tls)))
+    {
+        lidos = SSL_read(cliente->tls, buffer, tamanho);
+        if (lidos > 0)
+        {
+            return lidos;
+        }
+
+        switch (SSL_get_error(cliente->tls, lidos))
+        {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+
+        default:
+            return -1;
+        }
+    }
+#endif
+
+    return recv(cliente->socket, buffer, tamanho, 0);
+}
+
+// Escreve no socket sem bloquear. Com kTLS de envio, a cifragem é feita pelo kernel e o send comum continua valendo
+static int escreve_socket(ChatCliente *cliente, const void *buffer, int tamanho)
+{
+#ifdef COM_TLS
+    int escritos;
+
+    if (cliente->tls != NULL && !BIO_get_ktls_send(SSL_get_wbio(cliente->tls)))
+    {
+        escritos = SSL_write(cliente->tls, buffer, tamanho);
+        if (escritos > 0)
+        {
+            return escritos;
+        }
+
+        switch (SSL_get_error(cliente->tls, escritos))
+        {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+
+        default:
+            return -1;
+        }
+    }
+#endif
+
+    return send(cliente->socket, buffer, tamanho, MSG_NOSIGNAL);
+}
+
+ChatCliente *chat_cria(const char *nome, ChatAoReceber ao_receber, void *contexto)
+{
+    ChatCliente *cliente = calloc(1, sizeof(ChatCliente));
+
+    if (cliente == NULL)
+    {
+        return NULL;
+    }
+
+    cliente->socket = -1;
+    cliente->estado = CHAT_ENCERRADO;
+    cliente->ao_receber = ao_receber;
+    cliente->contexto = contexto;
+
+    if (nome != NULL)
+    {
+        strncpy(cliente->nome, nome, TAMANHO_NOME - 1);
+    }
+
+    return cliente;
+}
+
+int chat_ativa_tls(ChatCliente *cliente, const char *arquivo_sessao)
+{
+#ifdef COM_TLS
+    cliente->usar_tls = 1;
+    if (arquivo_sessao != NULL)
+    {
+        strncpy(cliente->arquivo_sessao, arquivo_sessao, TAMANHO_CAMINHO - 1);
+    }
+
+    return 0;
+#else
+    (void)cliente;
+    (void)arquivo_sessao;
+
+    return -1;
+#endif
+}
+
+#ifdef COM_TLS
+// Prepara a sessão TLS, retomando a sessão guardada quando ela existir
+static int prepara_tls(ChatCliente *cliente)
+{
+    FILE *arquivo;
+    SSL_SESSION *sessao = NULL;
+
+    cliente->contexto_tls = SSL_CTX_new(TLS_client_method());
+    if (cliente->contexto_tls == NULL)
+    {
+        return -1;
+    }
+
+    SSL_CTX_set_options(cliente->contexto_tls, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_session_cache_mode(cliente->contexto_tls, SSL_SESS_CACHE_CLIENT);
+    SSL_CTX_set_mode(cliente->contexto_tls, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    cliente->tls = SSL_new(cliente->contexto_tls);
+    if (cliente->tls == NULL || !SSL_set_fd(cliente->tls, cliente->socket))
+    {
+        return -1;
+    }
+
+    if (cliente->arquivo_sessao[0] != '\0' && (arquivo = fopen(cliente->arquivo_sessao, "r")) != NULL)
+    {
+        sessao = PEM_read_SSL_SESSION(arquivo, NULL, NULL, NULL);
+        fclose(arquivo);
+    }
+
+    if (sessao != NULL)
+    {
+        SSL_set_session(cliente->tls, sessao);
+        SSL_SESSION_free(sessao);
+    }
+
+    return 0;
+}
+
+// Avança o handshake TLS sem bloquear. Retorna 1 ao concluir, 0 se ainda aguarda e -1 em caso de erro
+static int avanca_tls(ChatCliente *cliente)
+{
+    int retorno = SSL_connect(cliente->tls);
+
+    if (retorno == 1)
+    {
+#ifdef MODO_DEBUGER
+        printf("TLS estabelecido: %s, sessão %s, kTLS envio %s, kTLS recebimento %s\n", SSL_get_version(cliente->tls),
+               SSL_session_reused(cliente->tls) ? "retomada" : "nova",
+               BIO_get_ktls_send(SSL_get_wbio(cliente->tls)) ? "sim" : "não",
+               BIO_get_ktls_recv(SSL_get_rbio(cliente->tls)) ? "sim" : "não");
+#endif
+        return 1;
+    }
+
+    switch (SSL_get_error(cliente->tls, retorno))
+    {
+    case SSL_ERROR_WANT_READ:
+        cliente->tls_quer = CHAT_LER;
+        return 0;
+
+    case SSL_ERROR_WANT_WRITE:
+        cliente->tls_quer = CHAT_ESCREVER;
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+// Guarda a sessão TLS para a próxima conexão e libera a conexão TLS. No TLS 1.3 os tickets chegam
+// depois do handshake, por isso a sessão é guardada no encerramento
+static void encerra_tls(ChatCliente *cliente)
+{
+    FILE *arquivo;
+    SSL_SESSION *sessao;
+
+    if (cliente->tls != NULL)
+    {
+        sessao = SSL_get1_session(cliente->tls);
+        if (sessao != NULL && SSL_SESSION_is_resumable(sessao) && cliente->arquivo_sessao[0] != '\0' &&
+            (arquivo = fopen(cliente->arquivo_sessao, "w")) != NULL)
+        {
+            PEM_write_SSL_SESSION(arquivo, sessao);
+            fclose(arquivo);
+        }
+
+        SSL_SESSION_free(sessao);
+        SSL_free(cliente->tls);
+        cliente->tls = NULL;
+    }
+
+    if (cliente->contexto_tls != NULL)
+    {
+        SSL_CTX_free(cliente->contexto_tls);
+        cliente->contexto_tls = NULL;
+    }
+}
+#endif
+
+// Passa ao próximo estado depois que o connect terminou
+static int conclui_conexao(ChatCliente *cliente)
+{
+#ifdef COM_TLS
+    if (cliente->usar_tls)
+    {
+        cliente->estado = CHAT_TLS;
+        if (prepara_tls(cliente) < 0)
+        {
+            return -1;
+        }
+
+        switch (avanca_tls(cliente))
+        {
+        case 1:
+            cliente->estado = CHAT_BOAS_VINDAS;
+            return 0;
+
+        case 0:
+            return 0;
+
+        default:
+            return -1;
+        }
+    }
+#endif
+
+    cliente->estado = CHAT_BOAS_VINDAS;
+
+    return 0;
+}
+
+// Inicia o connect não bloqueante no endereço
+static int conecta(ChatCliente *cliente, int familia, struct sockaddr *endereco, socklen_t tamanho_endereco)
+{
+    memcpy(&cliente->endereco, endereco, tamanho_endereco);
+    cliente->tamanho_endereco = tamanho_endereco;
+
+    cliente->socket = socket(familia, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (cliente->socket < 0)
+    {
+        return -1;
+    }
+
+    if (connect(cliente->socket, endereco, tamanho_endereco) == 0)
+    {
+        return conclui_conexao(cliente);
+    }
+
+    if (errno != EINPROGRESS && errno != EAGAIN)
+    {
+        return -1;
+    }
+
+    cliente->estado = CHAT_CONECTANDO;
+
+    return 0;
+}
+
+int chat_conecta_tcp(ChatCliente *cliente, const char *ip, int porta)
+{
+    struct sockaddr_in server_addr;
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(porta);
+    if (inet_pton(AF_INET, ip, &(server_addr.sin_addr)) <= 0)
+    {
+        return -1;
+    }
+
+    return conecta(cliente, AF_INET, (struct sockaddr *)&server_addr, sizeof(server_addr));
+}
+
+socklen_t chat_monta_endereco_unix(const char *caminho, struct sockaddr_un *endereco)
+{
+    memset(endereco, 0, sizeof(*endereco));
+    endereco->sun_family = AF_UNIX;
+    strncpy(endereco->sun_path, caminho, sizeof(endereco->sun_path) - 1);
+
+    // Com '@' inicial, o nome fica no espaço abstrato
+    if (caminho[0] == '@')
+    {
+        endereco->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + strlen(caminho);
+    }
+
+    return sizeof(*endereco);
+}
+
+int chat_conecta_unix(ChatCliente *cliente, const char *caminho)
+{
+    struct sockaddr_un unix_addr;
+    socklen_t tamanho_endereco = chat_monta_endereco_unix(caminho, &unix_addr);
+
+#ifdef COM_TLS
+    cliente->usar_tls = 0; // o socket Unix do servidor não usa TLS
+#endif
+
+    return conecta(cliente, AF_UNIX, (struct sockaddr *)&unix_addr, tamanho_endereco);
+}
+
+// Envia o nome assim que as boas vindas chegaram e ele é conhecido
+static int envia_nome(ChatCliente *cliente)
+{
+    if (buffer_acrescenta_mensagem(&cliente->saida, cliente->nome, strlen(cliente->nome)) < 0)
+    {
+        return -1;
+    }
+
+    cliente->estado = CHAT_APROVACAO;
+
+    return 0;
+}
+
+// Pede a retomada da sessão anterior no lugar do nome, informando a última sequência recebida
+static int envia_retomada(ChatCliente *cliente)
+{
+    char pedido[TAMANHO_CONTROLE];
+
+    snprintf(pedido, TAMANHO_CONTROLE, MARCA_RETOMAR "%016llx %llu", cliente->token, cliente->ultima_seq);
+
+    if (buffer_acrescenta_mensagem(&cliente->saida, pedido, strlen(pedido)) < 0)
+    {
+        return -1;
+    }
+
+    cliente->retomando = 1;
+    cliente->estado = CHAT_APROVACAO;
+
+    return 0;
+}
+
+int chat_define_nome(ChatCliente *cliente, const char *nome)
+{
+    strncpy(cliente->nome, nome, TAMANHO_NOME - 1);
+    cliente->nome[TAMANHO_NOME - 1] = '\0';
+
+    if (cliente->estado == CHAT_AGUARDA_NOME)
+    {
+        return envia_nome(cliente);
+    }
+
+    return 0;
+}
+
+int chat_envia(ChatCliente *cliente, const char *mensagem, int tamanho)
+{
+    // Com sessão retomável, as mensagens enviadas durante a desconexão aguardam a retomada
+    if ((cliente->estado == CHAT_ENCERRADO && cliente->token == 0) || cliente->encerrar_envio)
+    {
+        return -1;
+    }
+
+    if (cliente->estado != CHAT_APROVADO)
+    {
+        return buffer_acrescenta_mensagem(&cliente->espera, mensagem, tamanho);
+    }
+
+    return buffer_acrescenta_mensagem(&cliente->saida, mensagem, tamanho);
+}
+
+void chat_encerra_envio(ChatCliente *cliente)
+{
+    cliente->encerrar_envio = 1;
+}
+
+// Conduz a aprovação do nome a partir de uma mensagem recebida do servidor
+static int avanca_aprovacao(ChatCliente *cliente, const char *mensagem)
+{
+    char mensagem_aprovacao[TAMANHO_NOME + 32];
+
+    switch (cliente->estado)
+    {
+    case CHAT_BOAS_VINDAS:
+        cliente->estado = CHAT_AGUARDA_NOME;
+        if (cliente->token != 0)
+        {
+            return envia_retomada(cliente);
+        }
+        if (cliente->nome[0] != '\0')
+        {
+            return envia_nome(cliente);
+        }
+        return 0;
+
+    case CHAT_APROVACAO:
+        if (cliente->retomando)
+        {
+            return 0;
+        }
+
+        snprintf(mensagem_aprovacao, sizeof(mensagem_aprovacao), "Usuário %s aprovado!", cliente->nome);
+        if (strcmp(mensagem, mensagem_aprovacao))
+        {
+            return 0;
+        }
+
+        // A aprovação é confirmada devolvendo a mesma mensagem; depois dela seguem o pedido de sessão
+        // retomável e as mensagens em espera
+        if (buffer_acrescenta_mensagem(&cliente->saida, mensagem, strlen(mensagem)) < 0 ||
+            buffer_acrescenta_mensagem(&cliente->saida, MARCA_SESSAO, strlen(MARCA_SESSAO)) < 0 ||
+            buffer_transfere(&cliente->saida, &cliente->espera) < 0)
+        {
+            return -1;
+        }
+
+        cliente->estado = CHAT_APROVADO;
+        return 0;
+
+    default:
+        return 0;
+    }
+}
+
+// Entrega ao callback de eventos cada linha "nome\testado" de um lote de eventos da sala
+static void entrega_eventos(ChatCliente *cliente, char *lote)
+{
+    char *linha, *separador, *fim;
+
+    for (linha = lote; cliente->ao_evento != NULL && *linha != '\0'; linha = fim + 1)
+    {
+        fim = strchr(linha, '\n');
+        if (fim == NULL)
+        {
+            return;
+        }
+
+        separador = memchr(linha, '\t', fim - linha);
+        if (separador == NULL)
+        {
+            continue;
+        }
+
+        *separador = '\0';
+        *fim = '\0';
+        cliente->ao_evento(cliente, linha, separador + 1, cliente->contexto_evento);
+        *separador = '\t';
+        *fim = '\n';
+    }
+}
+
+// Entrega ao callback o arquivo oferecido: "id tamanho remetente nome"
+static void entrega_arquivo(ChatCliente *cliente, char *oferta)
+{
+    unsigned long long id;
+    long long tamanho;
+    int inicio_nome = 0;
+    char remetente[TAMANHO_NOME];
+
+    if (sscanf(oferta, "%llx %lld %100s %n", &id, &tamanho, remetente, &inicio_nome) == 3 && inicio_nome > 0)
+    {
+        cliente->ao_arquivo(cliente, id, tamanho, remetente, oferta + inicio_nome, cliente->contexto_arquivo);
+    }
+}
+
+// Trata as mensagens de controle da sessão retomável. Retorna 1 se a mensagem era de controle e não deve
+// ser entregue, 0 se deve ser entregue (a partir de *texto, com a sequência em *sequencia_mensagem quando
+// houver) e -1 em caso de erro
+static int trata_controle(ChatCliente *cliente, char *mensagem, char **texto, unsigned long long *sequencia_mensagem)
+{
+    unsigned long long token, sequencia;
+    int deslocamento = 0;
+
+    *texto = mensagem;
+    *sequencia_mensagem = 0;
+
+    if (mensagem[0] != '\001')
+    {
+        return 0;
+    }
+
+    if (sscanf(mensagem, MARCA_MENSAGEM "%llu %n", &sequencia, &deslocamento) == 1 && deslocamento > 0)
+    {
+        // Depois de uma retomada, o servidor reenvia a partir da última confirmação; o que já foi
+        // processado é descartado
+        if (sequencia <= cliente->ultima_seq)
+        {
+            return 1;
+        }
+
+        *texto = mensagem + deslocamento;
+        *sequencia_mensagem = sequencia;
+        return 0;
+    }
+
+    if (sscanf(mensagem, MARCA_SESSAO " %llx %llu", &token, &sequencia) == 2)
+    {
+        cliente->token = token;
+
+        if (!cliente->retomando)
+        {
+            cliente->ultima_seq = sequencia;
+            cliente->ultimo_ack = sequencia;
+            return 1;
+        }
+
+        // Sessão retomada: o servidor segue com as mensagens perdidas, e as mensagens em espera podem seguir
+        cliente->retomando = 0;
+        cliente->estado = CHAT_APROVADO;
+
+        return buffer_transfere(&cliente->saida, &cliente->espera) < 0 ? -1 : 1;
+    }
+
+    if (!strncmp(mensagem, MARCA_EVENTOS, strlen(MARCA_EVENTOS)))
+    {
+        entrega_eventos(cliente, mensagem + strlen(MARCA_EVENTOS));
+        return 1;
+    }
+
+    if (cliente->ao_arquivo != NULL && !strncmp(mensagem, MARCA_ARQUIVO, strlen(MARCA_ARQUIVO)))
+    {
+        entrega_arquivo(cliente, mensagem + strlen(MARCA_ARQUIVO));
+        return 1;
+    }
+
+    if (!strcmp(mensagem, MARCA_EXPIRADA))
+    {
+        // A sessão não existe mais no servidor: segue pela aprovação normal do nome
+        cliente->retomando = 0;
+        cliente->token = 0;
+        cliente->ultima_seq = 0;
+        cliente->ultimo_ack = 0;
+
+        return envia_nome(cliente) < 0 ? -1 : 1;
+    }
+
+    return 0;
+}
+
+// Entrega as mensagens completas do buffer de entrada
+static int entrega_mensagens(ChatCliente *cliente)
+{
+    int tamanho, controle;
+    unsigned long long sequencia;
+    char *mensagem, *texto, guardado;
+
+    while (cliente->entrada.tamanho >= (int)sizeof(int))
+    {
+        memcpy(&tamanho, cliente->entrada.dados + cliente->entrada.inicio, sizeof(int));
+
+        if (tamanho < 0 || tamanho > CHAT_TAMANHO_MAXIMO)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+
+        if (cliente->entrada.tamanho < (int)sizeof(int) + tamanho)
+        {
+            break;
+        }
+
+        // O byte seguinte à mensagem é trocado por '\0' durante a entrega e restaurado depois
+        mensagem = cliente->entrada.dados + cliente->entrada.inicio + sizeof(int);
+        guardado = mensagem[tamanho];
+        mensagem[tamanho] = '\0';
+
+        controle = trata_controle(cliente, mensagem, &texto, &sequencia);
+
+        if (controle < 0 || (controle == 0 && avanca_aprovacao(cliente, mensagem) < 0))
+        {
+            return -1;
+        }
+
+        if (controle == 0 && cliente->ao_receber != NULL)
+        {
+            cliente->ao_receber(cliente, texto, tamanho - (texto - mensagem), cliente->contexto);
+        }
+
+        // A mensagem conta como processada depois que o callback retorna
+        if (sequencia > cliente->ultima_seq)
+        {
+            cliente->ultima_seq = sequencia;
+        }
+
+        mensagem[tamanho] = guardado;
+        cliente->entrada.inicio += sizeof(int) + tamanho;
+        cliente->entrada.tamanho -= sizeof(int) + tamanho;
+    }
+
+    return 1;
+}
+
+// Lê tudo o que estiver disponível e entrega as mensagens completas
+static int recebe(ChatCliente *cliente)
+{
+    int lidos;
+
+    while (1)
+    {
+        // Espaço para um bloco de leitura mais o '\0' colocado durante a entrega
+        if (buffer_reserva(&cliente->entrada, 4097) < 0)
+        {
+            return -1;
+        }
+
+        lidos = le_socket(cliente, cliente->entrada.dados + cliente->entrada.tamanho, cliente->entrada.capacidade - cliente->entrada.tamanho - 1);
+
+        if (lidos == 0)
+        {
+            entrega_mensagens(cliente);
+            cliente->estado = CHAT_ENCERRADO;
+            return 0;
+        }
+
+        if (lidos < 0)
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        }
+
+        cliente->entrada.tamanho += lidos;
+
+        if (entrega_mensagens(cliente) < 0)
+        {
+            return -1;
+        }
+    }
+}
+
+// Coloca na fila uma confirmação cumulativa, no máximo uma por intervalo, se houver mensagens processadas
+// ainda não confirmadas
+static int verifica_confirmacao(ChatCliente *cliente)
+{
+    char confirmacao[TAMANHO_CONTROLE];
+    long long agora;
+
+    if (cliente->intervalo_ack_ms == 0 || cliente->estado != CHAT_APROVADO || cliente->token == 0 ||
+        cliente->envio_encerrado || cliente->ultima_seq <= cliente->ultimo_ack)
+    {
+        return 0;
+    }
+
+    agora = agora_ms();
+    if (agora < cliente->proximo_ack_ms)
+    {
+        return 0;
+    }
+
+    snprintf(confirmacao, TAMANHO_CONTROLE, MARCA_CONFIRMACAO "%llu", cliente->ultima_seq);
+
+    if (buffer_acrescenta_mensagem(&cliente->saida, confirmacao, strlen(confirmacao)) < 0)
+    {
+        return -1;
+    }
+
+    cliente->ultimo_ack = cliente->ultima_seq;
+    cliente->proximo_ack_ms = agora + cliente->intervalo_ack_ms;
+
+    return 0;
+}
+
+void chat_ativa_confirmacoes(ChatCliente *cliente, int intervalo_ms)
+{
+    cliente->intervalo_ack_ms = intervalo_ms;
+}
+
+int chat_prazo_ms(ChatCliente *cliente)
+{
+    long long restante;
+
+    if (cliente->intervalo_ack_ms == 0 || cliente->estado != CHAT_APROVADO || cliente->token == 0 ||
+        cliente->envio_encerrado || cliente->ultima_seq <= cliente->ultimo_ack)
+    {
+        return -1;
+    }
+
+    restante = cliente->proximo_ack_ms - agora_ms();
+
+    return restante > 0 ? (int)restante : 0;
+}
+
+int chat_descarrega(ChatCliente *cliente)
+{
+    int escritos;
+
+    if (cliente->estado < CHAT_BOAS_VINDAS || cliente->estado == CHAT_ENCERRADO)
+    {
+        return 1;
+    }
+
+    while (cliente->saida.tamanho > 0)
+    {
+        escritos = escreve_socket(cliente, cliente->saida.dados + cliente->saida.inicio, cliente->saida.tamanho);
+
+        if (escritos < 0)
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        }
+
+        cliente->saida.inicio += escritos;
+        cliente->saida.tamanho -= escritos;
+    }
+
+    // Fim do envio só depois da aprovação, para que as mensagens em espera também sejam enviadas
+    if (cliente->encerrar_envio && !cliente->envio_encerrado && cliente->estado == CHAT_APROVADO)
+    {
+#ifdef COM_TLS
+        if (cliente->tls != NULL)
+        {
+            SSL_shutdown(cliente->tls);
+        }
+#endif
+        shutdown(cliente->socket, SHUT_WR);
+        cliente->envio_encerrado = 1;
+    }
+
+    return 1;
+}
+
+int chat_processa(ChatCliente *cliente, int eventos)
+{
+    int erro = 0, retorno;
+    socklen_t tamanho_erro = sizeof(erro);
+
+    if (cliente->estado == CHAT_CONECTANDO)
+    {
+        if (!(eventos & CHAT_ESCREVER))
+        {
+            return 1;
+        }
+
+        if (getsockopt(cliente->socket, SOL_SOCKET, SO_ERROR, &erro, &tamanho_erro) < 0 || erro != 0)
+        {
+            errno = erro;
+            cliente->estado = CHAT_ENCERRADO;
+            return -1;
+        }
+
+        if (conclui_conexao(cliente) < 0)
+        {
+            cliente->estado = CHAT_ENCERRADO;
+            return -1;
+        }
+
+        return 1;
+    }
+
+#ifdef COM_TLS
+    if (cliente->estado == CHAT_TLS)
+    {
+        retorno = avanca_tls(cliente);
+        if (retorno < 0)
+        {
+            cliente->estado = CHAT_ENCERRADO;
+            return -1;
+        }
+
+        if (retorno == 0)
+        {
+            return 1;
+        }
+
+        cliente->estado = CHAT_BOAS_VINDAS;
+    }
+#endif
+
+    if ((eventos & CHAT_LER) || chat_pendente(cliente))
+    {
+        retorno = recebe(cliente);
+        if (retorno <= 0)
+        {
+            if (retorno < 0)
+            {
+                cliente->estado = CHAT_ENCERRADO;
+            }
+            return retorno;
+        }
+    }
+
+    if (verifica_confirmacao(cliente) < 0)
+    {
+        cliente->estado = CHAT_ENCERRADO;
+        return -1;
+    }
+
+    retorno = chat_descarrega(cliente);
+    if (retorno < 0)
+    {
+        cliente->estado = CHAT_ENCERRADO;
+    }
+
+    return retorno;
+}
+
+void chat_define_ao_evento(ChatCliente *cliente, ChatAoEvento ao_evento, void *contexto)
+{
+    cliente->ao_evento = ao_evento;
+    cliente->contexto_evento = contexto;
+}
+
+int chat_envia_evento(ChatCliente *cliente, const char *estado)
+{
+    char evento[TAMANHO_CONTROLE];
+
+    // Eventos são efêmeros: fora de uma sessão aprovada são descartados, e não aguardam a aprovação
+    if (cliente->estado != CHAT_APROVADO || cliente->encerrar_envio)
+    {
+        return -1;
+    }
+
+    snprintf(evento, TAMANHO_CONTROLE, MARCA_EVENTO "%.16s", estado);
+
+    return buffer_acrescenta_mensagem(&cliente->saida, evento, strlen(evento));
+}
+
+int chat_reconecta(ChatCliente *cliente)
+{
+    if (cliente->tamanho_endereco == 0)
+    {
+        return -1;
+    }
+
+#ifdef COM_TLS
+    encerra_tls(cliente);
+#endif
+
+    if (cliente->socket >= 0)
+    {
+        close(cliente->socket);
+        cliente->socket = -1;
+    }
+
+    // O que estava a caminho na conexão anterior é descartado; o servidor reenvia o que faltou da sala
+    cliente->entrada.inicio = cliente->entrada.tamanho = 0;
+    cliente->saida.inicio = cliente->saida.tamanho = 0;
+    cliente->retomando = 0;
+    cliente->envio_encerrado = 0;
+
+    return conecta(cliente, cliente->endereco.ss_family, (struct sockaddr *)&cliente->endereco, cliente->tamanho_endereco);
+}
+
+int chat_descritor(ChatCliente *cliente)
+{
+    return cliente->socket;
+}
+
+int chat_eventos(ChatCliente *cliente)
+{
+    switch (cliente->estado)
+    {
+    case CHAT_CONECTANDO:
+        return CHAT_ESCREVER;
+
+#ifdef COM_TLS
+    case CHAT_TLS:
+        return cliente->tls_quer;
+#endif
+
+    case CHAT_ENCERRADO:
+        return 0;
+
+    default:
+        return CHAT_LER | (cliente->saida.tamanho > 0 ? CHAT_ESCREVER : 0);
+    }
+}
+
+int chat_pendente(ChatCliente *cliente)
+{
+#ifdef COM_TLS
+    return cliente->tls != NULL && SSL_pending(cliente->tls) > 0;
+#else
+    (void)cliente;
+
+    return 0;
+#endif
+}
+
+int chat_estado(ChatCliente *cliente)
+{
+    return cliente->estado;
+}
+
+const char *chat_nome(ChatCliente *cliente)
+{
+    return cliente->nome;
+}
+
+unsigned long long chat_ultima_sequencia(ChatCliente *cliente)
+{
+    return cliente->ultima_seq;
+}
+
+void chat_destroi(ChatCliente *cliente)
+{
+    if (cliente == NULL)
+    {
+        return;
+    }
+
+#ifdef COM_TLS
+    encerra_tls(cliente);
+#endif
+
+    if (cliente->socket >= 0)
+    {
+        close(cliente->socket);
+    }
+
+    buffer_libera(&cliente->entrada);
+    buffer_libera(&cliente->saida);
+    buffer_libera(&cliente->espera);
+    free(cliente);
+}
+
+void chat_define_ao_arquivo(ChatCliente *cliente, ChatAoArquivo ao_arquivo, void *contexto)
+{
+    cliente->ao_arquivo = ao_arquivo;
+    cliente->contexto_arquivo = contexto;
+}
+
+// Escreve todos os bytes no socket bloqueante da conexão de dados
+static int escreve_tudo(int socket_dados, const void *dados, int tamanho)
+{
+    int escritos, total = 0;
+
+    while (total < tamanho)
+    {
+        escritos = write(socket_dados, (const char *)dados + total, tamanho - total);
+        if (escritos < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (escritos <= 0)
+        {
+            return -1;
+        }
+        total += escritos;
+    }
+
+    return 0;
+}
+
+// Lê exatamente tamanho bytes do socket bloqueante da conexão de dados
+static int le_tudo(int socket_dados, void *dados, int tamanho)
+{
+    int lidos, total = 0;
+
+    while (total < tamanho)
+    {
+        lidos = read(socket_dados, (char *)dados + total, tamanho - total);
+        if (lidos < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (lidos <= 0)
+        {
+            return -1;
+        }
+        total += lidos;
+    }
+
+    return 0;
+}
+
+// Lê uma mensagem de controle da conexão de dados
+static int le_controle(int socket_dados, char *mensagem, int capacidade)
+{
+    int tamanho;
+
+    if (le_tudo(socket_dados, &tamanho, sizeof(int)) < 0 || tamanho < 0 || tamanho >= capacidade || le_tudo(socket_dados, mensagem, tamanho) < 0)
+    {
+        return -1;
+    }
+
+    mensagem[tamanho] = '\0';
+
+    return tamanho;
+}
+
+// Abre uma conexão de dados com o servidor e se identifica com o pedido no lugar do nome. Retorna o socket
+// depois que o servidor informa o deslocamento a partir do qual seguem os bytes, ou -1
+static int abre_conexao_dados(ChatCliente *cliente, const char *pedido, long long *deslocamento)
+{
+    int socket_dados, tamanho = strlen(pedido);
+    char resposta[TAMANHO_CONTROLE * 4];
+
+    if (cliente->token == 0 || cliente->tamanho_endereco == 0)
+    {
+        errno = EPERM;
+        return -1;
+    }
+
+#ifdef COM_TLS
+    if (cliente->usar_tls)
+    {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+#endif
+
+    socket_dados = socket(cliente->endereco.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_dados < 0)
+    {
+        return -1;
+    }
+
+    // As boas vindas são descartadas; o pedido segue no lugar do nome
+    if (connect(socket_dados, (struct sockaddr *)&cliente->endereco, cliente->tamanho_endereco) < 0 ||
+        le_controle(socket_dados, resposta, sizeof(resposta)) < 0 ||
+        escreve_tudo(socket_dados, &tamanho, sizeof(int)) < 0 || escreve_tudo(socket_dados, pedido, tamanho) < 0 ||
+        le_controle(socket_dados, resposta, sizeof(resposta)) < 0)
+    {
+        close(socket_dados);
+        return -1;
+    }
+
+    if (!strcmp(resposta, MARCA_CONCLUIDA))
+    {
+        *deslocamento = -1; // nada mais a transferir
+        return socket_dados;
+    }
+
+    if (sscanf(resposta, MARCA_DESDE "%lld", deslocamento) != 1)
+    {
+        close(socket_dados);
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    return socket_dados;
+}
+
+int chat_envia_arquivo(ChatCliente *cliente, const char *destinatario, const char *caminho, unsigned long long *id)
+{
+    int arquivo, socket_dados;
+    long long deslocamento;
+    ssize_t enviados;
+    off_t posicao;
+    struct stat informacoes;
+    const char *nome = strrchr(caminho, '/') != NULL ? strrchr(caminho, '/') + 1 : caminho;
+    char pedido[TAMANHO_CONTROLE + 2 * TAMANHO_NOME], resposta[TAMANHO_CONTROLE];
+
+    arquivo = open(caminho, O_RDONLY | O_CLOEXEC);
+    if (arquivo < 0 || fstat(arquivo, &informacoes) < 0)
+    {
+        if (arquivo >= 0)
+        {
+            close(arquivo);
+        }
+        return -1;
+    }
+
+    while (*id == 0 && getrandom(id, sizeof(*id), 0) != sizeof(*id))
+        ;
+
+    snprintf(pedido, sizeof(pedido), MARCA_ENVIA "%016llx %016llx %s %lld %s", *id, cliente->token, destinatario, (long long)informacoes.st_size, nome);
+
+    // Bloqueia até o destinatário conectar e informar quanto já tem
+    socket_dados = abre_conexao_dados(cliente, pedido, &deslocamento);
+    if (socket_dados < 0)
+    {
+        close(arquivo);
+        return -1;
+    }
+
+    // Do arquivo para o socket sem passar pelo espaço de usuário
+    posicao = deslocamento;
+    while (deslocamento >= 0 && posicao < informacoes.st_size)
+    {
+        enviados = sendfile(socket_dados, arquivo, &posicao, informacoes.st_size - posicao);
+        if (enviados <= 0 && errno != EINTR)
+        {
+            break;
+        }
+    }
+
+    close(arquivo);
+
+    if (deslocamento >= 0 && (posicao < informacoes.st_size || le_controle(socket_dados, resposta, sizeof(resposta)) < 0 || strcmp(resposta, MARCA_CONCLUIDA)))
+    {
+        close(socket_dados);
+        return -1;
+    }
+
+    close(socket_dados);
+
+    return 0;
+}
+
+int chat_recebe_arquivo(ChatCliente *cliente, unsigned long long id, long long tamanho, const char *caminho)
+{
+    int arquivo, socket_dados, lidos;
+    long long deslocamento, recebido;
+    char pedido[TAMANHO_CONTROLE];
+    char *bloco;
+
+    arquivo = open(caminho, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (arquivo < 0)
+    {
+        return -1;
+    }
+
+    // O que já está no arquivo, de uma tentativa anterior, não é pedido de novo
+    recebido = lseek(arquivo, 0, SEEK_END);
+    if (recebido > tamanho && ftruncate(arquivo, 0) == 0)
+    {
+        recebido = lseek(arquivo, 0, SEEK_SET);
+    }
+
+    snprintf(pedido, sizeof(pedido), MARCA_RECEBE "%016llx %016llx %lld", id, cliente->token, recebido);
+
+    socket_dados = abre_conexao_dados(cliente, pedido, &deslocamento);
+    bloco = malloc(TAMANHO_BLOCO_ARQUIVO);
+
+    if (socket_dados < 0 || bloco == NULL)
+    {
+        if (socket_dados >= 0)
+        {
+            close(socket_dados);
+        }
+        free(bloco);
+        close(arquivo);
+        return -1;
+    }
+
+    recebido = deslocamento < 0 ? tamanho : recebido;
+
+    while (recebido < tamanho)
+    {
+        lidos = read(socket_dados, bloco, tamanho - recebido < TAMANHO_BLOCO_ARQUIVO ? tamanho - recebido : TAMANHO_BLOCO_ARQUIVO);
+        if (lidos < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (lidos <= 0 || escreve_tudo(arquivo, bloco, lidos) < 0)
+        {
+            break;
+        }
+        recebido += lidos;
+    }
+
+    free(bloco);
+    close(socket_dados);
+    close(arquivo);
+
+    return recebido == tamanho ? 0 : -1;
+}
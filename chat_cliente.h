@@ -0,0 +1,121 @@
+#ifndef CHAT_CLIENTE_H
+#define CHAT_CLIENTE_H
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Biblioteca de cliente do comunicador com API não bloqueante.
+//
+// Cada sessão é um ChatCliente com socket não bloqueante, máquina de estados da aprovação do nome,
+// fila de envio e callback de mensagem recebida. O laço de eventos pertence a quem usa a biblioteca:
+// ele registra chat_descritor() no seu select/poll/epoll com os eventos de chat_eventos() e chama
+// chat_processa() quando o descritor fica pronto. Assim um único processo pode manter milhares de
+// sessões (robôs, pontes, testes de carga).
+
+#define CHAT_LER 1       // a sessão quer ser avisada quando houver dados para ler
+#define CHAT_ESCREVER 2  // a sessão quer ser avisada quando o socket aceitar escrita
+
+#define CHAT_TAMANHO_MAXIMO 65536 // maior mensagem aceita do servidor
+
+// Estados da sessão, na ordem em que ocorrem
+#define CHAT_CONECTANDO 0    // connect em andamento
+#define CHAT_TLS 1           // handshake TLS em andamento
+#define CHAT_BOAS_VINDAS 2   // aguardando a mensagem de boas vindas do servidor
+#define CHAT_AGUARDA_NOME 3  // boas vindas recebidas, aguardando chat_define_nome
+#define CHAT_APROVACAO 4     // nome enviado, aguardando "Usuário <nome> aprovado!"
+#define CHAT_APROVADO 5      // aprovação confirmada, sessão apta à comunicação
+#define CHAT_ENCERRADO 6     // conexão fechada ou com erro
+
+typedef struct chat_cliente ChatCliente;
+
+// Chamada para cada mensagem recebida do servidor, inclusive as da aprovação. A mensagem termina em '\0'.
+// As mensagens de controle da sessão retomável são tratadas pela biblioteca e não chegam ao callback
+typedef void (*ChatAoReceber)(ChatCliente *cliente, const char *mensagem, int tamanho, void *contexto);
+
+// Chamada para cada usuário num lote de eventos efêmeros da sala, com o último estado informado por ele
+typedef void (*ChatAoEvento)(ChatCliente *cliente, const char *nome, const char *estado, void *contexto);
+
+// Chamada para cada arquivo oferecido por outro usuário; o arquivo é recebido com chat_recebe_arquivo
+typedef void (*ChatAoArquivo)(ChatCliente *cliente, unsigned long long id, long long tamanho, const char *remetente, const char *nome, void *contexto);
+
+// Cria uma sessão. O nome pode ser NULL e informado depois com chat_define_nome
+ChatCliente *chat_cria(const char *nome, ChatAoReceber ao_receber, void *contexto);
+
+// Ativa TLS na próxima conexão TCP, retomando a sessão guardada em arquivo_sessao quando existir.
+// Retorna -1 se a biblioteca foi compilada sem COM_TLS
+int chat_ativa_tls(ChatCliente *cliente, const char *arquivo_sessao);
+
+// Iniciam a conexão sem bloquear. Retornam 0 em caso de sucesso e -1 em caso de erro
+int chat_conecta_tcp(ChatCliente *cliente, const char *ip, int porta);
+int chat_conecta_unix(ChatCliente *cliente, const char *caminho);
+
+// Preenche o endereço Unix a partir do caminho e retorna o tamanho a passar a connect ou bind. Com '@' inicial,
+// o nome fica no espaço abstrato, que não cria arquivo. Também usada pelo servidor e pelo cli_chat_broadcast
+socklen_t chat_monta_endereco_unix(const char *caminho, struct sockaddr_un *endereco);
+
+// Informa o nome de usuário; se as boas vindas já chegaram, o nome é enviado na próxima escrita
+int chat_define_nome(ChatCliente *cliente, const char *nome);
+
+// Coloca a mensagem na fila de envio. Mensagens anteriores à aprovação aguardam a aprovação
+int chat_envia(ChatCliente *cliente, const char *mensagem, int tamanho);
+
+// Encerra o envio depois que a fila esvaziar; a sessão continua recebendo até o servidor fechar
+void chat_encerra_envio(ChatCliente *cliente);
+
+// Reconecta ao mesmo endereço depois de uma queda. Se o servidor concedeu sessão retomável, a sessão é
+// retomada sem nova aprovação e o servidor reenvia as mensagens da sala perdidas durante a desconexão;
+// caso contrário (ou se a sessão expirou), o nome passa de novo pela aprovação. Mesmo retorno de chat_conecta_tcp
+int chat_reconecta(ChatCliente *cliente);
+
+// Eventos efêmeros (digitando, ativo, ausente...): o servidor reúne os eventos da sala numa janela curta,
+// guarda só o último estado de cada usuário e envia um único lote por janela. Só recebe os lotes quem já
+// enviou algum evento. Eventos não entram no histórico e se perdem numa queda, por definição.
+// chat_envia_evento aceita estados de até 16 caracteres e retorna -1 fora de uma sessão aprovada
+void chat_define_ao_evento(ChatCliente *cliente, ChatAoEvento ao_evento, void *contexto);
+int chat_envia_evento(ChatCliente *cliente, const char *estado);
+
+// Ativa confirmações cumulativas de entrega: no máximo uma vez por intervalo, a sessão informa ao servidor
+// a maior sequência já processada pelo callback. Na retomada, o servidor reenvia o que não foi confirmado
+void chat_ativa_confirmacoes(ChatCliente *cliente, int intervalo_ms);
+
+// Milissegundos até a próxima confirmação pendente, ou -1 se não há nenhuma. Quem usa a biblioteca deve
+// limitar a espera do seu laço de eventos a esse prazo e chamar chat_processa quando ele vencer
+int chat_prazo_ms(ChatCliente *cliente);
+
+// Transferência de arquivos. Cada transferência usa uma conexão de dados própria com o servidor, que repassa
+// os bytes do remetente ao destinatário sem copiá-los. As duas funções bloqueiam até o fim da transferência
+// e devem rodar fora do laço de eventos (numa thread ou num processo filho). Exigem sessão retomável, que
+// identifica os dois lados, e conexão sem TLS (socket Unix ou servidor sem -c). Retornam 0 com o arquivo
+// entregue e -1 se a conexão caiu ou a transferência foi recusada (errno ECONNREFUSED); chamadas seguintes
+// com o mesmo id retomam do ponto em que o destinatário parou. O envio usa sendfile, que não evita o SIGPIPE
+// quando o servidor fecha a conexão: o processo que envia deve ignorar esse sinal.
+// chat_envia_arquivo sorteia o id quando *id é 0
+void chat_define_ao_arquivo(ChatCliente *cliente, ChatAoArquivo ao_arquivo, void *contexto);
+int chat_envia_arquivo(ChatCliente *cliente, const char *destinatario, const char *caminho, unsigned long long *id);
+int chat_recebe_arquivo(ChatCliente *cliente, unsigned long long id, long long tamanho, const char *caminho);
+
+// Descritor e eventos a registrar no laço de eventos de quem usa a biblioteca
+int chat_descritor(ChatCliente *cliente);
+int chat_eventos(ChatCliente *cliente);
+
+// Informa se há dados já recebidos em memória (TLS) que o laço de eventos não enxerga no descritor
+int chat_pendente(ChatCliente *cliente);
+
+// Avança a sessão com os eventos prontos (CHAT_LER e/ou CHAT_ESCREVER): conclui a conexão, lê e entrega
+// mensagens, conduz a aprovação e esvazia a fila. Retorna 1 se a sessão continua, 0 se o servidor fechou
+// a conexão e -1 em caso de erro
+int chat_processa(ChatCliente *cliente, int eventos);
+
+// Envia o que for possível da fila sem esperar pelo laço de eventos. Mesmo retorno de chat_processa
+int chat_descarrega(ChatCliente *cliente);
+
+int chat_estado(ChatCliente *cliente);
+const char *chat_nome(ChatCliente *cliente);
+
+// Sequência da última mensagem de sala processada, informada ao servidor na retomada da sessão
+unsigned long long chat_ultima_sequencia(ChatCliente *cliente);
+
+// Fecha a conexão e libera a sessão
+void chat_destroi(ChatCliente *cliente);
+
+#endif
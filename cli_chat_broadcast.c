@@ -4,9 +4,13 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <errno.h>
 
+#include "chat_cliente.h"
+
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 12345
 #define BUFFER_SIZE 401
@@ -195,40 +199,70 @@ int verifica_mensagem_shell(fd_set *readfds, int server_socket, char buffer[], i
     return retorno_envio;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
     int fecha_comunicador = 0;
-    int server_socket, max_descritor_arquivo, retorno_verificacao;
+    int server_socket, max_descritor_arquivo, retorno_verificacao, opcao;
+    char *caminho_unix = NULL; // -u: conecta pelo socket Unix do servidor em vez de TCP
     struct sockaddr_in server_addr;
+    struct sockaddr_un unix_addr;
+    socklen_t tamanho_unix;
     char buffer[BUFFER_SIZE];
     fd_set readfds; // conjunto de descritores para o select
 
+    while ((opcao = getopt(argc, argv, "u:")) != -1)
+    {
+        if (opcao != 'u')
+        {
+            fprintf(stderr, "Uso: %s [-u caminho_unix]\n", argv[0]);
+            exit(1);
+        }
+
+        caminho_unix = optarg;
+    }
+
     // Criar o socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    server_socket = socket(caminho_unix != NULL ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0)
     {
         error("\n Erro ao criar o socket\n");
     }
 
-    // Configurar o endereço do servidor
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
-    if (inet_pton(AF_INET, SERVER_IP, &(server_addr.sin_addr)) <= 0)
+    if (caminho_unix != NULL)
     {
-        error("\n Erro ao converter o endereço IP\n");
-    }
+        // Conectar ao servidor pelo socket Unix, mesmo protocolo sem a pilha TCP
+        tamanho_unix = chat_monta_endereco_unix(caminho_unix, &unix_addr);
 
-    // Conectar ao servidor
-    if (connect(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        if (connect(server_socket, (struct sockaddr *)&unix_addr, tamanho_unix) < 0)
+        {
+            close(server_socket);
+
+            printf("\n Falha [%s] conexao servidor. \n", strerror(errno));
+            return -6;
+        }
+    }
+    else
     {
-        close(server_socket);
+        // Configurar o endereço do servidor
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(SERVER_PORT);
+        if (inet_pton(AF_INET, SERVER_IP, &(server_addr.sin_addr)) <= 0)
+        {
+            error("\n Erro ao converter o endereço IP\n");
+        }
+
+        // Conectar ao servidor
+        if (connect(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        {
+            close(server_socket);
 
-        printf("\n Falha [%s] conexao servidor. \n", strerror(errno));
-        return -6;
+            printf("\n Falha [%s] conexao servidor. \n", strerror(errno));
+            return -6;
+        }
     }
 
 #ifdef MODO_DEBUGER
-    printf("Cliente conectado ao servidor %s na porta %d\n", SERVER_IP, SERVER_PORT);
+    printf("Cliente conectado ao servidor\n");
 #endif
 
     // Enviar e receber mensagens
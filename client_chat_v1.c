@@ -2,33 +2,47 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <arpa/inet.h>
 #include <signal.h>
-#include <sys/socket.h>
 #include <sys/select.h>
-#include <fcntl.h>
 #include <errno.h>
 
+#include "chat_cliente.h"
+
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 12345
 #define TAMANHO_BUFFER 401
 #define TAMANHO_NOME 101
+#define TAMANHO_ENTRADA 65536 // bloco lido de uma vez da entrada padrão
+#define ARQUIVO_SESSAO_TLS "/tmp/client_chat_v1.sessao" // sessão TLS guardada para retomada na próxima conexão
+#define MAX_TENTATIVAS_RECONEXAO 5 // tentativas seguidas de retomar a sessão depois de uma queda
+#define INTERVALO_CONFIRMACAO_MS 1000 // intervalo mínimo entre as confirmações de mensagens exibidas
+#define MAX_OFERTAS 16 // arquivos oferecidos lembrados para o /receber
 
 #define MODO_DEBUGER
 
-/* Declaração de variável global para permitir associar o descritor de arquivo do socket
+/* Declaração de variável global para permitir associar a sessão com o servidor
 // aos tratamentos de sinais do processo e rotina de erro */
-int server_socket = 0;
+ChatCliente *sessao = NULL;
+
+/* Entrada padrão lida em blocos: as linhas completas são enviadas e o resto aguarda o próximo bloco */
+char entrada[TAMANHO_ENTRADA];
+int tamanho_entrada = 0;
+
+/* Arquivos oferecidos por outros usuários, aguardando o /receber */
+struct
+{
+    unsigned long long id;
+    long long tamanho;
+    char nome[TAMANHO_NOME];
+} ofertas[MAX_OFERTAS];
+int proxima_oferta = 0;
 
 // Função que realiza fechamento seguro do comunicador na ocorrência de erros
 void error(const char *msg)
 {
     perror(msg);
 
-    if (server_socket >= 0)
-    {
-        close(server_socket);
-    }
+    chat_destroi(sessao);
 
     exit(1);
 }
@@ -39,318 +53,409 @@ void fecha_conexao()
 #ifdef MODO_DEBUGER
     printf("\n Vou fechar as conexões\n");
 #endif
-    if (server_socket > 0)
-    {
-        close(server_socket);
-    }
+    chat_destroi(sessao);
+
     exit(1);
 }
 
-// Função que envia uma mensagem pela rede
-int envia_mensagem(int server_socket, char buffer[], int tamanho)
+// Função chamada pela biblioteca para cada mensagem recebida do servidor
+void mostra_mensagem(ChatCliente *cliente, const char *mensagem, int tamanho, void *contexto)
 {
-    int enviado; // número de bytes enviados em cada chamada
+    printf("\n %s\n", mensagem);
+}
 
-    // Enviar o tamanho da mensagem
-#ifdef MODO_DEBUGER
-    printf("\n Tamanho da mensagem: %d", tamanho);
-    printf("\n Tamanho do tamanho: %d\n", sizeof(tamanho));
-#endif
+// Função chamada pela biblioteca para cada arquivo oferecido; a oferta fica guardada para o /receber
+void mostra_arquivo(ChatCliente *cliente, unsigned long long id, long long tamanho, const char *remetente, const char *nome, void *contexto)
+{
+    ofertas[proxima_oferta].id = id;
+    ofertas[proxima_oferta].tamanho = tamanho;
+    snprintf(ofertas[proxima_oferta].nome, TAMANHO_NOME, "%s", nome);
+    proxima_oferta = (proxima_oferta + 1) % MAX_OFERTAS;
 
-    enviado = send(server_socket, (char *)&tamanho, sizeof(tamanho), 0);
+    printf("\n %s quer enviar o arquivo %s (%lld bytes). Use /receber %016llx\n", remetente, nome, tamanho, id);
+}
 
-#ifdef MODO_DEBUGER
-    printf("\n Tamanho enviado: %d\n", enviado);
-#endif
+// Função que executa a transferência num processo filho, para o comunicador continuar atendendo a conversa.
+// Depois de uma queda a transferência é retomada do ponto em que parou
+void transfere_arquivo(ChatCliente *sessao, const char *destinatario, unsigned long long id, long long tamanho, const char *caminho)
+{
+    int tentativas = 0, retorno = -1;
 
-    if (enviado <= 0)
+    if (fork() != 0)
     {
-        return enviado; // erro ao enviar tamanho
+        return;
     }
 
-// Enviar a mensagem
-#ifdef MODO_DEBUGER
-    printf("\n Mensagem: %s", buffer);
-    printf("\n Tamanho da mensagem: %d\n", tamanho);
-#endif
-
-    enviado = send(server_socket, buffer, tamanho, 0);
+    signal(SIGPIPE, SIG_IGN); // a queda da conexão de dados aparece como erro do sendfile
 
-#ifdef MODO_DEBUGER
-    printf("\n Enviado: %d\n", enviado);
-#endif
-
-    return enviado; // sucesso ao enviar mensagem ou erro se enviado <= 0
-}
-
-// Função que recebe uma mensagem pela rede
-int recebe_mensagem(int server_socket, char buffer[], int tamanhoMax)
-{
-    int total = 0;                // total de bytes recebidos
-    int bytes_left = sizeof(int); // bytes restantes para receber o tamanho
-    int n;                        // número de bytes recebidos em cada chamada
-    int size;                     // tamanho da mensagem na ordem de bytes do host
-
-    // Receber o tamanho da mensagem
-    while (total < sizeof(int))
+    while (retorno < 0 && tentativas++ < MAX_TENTATIVAS_RECONEXAO)
     {
-#ifdef MODO_DEBUGER
-        printf("\n Receber tamanho da mensagem do servidor pela conexão %d\n", server_socket);
-#endif
-
-        n = recv(server_socket, (char *)&size + total, bytes_left, 0);
+        if (tentativas > 1)
+        {
+            sleep(1);
+        }
 
-        if (n <= 0)
+        if (destinatario != NULL)
         {
-            return n; // erro ao receber tamanho ou conexão fechada pelo outro lado
+            retorno = chat_envia_arquivo(sessao, destinatario, caminho, &id);
+        }
+        else
+        {
+            retorno = chat_recebe_arquivo(sessao, id, tamanho, caminho);
         }
-        total += n;
-        bytes_left -= n;
 
-#ifdef MODO_DEBUGER
-        printf("\n N: %d", n);
-        printf("\n Tamanho Network: %d", size);
-        printf("\n Total: %d", total);
-        printf("\n bytes_left: %d\n", bytes_left);
-#endif
+        if (retorno < 0 && (errno == ECONNREFUSED || errno == EPERM || errno == EPROTONOSUPPORT || errno == ENOENT))
+        {
+            break; // não adianta tentar de novo
+        }
     }
 
-    // Comentei porque o tamanho já está vindo correto (problema biendian vs litle endian)
-    // size = ntohl(size); // converter o tamanho da mensagem para a ordem de bytes do host
+    printf("\n Transferência de %s %s\n", caminho, retorno == 0 ? "concluída" : "falhou");
 
-#ifdef MODO_DEBUGER
-    printf("\n Tamanho Host: %d\n", size);
-#endif
+    _exit(retorno == 0 ? 0 : 1);
+}
 
-    // buffer = malloc(size); // alocar memória para a mensagem
+// Função que trata os comandos de arquivo digitados: "/enviar <destinatário> <arquivo>" e
+// "/receber <id> [arquivo]". Retorna 1 se a linha era um desses comandos
+int trata_comando_arquivo(ChatCliente *sessao, const char *linha)
+{
+    int i;
+    unsigned long long id;
+    char destinatario[TAMANHO_NOME], caminho[TAMANHO_BUFFER];
 
-    if (buffer == NULL)
+    if (sscanf(linha, "/enviar %100s %400[^\n]", destinatario, caminho) == 2)
     {
-        return -3; // erro ao alocar memória
+        transfere_arquivo(sessao, destinatario, 0, 0, caminho);
+        return 1;
     }
 
-    total = 0;         // reiniciar o total de bytes recebidos
-    bytes_left = size; // bytes restantes para receber a mensagem
-
-    // Receber a mensagem
-    while (total < size)
+    if (sscanf(linha, "/receber %llx", &id) == 1)
     {
-#ifdef MODO_DEBUGER
-        printf("\n Receber mensagem do servidor pela conexão %d\n", server_socket);
-#endif
-        n = recv(server_socket, buffer + total, bytes_left, 0);
+        for (i = 0; i < MAX_OFERTAS && (ofertas[i].id != id || id == 0); i++)
+            ;
 
-        if (n <= 0)
+        if (i == MAX_OFERTAS)
         {
-            // free(buffer); // liberar a memória alocada
-            return n; // erro ao receber ou conexão fechada pelo outro lado
+            printf("\n Nenhum arquivo oferecido com esse id\n");
+            return 1;
         }
-        total += n;
-        bytes_left -= n;
 
-#ifdef MODO_DEBUGER
-        printf("\n N: %d", n);
-        printf("\n Buffer: %s", buffer);
-        printf("\n Total: %d", total);
-        printf("\n bytes_left: %d\n", bytes_left);
-#endif
+        if (sscanf(linha, "/receber %*s %400[^\n]", caminho) != 1)
+        {
+            snprintf(caminho, sizeof(caminho), "%s", ofertas[i].nome);
+        }
+
+        transfere_arquivo(sessao, NULL, id, ofertas[i].tamanho, caminho);
+        return 1;
     }
 
-    // free(buffer); // liberar a memória alocada
-    return n; // sucesso ao receber mensagem ou erro se n <= 0
+    return 0;
 }
 
-// Função que verifica se recebeu mensagem pelo socket
-int verifica_mensagem_socket(fd_set *readfds, int server_socket, char buffer[], int tamanho_max)
+// Função que verifica se recebeu mensagem por entrada de usuário através do shell. A entrada é lida em blocos
+// sem o buffer do stdio, de modo que todas as linhas completas que chegaram juntas (arquivo, pipe, robô) são
+// enviadas de uma vez. A primeira linha é o nome do usuário; as demais seguem para a fila de envio da sessão.
+// Retorna -10 se o usuário pediu para sair e -11 no fim da entrada
+int verifica_mensagem_shell(fd_set *readfds, ChatCliente *sessao)
 {
-    int retorno_recebimento = 1;
+    int lidos, inicio = 0, fim, tamanho_linha, tamanho_parte, parte, corte, fim_entrada = 0, sair = 0, linhas = 0;
+    char *quebra;
 
-    if (FD_ISSET(server_socket, readfds))
+    if (!FD_ISSET(STDIN_FILENO, readfds))
     {
-        memset(buffer, 0, TAMANHO_BUFFER);
-
-        // receber a mensagem do servidor
-        retorno_recebimento = recebe_mensagem(server_socket, buffer, tamanho_max);
-
-        if (retorno_recebimento > 0)
-        {
-            printf("\n %s\n", buffer);
-        }
+        return 1;
     }
 
-    return retorno_recebimento;
-}
+#ifdef MODO_DEBUGER
+    printf("\n Usuario digitou mensagem\n");
+#endif
 
-// Função que verifica se recebeu mensagem por entrada de usuário através do shell
-int verifica_mensagem_shell(fd_set *readfds, int server_socket, char buffer[], int tamanho_max)
-{
-    int retorno_envio = 1;
+    lidos = read(STDIN_FILENO, entrada + tamanho_entrada, TAMANHO_ENTRADA - tamanho_entrada);
 
-    if (FD_ISSET(STDIN_FILENO, readfds))
+    if (lidos < 0)
     {
-#ifdef MODO_DEBUGER
-        printf("\n Usuario digitou mensagem\n");
-#endif
+        return -1;
+    }
 
-        fgets(buffer, tamanho_max, stdin);
+    if (lidos == 0)
+    {
+        fim_entrada = 1;
+    }
 
-        // a função fgets recebe a string com \n no final, que precisa ser lida com \0 nas funções de string
-        buffer[strcspn(buffer, "\n")] = '\0';
+    tamanho_entrada += lidos;
 
-        if (!(strcmp(buffer, "S") && strcmp(buffer, "s") && strcmp(buffer, "[S/s]")))
+    while (inicio < tamanho_entrada && !sair)
+    {
+        quebra = memchr(entrada + inicio, '\n', tamanho_entrada - inicio);
+
+        if (quebra != NULL)
+        {
+            fim = quebra - entrada;
+        }
+        else if (fim_entrada || tamanho_entrada == TAMANHO_ENTRADA)
         {
-            return -10;
+            // última linha sem quebra, ou linha maior que o bloco inteiro
+            fim = tamanho_entrada;
+        }
+        else
+        {
+            break; // linha incompleta aguarda o próximo bloco
         }
 
-#ifdef MODO_DEBUGER
-        printf("\n Mensagem a enviar: %s\n", buffer);
-#endif
+        tamanho_linha = fim - inicio;
+        if (tamanho_linha > 0 && entrada[fim - 1] == '\r')
+        {
+            tamanho_linha--;
+        }
 
-        retorno_envio = envia_mensagem(server_socket, buffer, strlen(buffer));
+        entrada[inicio + tamanho_linha] = '\0';
 
-#ifdef MODO_DEBUGER
-        if (retorno_envio > 0)
+        if (!(strcmp(entrada + inicio, "S") && strcmp(entrada + inicio, "s") && strcmp(entrada + inicio, "[S/s]")))
         {
-            printf("\n Mensagem enviada: %s\n", buffer);
+            sair = 1;
         }
-#endif
-    }
-
-    return retorno_envio;
-}
+        else if (tamanho_linha > 0 && chat_nome(sessao)[0] == '\0')
+        {
+            if (tamanho_linha >= TAMANHO_NOME)
+            {
+                entrada[inicio + TAMANHO_NOME - 1] = '\0';
+            }
 
-// Função que trata o processo de comunicação já aprovada entre o cliente e o servidor
-int trata_comunicador(fd_set *readfds, int server_socket, char buffer[], int tamanho_max)
-{
-    int retorno_verificacao;
+            chat_define_nome(sessao, entrada + inicio);
+        }
+        else if (tamanho_linha > 0 && trata_comando_arquivo(sessao, entrada + inicio))
+        {
+            // transferência iniciada num processo filho
+        }
+        else if (tamanho_linha > 0)
+        {
+            linhas++;
+
+            // linhas maiores que o buffer do servidor seguem em várias mensagens; o corte recua até o início de
+            // um caractere, pois o servidor descarta mensagens que começam ou terminam no meio de um
+            for (tamanho_parte = 0; tamanho_parte < tamanho_linha; tamanho_parte += parte)
+            {
+                parte = tamanho_linha - tamanho_parte < TAMANHO_BUFFER - 1 ? tamanho_linha - tamanho_parte : TAMANHO_BUFFER - 1;
+
+                for (corte = parte; corte > 0 && tamanho_parte + corte < tamanho_linha && (entrada[inicio + tamanho_parte + corte] & 0xc0) == 0x80; corte--)
+                {
+                }
+
+                // Sem início de caractere no trecho, o texto já não é UTF-8 válido e o corte fica onde estava
+                if (corte > 0)
+                {
+                    parte = corte;
+                }
+
+                if (chat_envia(sessao, entrada + inicio + tamanho_parte, parte) < 0)
+                {
+                    return -1;
+                }
+            }
+        }
 
-    retorno_verificacao = verifica_mensagem_shell(readfds, server_socket, buffer, TAMANHO_BUFFER);
+        inicio = fim + 1;
+    }
 
-    if (retorno_verificacao <= 0)
+    if (inicio > tamanho_entrada)
     {
-        return retorno_verificacao;
+        inicio = tamanho_entrada;
     }
 
-    retorno_verificacao = verifica_mensagem_socket(readfds, server_socket, buffer, TAMANHO_BUFFER);
-
-    return retorno_verificacao;
-}
-
-// Função que verifica se a mensagem de retorno do servidor é a aprovação da comunicação
-int verifica_retorno_aprovacao(char buffer[], char buffer_nome[], int tamanho_buffer)
-{
-    char mensagem_aprovacao[tamanho_buffer];
-
-    // Armazena e envia a mensagem de boas vindas para o cliente recém conectado
-    snprintf(mensagem_aprovacao, tamanho_buffer, "Usuário %s aprovado!", buffer_nome);
+    memmove(entrada, entrada + inicio, tamanho_entrada - inicio);
+    tamanho_entrada -= inicio;
 
 #ifdef MODO_DEBUGER
-    printf("\n Usuário aprovado?\n");
-    printf(" Buffer: %s\n", buffer);
-    printf(" Mensagem_aprovacao: %s\n", mensagem_aprovacao);
+    printf("\n Mensagens colocadas na fila: %d\n", linhas);
 #endif
 
-    if (!strcmp(buffer, mensagem_aprovacao))
+    // todas as linhas do bloco seguem juntas, sem esperar pelo próximo select
+    if (chat_descarrega(sessao) < 0)
     {
-#ifdef MODO_DEBUGER
-        printf("\n Sim!\n");
-#endif
+        return -1;
+    }
 
-        return -7; // Trata-se da aprovação da conferência do nome pelo servidor. É negativo para ser tratado pelo switch do main
+    if (sair)
+    {
+        return -10;
+    }
+
+    if (fim_entrada)
+    {
+        return -11;
     }
 
     return 1;
 }
 
-// Função que trata o processo de envio e aprovação do nome do cliente pelo servidor
-int trata_aprovacao_nome(fd_set *readfds, int server_socket, char buffer[], char nome_cliente[], int tamanho_nome, int tamanho_buffer)
+// Função que espera a fila de envio da sessão esvaziar antes de sair
+void esvazia_fila(ChatCliente *sessao)
 {
-    int retorno_verificacao;
-
-    retorno_verificacao = verifica_mensagem_shell(readfds, server_socket, nome_cliente, tamanho_nome);
+    fd_set writefds;
 
-    if (retorno_verificacao <= 0)
+    while (chat_eventos(sessao) & CHAT_ESCREVER)
     {
-        return retorno_verificacao;
-    }
+        FD_ZERO(&writefds);
+        FD_SET(chat_descritor(sessao), &writefds);
 
-    retorno_verificacao = verifica_mensagem_socket(readfds, server_socket, buffer, tamanho_buffer);
+        if (select(chat_descritor(sessao) + 1, NULL, &writefds, NULL, NULL) == -1 || chat_descarrega(sessao) < 0)
+        {
+            return;
+        }
+    }
+}
 
-    if (retorno_verificacao <= 0)
+// Função que reconecta depois de uma queda da conexão. A sessão aprovada é retomada sem repetir a aprovação
+// e sem perder as mensagens da sala. Retorna 1 se uma nova tentativa foi iniciada
+int reconecta(ChatCliente *sessao, int *tentativas)
+{
+    while ((*tentativas)++ < MAX_TENTATIVAS_RECONEXAO)
     {
-        return retorno_verificacao;
-    }
+        printf("\n Conexão perdida, reconectando...\n");
+        sleep(1);
 
-    retorno_verificacao = verifica_retorno_aprovacao(buffer, nome_cliente, tamanho_buffer);
+        if (chat_reconecta(sessao) == 0)
+        {
+            return 1;
+        }
+    }
 
-    return retorno_verificacao;
+    return 0;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
     int fecha_comunicador = 0;
     int apto_comunicacao = 0;
-    int max_descritor_arquivo, retorno_comunicador;
-    struct sockaddr_in server_addr;
-    char buffer[TAMANHO_BUFFER];
-    char nome_cliente[TAMANHO_NOME];
-    fd_set readfds; // conjunto de descritores para o select
-
-    // Criar o socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0)
+    int max_descritor_arquivo, retorno_comunicador, opcao, descritor, eventos, prazo;
+    int usar_tls = 0;          // -s: cifra a conexão TCP com TLS
+    int modo_lote = 0;         // -b: no fim da entrada, aguarda o servidor processar tudo antes de sair
+    int entrada_encerrada = 0;
+    int tentativas_reconexao = 0;
+    char *caminho_unix = NULL; // -u: conecta pelo socket Unix do servidor em vez de TCP
+    char *arquivo_sessao_tls = ARQUIVO_SESSAO_TLS; // -S: arquivo da sessão TLS guardada
+    struct timeval espera;
+    fd_set readfds, writefds; // conjuntos de descritores para o select
+
+    while ((opcao = getopt(argc, argv, "u:sS:b")) != -1)
     {
-        error("\n Erro ao criar o socket\n");
+        switch (opcao)
+        {
+        case 'b':
+            modo_lote = 1;
+            break;
+
+        case 'u':
+            caminho_unix = optarg;
+            break;
+
+        case 's':
+            usar_tls = 1;
+            break;
+
+        case 'S':
+            arquivo_sessao_tls = optarg;
+            break;
+
+        default:
+            fprintf(stderr, "Uso: %s [-u caminho_unix] [-s [-S arquivo_sessao]] [-b]\n", argv[0]);
+            exit(1);
+        }
     }
 
-    // Configurar o endereço do servidor
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
-    if (inet_pton(AF_INET, SERVER_IP, &(server_addr.sin_addr)) <= 0)
+    sessao = chat_cria(NULL, mostra_mensagem, NULL);
+    if (sessao == NULL)
     {
-        error("\n Erro ao converter o endereço IP\n");
+        error("\n Erro ao criar a sessão\n");
     }
 
-    // Conectar ao servidor
-    if (connect(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    // mensagens exibidas são confirmadas ao servidor, que reenvia as não confirmadas se a conexão cair
+    chat_ativa_confirmacoes(sessao, INTERVALO_CONFIRMACAO_MS);
+    chat_define_ao_arquivo(sessao, mostra_arquivo, NULL);
+
+    if (usar_tls && chat_ativa_tls(sessao, arquivo_sessao_tls) < 0)
     {
-        error("\n Falha de conexao no servidor \n");
+        fprintf(stderr, "Cliente compilado sem suporte a TLS (compile com -DCOM_TLS -lssl -lcrypto)\n");
+        exit(1);
+    }
+
+    if (caminho_unix != NULL)
+    {
+        // Conectar ao servidor pelo socket Unix, mesmo protocolo sem a pilha TCP
+        if (chat_conecta_unix(sessao, caminho_unix) < 0)
+        {
+            error("\n Falha de conexao no servidor \n");
+        }
+
+#ifdef MODO_DEBUGER
+        printf("Cliente conectando ao servidor pelo socket Unix %s\n", caminho_unix);
+#endif
     }
+    else
+    {
+        if (chat_conecta_tcp(sessao, SERVER_IP, SERVER_PORT) < 0)
+        {
+            error("\n Falha de conexao no servidor \n");
+        }
 
 #ifdef MODO_DEBUGER
-    printf("Cliente conectado ao servidor %s na porta %d\n", SERVER_IP, SERVER_PORT);
+        printf("Cliente conectando ao servidor %s na porta %d\n", SERVER_IP, SERVER_PORT);
 #endif
+    }
 
     // Tratamento de sinais
     sigset(SIGINT, fecha_conexao);
     sigset(SIGILL, fecha_conexao);
     sigset(SIGTERM, fecha_conexao);
     sigset(SIGSEGV, fecha_conexao);
+    signal(SIGCHLD, SIG_IGN); // transferências de arquivo terminam sem deixar processos zumbis
 
     printf("\n A qualquer momento, digite [S/s] para sair:\n");
 
     // Enviar e receber mensagens
     while (!fecha_comunicador)
     {
-        // limpar o conjunto de descritores
+        // limpar os conjuntos de descritores
         FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+
+        // adicionar a sessão, com os eventos que ela aguarda, e o prompt aos conjuntos de descritores
+        descritor = chat_descritor(sessao);
+        eventos = chat_eventos(sessao);
+
+        if (eventos & CHAT_LER)
+        {
+            FD_SET(descritor, &readfds);
+        }
+
+        if (eventos & CHAT_ESCREVER)
+        {
+            FD_SET(descritor, &writefds);
+        }
 
-        // adicionar o socket e o prompt ao conjunto de descritores
-        FD_SET(server_socket, &readfds);
-        FD_SET(STDIN_FILENO, &readfds);
+        if (!entrada_encerrada)
+        {
+            FD_SET(STDIN_FILENO, &readfds);
+        }
 
         // definir o valor máximo de descritor
-        if (server_socket > STDIN_FILENO)
-        {                                          // se a condição for verdadeira
-            max_descritor_arquivo = server_socket; // atribui sock a max_descritor_arquivo
+        if (descritor > STDIN_FILENO)
+        {
+            max_descritor_arquivo = descritor;
         }
         else
-        {                                         // caso contrário
-            max_descritor_arquivo = STDIN_FILENO; // atribui STDIN_FILENO a max_descritor_arquivo
+        {
+            max_descritor_arquivo = STDIN_FILENO;
         }
 
         // esperar por dados disponíveis no socket ou no prompt usando select
-        if (select(max_descritor_arquivo + 1, &readfds, NULL, NULL, NULL) == -1)
+        // dados TLS já decifrados em memória não acordam o select, que então não deve bloquear;
+        // a espera também termina quando vence o prazo da próxima confirmação de entrega
+        prazo = chat_pendente(sessao) ? 0 : chat_prazo_ms(sessao);
+        espera.tv_sec = prazo / 1000;
+        espera.tv_usec = (prazo % 1000) * 1000;
+
+        if (select(max_descritor_arquivo + 1, &readfds, &writefds, NULL, prazo >= 0 ? &espera : NULL) == -1)
         {
             error("\n Erro ao aguardar por atividade\n");
         }
@@ -359,48 +464,78 @@ int main()
         printf("\n Realizei select\n");
 #endif
 
-        if (!apto_comunicacao)
+        retorno_comunicador = verifica_mensagem_shell(&readfds, sessao);
+
+        if (retorno_comunicador > 0)
         {
-            retorno_comunicador = trata_aprovacao_nome(&readfds, server_socket, buffer, nome_cliente, TAMANHO_NOME, TAMANHO_BUFFER);
+            retorno_comunicador = chat_processa(sessao, (FD_ISSET(descritor, &readfds) ? CHAT_LER : 0) | (FD_ISSET(descritor, &writefds) ? CHAT_ESCREVER : 0));
         }
 
-        if (apto_comunicacao)
+        if (chat_estado(sessao) == CHAT_APROVADO)
         {
-            retorno_comunicador = trata_comunicador(&readfds, server_socket, buffer, TAMANHO_BUFFER);
+            tentativas_reconexao = 0;
         }
 
-        switch (retorno_comunicador)
+        if (!apto_comunicacao && chat_estado(sessao) == CHAT_APROVADO)
         {
-        case 0:
-            error("\n Servidor desconectado! Finalizando programa\n");
-
-        case -1:
-            error("\n Erro ao receber ou enviar mensagem\n");
-
-        case -3:
-            error("\n Erro ao alocar memória para o buffer\n");
-
-        case -7:
-           //Caso de aprovação aproveitando valor de retorno negativo livre
             apto_comunicacao = 1;
 
 #ifdef MODO_DEBUGER
             printf("\n Usuário aprovado\n");
 #endif
+        }
 
-            break;
+        switch (retorno_comunicador)
+        {
+        case 0:
+            if (entrada_encerrada)
+            {
+                // no modo lote, o servidor fecha a conexão depois de processar todas as mensagens enviadas
+                fecha_comunicador = 1;
+                break;
+            }
+
+            if (apto_comunicacao && reconecta(sessao, &tentativas_reconexao))
+            {
+                break;
+            }
+
+            error("\n Servidor desconectado! Finalizando programa\n");
+
+        case -1:
+            if (apto_comunicacao && chat_estado(sessao) == CHAT_ENCERRADO && reconecta(sessao, &tentativas_reconexao))
+            {
+                break;
+            }
+
+            error("\n Erro ao receber ou enviar mensagem\n");
 
         case -10:
             printf("\n Você optou por encerrar este Comunicador. Até a próxima! =D\n");
             fecha_comunicador = 1;
             break;
 
+        case -11:
+            if (!modo_lote)
+            {
+                printf("\n Fim da entrada. Até a próxima! =D\n");
+                fecha_comunicador = 1;
+                break;
+            }
+
+            // encerra apenas o envio, depois da fila esvaziar, e continua recebendo até o servidor fechar a conexão
+            entrada_encerrada = 1;
+            chat_encerra_envio(sessao);
+            chat_descarrega(sessao);
+            break;
+
         default:
             break;
         }
     }
 
     // Fechar a conexão
-    close(server_socket);
+    esvazia_fila(sessao);
+    chat_destroi(sessao);
     return 0;
-}
\ No newline at end of file
+}
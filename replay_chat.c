@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+// Reprodução de captura: lê o arquivo gravado pelo servidor com -g e reenvia os mesmos quadros, pelas mesmas
+// conexões, a um servidor local. Cada conexão da captura vira uma conexão nova; os quadros são escritos na
+// ordem em que o servidor os recebeu, no ritmo registrado ou, com -r, o mais rápido possível. O que o
+// servidor responde é lido e descartado, para que ele nunca fique bloqueado escrevendo para a reprodução.
+// Conexões cuja abertura não está na captura (herdadas numa troca do binário) são ignoradas
+//
+// Uso: replay_chat [-r] [-p porta] [-u caminho_unix] arquivo_captura
+
+#define SERVER_IP "127.0.0.1"
+#define SERVER_PORT 12345
+#define MARCA_ARQUIVO_CAPTURA "CHATCAP1"
+#define CAPTURA_ABERTURA 1
+#define CAPTURA_QUADRO 2
+#define CAPTURA_FECHAMENTO 3
+#define DRENAGEM_MS 500 // tempo para receber as últimas respostas antes de fechar as conexões
+
+// Conexões abertas, indexadas pelo identificador da captura
+typedef struct conexoes
+{
+    int *sockets;
+    unsigned int capacidade;
+    struct pollfd *descritores;
+    unsigned int *ids; // identificador da conexão de cada descritor do poll
+} Conexoes;
+
+long long agora_us()
+{
+    struct timespec agora;
+
+    clock_gettime(CLOCK_MONOTONIC, &agora);
+
+    return (long long)agora.tv_sec * 1000000 + agora.tv_nsec / 1000;
+}
+
+// Lê um varint do registro. Retorna -1 se o arquivo terminou no meio do valor
+int le_varint(const unsigned char *dados, long tamanho, long *posicao, unsigned long long *valor)
+{
+    int deslocamento = 0;
+
+    *valor = 0;
+
+    while (*posicao < tamanho && deslocamento < 64)
+    {
+        *valor |= (unsigned long long)(dados[*posicao] & 0x7f) << deslocamento;
+        deslocamento += 7;
+
+        if ((dados[(*posicao)++] & 0x80) == 0)
+        {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// Lê o arquivo de captura inteiro. Retorna NULL se não for possível lê-lo
+unsigned char *le_captura(const char *caminho, long *tamanho)
+{
+    unsigned char *dados;
+    FILE *arquivo = fopen(caminho, "rb");
+
+    if (arquivo == NULL)
+    {
+        return NULL;
+    }
+
+    fseek(arquivo, 0, SEEK_END);
+    *tamanho = ftell(arquivo);
+    fseek(arquivo, 0, SEEK_SET);
+
+    dados = malloc(*tamanho > 0 ? *tamanho : 1);
+    if (dados == NULL || fread(dados, 1, *tamanho, arquivo) != (size_t)*tamanho)
+    {
+        free(dados);
+        dados = NULL;
+    }
+
+    fclose(arquivo);
+
+    return dados;
+}
+
+int conecta_servidor(const char *caminho_unix, int porta)
+{
+    int socket_servidor;
+    struct sockaddr_in endereco;
+    struct sockaddr_un endereco_unix;
+
+    if (caminho_unix != NULL)
+    {
+        socket_servidor = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        memset(&endereco_unix, 0, sizeof(endereco_unix));
+        endereco_unix.sun_family = AF_UNIX;
+        strncpy(endereco_unix.sun_path, caminho_unix, sizeof(endereco_unix.sun_path) - 1);
+
+        if (socket_servidor < 0 || connect(socket_servidor, (struct sockaddr *)&endereco_unix, sizeof(endereco_unix)) < 0)
+        {
+            return -1;
+        }
+
+        return socket_servidor;
+    }
+
+    socket_servidor = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&endereco, 0, sizeof(endereco));
+    endereco.sin_family = AF_INET;
+    endereco.sin_port = htons(porta);
+    inet_pton(AF_INET, SERVER_IP, &endereco.sin_addr);
+
+    if (socket_servidor < 0 || connect(socket_servidor, (struct sockaddr *)&endereco, sizeof(endereco)) < 0)
+    {
+        return -1;
+    }
+
+    return socket_servidor;
+}
+
+// Garante espaço para o identificador na tabela de conexões
+void reserva_conexao(Conexoes *conexoes, unsigned int id)
+{
+    unsigned int i, capacidade;
+
+    if (id < conexoes->capacidade)
+    {
+        return;
+    }
+
+    capacidade = conexoes->capacidade ? conexoes->capacidade : 1024;
+    while (capacidade <= id)
+    {
+        capacidade *= 2;
+    }
+
+    conexoes->sockets = realloc(conexoes->sockets, capacidade * sizeof(int));
+    conexoes->descritores = realloc(conexoes->descritores, capacidade * sizeof(struct pollfd));
+    conexoes->ids = realloc(conexoes->ids, capacidade * sizeof(unsigned int));
+
+    if (conexoes->sockets == NULL || conexoes->descritores == NULL || conexoes->ids == NULL)
+    {
+        perror("\n Erro ao alocar a tabela de conexões");
+        exit(1);
+    }
+
+    for (i = conexoes->capacidade; i < capacidade; i++)
+    {
+        conexoes->sockets[i] = -1;
+    }
+
+    conexoes->capacidade = capacidade;
+}
+
+// Lê e descarta as respostas do servidor, esperando no máximo espera_ms. Retorna quantas conexões continuam abertas
+int drena_respostas(Conexoes *conexoes, int espera_ms)
+{
+    unsigned int i, total = 0;
+    char descarte[65536];
+
+    for (i = 0; i < conexoes->capacidade; i++)
+    {
+        if (conexoes->sockets[i] >= 0)
+        {
+            conexoes->descritores[total].fd = conexoes->sockets[i];
+            conexoes->descritores[total].events = POLLIN;
+            conexoes->ids[total] = i;
+            total++;
+        }
+    }
+
+    if (poll(conexoes->descritores, total, espera_ms) <= 0)
+    {
+        return total;
+    }
+
+    for (i = 0; i < total; i++)
+    {
+        // Os quadros seguintes de uma conexão que o servidor fechou são contados como ignorados
+        if (conexoes->descritores[i].revents != 0 && recv(conexoes->descritores[i].fd, descarte, sizeof(descarte), MSG_DONTWAIT) == 0)
+        {
+            close(conexoes->descritores[i].fd);
+            conexoes->sockets[conexoes->ids[i]] = -1;
+            total--;
+        }
+    }
+
+    return total;
+}
+
+// Escreve todos os bytes, drenando as respostas enquanto o servidor não aceita mais escrita
+int escreve_tudo(Conexoes *conexoes, int socket_servidor, const void *dados, int tamanho)
+{
+    int enviados = 0, n;
+
+    while (enviados < tamanho)
+    {
+        n = send(socket_servidor, (const char *)dados + enviados, tamanho - enviados, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                return -1;
+            }
+
+            drena_respostas(conexoes, 10);
+            continue;
+        }
+
+        enviados += n;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int opcao, socket_servidor, rapido = 0, porta = SERVER_PORT, tamanho_quadro;
+    long tamanho, posicao;
+    long aberturas = 0, quadros = 0, fechamentos = 0, ignorados = 0, falhas = 0;
+    long long inicio, instante_us = 0, espera_us, duracao_us, fim_drenagem;
+    unsigned long long tipo, delta, id, tamanho_registro;
+    unsigned int i;
+    char *caminho_unix = NULL;
+    unsigned char *dados;
+    Conexoes conexoes = {NULL, 0, NULL, NULL};
+    struct rlimit limite;
+
+    while ((opcao = getopt(argc, argv, "rp:u:")) != -1)
+    {
+        switch (opcao)
+        {
+        case 'r':
+            rapido = 1;
+            break;
+
+        case 'p':
+            porta = atoi(optarg);
+            break;
+
+        case 'u':
+            caminho_unix = optarg;
+            break;
+
+        default:
+            fprintf(stderr, "Uso: %s [-r] [-p porta] [-u caminho_unix] arquivo_captura\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Uso: %s [-r] [-p porta] [-u caminho_unix] arquivo_captura\n", argv[0]);
+        exit(1);
+    }
+
+    dados = le_captura(argv[optind], &tamanho);
+    if (dados == NULL || tamanho < (long)strlen(MARCA_ARQUIVO_CAPTURA) || memcmp(dados, MARCA_ARQUIVO_CAPTURA, strlen(MARCA_ARQUIVO_CAPTURA)))
+    {
+        fprintf(stderr, "%s não é um arquivo de captura\n", argv[optind]);
+        exit(1);
+    }
+
+    // Cada conexão da captura ocupa um descritor neste processo
+    if (getrlimit(RLIMIT_NOFILE, &limite) == 0)
+    {
+        limite.rlim_cur = limite.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limite);
+    }
+
+    posicao = strlen(MARCA_ARQUIVO_CAPTURA);
+    inicio = agora_us();
+
+    while (posicao < tamanho)
+    {
+        tipo = dados[posicao++];
+
+        if (le_varint(dados, tamanho, &posicao, &delta) < 0 || le_varint(dados, tamanho, &posicao, &id) < 0)
+        {
+            break; // captura interrompida no meio do registro
+        }
+
+        tamanho_registro = 0;
+        if (tipo == CAPTURA_QUADRO && (le_varint(dados, tamanho, &posicao, &tamanho_registro) < 0 || tamanho_registro > (unsigned long long)(tamanho - posicao)))
+        {
+            break;
+        }
+
+        // No ritmo registrado, espera o instante do registro atendendo as respostas do servidor
+        instante_us += delta;
+        while (!rapido && (espera_us = inicio + instante_us - agora_us()) > 0)
+        {
+            drena_respostas(&conexoes, espera_us > 1000 ? espera_us / 1000 : 1);
+        }
+
+        reserva_conexao(&conexoes, id);
+
+        switch (tipo)
+        {
+        case CAPTURA_ABERTURA:
+            socket_servidor = conecta_servidor(caminho_unix, porta);
+            if (socket_servidor < 0)
+            {
+                perror("\n Erro ao conectar");
+                falhas++;
+                break;
+            }
+
+            conexoes.sockets[id] = socket_servidor;
+            aberturas++;
+            break;
+
+        case CAPTURA_QUADRO:
+            if (conexoes.sockets[id] < 0)
+            {
+                ignorados++;
+                break;
+            }
+
+            // Mesmo enquadramento do cliente: tamanho em int seguido da mensagem
+            tamanho_quadro = tamanho_registro;
+            if (escreve_tudo(&conexoes, conexoes.sockets[id], &tamanho_quadro, sizeof(int)) < 0 ||
+                escreve_tudo(&conexoes, conexoes.sockets[id], dados + posicao, tamanho_quadro) < 0)
+            {
+                close(conexoes.sockets[id]);
+                conexoes.sockets[id] = -1;
+                falhas++;
+                break;
+            }
+
+            quadros++;
+            break;
+
+        case CAPTURA_FECHAMENTO:
+            // Fecha só o envio: com respostas ainda não lidas, o close descartaria os quadros que o servidor
+            // não leu. O socket é fechado quando o servidor encerra a conexão do seu lado
+            if (conexoes.sockets[id] >= 0)
+            {
+                shutdown(conexoes.sockets[id], SHUT_WR);
+                fechamentos++;
+            }
+            break;
+
+        default:
+            fprintf(stderr, "Registro desconhecido (%llu) na posição %ld\n", tipo, posicao);
+            exit(1);
+        }
+
+        posicao += tamanho_registro;
+
+        if (rapido && quadros % 256 == 0)
+        {
+            drena_respostas(&conexoes, 0);
+        }
+    }
+
+    duracao_us = agora_us() - inicio;
+
+    // Aguarda o servidor consumir o que falta e fechar as conexões encerradas
+    fim_drenagem = agora_us() + DRENAGEM_MS * 1000;
+    while (agora_us() < fim_drenagem && drena_respostas(&conexoes, 10) > 0)
+    {
+    }
+
+    for (i = 0; i < conexoes.capacidade; i++)
+    {
+        if (conexoes.sockets[i] >= 0)
+        {
+            close(conexoes.sockets[i]);
+        }
+    }
+
+    printf("conexões: %ld, quadros: %ld, fechamentos: %ld, ignorados: %ld, falhas: %ld\n", aberturas, quadros, fechamentos, ignorados, falhas);
+    printf("duração registrada: %.3f s, reprodução: %.3f s (%.0f quadros/s)\n", instante_us / 1e6, duracao_us / 1e6,
+           duracao_us > 0 ? quadros * 1e6 / duracao_us : 0.0);
+
+    free(dados);
+    free(conexoes.sockets);
+    free(conexoes.descritores);
+    free(conexoes.ids);
+
+    return falhas ? 1 : 0;
+}
@@ -1,655 +1,8046 @@
+#define _GNU_SOURCE // memfd_create, splice
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <linux/sockios.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <ctype.h>
+#include <limits.h>
+#include <dirent.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef COM_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "chat_cliente.h"
 
 #define SERVER_PORT 12345
-#define MAX_CLIENTS 100
+#ifndef MAX_CLIENTS
+#define MAX_CLIENTS 100 // posições da tabela de conexões; com select, limitado na prática por FD_SETSIZE
+#endif
 #define TAMANHO_BUFFER 401
 #define TAMANHO_NOME 101
+#define PRAZO_ENCERRAMENTO_MS 5000 // prazo máximo para esvaziar as filas de saída no encerramento
+#define JANELA_RECONEXAO_MS 10000  // janela na qual os clientes espalham suas reconexões
+#define CAMINHO_TROCA "/tmp/server_chat_v1.troca" // socket Unix usado na troca do binário sem queda
+#define PRAZO_TROCA_MS 5000          // prazo para o novo binário receber as conexões e confirmar a troca
+#define MAX_PARES 16                  // máximo de links com outros servidores da federação
+#define MAX_REMOTOS 1000              // máximo de usuários conectados em outros servidores
+#define TAMANHO_TABELA_NOMES (MAX_CLIENTS + MAX_REMOTOS) // posições da tabela de espalhamento dos nomes internados
+#define TAMANHO_BLOCO_NOMES 65536     // bloco da arena de nomes, alocado quando o anterior enche
+#define ALINHAMENTO_NOMES 16          // granularidade das classes de tamanho da arena de nomes
+#define CLASSES_NOMES ((TAMANHO_NOME + 32) / ALINHAMENTO_NOMES + 1)
+#define TAMANHO_BUFFER_PAR (TAMANHO_BUFFER + 64) // mensagem de cliente mais o cabeçalho de repasse
+#define MARCA_PAR "\001PAR "          // primeira mensagem de um servidor par, no lugar do nome de usuário, com o id e o segredo
+#define TAMANHO_SEGREDO_PAR 64       // maior segredo compartilhado dos pares (-K)
+#define INTERVALO_RECONEXAO_PAR_MS 1000
+#define PAR_CONECTANDO 1               // connect não bloqueante ao par em andamento
+#define PAR_TLS 2                      // handshake TLS com o par em andamento
+#define PAR_BOAS_VINDAS 3              // conectado ao par, aguardando as boas vindas
+#define PRAZO_CONEXAO_PAR_MS 10000     // prazo para o link com o par se estabelecer antes de uma nova tentativa
+#define MAX_HANDSHAKES 64              // conexões aceitas com handshake TLS em andamento
+#define PRAZO_HANDSHAKE_MS 10000       // prazo para o cliente concluir o handshake TLS
+#define TAMANHO_SALA 33                // nome de sala com até 32 caracteres
+#define SALA_PADRAO "geral"            // sala em que todo cliente entra ao ser aprovado
+#define NOS_VIRTUAIS 64                // pontos de cada servidor no anel de hash consistente
+#define MAX_ASSINATURAS 1000           // máximo de pares (sala, servidor) assinados neste servidor
+#define MAX_ORIGENS 256                // máximo de pares (servidor, sala) com sequência registrada
+#define TAMANHO_HISTORICO 1024         // mensagens guardadas para os clientes que retomam a sessão
+#define PRAZO_RETOMADA_MS 120000       // tempo em que a sessão de um cliente desconectado pode ser retomada
+#define MARCA_SESSAO "\001SESSAO"      // pedido de sessão retomável e resposta com token e sequência atual
+#define MARCA_RETOMAR "\001RETOMAR "   // primeira mensagem do cliente que retoma a sessão, no lugar do nome
+#define MARCA_EXPIRADA "\001EXPIRADA"  // resposta à retomada de uma sessão desconhecida ou expirada
+#define MARCA_MENSAGEM "\001MSG "      // mensagem com sequência, enviada aos clientes com sessão retomável
+#define MARCA_CONFIRMACAO "\001ACK "   // confirmação cumulativa: maior sequência já processada pelo cliente
+#define MARCA_EVENTO "\001EVENTO "     // evento efêmero do cliente (digitando, ativo, ausente...)
+#define MARCA_EVENTOS "\001EVENTOS "   // lote com o último evento de cada usuário da sala, linhas "nome\testado"
+#define TAMANHO_EVENTO 17              // estado de evento com até 16 caracteres
+#define JANELA_EVENTOS_MS 250          // eventos de uma sala são reunidos e despachados uma vez por janela
+#define MAX_WORKERS 64                 // máximo de processos worker no modo pré-fork (-w)
+#define TAMANHO_BARRAMENTO 4096        // mensagens codificadas guardadas no anel compartilhado entre os workers
+#define TAMANHO_FILA_WORKER 1024       // referências a mensagens na fila de entrada de cada worker
+#define MAX_THREADS_POOL 64            // máximo de threads na pool de processamento das mensagens (-T)
+#define MAX_TAREFAS_POOL 1024          // mensagens em processamento na pool ao mesmo tempo
+#define MAX_ETAPAS 8                   // etapas de processamento aplicadas a cada mensagem de sala
+#define MAX_NOS_DIRETORIO ((MAX_CLIENTS + MAX_REMOTOS) * (TAMANHO_NOME - 1) + 1) // pior caso: nenhum prefixo em comum
+#define TAMANHO_PAGINA_DIRETORIO 20    // nomes por página da consulta /quem
+#define MAX_TRANSFERENCIAS 32          // transferências de arquivo em andamento ou aguardando retomada
+#define TAMANHO_CANAL 65536            // bytes de uma transferência em trânsito no pipe do splice
+#define MARCA_ENVIA "\001ENVIA "       // conexão de dados do remetente: "id token destinatário tamanho nome"
+#define MARCA_RECEBE "\001RECEBE "     // conexão de dados do destinatário: "id token deslocamento"
+#define MARCA_ARQUIVO "\001ARQUIVO "   // aviso ao destinatário: "id tamanho remetente nome"
+#define MARCA_DESDE "\001DESDE "       // aos dois lados: deslocamento a partir do qual seguem os bytes do arquivo
+#define MARCA_CONCLUIDA "\001CONCLUIDA" // o destinatário recebeu o arquivo inteiro
+#define MARCA_RECUSADA "\001RECUSADA "  // transferência recusada, com o motivo
+#define TAMANHO_TERMO 128              // termo de moderação com até 127 bytes
+#define MODERACAO_BLOQUEAR 1           // a mensagem com o termo é descartada
+#define MODERACAO_MASCARAR 2           // o termo é substituído por '*'
+#define MODERACAO_MARCAR 4             // a mensagem é entregue e registrada no log para revisão
+#define BUFFER_SOCKET_BAIXA_LATENCIA (256 * 1024) // SO_SNDBUF e SO_RCVBUF dos clientes no perfil de baixa latência
+#define ESPERA_BUSY_POLL_US 50         // SO_BUSY_POLL: espera ativa do kernel na fila do dispositivo a cada leitura
+#define LIMITE_LOTE_SAIDA 4096         // bytes de mensagens de sala acumulados para um destinatário antes de escrever
+#define LIMITE_FILA_VOLUME (4 * 1024 * 1024) // mensagens de sala retidas para um cliente lento antes de esperar por ele
+#define LIMITE_NAO_ENVIADO 65536       // TCP_NOTSENT_LOWAT: bytes ainda não enviados que o kernel aceita de cada cliente
+#define JANELA_LOTE_MIN_US 100         // menor janela de acumulação de um lote
+#define MENSAGENS_POR_LOTE 8           // a janela do lote cobre esse número de intervalos médios entre mensagens
+#define TAMANHO_SEGMENTO_CAIXA (1024 * 1024) // arquivo de segmento das caixas postais, mapeado em memória
+#define MAX_SEGMENTOS_CAIXA 256        // segmentos de caixa postal abertos ao mesmo tempo
+#define MAX_CAIXAS 4096                // usuários com mensagens privadas guardadas
+#define MAX_MENSAGENS_CAIXAS 65536     // mensagens guardadas em todas as caixas postais
+#define MAX_PENDENTES_CAIXA 256        // mensagens guardadas para um mesmo usuário
+#define CAIXA_PENDENTE 1               // estados de um registro de caixa postal
+#define CAIXA_ENTREGUE 2
+#define TAMANHO_ANEL_CAPTURA (4 * 1024 * 1024) // registros da captura aguardando a thread de gravação
+#define INTERVALO_GRAVACAO_MS 20       // a thread de gravação esvazia o anel da captura a cada intervalo
+#define MARCA_ARQUIVO_CAPTURA "CHATCAP1" // início de todo arquivo de captura
+#define CAPTURA_ABERTURA 1             // registros da captura: conexão aceita
+#define CAPTURA_QUADRO 2               // quadro recebido da conexão
+#define CAPTURA_FECHAMENTO 3           // conexão encerrada
+#define TAMANHO_TERMO_BUSCA 32         // termo do índice de busca com até 31 bytes
+#define MAX_TERMOS_CONSULTA 4          // termos de uma busca, todos exigidos na mensagem
+#define RESULTADOS_BUSCA 10            // mensagens mais recentes exibidas na resposta de uma busca
+#define TAMANHO_RESPOSTA_BUSCA 4096
+#define TAMANHO_FILA_BUSCA 4096        // mensagens de sala aguardando a thread de busca
+#define TAMANHO_FILA_CONSULTAS 64      // buscas aguardando a thread, e respostas aguardando o laço principal
+#define MAX_TERMOS_MEMORIA 65536       // posições da tabela de termos ainda não gravados em segmento
+#define DOCUMENTOS_POR_SEGMENTO 8192   // mensagens indexadas em memória antes de gravar um segmento
+#define MAX_SEGMENTOS_BUSCA 64         // segmentos do índice de busca abertos ao mesmo tempo
+#define INTERVALO_INDEXACAO_MS 20      // a thread de busca esvazia a fila de mensagens a cada intervalo
+#define MARCA_INDICE_BUSCA "CHATIDX1"  // início de todo segmento do índice de busca
+#define TAMANHO_PREFIXO_BUSCA (PATH_MAX - 32) // deixa espaço no caminho para o nome do arquivo, como "indice.00000001.tmp"
+#define TAMANHO_LOTE_EVENTOS (sizeof(MARCA_EVENTOS) + MAX_CLIENTS * (TAMANHO_NOME + TAMANHO_EVENTO + 1))
 
 #define MODO_DEBUGER
 
 /* Declaração de variáveis globais para permitir associar os descritores de arquivo dos sockets
 // aos tratamentos de sinais do processo e rotina de erro */
 int sockfd = 0;
+int sockfd_unix = 0;       // socket Unix do servidor, para clientes e robôs no mesmo host
+char *caminho_unix = NULL; // caminho do socket Unix; com '@' inicial, nome no espaço abstrato
+int sinalfd = 0; // descritor do signalfd que entrega os sinais como eventos do select
+int trocafd = 0;  // socket Unix que aguarda um novo binário pedindo a transferência das conexões
+char *caminho_troca = CAMINHO_TROCA;
+int porta_servidor = SERVER_PORT;
+int id_no = 0;                       // identificador deste servidor na federação
+char *segredo_pares = NULL;          // -K: segredo que os servidores pares apresentam na identificação; sem ele, nenhum par é aceito
+unsigned long long sequencia_no = 0; // sequência das mensagens originadas neste servidor
+unsigned long long sequencia_historico = 0; // sequência das mensagens entregues aos clientes deste servidor
 int clientes_sockets[MAX_CLIENTS];
 
-typedef struct cliente
+// Dados de cada conexão, fora dos arrays percorridos a cada volta do laço (clientes_sockets e
+// clientes_pendentes). Nome e sala apontam para a arena de nomes, onde cada texto é guardado uma única vez
+typedef struct cliente
+{
+    const char *nome;              // vazio enquanto o cliente não informou o nome
+    const char *sala;              // vazio fora de qualquer sala
+    int socket;
+    unsigned char evento_pendente;
+    unsigned char recebe_eventos;  // o cliente participa dos eventos efêmeros e recebe os lotes da sala
+    char evento[TAMANHO_EVENTO];   // último evento efêmero ainda não despachado
+    unsigned long long token;      // token de retomada da sessão; 0 se o cliente não pediu sessão retomável
+    unsigned long long ultimo_ack; // maior sequência confirmada como processada; 0 se o cliente não confirma
+} Cliente;
+
+Cliente clientes_aprovados[MAX_CLIENTS];
+int posicoes_livres_clientes[MAX_CLIENTS]; // posições liberadas, reusadas antes de avançar o limite
+int total_livres_clientes = 0;
+int limite_clientes = 0;                    // uma além da maior posição já ocupada; os laços param aqui
+
+// Nome (de usuário ou de sala) guardado uma única vez na arena, com o número de referências. Os textos são
+// comparados pelo hash antes do strcmp, e as entradas liberadas voltam para a lista da sua classe de tamanho
+typedef struct nome_internado
+{
+    struct nome_internado *proximo; // próximo na mesma posição da tabela, ou próximo livre da classe
+    unsigned int hash;
+    int referencias;
+    char texto[];
+} NomeInternado;
+
+const char nome_vazio[] = "";
+NomeInternado *tabela_nomes[TAMANHO_TABELA_NOMES];
+NomeInternado *livres_nomes[CLASSES_NOMES]; // entradas liberadas, por classe de tamanho
+char *bloco_nomes = NULL;
+int uso_bloco_nomes = 0;
+
+// Estado de uma sessão transferida ao novo binário junto com o descritor do seu socket
+typedef struct estado_sessao
+{
+    int indice;          // posição da sessão nos arrays de clientes
+    int socket_original; // número do descritor no processo antigo, que também é o ID exibido aos usuários
+    int pendente;        // cliente ainda em processo de aprovação de nome
+    int aprovado;        // cliente aprovado para comunicação
+    char nome[TAMANHO_NOME];
+    char sala[TAMANHO_SALA];
+    unsigned long long token;
+    unsigned long long ultimo_ack;
+} EstadoSessao;
+
+// Link com outro servidor da federação. Links configurados com -P são reconectados quando caem;
+// links recebidos de outros servidores são descartados quando caem
+typedef struct par
+{
+    char endereco[TAMANHO_NOME]; // vazio para links recebidos
+    int porta;
+    int socket;
+    int id_no;          // 0 até o outro servidor se identificar
+    int socket_conexao; // link configurado ainda em estabelecimento, que só passa a socket quando concluído
+    int etapa_conexao;  // PAR_CONECTANDO, PAR_TLS ou PAR_BOAS_VINDAS
+    int tls_quer_escrita;        // o handshake TLS do link aguarda o socket aceitar escrita
+    long long prazo_conexao_ms; // fim do prazo para o link em estabelecimento
+} Par;
+
+// Maior sequência já entregue de cada servidor de origem em cada sala, usada para descartar repetições.
+// As mensagens de uma sala seguem sempre o mesmo caminho, então a sequência só cresce dentro da sala
+typedef struct origem
+{
+    int id_no;
+    unsigned int hash_sala;
+    unsigned long long ultima_seq;
+} Origem;
+
+// Ponto do anel de hash consistente: cada servidor ocupa NOS_VIRTUAIS pontos
+typedef struct ponto_anel
+{
+    unsigned int hash;
+    int id_no;
+} PontoAnel;
+
+// Servidor que tem membros locais numa sala cuja casa é este servidor
+typedef struct assinatura
+{
+    char sala[TAMANHO_SALA];
+    int id_no;
+} Assinatura;
+
+// Mensagem entregue aos clientes deste servidor, guardada para quem retomar a sessão
+typedef struct historico
+{
+    unsigned long long sequencia;
+    unsigned long long token_remetente; // o remetente não recebe a própria mensagem de volta
+    char sala[TAMANHO_SALA];
+    char texto[TAMANHO_BUFFER];
+} Historico;
+
+// Sessão de um cliente desconectado que ainda pode ser retomada com o token
+typedef struct sessao_suspensa
+{
+    unsigned long long token;
+    const char *nome; // na arena de nomes
+    const char *sala;
+    unsigned long long ultimo_ack;
+    long long expira_ms;
+} SessaoSuspensa;
+
+// Usuário aprovado em outro servidor da federação
+typedef struct remoto
+{
+    int id_no;
+    char nome[TAMANHO_NOME];
+} Remoto;
+
+// Nó da árvore de prefixos do diretório de usuários. Os filhos de cada nó formam uma lista em ordem
+// crescente de byte; o nó 0 é a raiz, de modo que 0 também marca o fim das listas
+typedef struct no_diretorio
+{
+    unsigned char letra;
+    int filho;
+    int irmao;     // próximo filho do mesmo pai, ou próximo nó livre
+    int nomes;     // nomes distintos nesta subárvore, usados para pular páginas sem percorrê-las
+    int usuarios;  // usuários conectados com exatamente este nome, neste ou em outros servidores
+} NoDiretorio;
+
+// Transferência de arquivo entre dois clientes aprovados. Cada lado abre uma conexão de dados própria, e os
+// bytes passam do socket do remetente ao do destinatário por splice através de um pipe, sem cópia para o
+// espaço de usuário. Se uma das conexões cai, as duas são fechadas e a transferência aguarda que ambos os
+// lados voltem; o destinatário informa quantos bytes já tem, e o remetente continua dali
+typedef struct transferencia
+{
+    unsigned long long id;                 // escolhido pelo remetente; 0 marca posição livre
+    unsigned long long token_remetente;    // tokens das sessões retomáveis, que autenticam as conexões de dados
+    unsigned long long token_destinatario;
+    long long tamanho;
+    long long entregue;                    // bytes já escritos no socket do destinatário
+    int no_canal;                          // bytes no pipe, lidos do remetente e ainda não entregues
+    int socket_envio;                      // conexões de dados; 0 enquanto o lado não conectou
+    int socket_recebimento;
+    int canal[2];
+    int iniciada;                          // o remetente já recebeu o deslocamento e está enviando
+    long long expira_ms;                   // prazo para retomar quando as conexões caem
+} Transferencia;
+
+Par pares[MAX_PARES];
+Remoto remotos[MAX_REMOTOS];
+Transferencia transferencias[MAX_TRANSFERENCIAS];
+NoDiretorio diretorio[MAX_NOS_DIRETORIO];
+int total_nos_diretorio = 1; // nós já usados, incluindo a raiz
+int nos_livres_diretorio = 0; // lista de nós liberados por remoções
+Origem origens[MAX_ORIGENS];
+PontoAnel anel[(MAX_PARES + 1) * NOS_VIRTUAIS];
+int tamanho_anel = 0;
+int anel_desatualizado = 1; // o anel é refeito no laço principal sempre que um par entra ou sai
+Assinatura assinaturas[MAX_ASSINATURAS];
+long long proxima_conexao_pares = 0;
+Historico historico[TAMANHO_HISTORICO]; // anel indexado pela sequência
+long long despacho_eventos_ms = 0;      // fim da janela dos eventos pendentes; 0 se não há nenhum
+SessaoSuspensa suspensas[MAX_CLIENTS];
+
+// Entrada do barramento entre workers. A sequência é 0 enquanto a entrada está sendo escrita e, depois de
+// publicada, vale a posição da entrada no anel mais um
+typedef struct entrada_barramento
+{
+    _Atomic unsigned long long sequencia;
+    int worker; // worker que publicou, que já entregou a mensagem aos seus clientes
+    char sala[TAMANHO_SALA];
+    char texto[TAMANHO_BUFFER];
+} EntradaBarramento;
+
+// Fila limitada sem trava de um worker produtor para um worker consumidor, com um único de cada lado. O
+// produtor escreve as referências e só então avança a cauda: se ele cair no meio de um lote, nada do lote
+// fica visível, e a fila segue utilizável pelo consumidor e pelo worker recriado na mesma posição
+typedef struct fila_worker
+{
+    _Atomic unsigned long long cauda;  // próxima posição a ser escrita, alterada apenas pelo produtor
+    _Atomic unsigned long long cabeca; // próxima posição a ser consumida, alterada apenas pelo consumidor
+    unsigned long long referencias[TAMANHO_FILA_WORKER]; // posições das mensagens no anel de mensagens
+} FilaWorker;
+
+// Barramento em memória compartilhada (memfd) entre os workers. Cada mensagem de sala é codificada uma vez
+// no anel de mensagens, e apenas a sua referência segue pela fila de cada um dos demais workers. As filas
+// de pares de workers que não existem nunca são tocadas e não ocupam memória residente
+typedef struct barramento
+{
+    _Atomic unsigned long long cabeca; // próxima posição do anel de mensagens a ser reservada
+    EntradaBarramento entradas[TAMANHO_BARRAMENTO];
+    _Atomic int avisados[MAX_WORKERS];           // o eventfd do worker já foi escrito e ele ainda não consumiu as filas
+    FilaWorker filas[MAX_WORKERS][MAX_WORKERS]; // filas[consumidor][produtor]
+} Barramento;
+
+Barramento *barramento = NULL;
+int total_workers = 0;                // -w: número de workers; 0 atende tudo num único processo
+int indice_worker = -1;               // posição deste processo entre os workers
+int eventos_workers[MAX_WORKERS];     // eventfd que acorda cada worker
+pid_t pids_workers[MAX_WORKERS];
+unsigned long long lote_barramento[TAMANHO_FILA_WORKER]; // referências publicadas nesta rodada do laço principal
+int tamanho_lote_barramento = 0;
+
+// Mensagem de sala entregue à pool para as etapas de processamento. A tarefa guarda a sala e o remetente
+// do momento do envio, de modo que o resultado é entregue mesmo que o cliente troque de sala ou saia
+typedef struct tarefa
+{
+    unsigned int conexao;          // identificador da conexão do remetente, que não recebe a própria mensagem
+    unsigned long long token;      // token do remetente, que também não a recebe ao retomar a sessão
+    char sala[TAMANHO_SALA];
+    char texto[TAMANHO_BUFFER];
+    int entregar;                  // resultado das etapas: 0 se alguma delas descartou a mensagem
+    _Atomic int concluida;
+    int proxima;                   // próxima tarefa da mesma conexão, ou da lista de livres; -1 no fim
+} Tarefa;
+
+// Deque de uma thread da pool. A dona retira do fim, o mais recente, e as demais roubam do início, o mais antigo
+typedef struct deque_pool
+{
+    pthread_mutex_t trava;
+    int tarefas[MAX_TAREFAS_POOL];
+    int inicio;
+    int tamanho;
+} DequePool;
+
+// Etapa de processamento de uma mensagem de sala, executada por uma thread da pool. Pode alterar o texto
+// (até TAMANHO_BUFFER - 1 caracteres) e retorna 0 para descartar a mensagem
+typedef int (*EtapaMensagem)(char texto[], const char sala[]);
+
+Tarefa tarefas_pool[MAX_TAREFAS_POOL];
+DequePool deques_pool[MAX_THREADS_POOL];
+EtapaMensagem etapas_mensagem[MAX_ETAPAS];
+int total_etapas = 0;
+int total_threads_pool = 0;              // -T: threads da pool; 0 processa as mensagens no laço principal
+int eventos_pool = 0;                    // eventfd que acorda o laço principal quando uma tarefa é concluída
+int tarefas_livres = -1;                 // lista de tarefas livres, usada apenas pelo laço principal
+int proximo_deque = 0;                   // deque que recebe a próxima tarefa, em rodízio
+_Atomic int tarefas_enfileiradas = 0;    // tarefas ainda não retiradas de nenhum deque
+pthread_mutex_t trava_pool = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tarefa_disponivel = PTHREAD_COND_INITIALIZER;
+int primeira_tarefa[MAX_CLIENTS];        // tarefas de cada conexão, na ordem de envio, entregues nessa ordem
+int ultima_tarefa[MAX_CLIENTS];
+
+// Autômato de Aho-Corasick dos termos de moderação, já determinizado: cada byte do texto custa uma única
+// consulta à tabela de transições. Os bytes são agrupados em classes (maiúsculas e minúsculas na mesma
+// classe, e todos os bytes ausentes dos termos na classe 0), de modo que cada estado ocupa uma linha curta
+// e contígua da tabela
+typedef struct moderacao
+{
+    _Atomic int referencias;       // o autômato em uso e cada mensagem em análise guardam uma referência
+    int total_estados;
+    int total_classes;
+    unsigned short classe[256];
+    int *transicoes;               // total_estados linhas de total_classes próximos estados
+    unsigned char *acoes;          // ações dos termos que terminam em cada estado, inclusive os sufixos
+    unsigned char *mascara;        // maior termo a mascarar que termina em cada estado
+    unsigned char filtro_baixo[16]; // pré-filtro dos bytes que iniciam algum termo, pelos quatro bits baixos
+    unsigned char filtro_alto[16];  // e pelos quatro bits altos
+} Moderacao;
+
+Moderacao *moderacao_atual = NULL;
+pthread_mutex_t trava_moderacao = PTHREAD_MUTEX_INITIALIZER;
+char *caminho_moderacao = NULL; // -m: arquivo de termos de moderação, recarregado com SIGHUP
+int nucleo_baixa_latencia = -1;  // -L: núcleo do laço principal no perfil de baixa latência; -1 no perfil comum
+long long janela_lote_max_us = 0;  // -b: maior janela dos lotes de mensagens de sala; 0 escreve cada mensagem na hora
+char *caminho_captura = NULL;   // -g: arquivo em que os quadros recebidos são capturados para reprodução
+int arquivo_captura = -1;
+char *anel_captura = NULL;                      // anel de bytes entre o laço principal e a thread de gravação
+_Atomic unsigned long long inicio_captura = 0; // bytes já gravados no arquivo, avançado pela thread de gravação
+_Atomic unsigned long long fim_captura = 0;    // bytes já registrados, avançado pelo laço principal
+_Atomic int encerrando_captura = 0;
+pthread_t thread_captura;
+unsigned long long registros_descartados_captura = 0;
+long long ultimo_registro_captura_us = 0;
+unsigned int identificador_conexao[MAX_CLIENTS]; // identificador de cada conexão, na captura e nas respostas da busca
+unsigned int proximo_identificador_conexao = 1;
+int usar_ssse3 = 0;             // o processador executa o pré-filtro vetorial
+int usar_avx2 = 0;              // o processador executa a validação das mensagens em blocos de 32 bytes
+
+// Registro de um segmento de caixa postal, seguido do nome do destinatário e do texto, alinhado a 8 bytes
+typedef struct registro_caixa
+{
+    unsigned int tamanho;         // bytes do registro inteiro; 0 marca o fim do segmento
+    unsigned char estado;         // CAIXA_PENDENTE ou CAIXA_ENTREGUE
+    unsigned char tamanho_nome;
+    unsigned short tamanho_texto;
+    unsigned long long ordem;     // ordem de chegada, mantida quando a compactação copia o registro
+} RegistroCaixa;
+
+typedef struct segmento_caixa
+{
+    char *mapa;                   // NULL com a posição livre
+    unsigned int numero;          // número do arquivo; os segmentos são gravados em ordem crescente
+    int usado;                    // bytes já gravados
+    int total;                    // registros gravados
+    int vivas;                    // registros ainda pendentes
+} SegmentoCaixa;
+
+// Mensagem guardada, na lista da caixa postal do destinatário
+typedef struct referencia_caixa
+{
+    int segmento;
+    int deslocamento;
+    int proxima;
+} ReferenciaCaixa;
+
+typedef struct caixa_postal
+{
+    char nome[TAMANHO_NOME];      // vazio com a posição livre
+    int primeira;                 // mensagens guardadas, na ordem de chegada
+    int ultima;
+    int pendentes;
+} CaixaPostal;
+
+char *diretorio_caixas = NULL;   // -M: diretório dos segmentos das caixas postais; NULL descarta as mensagens privadas para quem está desconectado
+SegmentoCaixa segmentos_caixa[MAX_SEGMENTOS_CAIXA];
+int segmento_ativo_caixa = -1;   // segmento em que os registros são acrescentados
+CaixaPostal caixas_postais[MAX_CAIXAS];
+ReferenciaCaixa referencias_caixas[MAX_MENSAGENS_CAIXAS];
+int referencias_livres_caixas = -1;
+unsigned long long proxima_ordem_caixa = 1;
+int caixas_alteradas = 0;        // há entregas ainda não vistas pela faxina
+pthread_mutex_t trava_caixas = PTHREAD_MUTEX_INITIALIZER; // protege as caixas, entre o laço principal e a faxina
+pthread_cond_t faxina_caixas = PTHREAD_COND_INITIALIZER;
+
+// Mensagem de sala a caminho do log da busca
+typedef struct mensagem_busca
+{
+    char sala[TAMANHO_SALA];
+    char texto[TAMANHO_BUFFER];
+} MensagemBusca;
+
+// Busca pedida por um cliente e, no caminho de volta, a resposta
+typedef struct consulta_busca
+{
+    int indice_cliente;
+    unsigned int conexao;         // identificador da conexão, para não responder a quem ocupou a posição depois
+    char texto[TAMANHO_RESPOSTA_BUSCA];
+} ConsultaBusca;
+
+// Registro do log da busca, seguido da sala e do texto
+typedef struct registro_busca
+{
+    unsigned short tamanho_texto;
+    unsigned char tamanho_sala;
+    unsigned char reservado;
+} RegistroBusca;
+
+// Termo indexado em memória: as mensagens em que aparece, em ordem crescente e codificadas como as
+// diferenças entre elas em varint
+typedef struct termo_memoria
+{
+    char termo[TAMANHO_TERMO_BUSCA]; // vazio com a posição livre
+    unsigned char *mensagens;
+    int tamanho;
+    int capacidade;
+    unsigned int ultima_mensagem;
+    unsigned int total_mensagens;
+} TermoMemoria;
+
+// Início de um segmento do índice, seguido das entradas em ordem alfabética e das listas de mensagens
+typedef struct cabecalho_indice
+{
+    char marca[8];
+    unsigned int primeira_mensagem;
+    unsigned int fim_mensagens;     // o segmento cobre as mensagens de primeira_mensagem até antes desta
+    unsigned int total_termos;
+    unsigned int reservado;
+} CabecalhoIndice;
+
+typedef struct entrada_indice
+{
+    char termo[TAMANHO_TERMO_BUSCA];
+    unsigned int deslocamento;      // início da lista de mensagens no arquivo
+    unsigned int tamanho;
+    unsigned int total_mensagens;
+    unsigned int ultima_mensagem;   // usada ao mesclar, para continuar a lista com a do segmento seguinte
+} EntradaIndice;
+
+typedef struct segmento_busca
+{
+    char *mapa;
+    long tamanho;
+    unsigned int numero;
+    CabecalhoIndice *cabecalho;
+    EntradaIndice *entradas;
+} SegmentoBusca;
+
+char *diretorio_busca = NULL;    // -S: diretório do log das mensagens de sala e do índice de busca
+char prefixo_busca[TAMANHO_PREFIXO_BUSCA]; // diretório e, com workers, o prefixo dos arquivos do worker
+int busca_ativa = 0;
+MensagemBusca fila_busca[TAMANHO_FILA_BUSCA];
+_Atomic unsigned long long inicio_fila_busca = 0; // avançado pela thread de busca
+_Atomic unsigned long long fim_fila_busca = 0;    // avançado pelo laço principal
+unsigned long long mensagens_descartadas_busca = 0;
+ConsultaBusca consultas_busca[TAMANHO_FILA_CONSULTAS];
+_Atomic unsigned long long inicio_consultas_busca = 0; // consultas respondidas pela thread de busca
+_Atomic unsigned long long fim_consultas_busca = 0;
+ConsultaBusca respostas_busca[TAMANHO_FILA_CONSULTAS]; // a resposta fica na mesma posição da consulta
+unsigned long long inicio_respostas_busca = 0;    // respostas já entregues pelo laço principal
+int eventos_busca = -1;          // eventfd que acorda o laço principal quando há respostas
+int encerrando_busca = 0;
+pthread_mutex_t trava_busca = PTHREAD_MUTEX_INITIALIZER; // só para a thread de busca esperar por consultas
+pthread_cond_t sinal_busca = PTHREAD_COND_INITIALIZER;
+pthread_t thread_indexacao;
+
+// Daqui em diante, somente a thread de busca usa o log e o índice
+int arquivo_log_busca = -1;
+long fim_log_busca = 0;
+long *deslocamentos_busca = NULL; // início de cada mensagem no log, pelo número da mensagem
+unsigned int total_mensagens_busca = 0;
+unsigned int capacidade_deslocamentos_busca = 0;
+TermoMemoria *termos_memoria = NULL;
+unsigned int total_termos_memoria = 0;
+unsigned int primeira_mensagem_memoria = 0; // as mensagens a partir desta ainda não estão em segmento
+unsigned int mensagens_indexadas = 0;        // a indexação segue o log e pode ficar atrás dele
+SegmentoBusca segmentos_busca[MAX_SEGMENTOS_BUSCA]; // em ordem, do mais antigo ao mais recente
+int total_segmentos_busca = 0;
+unsigned int proximo_numero_indice = 1;
+
+// Faixa de volume da saída de um destinatário: as mensagens de sala ficam aqui, acumuladas na janela do lote
+// ou retidas enquanto o socket não aceita escrita, e as demais mensagens passam à frente delas
+typedef struct lote_saida
+{
+    long long prazo_us;           // fim da janela do lote; 0 fora da janela
+    long long ultima_us;          // chegada da última mensagem para o destinatário
+    long long intervalo_medio_us; // média móvel do intervalo entre as mensagens
+    int inicio_quadro;            // início da mensagem em escrita
+    int enviado;                  // bytes já escritos
+    int tamanho;                  // bytes guardados, inclusive os já escritos
+    int capacidade;
+    int listado;                  // o socket está em sockets_com_lote
+    char *dados;
+} LoteSaida;
+
+LoteSaida *lotes_saida[FD_SETSIZE]; // faixa de volume de cada socket, indexada pelo descritor e criada no primeiro uso
+int sockets_com_lote[FD_SETSIZE];   // sockets com lote na janela ou com mensagens retidas
+int total_sockets_com_lote = 0;
+long long proximo_despacho_lotes_us = 0; // fim da janela mais próxima; 0 se não há lote na janela
+
+#ifdef COM_TLS
+SSL_CTX *tls_contexto = NULL;       // contexto TLS do socket TCP do servidor, ativado com -c e -k
+SSL_CTX *tls_contexto_pares = NULL; // contexto TLS dos links iniciados com outros servidores
+SSL *tls_conexoes[FD_SETSIZE];      // sessão TLS de cada socket, indexada pelo descritor
+
+// Conexão aceita cujo handshake TLS ainda não terminou; só depois dele ela ocupa uma posição na tabela
+typedef struct handshake
+{
+    int socket;
+    int quer_escrita; // o handshake aguarda o socket aceitar escrita, e não dados para ler
+    long long prazo_ms;
+} Handshake;
+
+Handshake handshakes[MAX_HANDSHAKES];
+int total_handshakes = 0;
+#endif
+
+// Lê do socket. Em conexões TLS, usa o kTLS quando o kernel decifra os registros e a biblioteca caso contrário
+int le_socket(int socket_cliente, void *buffer, int tamanho)
+{
+#ifdef COM_TLS
+    SSL *tls = tls_conexoes[socket_cliente];
+
+    if (tls != NULL && !BIO_get_ktls_recv(SSL_get_rbio(tls)))
+    {
+        return SSL_read(tls, buffer, tamanho);
+    }
+#endif
+
+    return recv(socket_cliente, buffer, tamanho, 0);
+}
+
+// Escreve no socket. Com kTLS de envio, a cifragem é feita pelo kernel e o send comum continua valendo
+int escreve_socket(int socket_cliente, const void *buffer, int tamanho)
+{
+#ifdef COM_TLS
+    SSL *tls = tls_conexoes[socket_cliente];
+
+    if (tls != NULL && !BIO_get_ktls_send(SSL_get_wbio(tls)))
+    {
+        return SSL_write(tls, buffer, tamanho);
+    }
+#endif
+
+    return send(socket_cliente, buffer, tamanho, 0);
+}
+
+// Fecha o socket de um cliente ou par, liberando a sessão TLS associada
+void fecha_socket(int socket_cliente)
+{
+    // A faixa de volume de quem sai é descartada; a memória fica para a próxima conexão com o mesmo descritor
+    if (socket_cliente < FD_SETSIZE && lotes_saida[socket_cliente] != NULL)
+    {
+        lotes_saida[socket_cliente]->prazo_us = 0;
+        lotes_saida[socket_cliente]->ultima_us = 0;
+        lotes_saida[socket_cliente]->inicio_quadro = 0;
+        lotes_saida[socket_cliente]->enviado = 0;
+        lotes_saida[socket_cliente]->tamanho = 0;
+    }
+
+#ifdef COM_TLS
+    if (tls_conexoes[socket_cliente] != NULL)
+    {
+        SSL_free(tls_conexoes[socket_cliente]);
+        tls_conexoes[socket_cliente] = NULL;
+    }
+#endif
+
+    close(socket_cliente);
+}
+
+#ifdef COM_TLS
+// Cria os contextos TLS a partir do certificado e da chave. O cache de sessões e os tickets permitem
+// retomar sessões sem o handshake completo, e o kTLS é pedido para que o kernel assuma a cifragem
+void inicia_tls(const char *certificado, const char *chave)
+{
+    tls_contexto = SSL_CTX_new(TLS_server_method());
+    tls_contexto_pares = SSL_CTX_new(TLS_client_method());
+    if (tls_contexto == NULL || tls_contexto_pares == NULL)
+    {
+        ERR_print_errors_fp(stderr);
+        exit(1);
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(tls_contexto, certificado) <= 0 || SSL_CTX_use_PrivateKey_file(tls_contexto, chave, SSL_FILETYPE_PEM) <= 0)
+    {
+        ERR_print_errors_fp(stderr);
+        exit(1);
+    }
+
+    SSL_CTX_set_options(tls_contexto, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_options(tls_contexto_pares, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_session_cache_mode(tls_contexto, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(tls_contexto, (const unsigned char *)"server_chat_v1", strlen("server_chat_v1"));
+}
+
+// Prepara o handshake TLS de um socket recém aceito (servidor) ou recém conectado (par). O socket fica não
+// bloqueante até o fim do handshake, conduzido por avanca_handshake a cada evento do select. Retorna 0 em caso de sucesso
+int inicia_handshake(int socket_cliente, SSL_CTX *contexto, int lado_servidor)
+{
+    SSL *tls = SSL_new(contexto);
+
+    if (tls == NULL || !SSL_set_fd(tls, socket_cliente))
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_free(tls);
+        return -1;
+    }
+
+    if (lado_servidor)
+    {
+        SSL_set_accept_state(tls);
+    }
+    else
+    {
+        SSL_set_connect_state(tls);
+    }
+
+    fcntl(socket_cliente, F_SETFL, fcntl(socket_cliente, F_GETFL) | O_NONBLOCK);
+    tls_conexoes[socket_cliente] = tls;
+
+    return 0;
+}
+
+// Avança o handshake TLS sem bloquear. Retorna 1 ao concluir, com o socket de volta ao modo bloqueante,
+// 0 se ainda aguarda o socket, com o evento esperado em quer_escrita, e -1 em caso de erro
+int avanca_handshake(int socket_cliente, int *quer_escrita)
+{
+    SSL *tls = tls_conexoes[socket_cliente];
+    int retorno = SSL_do_handshake(tls);
+
+    if (retorno == 1)
+    {
+        fcntl(socket_cliente, F_SETFL, fcntl(socket_cliente, F_GETFL) & ~O_NONBLOCK);
+
+#ifdef MODO_DEBUGER
+        printf("\n TLS estabelecido com %d: %s, sessão %s, kTLS envio %s, kTLS recebimento %s\n", socket_cliente, SSL_get_version(tls),
+               SSL_session_reused(tls) ? "retomada" : "nova",
+               BIO_get_ktls_send(SSL_get_wbio(tls)) ? "sim" : "não",
+               BIO_get_ktls_recv(SSL_get_rbio(tls)) ? "sim" : "não");
+#endif
+
+        return 1;
+    }
+
+    switch (SSL_get_error(tls, retorno))
+    {
+    case SSL_ERROR_WANT_READ:
+        *quer_escrita = 0;
+        return 0;
+
+    case SSL_ERROR_WANT_WRITE:
+        *quer_escrita = 1;
+        return 0;
+
+    default:
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+}
+#endif
+
+// Informa se há dados já decifrados aguardando leitura, que o select não enxerga no socket
+int tls_pendente(int socket_cliente)
+{
+#ifdef COM_TLS
+    return tls_conexoes[socket_cliente] != NULL && SSL_pending(tls_conexoes[socket_cliente]) > 0;
+#else
+    return 0;
+#endif
+}
+
+// Informa se o socket pode ser transferido a outro processo: sem TLS, ou com TLS inteiramente no kernel
+int socket_transferivel(int socket_cliente)
+{
+#ifdef COM_TLS
+    SSL *tls = tls_conexoes[socket_cliente];
+
+    return tls == NULL || (BIO_get_ktls_send(SSL_get_wbio(tls)) && BIO_get_ktls_recv(SSL_get_rbio(tls)));
+#else
+    return 1;
+#endif
+}
+
+// Realiza fechamento seguro do comunicador na ocorrência de erros
+void error(const char *msg)
+{
+    int i;
+
+    if (sockfd > 0)
+    {
+        close(sockfd);
+    }
+
+    if (sockfd_unix > 0)
+    {
+        close(sockfd_unix);
+    }
+
+    for (i = 0; i < limite_clientes; i++)
+    {
+        if (clientes_sockets[i] > 0)
+        {
+            close(clientes_sockets[i]);
+        }
+    }
+
+    perror(msg);
+    exit(1);
+}
+
+// Devolve o texto guardado na arena, criando a entrada se ainda não existe. A referência devolvida é
+// liberada com libera_nome. O texto vazio não ocupa a arena
+const char *interna_nome(const char *texto)
+{
+    unsigned int hash = 2166136261u;
+    int tamanho, classe;
+    const unsigned char *letra;
+    NomeInternado *entrada;
+
+    if (texto[0] == '\0')
+    {
+        return nome_vazio;
+    }
+
+    // FNV-1a
+    for (letra = (const unsigned char *)texto; *letra != '\0'; letra++)
+    {
+        hash = (hash ^ *letra) * 16777619u;
+    }
+
+    for (entrada = tabela_nomes[hash % TAMANHO_TABELA_NOMES]; entrada != NULL; entrada = entrada->proximo)
+    {
+        if (entrada->hash == hash && !strcmp(entrada->texto, texto))
+        {
+            entrada->referencias++;
+            return entrada->texto;
+        }
+    }
+
+    tamanho = strlen(texto) + 1;
+    classe = (sizeof(NomeInternado) + tamanho + ALINHAMENTO_NOMES - 1) / ALINHAMENTO_NOMES;
+
+    if (classe >= CLASSES_NOMES)
+    {
+        return nome_vazio; // maior que qualquer nome aceito pelo servidor
+    }
+
+    if (livres_nomes[classe] != NULL)
+    {
+        entrada = livres_nomes[classe];
+        livres_nomes[classe] = entrada->proximo;
+    }
+    else
+    {
+        if (bloco_nomes == NULL || uso_bloco_nomes + classe * ALINHAMENTO_NOMES > TAMANHO_BLOCO_NOMES)
+        {
+            bloco_nomes = malloc(TAMANHO_BLOCO_NOMES);
+            uso_bloco_nomes = 0;
+
+            if (bloco_nomes == NULL)
+            {
+                error("\n Erro ao alocar a arena de nomes");
+            }
+        }
+
+        entrada = (NomeInternado *)(bloco_nomes + uso_bloco_nomes);
+        uso_bloco_nomes += classe * ALINHAMENTO_NOMES;
+    }
+
+    entrada->hash = hash;
+    entrada->referencias = 1;
+    memcpy(entrada->texto, texto, tamanho);
+    entrada->proximo = tabela_nomes[hash % TAMANHO_TABELA_NOMES];
+    tabela_nomes[hash % TAMANHO_TABELA_NOMES] = entrada;
+
+    return entrada->texto;
+}
+
+// Libera uma referência obtida com interna_nome; a entrada volta para a arena com a última referência
+void libera_nome(const char *nome)
+{
+    NomeInternado *entrada, **anterior;
+    int classe;
+
+    if (nome == NULL || nome == nome_vazio)
+    {
+        return;
+    }
+
+    entrada = (NomeInternado *)(nome - offsetof(NomeInternado, texto));
+    if (--entrada->referencias > 0)
+    {
+        return;
+    }
+
+    for (anterior = &tabela_nomes[entrada->hash % TAMANHO_TABELA_NOMES]; *anterior != entrada; anterior = &(*anterior)->proximo)
+        ;
+    *anterior = entrada->proximo;
+
+    classe = (sizeof(NomeInternado) + strlen(entrada->texto) + 1 + ALINHAMENTO_NOMES - 1) / ALINHAMENTO_NOMES;
+    entrada->proximo = livres_nomes[classe];
+    livres_nomes[classe] = entrada;
+}
+
+// Troca o nome guardado em destino, mantendo as referências em dia
+void troca_nome(const char **destino, const char *texto)
+{
+    const char *novo = interna_nome(texto);
+
+    libera_nome(*destino);
+    *destino = novo;
+}
+
+// Acrescenta o valor ao registro em varint: 7 bits por byte, o bit mais alto indica que há mais bytes.
+// Retorna quantos bytes foram escritos
+int codifica_varint(unsigned char *destino, unsigned long long valor)
+{
+    int tamanho = 0;
+
+    while (valor >= 0x80)
+    {
+        destino[tamanho++] = (valor & 0x7f) | 0x80;
+        valor >>= 7;
+    }
+
+    destino[tamanho++] = valor;
+
+    return tamanho;
+}
+
+// Registra um evento da conexão na captura: tipo, microssegundos desde o registro anterior, conexão e, nos
+// quadros, o tamanho e o conteúdo. O registro só é copiado para o anel; a gravação no arquivo fica com a
+// thread de gravação. Com o anel cheio, o registro é descartado e contado, sem atrasar o laço principal
+void registra_captura(int indice_cliente, int tipo, const char *dados, int tamanho)
+{
+    unsigned char cabecalho[1 + 3 * 10];
+    int tamanho_cabecalho = 0, parte;
+    unsigned long long fim, livre;
+    long long instante_us;
+    struct timespec agora;
+
+    if (arquivo_captura < 0)
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &agora);
+    instante_us = (long long)agora.tv_sec * 1000000 + agora.tv_nsec / 1000;
+
+    cabecalho[tamanho_cabecalho++] = tipo;
+    tamanho_cabecalho += codifica_varint(cabecalho + tamanho_cabecalho, ultimo_registro_captura_us ? instante_us - ultimo_registro_captura_us : 0);
+    tamanho_cabecalho += codifica_varint(cabecalho + tamanho_cabecalho, identificador_conexao[indice_cliente]);
+    if (tipo == CAPTURA_QUADRO)
+    {
+        tamanho_cabecalho += codifica_varint(cabecalho + tamanho_cabecalho, tamanho);
+    }
+    else
+    {
+        tamanho = 0;
+    }
+
+    // Só este processo produz; a thread de gravação apenas avança o início
+    fim = atomic_load_explicit(&fim_captura, memory_order_relaxed);
+    livre = TAMANHO_ANEL_CAPTURA - (fim - atomic_load_explicit(&inicio_captura, memory_order_acquire));
+
+    if (livre < (unsigned long long)(tamanho_cabecalho + tamanho))
+    {
+        registros_descartados_captura++;
+        return;
+    }
+
+    ultimo_registro_captura_us = instante_us;
+
+    // O cabeçalho e o conteúdo podem dar a volta no anel
+    parte = TAMANHO_ANEL_CAPTURA - fim % TAMANHO_ANEL_CAPTURA;
+    parte = parte < tamanho_cabecalho ? parte : tamanho_cabecalho;
+    memcpy(anel_captura + fim % TAMANHO_ANEL_CAPTURA, cabecalho, parte);
+    memcpy(anel_captura, cabecalho + parte, tamanho_cabecalho - parte);
+    fim += tamanho_cabecalho;
+
+    if (tamanho > 0)
+    {
+        parte = TAMANHO_ANEL_CAPTURA - fim % TAMANHO_ANEL_CAPTURA;
+        parte = parte < tamanho ? parte : tamanho;
+        memcpy(anel_captura + fim % TAMANHO_ANEL_CAPTURA, dados, parte);
+        memcpy(anel_captura, dados + parte, tamanho - parte);
+        fim += tamanho;
+    }
+
+    atomic_store_explicit(&fim_captura, fim, memory_order_release);
+}
+
+// Thread de gravação: escreve no arquivo, fora do laço principal, o que a captura acumulou no anel
+void *thread_gravacao(void *argumento)
+{
+    unsigned long long inicio, fim;
+    long parte;
+    int encerrando;
+
+    while (1)
+    {
+        encerrando = atomic_load_explicit(&encerrando_captura, memory_order_acquire);
+        inicio = atomic_load_explicit(&inicio_captura, memory_order_relaxed);
+        fim = atomic_load_explicit(&fim_captura, memory_order_acquire);
+
+        if (inicio == fim)
+        {
+            if (encerrando)
+            {
+                break;
+            }
+
+            usleep(INTERVALO_GRAVACAO_MS * 1000);
+            continue;
+        }
+
+        parte = TAMANHO_ANEL_CAPTURA - inicio % TAMANHO_ANEL_CAPTURA;
+        parte = (unsigned long long)parte < fim - inicio ? parte : (long)(fim - inicio);
+        parte = write(arquivo_captura, anel_captura + inicio % TAMANHO_ANEL_CAPTURA, parte);
+
+        if (parte < 0 && errno != EINTR)
+        {
+            perror("\n Erro ao gravar a captura");
+            break;
+        }
+
+        if (parte > 0)
+        {
+            atomic_store_explicit(&inicio_captura, inicio + parte, memory_order_release);
+        }
+    }
+
+    return NULL;
+}
+
+// Abre o arquivo de captura e inicia a thread de gravação. Com workers, cada worker grava o próprio arquivo,
+// com o índice do worker acrescentado ao nome
+void inicia_captura()
+{
+    char caminho[PATH_MAX];
+    pthread_t thread;
+
+    if (caminho_captura == NULL)
+    {
+        return;
+    }
+
+    if (indice_worker >= 0)
+    {
+        snprintf(caminho, sizeof(caminho), "%s.%d", caminho_captura, indice_worker);
+    }
+    else
+    {
+        snprintf(caminho, sizeof(caminho), "%s", caminho_captura);
+    }
+
+    arquivo_captura = open(caminho, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    anel_captura = malloc(TAMANHO_ANEL_CAPTURA);
+
+    if (arquivo_captura < 0 || anel_captura == NULL || write(arquivo_captura, MARCA_ARQUIVO_CAPTURA, strlen(MARCA_ARQUIVO_CAPTURA)) < 0)
+    {
+        error("\n Erro ao criar o arquivo de captura");
+    }
+
+    if (pthread_create(&thread, NULL, thread_gravacao, NULL) != 0)
+    {
+        error("\n Erro ao criar a thread de gravação");
+    }
+
+    thread_captura = thread;
+
+#ifdef MODO_DEBUGER
+    printf("\n Capturando os quadros recebidos em %s\n", caminho);
+#endif
+}
+
+// Espera a thread de gravação esvaziar o anel e fecha o arquivo de captura
+void encerra_captura()
+{
+    if (arquivo_captura < 0)
+    {
+        return;
+    }
+
+    atomic_store_explicit(&encerrando_captura, 1, memory_order_release);
+    pthread_join(thread_captura, NULL);
+
+    if (registros_descartados_captura > 0)
+    {
+        fprintf(stderr, "\n Captura: %llu registros descartados com o anel cheio\n", registros_descartados_captura);
+    }
+
+    close(arquivo_captura);
+    arquivo_captura = -1;
+}
+
+// Ocupa uma posição da tabela de conexões: a última liberada, ou a seguinte à maior já usada. Retorna -1
+// com a tabela cheia
+int reserva_posicao_cliente()
+{
+    if (total_livres_clientes > 0)
+    {
+        return posicoes_livres_clientes[--total_livres_clientes];
+    }
+
+    if (limite_clientes < MAX_CLIENTS)
+    {
+        clientes_aprovados[limite_clientes].nome = nome_vazio;
+        clientes_aprovados[limite_clientes].sala = nome_vazio;
+        return limite_clientes++;
+    }
+
+    return -1;
+}
+
+// Devolve a posição à lista de livres e zera o seu descritor
+void libera_posicao_cliente(int indice_cliente)
+{
+    if (clientes_sockets[indice_cliente] == 0)
+    {
+        return;
+    }
+
+    registra_captura(indice_cliente, CAPTURA_FECHAMENTO, NULL, 0);
+
+    clientes_sockets[indice_cliente] = 0;
+    posicoes_livres_clientes[total_livres_clientes++] = indice_cliente;
+}
+
+// Refaz a lista de livres a partir dos descritores, depois que as posições foram ocupadas diretamente
+void refaz_posicoes_livres()
+{
+    int i;
+
+    limite_clientes = 0;
+    total_livres_clientes = 0;
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (clientes_sockets[i] != 0)
+        {
+            limite_clientes = i + 1;
+        }
+    }
+
+    for (i = limite_clientes - 1; i >= 0; i--)
+    {
+        if (clientes_aprovados[i].nome == NULL)
+        {
+            clientes_aprovados[i].nome = nome_vazio;
+        }
+        if (clientes_aprovados[i].sala == NULL)
+        {
+            clientes_aprovados[i].sala = nome_vazio;
+        }
+        if (clientes_sockets[i] == 0)
+        {
+            posicoes_livres_clientes[total_livres_clientes++] = i;
+        }
+    }
+}
+
+// Desconecta o cliente que em algum momento apresentou falhas de comunicação
+void deconecta_cliente(int indice_cliente, int clientes_sockets[], int clientes_pendentes[], Cliente clientes_aprovados[])
+{
+#ifdef MODO_DEBUGER
+    printf("\n Vou desconectar o cliente %d\n", clientes_sockets[indice_cliente]);
+#endif
+
+    fecha_socket(clientes_sockets[indice_cliente]);
+    libera_posicao_cliente(indice_cliente);
+    clientes_pendentes[indice_cliente] = 0;
+    clientes_aprovados[indice_cliente].socket = 0;
+    troca_nome(&clientes_aprovados[indice_cliente].nome, "");
+    troca_nome(&clientes_aprovados[indice_cliente].sala, "");
+    clientes_aprovados[indice_cliente].token = 0;
+    clientes_aprovados[indice_cliente].ultimo_ack = 0;
+    clientes_aprovados[indice_cliente].evento_pendente = 0;
+    clientes_aprovados[indice_cliente].recebe_eventos = 0;
+}
+
+long long agora_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Escreve parte da faixa de volume. Sem bloquear, escreve o que o socket aceitar; nas sessões TLS em espaço
+// de usuário a escrita é sempre completa, pois o registro TLS não pode ser interrompido
+int escreve_volume(int dest_socket, const char *dados, int tamanho, int bloquear)
+{
+#ifdef COM_TLS
+    SSL *tls = tls_conexoes[dest_socket];
+
+    if (tls != NULL && !BIO_get_ktls_send(SSL_get_wbio(tls)))
+    {
+        return SSL_write(tls, dados, tamanho);
+    }
+#endif
+
+    return send(dest_socket, dados, tamanho, bloquear ? 0 : MSG_DONTWAIT);
+}
+
+// Escreve a faixa de volume do socket até onde ele aceitar sem bloquear ou, com bloquear != 0, por inteiro.
+// Encerra a janela do lote. Retorna -1 em caso de erro
+int descarrega_lote(int dest_socket, int bloquear)
+{
+    LoteSaida *lote = dest_socket < FD_SETSIZE ? lotes_saida[dest_socket] : NULL;
+    int enviado, tamanho_quadro;
+
+    if (lote == NULL)
+    {
+        return 0;
+    }
+
+    lote->prazo_us = 0;
+
+#ifdef MODO_DEBUGER
+    printf("\n Faixa de volume com %d bytes para o cliente %d\n", lote->tamanho - lote->enviado, dest_socket);
+#endif
+
+    while (lote->enviado < lote->tamanho)
+    {
+        enviado = escreve_volume(dest_socket, lote->dados + lote->enviado, lote->tamanho - lote->enviado, bloquear);
+
+        if (enviado < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break; // o restante espera o socket aceitar escrita
+        }
+
+        if (enviado <= 0)
+        {
+            return -1;
+        }
+
+        lote->enviado += enviado;
+    }
+
+    // Avança até a mensagem em escrita, a única que as demais mensagens não podem interromper
+    while (lote->inicio_quadro < lote->enviado)
+    {
+        memcpy(&tamanho_quadro, lote->dados + lote->inicio_quadro, sizeof(int));
+
+        if (lote->inicio_quadro + (int)sizeof(int) + tamanho_quadro > lote->enviado)
+        {
+            break;
+        }
+
+        lote->inicio_quadro += sizeof(int) + tamanho_quadro;
+    }
+
+    if (lote->enviado == lote->tamanho)
+    {
+        lote->inicio_quadro = 0;
+        lote->enviado = 0;
+        lote->tamanho = 0;
+    }
+
+    return 0;
+}
+
+// Antes de uma mensagem da faixa de controle, conclui a mensagem de sala que estiver com a escrita pela
+// metade; as demais continuam na faixa de volume, atrás da mensagem de controle. Retorna -1 em caso de erro
+int conclui_quadro_lote(int dest_socket)
+{
+    LoteSaida *lote = dest_socket < FD_SETSIZE ? lotes_saida[dest_socket] : NULL;
+    int enviado, tamanho_quadro, fim_quadro;
+
+    if (lote == NULL || lote->enviado == lote->inicio_quadro)
+    {
+        return 0;
+    }
+
+    memcpy(&tamanho_quadro, lote->dados + lote->inicio_quadro, sizeof(int));
+    fim_quadro = lote->inicio_quadro + sizeof(int) + tamanho_quadro;
+
+    while (lote->enviado < fim_quadro)
+    {
+        enviado = escreve_volume(dest_socket, lote->dados + lote->enviado, fim_quadro - lote->enviado, 1);
+        if (enviado <= 0)
+        {
+            return -1;
+        }
+
+        lote->enviado += enviado;
+    }
+
+    lote->inicio_quadro = fim_quadro;
+
+    if (lote->enviado == lote->tamanho)
+    {
+        lote->inicio_quadro = 0;
+        lote->enviado = 0;
+        lote->tamanho = 0;
+    }
+
+    return 0;
+}
+
+// Envia uma mensagem pela rede
+int envia_mensagem(int dest_socket, char buffer[], int tamanho)
+{
+    int enviado; // número de bytes enviados em cada chamada
+
+    // Faixa de controle: passa à frente das mensagens de sala retidas para o destinatário
+    if (conclui_quadro_lote(dest_socket) < 0)
+    {
+        return -1;
+    }
+
+    // Enviar o tamanho da mensagem
+#ifdef MODO_DEBUGER
+    printf("\n Tamanho da mensagem: %d", tamanho);
+    printf("\n Tamanho do tamanho: %d\n", sizeof(tamanho));
+#endif
+
+    enviado = escreve_socket(dest_socket, (char *)&tamanho, sizeof(tamanho));
+
+#ifdef MODO_DEBUGER
+    printf("\n Tamanho enviado: %d\n", enviado);
+#endif
+
+    if (enviado <= 0)
+    {
+        return enviado; // erro ao enviar tamanho
+    }
+
+    // Enviar a mensagem
+#ifdef MODO_DEBUGER
+    printf("\n Mensagem: %s\n", buffer);
+#endif
+
+    enviado = escreve_socket(dest_socket, buffer, tamanho);
+
+#ifdef MODO_DEBUGER
+    printf("\n Tamanho enviado: %d\n", enviado);
+#endif
+
+    return enviado; // sucesso ao enviar mensagem ou erro se enviado <= 0
+}
+
+// Envia uma mensagem de sala pela faixa de volume do destinatário, atrás da qual as demais mensagens não
+// esperam. Com -b, as mensagens são acumuladas num lote quando chegam ao destinatário mais depressa que a
+// janela máxima. A janela acompanha o intervalo médio entre as mensagens: um destinatário numa sala calma
+// recebe cada mensagem na hora, e numa sala movimentada recebe várias mensagens por escrita. O lote é escrito
+// ao fim da janela ou ao alcançar LIMITE_LOTE_SAIDA. O que o socket não aceitar sem bloquear fica retido e
+// segue quando ele aceitar escrita. Mesmo retorno de envia_mensagem
+int enfileira_lote(int dest_socket, char buffer[], int tamanho)
+{
+    LoteSaida *lote;
+    long long agora, amostra, janela;
+    int capacidade, vazia;
+    char *dados;
+
+    if (dest_socket >= FD_SETSIZE)
+    {
+        return envia_mensagem(dest_socket, buffer, tamanho);
+    }
+
+    if (lotes_saida[dest_socket] == NULL)
+    {
+        lotes_saida[dest_socket] = calloc(1, sizeof(LoteSaida));
+        if (lotes_saida[dest_socket] == NULL)
+        {
+            return envia_mensagem(dest_socket, buffer, tamanho);
+        }
+    }
+
+    lote = lotes_saida[dest_socket];
+    agora = agora_us();
+
+    // Média móvel do intervalo entre as mensagens do destinatário; pausas longas contam como 4 janelas,
+    // para que a média volte logo ao ritmo de uma nova rajada
+    if (janela_lote_max_us > 0)
+    {
+        amostra = lote->ultima_us ? agora - lote->ultima_us : 4 * janela_lote_max_us;
+        amostra = amostra < 4 * janela_lote_max_us ? amostra : 4 * janela_lote_max_us;
+        lote->intervalo_medio_us = lote->ultima_us ? (7 * lote->intervalo_medio_us + amostra) / 8 : amostra;
+        lote->ultima_us = agora;
+    }
+
+    // Com a faixa cheia, o servidor espera o cliente lento, como fazia antes da faixa existir
+    if (lote->tamanho - lote->inicio_quadro + (int)sizeof(int) + tamanho > LIMITE_FILA_VOLUME && descarrega_lote(dest_socket, 1) < 0)
+    {
+        return -1;
+    }
+
+    if (lote->tamanho + (int)sizeof(int) + tamanho > lote->capacidade)
+    {
+        // Descarta o que já foi escrito antes de crescer
+        memmove(lote->dados, lote->dados + lote->inicio_quadro, lote->tamanho - lote->inicio_quadro);
+        lote->tamanho -= lote->inicio_quadro;
+        lote->enviado -= lote->inicio_quadro;
+        lote->inicio_quadro = 0;
+
+        capacidade = lote->capacidade ? lote->capacidade : LIMITE_LOTE_SAIDA;
+        while (lote->tamanho + (int)sizeof(int) + tamanho > capacidade)
+        {
+            capacidade *= 2;
+        }
+
+        if (capacidade != lote->capacidade)
+        {
+            dados = realloc(lote->dados, capacidade);
+            if (dados == NULL)
+            {
+                return descarrega_lote(dest_socket, 1) < 0 ? -1 : envia_mensagem(dest_socket, buffer, tamanho);
+            }
+
+            lote->dados = dados;
+            lote->capacidade = capacidade;
+        }
+    }
+
+    vazia = lote->enviado == lote->tamanho;
+
+    // Mesmo enquadramento de envia_mensagem: o cliente não distingue as mensagens vindas pela faixa de volume
+    memcpy(lote->dados + lote->tamanho, &tamanho, sizeof(int));
+    memcpy(lote->dados + lote->tamanho + sizeof(int), buffer, tamanho);
+    lote->tamanho += sizeof(int) + tamanho;
+
+    if (vazia && janela_lote_max_us > 0 && lote->intervalo_medio_us <= janela_lote_max_us)
+    {
+        janela = lote->intervalo_medio_us * MENSAGENS_POR_LOTE;
+        janela = janela < JANELA_LOTE_MIN_US ? JANELA_LOTE_MIN_US : janela;
+        janela = janela > janela_lote_max_us ? janela_lote_max_us : janela;
+        lote->prazo_us = agora + janela;
+    }
+    else if (vazia || (lote->prazo_us != 0 && lote->tamanho - lote->enviado >= LIMITE_LOTE_SAIDA))
+    {
+        // Fora da janela, escreve na hora; mensagens retidas esperam o socket aceitar escrita
+        if (descarrega_lote(dest_socket, 0) < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (lote->enviado < lote->tamanho && !lote->listado)
+    {
+        lote->listado = 1;
+        sockets_com_lote[total_sockets_com_lote++] = dest_socket;
+    }
+
+    return tamanho;
+}
+
+// Inclui no select de escrita os sockets com mensagens de sala retidas fora da janela do lote
+void prepara_lotes(fd_set *writefds, int *max_socket_cliente)
+{
+    int i, dest_socket;
+
+    for (i = 0; i < total_sockets_com_lote; i++)
+    {
+        dest_socket = sockets_com_lote[i];
+
+        if (lotes_saida[dest_socket]->prazo_us == 0 && lotes_saida[dest_socket]->enviado < lotes_saida[dest_socket]->tamanho)
+        {
+            FD_SET(dest_socket, writefds);
+            if (dest_socket > *max_socket_cliente)
+            {
+                *max_socket_cliente = dest_socket;
+            }
+        }
+    }
+}
+
+// Escreve os lotes cuja janela terminou e as mensagens retidas dos sockets que aceitam escrita, ou tudo,
+// bloqueando, com todos != 0. Calcula o fim da próxima janela
+void despacha_lotes(int todos, fd_set *writefds)
+{
+    int i, dest_socket, restantes = 0;
+    long long agora = agora_us();
+    LoteSaida *lote;
+
+    proximo_despacho_lotes_us = 0;
+
+    for (i = 0; i < total_sockets_com_lote; i++)
+    {
+        dest_socket = sockets_com_lote[i];
+        lote = lotes_saida[dest_socket];
+
+        if (lote->enviado < lote->tamanho && (todos || (lote->prazo_us != 0 && lote->prazo_us <= agora) || (lote->prazo_us == 0 && writefds != NULL && FD_ISSET(dest_socket, writefds))))
+        {
+            if (descarrega_lote(dest_socket, todos) < 0)
+            {
+                perror("\n Erro ao enviar as mensagens de sala");
+
+                lote->inicio_quadro = 0;
+                lote->enviado = 0;
+                lote->tamanho = 0;
+            }
+        }
+
+        if (lote->enviado == lote->tamanho)
+        {
+            lote->prazo_us = 0;
+            lote->listado = 0;
+            continue;
+        }
+
+        if (lote->prazo_us != 0 && (proximo_despacho_lotes_us == 0 || lote->prazo_us < proximo_despacho_lotes_us))
+        {
+            proximo_despacho_lotes_us = lote->prazo_us;
+        }
+
+        sockets_com_lote[restantes++] = dest_socket;
+    }
+
+    total_sockets_com_lote = restantes;
+}
+
+// Recebe uma mensagem pela rede. A mensagem termina em '\0' e seu tamanho, que pode incluir bytes nulos,
+// é informado em tamanho_mensagem quando não for NULL. Mensagens que não cabem no buffer são recusadas (-4)
+int recebe_mensagem(int client_socket, char buffer[], int tamanho_buffer, int *tamanho_mensagem)
+{
+    int total = 0;               // total de bytes recebidos
+    int bytesLeft = sizeof(int); // bytes restantes para receber o tamanho
+    int n;                       // número de bytes recebidos em cada chamada
+    int size;                    // tamanho da mensagem na ordem de bytes do host
+
+    // Receber o tamanho da mensagem
+    while (total < sizeof(int))
+    {
+#ifdef MODO_DEBUGER
+        printf("\n Receber tamanho da mensagem do cliente %d\n", client_socket);
+#endif
+
+        n = le_socket(client_socket, (char *)&size + total, bytesLeft);
+
+        if (n <= 0)
+        {
+            return n; // erro ao receber tamanho ou conexão fechada pelo outro lado
+        }
+
+        total += n;
+        bytesLeft -= n;
+
+#ifdef MODO_DEBUGER
+        printf("\n N: %d", n);
+        printf("\n Tamanho: %d", size);
+        printf("\n Total: %d", total);
+        printf("\n BytesLeft: %d\n", bytesLeft);
+#endif
+    }
+
+    // size = ntohl(size); // converter o tamanho da mensagem para a ordem de bytes do host
+
+    // buffer = malloc(size); // alocar memória para a mensagem
+
+    if (buffer == NULL)
+    {
+        return -3; // erro ao alocar memória
+    }
+
+    if (size < 0 || size > tamanho_buffer - 1)
+    {
+        errno = EMSGSIZE;
+        return -4; // tamanho inválido, que estouraria o buffer
+    }
+
+    total = 0;        // reiniciar o total de bytes recebidos
+    bytesLeft = size; // bytes restantes para receber a mensagem
+
+    // Receber a mensagem
+    while (total < size)
+    {
+#ifdef MODO_DEBUGER
+        printf("\n Receber mensagem do cliente %d\n", client_socket);
+#endif
+        n = le_socket(client_socket, buffer + total, bytesLeft);
+
+        if (n <= 0)
+        {
+            // free(buffer); // liberar a memória alocada
+            return n; // erro ao receber mensagem ou conexão fechada pelo outro lado
+        }
+
+        total += n;
+        bytesLeft -= n;
+
+#ifdef MODO_DEBUGER
+        printf("\n N: %d", n);
+        printf("\n Buffer: %s", buffer);
+        printf("\n Total: %d", total);
+        printf("\n BytesLeft: %d\n", bytesLeft);
+#endif
+    }
+
+    buffer[size] = '\0';
+
+    if (tamanho_mensagem != NULL)
+    {
+        *tamanho_mensagem = size;
+    }
+
+    // free(buffer); // liberar a memória alocada
+    return sizeof(int) + size; // sucesso ao receber, mesmo com mensagem vazia
+}
+
+// Desiste de um destinatário cujo envio falhou, sem derrubar o servidor nem os demais clientes. O shutdown
+// faz o socket aparecer como legível no próximo select, e o caminho normal de desconexão, que suspende a
+// sessão retomável, cuida do resto
+void derruba_destinatario(int dest_socket)
+{
+    char string_erro_cliente[100];
+
+    snprintf(string_erro_cliente, sizeof(string_erro_cliente), "\n Erro ao enviar a mensagem, desconectando cliente %d", dest_socket);
+    perror(string_erro_cliente);
+
+    shutdown(dest_socket, SHUT_RDWR);
+}
+
+// Envia uma mensagem para todos os outros clientes conectados
+void broadcast_message(int socket_cliente, char buffer[], int tamanho, int clientes_sockets[], int max_clients)
+{
+    int i, dest_socket;
+
+#ifdef MODO_DEBUGER
+    printf("\n Mensagem recebida broadcast: %s", buffer);
+    printf("\n Tamanho da mensagem broadcast: %d\n", tamanho);
+#endif
+
+    for (i = 0; i < max_clients; i++)
+    {
+        dest_socket = clientes_sockets[i];
+        if (dest_socket == 0 || dest_socket == socket_cliente)
+        {
+            continue;
+        }
+        if (envia_mensagem(dest_socket, buffer, tamanho) <= 0)
+        {
+            derruba_destinatario(dest_socket);
+        }
+    }
+}
+
+// Posição do primeiro byte a partir de inicio que não é ASCII imprimível, ou tamanho se não há nenhum.
+// Na comparação com sinal, os bytes a partir de 0x80 são negativos e caem junto com os de controle
+int pula_ascii_imprimivel(const unsigned char *texto, int inicio, int tamanho)
+{
+#if defined(__SSE2__)
+    int suspeitos;
+    __m128i bloco;
+
+    for (; inicio + 16 <= tamanho; inicio += 16)
+    {
+        bloco = _mm_loadu_si128((const __m128i *)(texto + inicio));
+        suspeitos = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(bloco, _mm_set1_epi8(0x20)), _mm_cmpeq_epi8(bloco, _mm_set1_epi8(0x7f))));
+
+        if (suspeitos)
+        {
+            return inicio + __builtin_ctz(suspeitos);
+        }
+    }
+#endif
+
+    for (; inicio < tamanho && texto[inicio] >= 0x20 && texto[inicio] < 0x7f; inicio++)
+        ;
+
+    return inicio;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Mesma verificação, 32 bytes por vez
+__attribute__((target("avx2"))) int pula_ascii_imprimivel_avx2(const unsigned char *texto, int inicio, int tamanho)
+{
+    int suspeitos;
+    __m256i bloco;
+
+    for (; inicio + 32 <= tamanho; inicio += 32)
+    {
+        bloco = _mm256_loadu_si256((const __m256i *)(texto + inicio));
+        suspeitos = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), bloco), _mm256_cmpeq_epi8(bloco, _mm256_set1_epi8(0x7f))));
+
+        if (suspeitos)
+        {
+            return inicio + __builtin_ctz(suspeitos);
+        }
+    }
+
+    return pula_ascii_imprimivel(texto, inicio, tamanho);
+}
+#endif
+
+// Valida a mensagem recebida uma única vez, na entrada. Os trechos ASCII imprimíveis, quase todo o texto de
+// um chat, são verificados em blocos com SSE2/AVX2; o restante passa pelo decodificador UTF-8 byte a byte.
+// Caracteres de controle (inclusive '\0' e os C1) são trocados por espaços, de modo que strlen da mensagem
+// passa a valer o seu tamanho e nada chega ao terminal dos outros usuários. O '\001' inicial só é mantido nas
+// mensagens de controle que o cliente envia ao servidor, tratadas por trata_comando; em qualquer outra ele
+// também vira espaço, para que ninguém forje mensagens de controle do servidor para os outros clientes.
+// Retorna 0 se a mensagem é UTF-8 válido e -1 caso contrário
+int valida_mensagem(char buffer[], int tamanho)
+{
+    int i, j, comprimento;
+    unsigned int codigo;
+    unsigned char *texto = (unsigned char *)buffer;
+    int controle = (tamanho == (int)strlen(MARCA_SESSAO) && !memcmp(buffer, MARCA_SESSAO, tamanho)) ||
+                   (tamanho >= (int)strlen(MARCA_EVENTO) && !memcmp(buffer, MARCA_EVENTO, strlen(MARCA_EVENTO))) ||
+                   (tamanho >= (int)strlen(MARCA_CONFIRMACAO) && !memcmp(buffer, MARCA_CONFIRMACAO, strlen(MARCA_CONFIRMACAO)));
+
+    for (i = controle ? 1 : 0; i < tamanho; i += comprimento)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        i = usar_avx2 ? pula_ascii_imprimivel_avx2(texto, i, tamanho) : pula_ascii_imprimivel(texto, i, tamanho);
+#else
+        i = pula_ascii_imprimivel(texto, i, tamanho);
+#endif
+        if (i == tamanho)
+        {
+            break;
+        }
+
+        if (texto[i] < 0x80)
+        {
+            texto[i] = ' '; // controle C0 ou DEL
+            comprimento = 1;
+            continue;
+        }
+
+        if (texto[i] >= 0xc2 && texto[i] <= 0xdf)
+        {
+            comprimento = 2;
+            codigo = texto[i] & 0x1f;
+        }
+        else if (texto[i] >= 0xe0 && texto[i] <= 0xef)
+        {
+            comprimento = 3;
+            codigo = texto[i] & 0x0f;
+        }
+        else if (texto[i] >= 0xf0 && texto[i] <= 0xf4)
+        {
+            comprimento = 4;
+            codigo = texto[i] & 0x07;
+        }
+        else
+        {
+            return -1; // byte de continuação solto, início de forma longa ou acima de U+10FFFF
+        }
+
+        if (i + comprimento > tamanho)
+        {
+            return -1; // sequência truncada
+        }
+
+        for (j = 1; j < comprimento; j++)
+        {
+            if ((texto[i + j] & 0xc0) != 0x80)
+            {
+                return -1;
+            }
+            codigo = (codigo << 6) | (texto[i + j] & 0x3f);
+        }
+
+        // Formas longas, surrogates e códigos acima de U+10FFFF
+        if ((comprimento == 3 && codigo < 0x800) || (comprimento == 4 && (codigo < 0x10000 || codigo > 0x10ffff)) || (codigo >= 0xd800 && codigo <= 0xdfff))
+        {
+            return -1;
+        }
+
+        if (codigo >= 0x80 && codigo <= 0x9f)
+        {
+            texto[i] = ' '; // controle C1
+            texto[i + 1] = ' ';
+        }
+    }
+
+    return 0;
+}
+
+// Retorna o tempo monotônico atual em milissegundos
+long long agora_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Retorna o total de bytes ainda não confirmados pelo cliente na fila de saída do kernel
+int bytes_pendentes_saida(int socket_cliente)
+{
+    int pendentes = 0;
+
+    if (ioctl(socket_cliente, SIOCOUTQ, &pendentes) < 0)
+    {
+        return 0;
+    }
+
+    return pendentes;
+}
+
+// Hash FNV-1a seguido da finalização do MurmurHash3, para espalhar bem nomes parecidos no anel
+unsigned int hash_texto(const char *texto)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*texto)
+    {
+        hash ^= (unsigned char)*texto++;
+        hash *= 16777619u;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+// Separa os termos do texto para a busca: sequências de letras e dígitos ASCII, convertidos para minúsculas,
+// e de bytes UTF-8 dos demais caracteres, mantidos como estão. Termos longos são cortados. Retorna quantos
+// termos foram separados, até maximo
+int separa_termos(const char *texto, char termos[][TAMANHO_TERMO_BUSCA], int maximo)
+{
+    int total = 0, tamanho = 0;
+    const unsigned char *c = (const unsigned char *)texto;
+
+    while (total < maximo)
+    {
+        if (*c != '\0' && (isalnum(*c) || *c >= 0x80))
+        {
+            if (tamanho < TAMANHO_TERMO_BUSCA - 1)
+            {
+                termos[total][tamanho++] = tolower(*c);
+            }
+        }
+        else if (tamanho > 0)
+        {
+            termos[total++][tamanho] = '\0';
+            tamanho = 0;
+        }
+
+        if (*c++ == '\0')
+        {
+            break;
+        }
+    }
+
+    return total;
+}
+
+// Lê um varint gravado por codifica_varint. Retorna a posição seguinte
+const unsigned char *decodifica_varint(const unsigned char *dados, unsigned int *valor)
+{
+    int deslocamento = 0;
+
+    *valor = 0;
+
+    do
+    {
+        *valor |= (unsigned int)(*dados & 0x7f) << deslocamento;
+        deslocamento += 7;
+    } while (*dados++ & 0x80);
+
+    return dados;
+}
+
+// Escreve todos os bytes no arquivo. Retorna -1 em caso de erro
+int grava_tudo(int arquivo, const void *dados, long tamanho)
+{
+    long gravados = 0, resultado;
+
+    while (gravados < tamanho)
+    {
+        resultado = write(arquivo, (const char *)dados + gravados, tamanho - gravados);
+        if (resultado < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        gravados += resultado;
+    }
+
+    return 0;
+}
+
+// Posição do termo na tabela em memória, ou a posição livre em que ele entraria. A tabela é gravada em
+// segmento antes de passar da metade, então a sondagem sempre termina
+TermoMemoria *procura_termo_memoria(const char termo[])
+{
+    unsigned int posicao = hash_texto(termo) % MAX_TERMOS_MEMORIA;
+
+    while (termos_memoria[posicao].termo[0] != '\0' && strcmp(termos_memoria[posicao].termo, termo))
+    {
+        posicao = (posicao + 1) % MAX_TERMOS_MEMORIA;
+    }
+
+    return &termos_memoria[posicao];
+}
+
+// Acrescenta a mensagem à lista do termo. As mensagens chegam em ordem crescente, então basta guardar a
+// diferença para a anterior
+void indexa_termo_memoria(const char termo[], unsigned int mensagem)
+{
+    TermoMemoria *entrada = procura_termo_memoria(termo);
+    unsigned char codigo[10];
+    int tamanho;
+
+    if (entrada->termo[0] == '\0')
+    {
+        // Tabela cheia porque os segmentos não puderam ser gravados: o termo fica fora do índice
+        if (total_termos_memoria >= MAX_TERMOS_MEMORIA - 1)
+        {
+            return;
+        }
+
+        strcpy(entrada->termo, termo);
+        total_termos_memoria++;
+    }
+    else if (entrada->ultima_mensagem == mensagem)
+    {
+        // Termo repetido na mesma mensagem
+        return;
+    }
+
+    tamanho = codifica_varint(codigo, entrada->total_mensagens ? mensagem - entrada->ultima_mensagem : mensagem);
+
+    if (entrada->tamanho + tamanho > entrada->capacidade)
+    {
+        entrada->capacidade = entrada->capacidade ? entrada->capacidade * 2 : 16;
+        entrada->mensagens = realloc(entrada->mensagens, entrada->capacidade);
+        if (entrada->mensagens == NULL)
+        {
+            error("\n Erro ao alocar o índice de busca");
+        }
+    }
+
+    memcpy(entrada->mensagens + entrada->tamanho, codigo, tamanho);
+    entrada->tamanho += tamanho;
+    entrada->ultima_mensagem = mensagem;
+    entrada->total_mensagens++;
+}
+
+void indexa_termos(const char texto[], unsigned int mensagem)
+{
+    char termos[TAMANHO_BUFFER / 2][TAMANHO_TERMO_BUSCA];
+    int i, total = separa_termos(texto, termos, TAMANHO_BUFFER / 2);
+
+    for (i = 0; i < total; i++)
+    {
+        indexa_termo_memoria(termos[i], mensagem);
+    }
+}
+
+void guarda_deslocamento_busca(long deslocamento)
+{
+    if (total_mensagens_busca == capacidade_deslocamentos_busca)
+    {
+        capacidade_deslocamentos_busca = capacidade_deslocamentos_busca ? capacidade_deslocamentos_busca * 2 : 65536;
+        deslocamentos_busca = realloc(deslocamentos_busca, capacidade_deslocamentos_busca * sizeof(long));
+        if (deslocamentos_busca == NULL)
+        {
+            error("\n Erro ao alocar o índice de busca");
+        }
+    }
+
+    deslocamentos_busca[total_mensagens_busca++] = deslocamento;
+}
+
+// Acrescenta a mensagem ao log; a indexação a lê de lá depois
+void acrescenta_mensagem_busca(MensagemBusca *mensagem)
+{
+    RegistroBusca registro = {0};
+    struct iovec partes[3];
+    long gravados;
+
+    registro.tamanho_texto = strlen(mensagem->texto);
+    registro.tamanho_sala = strlen(mensagem->sala);
+
+    partes[0].iov_base = &registro;
+    partes[0].iov_len = sizeof(registro);
+    partes[1].iov_base = mensagem->sala;
+    partes[1].iov_len = registro.tamanho_sala;
+    partes[2].iov_base = mensagem->texto;
+    partes[2].iov_len = registro.tamanho_texto;
+
+    gravados = writev(arquivo_log_busca, partes, 3);
+    if (gravados != (long)(sizeof(registro) + registro.tamanho_sala + registro.tamanho_texto))
+    {
+        perror("\n Erro ao gravar o log da busca");
+
+        // Um registro pela metade seria lido como o início do seguinte
+        if (gravados > 0 && ftruncate(arquivo_log_busca, fim_log_busca) < 0)
+        {
+            perror("\n Erro ao desfazer a gravação no log da busca");
+        }
+        return;
+    }
+
+    guarda_deslocamento_busca(fim_log_busca);
+    fim_log_busca += gravados;
+}
+
+// Passa ao log as mensagens da fila. Chamada também no meio das gravações e mesclas de segmentos, para a
+// fila não encher enquanto elas demoram
+void recolhe_mensagens_busca()
+{
+    unsigned long long inicio = atomic_load_explicit(&inicio_fila_busca, memory_order_relaxed);
+    unsigned long long fim = atomic_load_explicit(&fim_fila_busca, memory_order_acquire);
+
+    for (; inicio < fim; inicio++)
+    {
+        acrescenta_mensagem_busca(&fila_busca[inicio % TAMANHO_FILA_BUSCA]);
+        atomic_store_explicit(&inicio_fila_busca, inicio + 1, memory_order_release);
+    }
+}
+
+// Lê do log a sala e o texto da mensagem. Retorna -1 se o log não pôde ser lido
+int le_mensagem_busca(unsigned int mensagem, char sala[], char texto[])
+{
+    char dados[sizeof(RegistroBusca) + TAMANHO_SALA + TAMANHO_BUFFER];
+    long tamanho = (mensagem + 1 < total_mensagens_busca ? deslocamentos_busca[mensagem + 1] : fim_log_busca) - deslocamentos_busca[mensagem];
+    RegistroBusca registro;
+
+    if (tamanho > (long)sizeof(dados) || pread(arquivo_log_busca, dados, tamanho, deslocamentos_busca[mensagem]) != tamanho)
+    {
+        return -1;
+    }
+
+    memcpy(&registro, dados, sizeof(registro));
+    memcpy(sala, dados + sizeof(registro), registro.tamanho_sala);
+    memcpy(texto, dados + sizeof(registro) + registro.tamanho_sala, registro.tamanho_texto);
+    sala[registro.tamanho_sala] = '\0';
+    texto[registro.tamanho_texto] = '\0';
+
+    return 0;
+}
+
+void caminho_segmento_busca(char caminho[], unsigned int numero)
+{
+    snprintf(caminho, PATH_MAX, "%sindice.%08u", prefixo_busca, numero);
+}
+
+// Mapeia o segmento do índice e o coloca na lista, em ordem pela primeira mensagem. Retorna -1 se o arquivo
+// não pôde ser aberto ou não é um segmento completo
+int abre_segmento_busca(unsigned int numero)
+{
+    int i, arquivo;
+    char caminho[PATH_MAX];
+    struct stat estado;
+    SegmentoBusca segmento;
+
+    if (total_segmentos_busca == MAX_SEGMENTOS_BUSCA)
+    {
+        return -1;
+    }
+
+    caminho_segmento_busca(caminho, numero);
+
+    arquivo = open(caminho, O_RDONLY | O_CLOEXEC);
+    if (arquivo < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(arquivo, &estado) < 0 || estado.st_size < (off_t)sizeof(CabecalhoIndice))
+    {
+        close(arquivo);
+        return -1;
+    }
+
+    segmento.mapa = mmap(NULL, estado.st_size, PROT_READ, MAP_SHARED, arquivo, 0);
+    close(arquivo);
+
+    if (segmento.mapa == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    segmento.tamanho = estado.st_size;
+    segmento.numero = numero;
+    segmento.cabecalho = (CabecalhoIndice *)segmento.mapa;
+    segmento.entradas = (EntradaIndice *)(segmento.cabecalho + 1);
+
+    if (memcmp(segmento.cabecalho->marca, MARCA_INDICE_BUSCA, sizeof(segmento.cabecalho->marca)) ||
+        sizeof(CabecalhoIndice) + (long)segmento.cabecalho->total_termos * sizeof(EntradaIndice) > (unsigned long)segmento.tamanho)
+    {
+        munmap(segmento.mapa, segmento.tamanho);
+        return -1;
+    }
+
+    for (i = 0; i < (int)segmento.cabecalho->total_termos; i++)
+    {
+        if ((long)segmento.entradas[i].deslocamento + segmento.entradas[i].tamanho > segmento.tamanho)
+        {
+            munmap(segmento.mapa, segmento.tamanho);
+            return -1;
+        }
+    }
+
+    for (i = total_segmentos_busca; i > 0 && segmentos_busca[i - 1].cabecalho->primeira_mensagem > segmento.cabecalho->primeira_mensagem; i--)
+    {
+        segmentos_busca[i] = segmentos_busca[i - 1];
+    }
+
+    segmentos_busca[i] = segmento;
+    total_segmentos_busca++;
+
+    if (numero >= proximo_numero_indice)
+    {
+        proximo_numero_indice = numero + 1;
+    }
+
+    return 0;
+}
+
+// Retira o segmento da lista e, se pedido, apaga o arquivo
+void fecha_segmento_busca(int posicao, int apagar)
+{
+    char caminho[PATH_MAX];
+
+    if (apagar)
+    {
+        caminho_segmento_busca(caminho, segmentos_busca[posicao].numero);
+        unlink(caminho);
+    }
+
+    munmap(segmentos_busca[posicao].mapa, segmentos_busca[posicao].tamanho);
+
+    total_segmentos_busca--;
+    memmove(&segmentos_busca[posicao], &segmentos_busca[posicao + 1], (total_segmentos_busca - posicao) * sizeof(SegmentoBusca));
+}
+
+// Grava e abre um segmento do índice com as entradas e as listas de mensagens. Os deslocamentos das
+// entradas chegam relativos ao início das listas. O arquivo só recebe o nome definitivo depois de completo
+// e sincronizado, então um segmento com o nome definitivo está sempre inteiro. Retorna -1 em caso de erro
+int grava_segmento_busca(unsigned int primeira, unsigned int fim, EntradaIndice entradas[], unsigned int total_termos, unsigned char listas[], long tamanho_listas)
+{
+    unsigned int i, numero = proximo_numero_indice++;
+    int arquivo;
+    long base = sizeof(CabecalhoIndice) + (long)total_termos * sizeof(EntradaIndice);
+    char caminho[PATH_MAX], temporario[PATH_MAX + 4];
+    CabecalhoIndice cabecalho;
+
+    memset(&cabecalho, 0, sizeof(cabecalho));
+    memcpy(cabecalho.marca, MARCA_INDICE_BUSCA, sizeof(cabecalho.marca));
+    cabecalho.primeira_mensagem = primeira;
+    cabecalho.fim_mensagens = fim;
+    cabecalho.total_termos = total_termos;
+
+    for (i = 0; i < total_termos; i++)
+    {
+        entradas[i].deslocamento += base;
+    }
+
+    caminho_segmento_busca(caminho, numero);
+    snprintf(temporario, sizeof(temporario), "%s.tmp", caminho);
+
+    arquivo = open(temporario, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (arquivo < 0)
+    {
+        return -1;
+    }
+
+    if (grava_tudo(arquivo, &cabecalho, sizeof(cabecalho)) < 0 || grava_tudo(arquivo, entradas, (long)total_termos * sizeof(EntradaIndice)) < 0 ||
+        grava_tudo(arquivo, listas, tamanho_listas) < 0)
+    {
+        close(arquivo);
+        unlink(temporario);
+        return -1;
+    }
+
+    recolhe_mensagens_busca();
+
+    if (fsync(arquivo) < 0)
+    {
+        close(arquivo);
+        unlink(temporario);
+        return -1;
+    }
+
+    close(arquivo);
+    recolhe_mensagens_busca();
+
+    if (rename(temporario, caminho) < 0)
+    {
+        unlink(temporario);
+        return -1;
+    }
+
+    if (abre_segmento_busca(numero) < 0)
+    {
+        unlink(caminho);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Mescla os dois segmentos mais recentes num só. A lista de um termo presente nos dois é a do antigo seguida
+// da do novo; como as mensagens do novo vêm todas depois, só a primeira diferença da lista do novo é
+// recalculada e o resto é copiado como está. Retorna -1 em caso de erro
+int mescla_par_busca()
+{
+    SegmentoBusca *antigo = &segmentos_busca[total_segmentos_busca - 2], *novo = &segmentos_busca[total_segmentos_busca - 1];
+    EntradaIndice *a = antigo->entradas, *b = novo->entradas, *entradas, *entrada;
+    unsigned int i = 0, j = 0, total = 0, primeira, numero_antigo = antigo->numero, numero_novo = novo->numero;
+    unsigned int total_a = antigo->cabecalho->total_termos, total_b = novo->cabecalho->total_termos;
+    long inicio, tamanho_listas = 0;
+    int k, comparacao, resultado;
+    const unsigned char *lista, *resto;
+    unsigned char *listas;
+
+    // As listas mescladas ocupam no máximo as do antigo e as do novo, mais um varint maior por termo comum,
+    // que cabe nos cabeçalhos e entradas dos dois arquivos
+    entradas = calloc(total_a + total_b + 1, sizeof(EntradaIndice));
+    listas = malloc(antigo->tamanho + novo->tamanho);
+    if (entradas == NULL || listas == NULL)
+    {
+        free(entradas);
+        free(listas);
+        return -1;
+    }
+
+    while (i < total_a || j < total_b)
+    {
+        comparacao = i == total_a ? 1 : j == total_b ? -1 : strncmp(a[i].termo, b[j].termo, TAMANHO_TERMO_BUSCA);
+        entrada = &entradas[total++];
+        inicio = tamanho_listas;
+
+        if (comparacao <= 0)
+        {
+            *entrada = a[i];
+            memcpy(listas + tamanho_listas, antigo->mapa + a[i].deslocamento, a[i].tamanho);
+            tamanho_listas += a[i].tamanho;
+        }
+
+        if (comparacao > 0)
+        {
+            *entrada = b[j];
+            memcpy(listas + tamanho_listas, novo->mapa + b[j].deslocamento, b[j].tamanho);
+            tamanho_listas += b[j].tamanho;
+        }
+        else if (comparacao == 0)
+        {
+            lista = (const unsigned char *)novo->mapa + b[j].deslocamento;
+            resto = decodifica_varint(lista, &primeira);
+
+            tamanho_listas += codifica_varint(listas + tamanho_listas, primeira - a[i].ultima_mensagem);
+            memcpy(listas + tamanho_listas, resto, b[j].tamanho - (resto - lista));
+            tamanho_listas += b[j].tamanho - (resto - lista);
+
+            entrada->total_mensagens += b[j].total_mensagens;
+            entrada->ultima_mensagem = b[j].ultima_mensagem;
+        }
+
+        entrada->deslocamento = inicio;
+        entrada->tamanho = tamanho_listas - inicio;
+
+        i += comparacao <= 0;
+        j += comparacao >= 0;
+
+        if (total % 4096 == 0)
+        {
+            recolhe_mensagens_busca();
+        }
+    }
+
+    resultado = grava_segmento_busca(antigo->cabecalho->primeira_mensagem, novo->cabecalho->fim_mensagens, entradas, total, listas, tamanho_listas);
+
+    free(entradas);
+    free(listas);
+
+    if (resultado < 0)
+    {
+        return -1;
+    }
+
+    // O segmento mesclado entrou na lista; os dois de origem saem, e os seus arquivos são apagados
+    for (k = total_segmentos_busca - 1; k >= 0; k--)
+    {
+        if (segmentos_busca[k].numero == numero_antigo || segmentos_busca[k].numero == numero_novo)
+        {
+            fecha_segmento_busca(k, 1);
+        }
+    }
+
+    return 0;
+}
+
+// Mescla os dois segmentos mais recentes enquanto o último tiver ao menos tantas mensagens quanto o
+// anterior. Como numa contagem binária, restam poucos segmentos e cada mensagem é regravada poucas vezes
+void mescla_segmentos_busca()
+{
+    CabecalhoIndice *antigo, *novo;
+
+    while (total_segmentos_busca >= 2)
+    {
+        recolhe_mensagens_busca();
+
+        antigo = segmentos_busca[total_segmentos_busca - 2].cabecalho;
+        novo = segmentos_busca[total_segmentos_busca - 1].cabecalho;
+
+        if (novo->fim_mensagens - novo->primeira_mensagem < antigo->fim_mensagens - antigo->primeira_mensagem)
+        {
+            break;
+        }
+
+        if (mescla_par_busca() < 0)
+        {
+            perror("\n Erro ao mesclar segmentos do índice de busca");
+            break;
+        }
+    }
+}
+
+int compara_termos_memoria(const void *a, const void *b)
+{
+    return strcmp((*(TermoMemoria *const *)a)->termo, (*(TermoMemoria *const *)b)->termo);
+}
+
+// Grava os termos em memória num novo segmento, esvazia a tabela e mescla os segmentos. Se a gravação
+// falhar, os termos continuam em memória e ela é tentada de novo com a próxima mensagem
+void grava_termos_memoria()
+{
+    unsigned int i, total = 0;
+    long tamanho_listas = 0;
+    TermoMemoria **ordenados;
+    EntradaIndice *entradas;
+    unsigned char *listas;
+
+    if (total_termos_memoria == 0)
+    {
+        primeira_mensagem_memoria = mensagens_indexadas;
+        return;
+    }
+
+    ordenados = malloc(total_termos_memoria * sizeof(TermoMemoria *));
+    entradas = calloc(total_termos_memoria, sizeof(EntradaIndice));
+    if (ordenados == NULL || entradas == NULL)
+    {
+        error("\n Erro ao alocar o índice de busca");
+    }
+
+    for (i = 0; i < MAX_TERMOS_MEMORIA; i++)
+    {
+        if (termos_memoria[i].termo[0] != '\0')
+        {
+            ordenados[total++] = &termos_memoria[i];
+            tamanho_listas += termos_memoria[i].tamanho;
+        }
+    }
+
+    qsort(ordenados, total, sizeof(TermoMemoria *), compara_termos_memoria);
+
+    listas = malloc(tamanho_listas);
+    if (listas == NULL)
+    {
+        error("\n Erro ao alocar o índice de busca");
+    }
+
+    tamanho_listas = 0;
+    for (i = 0; i < total; i++)
+    {
+        memcpy(entradas[i].termo, ordenados[i]->termo, TAMANHO_TERMO_BUSCA);
+        entradas[i].deslocamento = tamanho_listas;
+        entradas[i].tamanho = ordenados[i]->tamanho;
+        entradas[i].total_mensagens = ordenados[i]->total_mensagens;
+        entradas[i].ultima_mensagem = ordenados[i]->ultima_mensagem;
+
+        memcpy(listas + tamanho_listas, ordenados[i]->mensagens, ordenados[i]->tamanho);
+        tamanho_listas += ordenados[i]->tamanho;
+    }
+
+    if (grava_segmento_busca(primeira_mensagem_memoria, mensagens_indexadas, entradas, total, listas, tamanho_listas) == 0)
+    {
+        for (i = 0; i < total; i++)
+        {
+            free(ordenados[i]->mensagens);
+            memset(ordenados[i], 0, sizeof(TermoMemoria));
+        }
+
+        total_termos_memoria = 0;
+        primeira_mensagem_memoria = mensagens_indexadas;
+
+        mescla_segmentos_busca();
+    }
+    else
+    {
+        perror("\n Erro ao gravar um segmento do índice de busca");
+    }
+
+    free(ordenados);
+    free(entradas);
+    free(listas);
+}
+
+// Grava a tabela em memória em segmento quando ela chega ao limite de mensagens ou de termos
+void verifica_termos_memoria()
+{
+    if (mensagens_indexadas - primeira_mensagem_memoria >= DOCUMENTOS_POR_SEGMENTO || total_termos_memoria >= MAX_TERMOS_MEMORIA / 2)
+    {
+        grava_termos_memoria();
+    }
+}
+
+// Lista de mensagens do termo numa fonte do índice: a tabela em memória, com a fonte -1, ou um segmento,
+// com busca binária nas entradas. Retorna NULL se o termo não aparece na fonte
+const unsigned char *lista_termo_busca(int fonte, const char termo[], unsigned int *total_mensagens)
+{
+    int inicio = 0, fim, meio, comparacao;
+    TermoMemoria *termo_memoria;
+    EntradaIndice *entradas;
+
+    if (fonte < 0)
+    {
+        termo_memoria = procura_termo_memoria(termo);
+        if (termo_memoria->termo[0] == '\0')
+        {
+            return NULL;
+        }
+
+        *total_mensagens = termo_memoria->total_mensagens;
+        return termo_memoria->mensagens;
+    }
+
+    entradas = segmentos_busca[fonte].entradas;
+    fim = segmentos_busca[fonte].cabecalho->total_termos - 1;
+
+    while (inicio <= fim)
+    {
+        meio = (inicio + fim) / 2;
+        comparacao = strncmp(entradas[meio].termo, termo, TAMANHO_TERMO_BUSCA);
+
+        if (comparacao == 0)
+        {
+            *total_mensagens = entradas[meio].total_mensagens;
+            return (const unsigned char *)segmentos_busca[fonte].mapa + entradas[meio].deslocamento;
+        }
+
+        if (comparacao < 0)
+        {
+            inicio = meio + 1;
+        }
+        else
+        {
+            fim = meio - 1;
+        }
+    }
+
+    return NULL;
+}
+
+// Mensagens da fonte que têm todos os termos, em ordem crescente, numa lista a ser liberada por quem chama.
+// Retorna NULL, com total 0, se algum termo falta na fonte
+unsigned int *intersecta_termos_busca(int fonte, char termos[][TAMANHO_TERMO_BUSCA], int total_termos, unsigned int *total)
+{
+    unsigned int i, k, quantidade, valor, mensagem, encontradas, *resultado = NULL, *lista;
+    const unsigned char *dados;
+    int t;
+
+    *total = 0;
+
+    for (t = 0; t < total_termos; t++)
+    {
+        dados = lista_termo_busca(fonte, termos[t], &quantidade);
+        if (dados == NULL || (lista = malloc(quantidade * sizeof(unsigned int))) == NULL)
+        {
+            free(resultado);
+            *total = 0;
+            return NULL;
+        }
+
+        for (i = 0, mensagem = 0; i < quantidade; i++)
+        {
+            dados = decodifica_varint(dados, &valor);
+            mensagem = i ? mensagem + valor : valor;
+            lista[i] = mensagem;
+        }
+
+        if (t == 0)
+        {
+            resultado = lista;
+            *total = quantidade;
+            continue;
+        }
+
+        // Interseção de duas listas crescentes, guardada sobre o resultado anterior
+        for (i = 0, k = 0, encontradas = 0; i < *total && k < quantidade;)
+        {
+            if (resultado[i] < lista[k])
+            {
+                i++;
+            }
+            else if (resultado[i] > lista[k])
+            {
+                k++;
+            }
+            else
+            {
+                resultado[encontradas++] = resultado[i];
+                i++;
+                k++;
+            }
+        }
+
+        *total = encontradas;
+        free(lista);
+    }
+
+    return resultado;
+}
+
+// Monta a resposta da busca: quantas mensagens têm todos os termos e as mais recentes delas, lidas do log
+void responde_consulta_busca(const char consulta[], char resposta[])
+{
+    char termos[MAX_TERMOS_CONSULTA][TAMANHO_TERMO_BUSCA];
+    char sala[TAMANHO_SALA], texto[TAMANHO_BUFFER];
+    unsigned int encontradas[RESULTADOS_BUSCA], *mensagens, total;
+    unsigned long long total_encontradas = 0;
+    int i, k, fonte, tamanho, linha, exibidas = 0, total_termos;
+
+    total_termos = separa_termos(consulta, termos, MAX_TERMOS_CONSULTA);
+    if (total_termos == 0)
+    {
+        snprintf(resposta, TAMANHO_RESPOSTA_BUSCA, "Use /busca <termos>.");
+        return;
+    }
+
+    // Da fonte mais recente para a mais antiga: a tabela em memória e depois os segmentos
+    for (k = 0; k <= total_segmentos_busca; k++)
+    {
+        fonte = k == 0 ? -1 : total_segmentos_busca - k;
+
+        mensagens = intersecta_termos_busca(fonte, termos, total_termos, &total);
+        total_encontradas += total;
+
+        for (i = (int)total - 1; i >= 0 && exibidas < RESULTADOS_BUSCA; i--)
+        {
+            encontradas[exibidas++] = mensagens[i];
+        }
+
+        free(mensagens);
+    }
+
+    if (total_encontradas == 0)
+    {
+        snprintf(resposta, TAMANHO_RESPOSTA_BUSCA, "Nenhuma mensagem com \"%s\".", consulta);
+        return;
+    }
+
+    tamanho = snprintf(resposta, TAMANHO_RESPOSTA_BUSCA, "%llu %s com \"%s\"%s", total_encontradas, total_encontradas == 1 ? "mensagem" : "mensagens", consulta,
+                       total_encontradas > (unsigned long long)exibidas ? "; as mais recentes:" : ":");
+
+    for (i = 0; i < exibidas && tamanho < TAMANHO_RESPOSTA_BUSCA; i++)
+    {
+        if (le_mensagem_busca(encontradas[i], sala, texto) < 0)
+        {
+            continue;
+        }
+
+        // A resposta termina na última linha inteira que couber
+        linha = snprintf(resposta + tamanho, TAMANHO_RESPOSTA_BUSCA - tamanho, "\n[%s] %s", sala, texto);
+        if (tamanho + linha >= TAMANHO_RESPOSTA_BUSCA)
+        {
+            resposta[tamanho] = '\0';
+            break;
+        }
+        tamanho += linha;
+    }
+}
+
+// Thread de busca: grava as mensagens de sala no log, mantém o índice, mescla os segmentos e responde às
+// consultas. Só ela usa o log e o índice, que então dispensam trava; o laço principal apenas passa as
+// mensagens e as consultas pelas filas e recebe as respostas pelo eventfd
+void *thread_busca(void *argumento)
+{
+    unsigned long long inicio, fim, um = 1;
+    int encerrando;
+    char sala[TAMANHO_SALA], texto[TAMANHO_BUFFER];
+    ConsultaBusca *consulta;
+    struct timespec prazo;
+
+    while (1)
+    {
+        recolhe_mensagens_busca();
+
+        // Inclui, na partida, as mensagens do log que não chegaram a um segmento antes da última parada
+        while (mensagens_indexadas < total_mensagens_busca)
+        {
+            if (le_mensagem_busca(mensagens_indexadas, sala, texto) == 0)
+            {
+                indexa_termos(texto, mensagens_indexadas);
+            }
+
+            mensagens_indexadas++;
+            verifica_termos_memoria();
+        }
+
+        // A resposta vai para a posição da consulta; avançar o início das consultas a publica
+        inicio = atomic_load_explicit(&inicio_consultas_busca, memory_order_relaxed);
+        fim = atomic_load_explicit(&fim_consultas_busca, memory_order_acquire);
+
+        for (; inicio < fim; inicio++)
+        {
+            consulta = &consultas_busca[inicio % TAMANHO_FILA_CONSULTAS];
+
+            responde_consulta_busca(consulta->texto, respostas_busca[inicio % TAMANHO_FILA_CONSULTAS].texto);
+            respostas_busca[inicio % TAMANHO_FILA_CONSULTAS].indice_cliente = consulta->indice_cliente;
+            respostas_busca[inicio % TAMANHO_FILA_CONSULTAS].conexao = consulta->conexao;
+
+            atomic_store_explicit(&inicio_consultas_busca, inicio + 1, memory_order_release);
+
+            if (write(eventos_busca, &um, sizeof(um)) < 0 && errno != EAGAIN)
+            {
+                perror("\n Erro ao sinalizar a resposta da busca");
+            }
+        }
+
+        // As mensagens de sala são recolhidas a cada intervalo; só as consultas acordam a thread na hora
+        pthread_mutex_lock(&trava_busca);
+        if (!encerrando_busca && atomic_load_explicit(&inicio_consultas_busca, memory_order_relaxed) == atomic_load_explicit(&fim_consultas_busca, memory_order_acquire))
+        {
+            clock_gettime(CLOCK_REALTIME, &prazo);
+            prazo.tv_nsec += INTERVALO_INDEXACAO_MS * 1000000L;
+            if (prazo.tv_nsec >= 1000000000L)
+            {
+                prazo.tv_sec++;
+                prazo.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&sinal_busca, &trava_busca, &prazo);
+        }
+        encerrando = encerrando_busca;
+        pthread_mutex_unlock(&trava_busca);
+
+        // O laço principal já não acrescenta mensagens; as da fila vão para o log, e a indexação das que
+        // faltarem fica para a próxima partida
+        if (encerrando)
+        {
+            recolhe_mensagens_busca();
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// Abre o log das mensagens de sala e os segmentos do índice no diretório da busca e inicia a thread de
+// busca. Chamada depois de herdar as conexões, quando o binário anterior já não grava mais no log
+void inicia_busca()
+{
+    int i, lidos, tamanho_prefixo;
+    unsigned int numero, esperada = 0;
+    long tamanho;
+    char caminho[PATH_MAX + 256], *mapa;
+    DIR *diretorio;
+    struct dirent *entrada;
+    struct stat estado;
+    RegistroBusca registro;
+    pthread_t thread;
+
+    if (diretorio_busca == NULL)
+    {
+        return;
+    }
+
+    // Com workers, cada um tem o seu log e o seu índice, com todas as mensagens de sala
+    if (indice_worker >= 0)
+    {
+        tamanho_prefixo = snprintf(prefixo_busca, sizeof(prefixo_busca), "%s/w%d.", diretorio_busca, indice_worker);
+    }
+    else
+    {
+        tamanho_prefixo = snprintf(prefixo_busca, sizeof(prefixo_busca), "%s/", diretorio_busca);
+    }
+
+    if (tamanho_prefixo >= (int)sizeof(prefixo_busca))
+    {
+        fprintf(stderr, "Caminho do diretório da busca muito longo: %s\n", diretorio_busca);
+        exit(1);
+    }
+
+    snprintf(caminho, sizeof(caminho), "%smensagens", prefixo_busca);
+    arquivo_log_busca = open(caminho, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (arquivo_log_busca < 0 || fstat(arquivo_log_busca, &estado) < 0)
+    {
+        error("\n Erro ao abrir o log da busca");
+    }
+
+    // Refaz a posição de cada mensagem; um registro incompleto no fim, da última parada, é descartado
+    tamanho = estado.st_size;
+    fim_log_busca = 0;
+
+    if (tamanho > 0)
+    {
+        mapa = mmap(NULL, tamanho, PROT_READ, MAP_PRIVATE, arquivo_log_busca, 0);
+        if (mapa == MAP_FAILED)
+        {
+            error("\n Erro ao mapear o log da busca");
+        }
+
+        while (fim_log_busca + (long)sizeof(registro) <= tamanho)
+        {
+            memcpy(&registro, mapa + fim_log_busca, sizeof(registro));
+
+            if (registro.tamanho_sala >= TAMANHO_SALA || registro.tamanho_texto >= TAMANHO_BUFFER ||
+                fim_log_busca + (long)sizeof(registro) + registro.tamanho_sala + registro.tamanho_texto > tamanho)
+            {
+                break;
+            }
+
+            guarda_deslocamento_busca(fim_log_busca);
+            fim_log_busca += sizeof(registro) + registro.tamanho_sala + registro.tamanho_texto;
+        }
+
+        munmap(mapa, tamanho);
+
+        if (fim_log_busca < tamanho && ftruncate(arquivo_log_busca, fim_log_busca) < 0)
+        {
+            error("\n Erro ao descartar o fim incompleto do log da busca");
+        }
+    }
+
+    diretorio = opendir(diretorio_busca);
+    if (diretorio == NULL)
+    {
+        error("\n Erro ao abrir o diretório da busca");
+    }
+
+    // Arquivos temporários são de gravações interrompidas e são apagados
+    while ((entrada = readdir(diretorio)) != NULL)
+    {
+        snprintf(caminho, sizeof(caminho), "%s/%s", diretorio_busca, entrada->d_name);
+
+        if (strncmp(caminho, prefixo_busca, strlen(prefixo_busca)) || sscanf(caminho + strlen(prefixo_busca), "indice.%u%n", &numero, &lidos) != 1)
+        {
+            continue;
+        }
+
+        if (caminho[strlen(prefixo_busca) + lidos] != '\0')
+        {
+            unlink(caminho);
+        }
+        else if (abre_segmento_busca(numero) < 0)
+        {
+            fprintf(stderr, "\n Segmento de busca inválido ignorado: %s\n", caminho);
+        }
+    }
+
+    closedir(diretorio);
+
+    // Os segmentos devem cobrir as mensagens em sequência. Uma mescla interrompida deixa os segmentos de
+    // origem junto com o mesclado, e os que se sobrepõem ou passam do log saem; as mensagens depois do
+    // último segmento que restar são indexadas de novo pela thread
+    for (i = 0; i < total_segmentos_busca;)
+    {
+        if (segmentos_busca[i].cabecalho->primeira_mensagem != esperada || segmentos_busca[i].cabecalho->fim_mensagens > total_mensagens_busca)
+        {
+            fecha_segmento_busca(i, 1);
+            continue;
+        }
+
+        esperada = segmentos_busca[i++].cabecalho->fim_mensagens;
+    }
+
+    primeira_mensagem_memoria = mensagens_indexadas = esperada;
+
+    termos_memoria = calloc(MAX_TERMOS_MEMORIA, sizeof(TermoMemoria));
+    eventos_busca = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (termos_memoria == NULL || eventos_busca < 0)
+    {
+        error("\n Erro ao preparar a busca");
+    }
+
+#ifdef MODO_DEBUGER
+    printf("\n Busca em %s: %u mensagens no log, %d segmentos do índice\n", diretorio_busca, total_mensagens_busca, total_segmentos_busca);
+#endif
+
+    encerrando_busca = 0;
+    if (pthread_create(&thread, NULL, thread_busca, NULL) != 0)
+    {
+        error("\n Erro ao criar a thread de busca");
+    }
+
+    thread_indexacao = thread;
+    busca_ativa = 1;
+}
+
+// Espera a thread de busca gravar as mensagens da fila e fecha o log e o índice. A tabela em memória não
+// precisa ser gravada: na próxima partida, as mensagens que faltam nos segmentos são indexadas a partir do log
+void encerra_busca()
+{
+    unsigned int i;
+
+    if (!busca_ativa)
+    {
+        return;
+    }
+
+    busca_ativa = 0;
+
+    pthread_mutex_lock(&trava_busca);
+    encerrando_busca = 1;
+    pthread_cond_signal(&sinal_busca);
+    pthread_mutex_unlock(&trava_busca);
+
+    pthread_join(thread_indexacao, NULL);
+
+    if (mensagens_descartadas_busca > 0)
+    {
+        fprintf(stderr, "\n Busca: %llu mensagens fora do log com a fila cheia\n", mensagens_descartadas_busca);
+    }
+
+    // Tudo volta ao estado inicial, para a busca poder ser reiniciada se a troca do binário falhar
+    for (i = 0; i < MAX_TERMOS_MEMORIA; i++)
+    {
+        free(termos_memoria[i].mensagens);
+    }
+    free(termos_memoria);
+    termos_memoria = NULL;
+    total_termos_memoria = 0;
+
+    while (total_segmentos_busca > 0)
+    {
+        fecha_segmento_busca(total_segmentos_busca - 1, 0);
+    }
+
+    free(deslocamentos_busca);
+    deslocamentos_busca = NULL;
+    total_mensagens_busca = capacidade_deslocamentos_busca = 0;
+
+    close(arquivo_log_busca);
+    close(eventos_busca);
+    arquivo_log_busca = eventos_busca = -1;
+
+    atomic_store(&inicio_fila_busca, 0);
+    atomic_store(&fim_fila_busca, 0);
+    atomic_store(&inicio_consultas_busca, 0);
+    atomic_store(&fim_consultas_busca, 0);
+    inicio_respostas_busca = 0;
+}
+
+// Passa a mensagem de sala à thread de busca. Com a fila cheia, a mensagem é entregue mas fica fora do log
+void registra_busca(const char sala[], const char texto[])
+{
+    unsigned long long fim;
+    MensagemBusca *mensagem;
+
+    if (!busca_ativa)
+    {
+        return;
+    }
+
+    fim = atomic_load_explicit(&fim_fila_busca, memory_order_relaxed);
+    if (fim - atomic_load_explicit(&inicio_fila_busca, memory_order_acquire) == TAMANHO_FILA_BUSCA)
+    {
+        mensagens_descartadas_busca++;
+        return;
+    }
+
+    mensagem = &fila_busca[fim % TAMANHO_FILA_BUSCA];
+    snprintf(mensagem->sala, TAMANHO_SALA, "%s", sala);
+    snprintf(mensagem->texto, TAMANHO_BUFFER, "%s", texto);
+
+    atomic_store_explicit(&fim_fila_busca, fim + 1, memory_order_release);
+}
+
+// Passa a busca do cliente à thread de busca; a resposta volta por trata_busca, sem bloquear o laço. Cada
+// consulta aceita reserva a posição da sua resposta, que só é liberada quando a resposta é entregue
+void pede_busca(int indice_cliente, const char texto[], Cliente clientes_aprovados[])
+{
+    unsigned long long fim = atomic_load_explicit(&fim_consultas_busca, memory_order_relaxed);
+    ConsultaBusca *consulta;
+    char resposta[TAMANHO_BUFFER];
+
+    if (!busca_ativa || fim - inicio_respostas_busca == TAMANHO_FILA_CONSULTAS)
+    {
+        snprintf(resposta, TAMANHO_BUFFER, "%s", busca_ativa ? "Muitas buscas em andamento; tente de novo." : "A busca não está habilitada neste servidor.");
+        envia_mensagem(clientes_aprovados[indice_cliente].socket, resposta, strlen(resposta));
+        return;
+    }
+
+    consulta = &consultas_busca[fim % TAMANHO_FILA_CONSULTAS];
+    consulta->indice_cliente = indice_cliente;
+    consulta->conexao = identificador_conexao[indice_cliente];
+    snprintf(consulta->texto, TAMANHO_RESPOSTA_BUSCA, "%s", texto + strspn(texto, " "));
+
+    atomic_store_explicit(&fim_consultas_busca, fim + 1, memory_order_release);
+
+    pthread_mutex_lock(&trava_busca);
+    pthread_cond_signal(&sinal_busca);
+    pthread_mutex_unlock(&trava_busca);
+}
+
+// Entrega as respostas prontas das buscas. Se a conexão que pediu a busca já saiu, a resposta é descartada,
+// mesmo que outra conexão ocupe agora a mesma posição
+void trata_busca(fd_set *readfds, Cliente clientes_aprovados[])
+{
+    unsigned long long contador, prontas;
+    ConsultaBusca *resposta;
+
+    if (!busca_ativa || FD_ISSET(eventos_busca, readfds) == 0)
+    {
+        return;
+    }
+
+    if (read(eventos_busca, &contador, sizeof(contador)) < 0 && errno != EAGAIN)
+    {
+        perror("\n Erro ao ler o eventfd da busca");
+    }
+
+    prontas = atomic_load_explicit(&inicio_consultas_busca, memory_order_acquire);
+
+    for (; inicio_respostas_busca < prontas; inicio_respostas_busca++)
+    {
+        resposta = &respostas_busca[inicio_respostas_busca % TAMANHO_FILA_CONSULTAS];
+
+        if (identificador_conexao[resposta->indice_cliente] == resposta->conexao && clientes_aprovados[resposta->indice_cliente].socket != 0)
+        {
+            envia_mensagem(clientes_aprovados[resposta->indice_cliente].socket, resposta->texto, strlen(resposta->texto));
+        }
+    }
+}
+
+// Envia a mensagem de reinício ao cliente sem bloquear além do prazo de encerramento
+void avisa_reinicio_cliente(int socket_cliente, long long prazo)
+{
+    char mensagem_reinicio[TAMANHO_BUFFER];
+    struct timeval limite_envio;
+    long long restante = prazo - agora_ms();
+
+    if (restante <= 0)
+    {
+        return;
+    }
+
+    limite_envio.tv_sec = restante / 1000;
+    limite_envio.tv_usec = (restante % 1000) * 1000;
+    setsockopt(socket_cliente, SOL_SOCKET, SO_SNDTIMEO, &limite_envio, sizeof(limite_envio));
+
+    // Cada cliente recebe um atraso diferente para que as reconexões não cheguem todas ao mesmo tempo
+    snprintf(mensagem_reinicio, TAMANHO_BUFFER, "Servidor reiniciando. Reconecte em %d ms.", rand() % JANELA_RECONEXAO_MS);
+
+    envia_mensagem(socket_cliente, mensagem_reinicio, strlen(mensagem_reinicio));
+}
+
+// Encerra o sentido de envio do socket, avisando antes o fim da sessão TLS quando houver
+void encerra_envio(int socket_cliente)
+{
+#ifdef COM_TLS
+    if (tls_conexoes[socket_cliente] != NULL)
+    {
+        SSL_shutdown(tls_conexoes[socket_cliente]);
+    }
+#endif
+
+    shutdown(socket_cliente, SHUT_WR);
+}
+
+// Encerra o servidor de forma gradual: para de aceitar conexões, avisa os clientes e aguarda
+// as filas de saída esvaziarem até o prazo de encerramento antes de fechar os sockets
+void encerra_servidor_gradualmente()
+{
+    int i, max_socket_cliente, restantes;
+    char descarte[TAMANHO_BUFFER];
+    long long prazo, restante;
+    struct timeval espera;
+    fd_set readfds;
+
+#ifdef MODO_DEBUGER
+    printf("\n Vou encerrar o servidor gradualmente\n");
+#endif
+
+    prazo = agora_ms() + PRAZO_ENCERRAMENTO_MS;
+
+    // Mensagens de sala ainda em lotes seguem para as filas de saída, esvaziadas abaixo
+    despacha_lotes(1, NULL);
+
+    // Parar de aceitar novas conexões e pedidos de troca
+    if (sockfd > 0)
+    {
+        close(sockfd);
+        sockfd = 0;
+    }
+
+    if (sockfd_unix > 0)
+    {
+        close(sockfd_unix);
+        sockfd_unix = 0;
+        if (caminho_unix != NULL && caminho_unix[0] != '@')
+        {
+            unlink(caminho_unix);
+        }
+    }
+
+    if (trocafd > 0)
+    {
+        close(trocafd);
+        trocafd = 0;
+        unlink(caminho_troca);
+    }
+
+    srand(time(NULL) ^ getpid());
+
+    for (i = 0; i < limite_clientes; i++)
+    {
+        if (clientes_sockets[i] == 0)
+        {
+            continue;
+        }
+
+        avisa_reinicio_cliente(clientes_sockets[i], prazo);
+
+        // Sinaliza fim de envio: o cliente lê o que falta e fecha a sua ponta
+        encerra_envio(clientes_sockets[i]);
+    }
+
+    // Aguardar até que todos os clientes confirmem os dados enviados ou fechem a conexão
+    while ((restante = prazo - agora_ms()) > 0)
+    {
+        FD_ZERO(&readfds);
+        max_socket_cliente = -1;
+        restantes = 0;
+
+        for (i = 0; i < limite_clientes; i++)
+        {
+            if (clientes_sockets[i] == 0)
+            {
+                continue;
+            }
+
+            if (bytes_pendentes_saida(clientes_sockets[i]) == 0)
+            {
+                fecha_socket(clientes_sockets[i]);
+                clientes_sockets[i] = 0;
+                continue;
+            }
+
+            FD_SET(clientes_sockets[i], &readfds);
+            if (clientes_sockets[i] > max_socket_cliente)
+            {
+                max_socket_cliente = clientes_sockets[i];
+            }
+            restantes++;
+        }
+
+        if (restantes == 0)
+        {
+            break;
+        }
+
+        espera.tv_sec = 0;
+        espera.tv_usec = (restante < 50 ? restante : 50) * 1000;
+
+        if (select(max_socket_cliente + 1, &readfds, NULL, NULL, &espera) < 0 && errno != EINTR)
+        {
+            break;
+        }
+
+        // Descarta o que os clientes ainda enviarem e fecha quem já encerrou a conexão
+        for (i = 0; i < limite_clientes; i++)
+        {
+            if (clientes_sockets[i] == 0 || FD_ISSET(clientes_sockets[i], &readfds) == 0)
+            {
+                continue;
+            }
+
+            if (recv(clientes_sockets[i], descarte, sizeof(descarte), MSG_DONTWAIT) == 0)
+            {
+                fecha_socket(clientes_sockets[i]);
+                clientes_sockets[i] = 0;
+            }
+        }
+    }
+
+    // Prazo esgotado: fecha o que restou
+    for (i = 0; i < limite_clientes; i++)
+    {
+        if (clientes_sockets[i] > 0)
+        {
+            fecha_socket(clientes_sockets[i]);
+            clientes_sockets[i] = 0;
+        }
+    }
+
+    encerra_captura();
+    encerra_busca();
+
+#ifdef MODO_DEBUGER
+    printf("\n Servidor encerrado\n");
+#endif
+
+    exit(0);
+}
+
+// Libera uma referência ao autômato de moderação; o último a soltá-lo libera a memória
+void libera_moderacao(Moderacao *moderacao)
+{
+    if (moderacao == NULL || atomic_fetch_sub(&moderacao->referencias, 1) != 1)
+    {
+        return;
+    }
+
+    free(moderacao->transicoes);
+    free(moderacao->acoes);
+    free(moderacao->mascara);
+    free(moderacao);
+}
+
+// Lê uma linha "acao termo" do arquivo de moderação. Retorna a ação, 0 para linhas vazias ou de
+// comentário e -1 para ações desconhecidas
+int le_termo_moderacao(char linha[], char termo[])
+{
+    char acao[16];
+    int inicio_termo;
+
+    linha[strcspn(linha, "\r\n")] = '\0';
+
+    if (linha[0] == '#' || sscanf(linha, "%15s %n", acao, &inicio_termo) != 1 || linha[inicio_termo] == '\0')
+    {
+        return 0;
+    }
+
+    strncpy(termo, linha + inicio_termo, TAMANHO_TERMO - 1);
+    termo[TAMANHO_TERMO - 1] = '\0';
+
+    if (!strcmp(acao, "bloquear"))
+    {
+        return MODERACAO_BLOQUEAR;
+    }
+    if (!strcmp(acao, "mascarar"))
+    {
+        return MODERACAO_MASCARAR;
+    }
+    if (!strcmp(acao, "marcar"))
+    {
+        return MODERACAO_MARCAR;
+    }
+
+    return -1;
+}
+
+// Compila o arquivo de termos num autômato de Aho-Corasick. Retorna NULL em caso de erro
+Moderacao *compila_moderacao(const char *caminho)
+{
+    int i, c, acao, estado, proximo, capacidade, total_termos = 0, inicio_fila, fim_fila;
+    int *falha, *fila, *novo, *transicoes;
+    unsigned char byte, *acoes, *mascara;
+    char linha[TAMANHO_TERMO + 32], termo[TAMANHO_TERMO];
+    FILE *arquivo;
+    Moderacao *moderacao;
+
+    arquivo = fopen(caminho, "r");
+    if (arquivo == NULL)
+    {
+        perror("\n Erro ao abrir o arquivo de moderação");
+        return NULL;
+    }
+
+    moderacao = calloc(1, sizeof(Moderacao));
+    if (moderacao == NULL)
+    {
+        perror("\n Erro ao alocar o autômato de moderação");
+        fclose(arquivo);
+        return NULL;
+    }
+
+    // Com a referência inicial, libera_moderacao descarta o autômato parcial em qualquer falha
+    atomic_init(&moderacao->referencias, 1);
+
+    // Primeira passada: classes dos bytes e pré-filtro dos bytes iniciais
+    moderacao->total_classes = 1;
+    while (fgets(linha, sizeof(linha), arquivo) != NULL)
+    {
+        if ((acao = le_termo_moderacao(linha, termo)) <= 0)
+        {
+            if (acao < 0)
+            {
+                fprintf(stderr, "\n Ação de moderação desconhecida: %s\n", linha);
+            }
+            continue;
+        }
+
+        for (i = 0; termo[i] != '\0'; i++)
+        {
+            byte = tolower((unsigned char)termo[i]);
+            if (moderacao->classe[byte] == 0)
+            {
+                moderacao->classe[byte] = moderacao->total_classes;
+                moderacao->classe[toupper(byte)] = moderacao->total_classes;
+                moderacao->total_classes++;
+            }
+        }
+
+        byte = termo[0];
+        for (c = 0; c < 2; c++, byte = isupper(byte) ? tolower(byte) : toupper(byte))
+        {
+            moderacao->filtro_baixo[byte & 0x0f] |= 1 << ((byte >> 4) & 7);
+            moderacao->filtro_alto[byte >> 4] = 1 << ((byte >> 4) & 7);
+        }
+
+        total_termos++;
+    }
+
+    // Segunda passada: árvore de prefixos dos termos; -1 marca transição ainda inexistente
+    capacidade = 1024;
+    moderacao->transicoes = malloc((size_t)capacidade * moderacao->total_classes * sizeof(int));
+    moderacao->acoes = calloc(capacidade, 1);
+    moderacao->mascara = calloc(capacidade, 1);
+    if (moderacao->transicoes == NULL || moderacao->acoes == NULL || moderacao->mascara == NULL)
+    {
+        perror("\n Erro ao alocar o autômato de moderação");
+        fclose(arquivo);
+        libera_moderacao(moderacao);
+        return NULL;
+    }
+    moderacao->total_estados = 1;
+    memset(moderacao->transicoes, -1, moderacao->total_classes * sizeof(int));
+
+    rewind(arquivo);
+    while (fgets(linha, sizeof(linha), arquivo) != NULL)
+    {
+        if ((acao = le_termo_moderacao(linha, termo)) <= 0)
+        {
+            continue;
+        }
+
+        estado = 0;
+        for (i = 0; termo[i] != '\0'; i++)
+        {
+            c = moderacao->classe[(unsigned char)termo[i]];
+            proximo = moderacao->transicoes[estado * moderacao->total_classes + c];
+
+            if (proximo < 0)
+            {
+                if (moderacao->total_estados == capacidade)
+                {
+                    // Cada bloco só é trocado se o seu realloc deu certo, para que a liberação não perca nenhum
+                    capacidade *= 2;
+                    transicoes = realloc(moderacao->transicoes, (size_t)capacidade * moderacao->total_classes * sizeof(int));
+                    if (transicoes != NULL)
+                    {
+                        moderacao->transicoes = transicoes;
+                    }
+                    acoes = realloc(moderacao->acoes, capacidade);
+                    if (acoes != NULL)
+                    {
+                        moderacao->acoes = acoes;
+                    }
+                    mascara = realloc(moderacao->mascara, capacidade);
+                    if (mascara != NULL)
+                    {
+                        moderacao->mascara = mascara;
+                    }
+
+                    if (transicoes == NULL || acoes == NULL || mascara == NULL)
+                    {
+                        perror("\n Erro ao ampliar o autômato de moderação");
+                        fclose(arquivo);
+                        libera_moderacao(moderacao);
+                        return NULL;
+                    }
+                }
+
+                proximo = moderacao->total_estados++;
+                memset(&moderacao->transicoes[proximo * moderacao->total_classes], -1, moderacao->total_classes * sizeof(int));
+                moderacao->acoes[proximo] = 0;
+                moderacao->mascara[proximo] = 0;
+                moderacao->transicoes[estado * moderacao->total_classes + c] = proximo;
+            }
+
+            estado = proximo;
+        }
+
+        moderacao->acoes[estado] |= acao;
+        if (acao == MODERACAO_MASCARAR)
+        {
+            moderacao->mascara[estado] = i;
+        }
+    }
+
+    fclose(arquivo);
+
+    // Busca em largura: calcula a falha de cada estado e completa as transições que faltam com as da
+    // falha, de modo que a busca nunca precisa voltar. Cada estado herda as ações dos seus sufixos
+    falha = calloc(moderacao->total_estados, sizeof(int));
+    fila = malloc(moderacao->total_estados * sizeof(int));
+    if (falha == NULL || fila == NULL)
+    {
+        perror("\n Erro ao alocar o autômato de moderação");
+        free(falha);
+        free(fila);
+        libera_moderacao(moderacao);
+        return NULL;
+    }
+    inicio_fila = fim_fila = 0;
+    fila[fim_fila++] = 0;
+
+    while (inicio_fila < fim_fila)
+    {
+        estado = fila[inicio_fila++];
+        novo = &moderacao->transicoes[estado * moderacao->total_classes];
+
+        for (c = 0; c < moderacao->total_classes; c++)
+        {
+            if (novo[c] < 0)
+            {
+                novo[c] = estado == 0 ? 0 : moderacao->transicoes[falha[estado] * moderacao->total_classes + c];
+                continue;
+            }
+
+            proximo = novo[c];
+            falha[proximo] = estado == 0 ? 0 : moderacao->transicoes[falha[estado] * moderacao->total_classes + c];
+            moderacao->acoes[proximo] |= moderacao->acoes[falha[proximo]];
+            if (moderacao->mascara[falha[proximo]] > moderacao->mascara[proximo])
+            {
+                moderacao->mascara[proximo] = moderacao->mascara[falha[proximo]];
+            }
+            fila[fim_fila++] = proximo;
+        }
+    }
+
+    free(falha);
+    free(fila);
+
+#ifdef MODO_DEBUGER
+    printf("\n Moderação compilada: %d termos, %d estados, %d classes\n", total_termos, moderacao->total_estados, moderacao->total_classes);
+#endif
+
+    return moderacao;
+}
+
+// Posição do primeiro byte a partir de inicio que pode iniciar um termo, ou tamanho se não há nenhum.
+// Um byte passa pelo filtro se os seus quatro bits baixos e altos marcam o mesmo grupo; o filtro admite
+// falsos positivos, que apenas levam o autômato a um passo a mais
+int proximo_candidato(const Moderacao *moderacao, const unsigned char *texto, int inicio, int tamanho)
+{
+    for (; inicio < tamanho; inicio++)
+    {
+        if (moderacao->filtro_baixo[texto[inicio] & 0x0f] & moderacao->filtro_alto[texto[inicio] >> 4])
+        {
+            break;
+        }
+    }
+
+    return inicio;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Mesmo filtro, 16 bytes por vez: cada metade do byte indexa a sua tabela com pshufb
+__attribute__((target("ssse3"))) int proximo_candidato_ssse3(const Moderacao *moderacao, const unsigned char *texto, int inicio, int tamanho)
+{
+    int candidatos;
+    __m128i bloco, grupos;
+    __m128i baixo = _mm_loadu_si128((const __m128i *)moderacao->filtro_baixo);
+    __m128i alto = _mm_loadu_si128((const __m128i *)moderacao->filtro_alto);
+    __m128i quatro_bits = _mm_set1_epi8(0x0f);
+
+    for (; inicio + 16 <= tamanho; inicio += 16)
+    {
+        bloco = _mm_loadu_si128((const __m128i *)(texto + inicio));
+        grupos = _mm_and_si128(_mm_shuffle_epi8(baixo, _mm_and_si128(bloco, quatro_bits)),
+                               _mm_shuffle_epi8(alto, _mm_and_si128(_mm_srli_epi16(bloco, 4), quatro_bits)));
+        candidatos = _mm_movemask_epi8(_mm_cmpeq_epi8(grupos, _mm_setzero_si128())) ^ 0xffff;
+
+        if (candidatos)
+        {
+            return inicio + __builtin_ctz(candidatos);
+        }
+    }
+
+    return proximo_candidato(moderacao, texto, inicio, tamanho);
+}
+#endif
+
+// Etapa de moderação: percorre o texto uma única vez com o autômato. Termos a mascarar são trocados por
+// '*'; a mensagem com termo a bloquear é descartada e a com termo a marcar é registrada no log
+int modera_mensagem(char texto[], const char sala[])
+{
+    int i, j, tamanho, estado = 0, acoes = 0;
+    unsigned char *bytes = (unsigned char *)texto;
+    Moderacao *moderacao;
+
+    pthread_mutex_lock(&trava_moderacao);
+    moderacao = moderacao_atual;
+    if (moderacao != NULL)
+    {
+        atomic_fetch_add(&moderacao->referencias, 1);
+    }
+    pthread_mutex_unlock(&trava_moderacao);
+
+    if (moderacao == NULL)
+    {
+        return 1;
+    }
+
+    tamanho = strlen(texto);
+
+    for (i = 0; i < tamanho; i++)
+    {
+        // Na raiz, o autômato só sai do lugar com um byte que inicia algum termo
+        if (estado == 0)
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            i = usar_ssse3 ? proximo_candidato_ssse3(moderacao, bytes, i, tamanho) : proximo_candidato(moderacao, bytes, i, tamanho);
+#else
+            i = proximo_candidato(moderacao, bytes, i, tamanho);
+#endif
+            if (i == tamanho)
+            {
+                break;
+            }
+        }
+
+        estado = moderacao->transicoes[estado * moderacao->total_classes + moderacao->classe[bytes[i]]];
+        acoes |= moderacao->acoes[estado];
+
+        // O texto já percorrido pode ser alterado sem afetar a busca
+        for (j = 0; j < moderacao->mascara[estado]; j++)
+        {
+            texto[i - j] = '*';
+        }
+    }
+
+    libera_moderacao(moderacao);
+
+    if (acoes & MODERACAO_BLOQUEAR)
+    {
+        fprintf(stderr, "\n Moderação: mensagem bloqueada na sala %s\n", sala);
+        return 0;
+    }
+
+    if (acoes & MODERACAO_MARCAR)
+    {
+        fprintf(stderr, "\n Moderação: mensagem marcada na sala %s: %s\n", sala, texto);
+    }
+
+    return 1;
+}
+
+// Compila o arquivo de moderação e troca o autômato em uso. As mensagens em análise terminam com o
+// autômato anterior, liberado pela última delas
+void *recarrega_moderacao(void *argumento)
+{
+    Moderacao *nova, *anterior;
+
+    nova = compila_moderacao(caminho_moderacao);
+    if (nova == NULL)
+    {
+        fprintf(stderr, "\n Moderação mantida com os termos anteriores\n");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&trava_moderacao);
+    anterior = moderacao_atual;
+    moderacao_atual = nova;
+    pthread_mutex_unlock(&trava_moderacao);
+
+    libera_moderacao(anterior);
+
+    return NULL;
+}
+
+// Recompila os termos de moderação numa thread, sem pausar o laço principal
+void pede_recarga_moderacao()
+{
+    pthread_t thread;
+
+    if (caminho_moderacao == NULL)
+    {
+        return;
+    }
+
+    if (pthread_create(&thread, NULL, recarrega_moderacao, NULL) != 0)
+    {
+        perror("\n Erro ao criar a thread de recarga da moderação");
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// Trata os sinais do sistema operacional entregues pelo signalfd como eventos do laço principal
+void verifica_sinais(fd_set *readfds)
+{
+    struct signalfd_siginfo info_sinal;
+
+    if (FD_ISSET(sinalfd, readfds) == 0)
+    {
+        return;
+    }
+
+    while (read(sinalfd, &info_sinal, sizeof(info_sinal)) == sizeof(info_sinal))
+    {
+#ifdef MODO_DEBUGER
+        printf("\n Recebi o sinal %d\n", info_sinal.ssi_signo);
+#endif
+
+        if (info_sinal.ssi_signo == SIGTERM || info_sinal.ssi_signo == SIGINT)
+        {
+            encerra_servidor_gradualmente();
+        }
+
+        if (info_sinal.ssi_signo == SIGHUP)
+        {
+            pede_recarga_moderacao();
+        }
+    }
+}
+
+// Insere o usuário no diretório. Nomes repetidos aparecem uma única vez nas consultas
+void diretorio_insere(const char nome[])
+{
+    int i, no = 0, anterior, filho;
+    int caminho[TAMANHO_NOME];
+
+    for (i = 0; nome[i] != '\0' && i < TAMANHO_NOME - 1; i++)
+    {
+        caminho[i] = no;
+        anterior = 0;
+        for (filho = diretorio[no].filho; filho != 0 && diretorio[filho].letra < (unsigned char)nome[i]; filho = diretorio[filho].irmao)
+        {
+            anterior = filho;
+        }
+
+        if (filho == 0 || diretorio[filho].letra != (unsigned char)nome[i])
+        {
+            if (nos_livres_diretorio != 0)
+            {
+                filho = nos_livres_diretorio;
+                nos_livres_diretorio = diretorio[filho].irmao;
+            }
+            else
+            {
+                filho = total_nos_diretorio++;
+            }
+
+            diretorio[filho].letra = nome[i];
+            diretorio[filho].filho = 0;
+            diretorio[filho].nomes = 0;
+            diretorio[filho].usuarios = 0;
+            diretorio[filho].irmao = anterior != 0 ? diretorio[anterior].irmao : diretorio[no].filho;
+            if (anterior != 0)
+            {
+                diretorio[anterior].irmao = filho;
+            }
+            else
+            {
+                diretorio[no].filho = filho;
+            }
+        }
+
+        no = filho;
+    }
+
+    // Um nome novo conta em todos os nós do caminho
+    if (diretorio[no].usuarios++ == 0)
+    {
+        diretorio[no].nomes++;
+        while (i-- > 0)
+        {
+            diretorio[caminho[i]].nomes++;
+        }
+    }
+}
+
+// Remove o usuário do diretório, liberando os nós que ficaram sem nenhum nome
+void diretorio_remove(const char nome[])
+{
+    int i, j, no = 0, anterior, filho, tamanho;
+    int caminho[TAMANHO_NOME];
+
+    for (i = 0; nome[i] != '\0' && i < TAMANHO_NOME - 1; i++)
+    {
+        caminho[i] = no;
+        for (filho = diretorio[no].filho; filho != 0 && diretorio[filho].letra != (unsigned char)nome[i]; filho = diretorio[filho].irmao)
+            ;
+
+        if (filho == 0)
+        {
+            return; // nome ausente
+        }
+        no = filho;
+    }
+    tamanho = i;
+
+    if (diretorio[no].usuarios == 0 || --diretorio[no].usuarios > 0)
+    {
+        return;
+    }
+
+    diretorio[no].nomes--;
+    for (i = tamanho - 1; i >= 0; i--)
+    {
+        diretorio[caminho[i]].nomes--;
+
+        // Nó sem nomes na subárvore sai da lista do pai e volta para a lista de livres
+        if (diretorio[no].nomes == 0)
+        {
+            anterior = 0;
+            for (j = diretorio[caminho[i]].filho; j != no; j = diretorio[j].irmao)
+            {
+                anterior = j;
+            }
+
+            if (anterior != 0)
+            {
+                diretorio[anterior].irmao = diretorio[no].irmao;
+            }
+            else
+            {
+                diretorio[caminho[i]].filho = diretorio[no].irmao;
+            }
+
+            diretorio[no].irmao = nos_livres_diretorio;
+            nos_livres_diretorio = no;
+        }
+
+        no = caminho[i];
+    }
+}
+
+// Percorre a subárvore em ordem alfabética, pulando os primeiros nomes pela contagem de cada subárvore, e
+// acrescenta à resposta até restantes nomes. O custo é proporcional à profundidade e ao tamanho da página
+void lista_diretorio(int no, char nome[], int profundidade, int *pular, int *restantes, char resposta[], int tamanho_resposta)
+{
+    int filho;
+
+    if (diretorio[no].usuarios > 0)
+    {
+        if (*pular > 0)
+        {
+            (*pular)--;
+        }
+        else
+        {
+            nome[profundidade] = '\0';
+            strncat(resposta, "\n", tamanho_resposta - strlen(resposta) - 1);
+            strncat(resposta, nome, tamanho_resposta - strlen(resposta) - 1);
+            (*restantes)--;
+        }
+    }
+
+    for (filho = diretorio[no].filho; filho != 0 && *restantes > 0; filho = diretorio[filho].irmao)
+    {
+        if (diretorio[filho].nomes <= *pular)
+        {
+            *pular -= diretorio[filho].nomes;
+            continue;
+        }
+
+        nome[profundidade] = diretorio[filho].letra;
+        lista_diretorio(filho, nome, profundidade + 1, pular, restantes, resposta, tamanho_resposta);
+    }
+}
+
+// Responde a consulta "/quem [prefixo] [página]" com uma página dos nomes de usuários conectados, neste e
+// nos demais servidores da federação, que começam com o prefixo. A resposta vai numa única mensagem, com
+// um nome por linha, e serve também ao autocompletar de menções
+void consulta_diretorio(int socket_cliente, const char prefixo[], int pagina)
+{
+    int i, no = 0, filho, pular, restantes = TAMANHO_PAGINA_DIRETORIO, total_paginas;
+    char nome[TAMANHO_NOME];
+    char resposta[TAMANHO_PAGINA_DIRETORIO * TAMANHO_NOME + TAMANHO_BUFFER];
+
+    for (i = 0; prefixo[i] != '\0' && no >= 0; i++)
+    {
+        for (filho = diretorio[no].filho; filho != 0 && diretorio[filho].letra != (unsigned char)prefixo[i]; filho = diretorio[filho].irmao)
+            ;
+        no = filho != 0 ? filho : -1;
+    }
+
+    total_paginas = no < 0 ? 0 : (diretorio[no].nomes + TAMANHO_PAGINA_DIRETORIO - 1) / TAMANHO_PAGINA_DIRETORIO;
+    snprintf(resposta, sizeof(resposta), "Usuários com prefixo '%s': %d, página %d de %d", prefixo, no < 0 ? 0 : diretorio[no].nomes, pagina, total_paginas);
+
+    if (no >= 0 && pagina >= 1)
+    {
+        strcpy(nome, prefixo);
+        pular = (pagina - 1) * TAMANHO_PAGINA_DIRETORIO;
+        lista_diretorio(no, nome, strlen(prefixo), &pular, &restantes, resposta, sizeof(resposta));
+    }
+
+    envia_mensagem(socket_cliente, resposta, strlen(resposta));
+}
+
+// Remove da lista de usuários remotos todos os usuários de um servidor
+void remove_remotos_no(int no)
+{
+    int i;
+
+    for (i = 0; i < MAX_REMOTOS; i++)
+    {
+        if (remotos[i].id_no == no)
+        {
+            diretorio_remove(remotos[i].nome);
+            remotos[i].id_no = 0;
+            remotos[i].nome[0] = '\0';
+        }
+    }
+}
+
+// Fecha um link com servidor par. Os usuários do servidor saem da lista se não houver outro link com ele
+void desfaz_link_par(int indice_par)
+{
+    int i, no = pares[indice_par].id_no;
+
+#ifdef MODO_DEBUGER
+    printf("\n Vou desfazer o link com o servidor %d\n", no);
+#endif
+
+    fecha_socket(pares[indice_par].socket);
+    pares[indice_par].socket = 0;
+    pares[indice_par].id_no = 0;
+
+    // Um link que caiu antes de se identificar não trouxe usuários nem assinaturas
+    if (no == 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < MAX_PARES; i++)
+    {
+        if (pares[i].socket > 0 && pares[i].id_no == no)
+        {
+            return;
+        }
+    }
+
+    remove_remotos_no(no);
+
+    for (i = 0; i < MAX_ASSINATURAS; i++)
+    {
+        if (assinaturas[i].id_no == no)
+        {
+            assinaturas[i].id_no = 0;
+        }
+    }
+
+    anel_desatualizado = 1;
+}
+
+// Envia uma mensagem a um servidor par, desfazendo o link em caso de falha
+void envia_par(int indice_par, char mensagem[])
+{
+    if (pares[indice_par].socket <= 0)
+    {
+        return;
+    }
+
+    if (envia_mensagem(pares[indice_par].socket, mensagem, strlen(mensagem)) <= 0)
+    {
+        perror("\n Erro ao enviar a mensagem ao servidor par");
+        desfaz_link_par(indice_par);
+    }
+}
+
+// Envia a mensagem uma única vez a cada servidor par, mesmo que haja mais de um link com ele
+void envia_todos_pares(char mensagem[])
+{
+    int i, j, repetido;
+
+    for (i = 0; i < MAX_PARES; i++)
+    {
+        if (pares[i].socket <= 0 || pares[i].id_no == 0)
+        {
+            continue;
+        }
+
+        repetido = 0;
+        for (j = 0; j < i; j++)
+        {
+            if (pares[j].socket > 0 && pares[j].id_no == pares[i].id_no)
+            {
+                repetido = 1;
+                break;
+            }
+        }
+
+        if (!repetido)
+        {
+            envia_par(i, mensagem);
+        }
+    }
+}
+
+// Informa aos servidores pares a entrada ou saída de um usuário local
+void anuncia_usuario(const char *evento, const char nome[])
+{
+    char mensagem[TAMANHO_BUFFER_PAR];
+
+    snprintf(mensagem, TAMANHO_BUFFER_PAR, "%s %d %s", evento, id_no, nome);
+    envia_todos_pares(mensagem);
+}
+
+// Retorna o link ativo com um servidor da federação, ou -1 se não houver
+int indice_par_no(int no)
+{
+    int i;
+
+    for (i = 0; i < MAX_PARES; i++)
+    {
+        if (pares[i].socket > 0 && pares[i].id_no == no)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Ordena os pontos do anel pelo hash
+int compara_pontos_anel(const void *a, const void *b)
+{
+    const PontoAnel *pa = a, *pb = b;
+
+    if (pa->hash != pb->hash)
+    {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+
+    return pa->id_no - pb->id_no;
+}
+
+// Retorna o servidor casa da sala: o dono do primeiro ponto do anel a partir do hash do nome da sala
+int dono_sala(const char sala[])
+{
+    int inicio = 0, fim = tamanho_anel;
+    unsigned int hash = hash_texto(sala);
+
+    if (tamanho_anel == 0)
+    {
+        return id_no;
+    }
+
+    // Busca binária pelo primeiro ponto com hash maior ou igual ao da sala
+    while (inicio < fim)
+    {
+        int meio = (inicio + fim) / 2;
+
+        if (anel[meio].hash < hash)
+        {
+            inicio = meio + 1;
+        }
+        else
+        {
+            fim = meio;
+        }
+    }
+
+    return anel[inicio == tamanho_anel ? 0 : inicio].id_no;
+}
+
+// Conta os clientes deste servidor que estão na sala
+int membros_locais_sala(const char sala[], Cliente clientes_aprovados[])
+{
+    int i, membros = 0;
+
+    for (i = 0; i < limite_clientes; i++)
+    {
+        if (clientes_aprovados[i].socket != 0 && !strcmp(clientes_aprovados[i].sala, sala))
+        {
+            membros++;
+        }
+    }
+
+    return membros;
+}
+
+// Informa ao servidor casa da sala que este servidor passou a ter (ASSINA) ou deixou de ter (CANCELA) membros nela
+void envia_assinatura(const char *evento, const char sala[])
+{
+    int indice_par, casa = dono_sala(sala);
+    char mensagem[TAMANHO_BUFFER_PAR];
+
+    if (casa == id_no || (indice_par = indice_par_no(casa)) < 0)
+    {
+        return;
+    }
+
+    snprintf(mensagem, TAMANHO_BUFFER_PAR, "%s %d %s", evento, id_no, sala);
+    envia_par(indice_par, mensagem);
+}
+
+// Registra ou remove a assinatura de um servidor numa sala da qual este servidor é casa
+void atualiza_assinatura(int no, const char sala[], int assinar)
+{
+    int i, livre = -1;
+
+    for (i = 0; i < MAX_ASSINATURAS; i++)
+    {
+        if (assinaturas[i].id_no == no && !strcmp(assinaturas[i].sala, sala))
+        {
+            if (!assinar)
+            {
+                assinaturas[i].id_no = 0;
+            }
+            return;
+        }
+
+        if (assinaturas[i].id_no == 0 && livre < 0)
+        {
+            livre = i;
+        }
+    }
+
+    if (assinar && livre >= 0)
+    {
+        assinaturas[livre].id_no = no;
+        strncpy(assinaturas[livre].sala, sala, TAMANHO_SALA - 1);
+        assinaturas[livre].sala[TAMANHO_SALA - 1] = '\0';
+    }
+}
+
+// Refaz o anel com este servidor e os pares identificados. Apenas as salas dos pontos que mudaram trocam de casa,
+// então as assinaturas são descartadas onde este servidor deixou de ser casa e reenviadas às casas atuais
+void atualiza_anel(Cliente clientes_aprovados[])
+{
+    int i, j, k;
+    char ponto[32];
+
+    if (!anel_desatualizado)
+    {
+        return;
+    }
+
+    anel_desatualizado = 0;
+    tamanho_anel = 0;
+
+    for (i = -1; i < MAX_PARES; i++)
+    {
+        int no = i < 0 ? id_no : pares[i].id_no;
+
+        if (i >= 0 && (pares[i].socket <= 0 || no == 0 || indice_par_no(no) != i))
+        {
+            continue;
+        }
+
+        for (k = 0; k < NOS_VIRTUAIS; k++)
+        {
+            snprintf(ponto, sizeof(ponto), "%d#%d", no, k);
+            anel[tamanho_anel].hash = hash_texto(ponto);
+            anel[tamanho_anel].id_no = no;
+            tamanho_anel++;
+        }
+    }
+
+    qsort(anel, tamanho_anel, sizeof(PontoAnel), compara_pontos_anel);
+
+#ifdef MODO_DEBUGER
+    printf("\n Anel refeito com %d pontos\n", tamanho_anel);
+#endif
+
+    for (i = 0; i < MAX_ASSINATURAS; i++)
+    {
+        if (assinaturas[i].id_no != 0 && dono_sala(assinaturas[i].sala) != id_no)
+        {
+            assinaturas[i].id_no = 0;
+        }
+    }
+
+    // Cada sala com membros locais é assinada uma vez, na primeira posição em que aparece
+    for (i = 0; i < limite_clientes; i++)
+    {
+        if (clientes_aprovados[i].socket == 0)
+        {
+            continue;
+        }
+
+        for (j = 0; j < i; j++)
+        {
+            if (clientes_aprovados[j].socket != 0 && !strcmp(clientes_aprovados[j].sala, clientes_aprovados[i].sala))
+            {
+                break;
+            }
+        }
+
+        if (j == i)
+        {
+            envia_assinatura("ASSINA", clientes_aprovados[i].sala);
+        }
+    }
+}
+
+// Registra a sequência recebida de um servidor de origem numa sala. Retorna 0 se ela já foi entregue antes
+int registra_sequencia(int origem, const char sala[], unsigned long long sequencia)
+{
+    int i, livre = -1;
+    unsigned int hash = hash_texto(sala);
+
+    for (i = 0; i < MAX_ORIGENS; i++)
+    {
+        if (origens[i].id_no == origem && origens[i].hash_sala == hash)
+        {
+            if (sequencia <= origens[i].ultima_seq)
+            {
+                return 0;
+            }
+
+            origens[i].ultima_seq = sequencia;
+            return 1;
+        }
+
+        if (origens[i].id_no == 0 && livre < 0)
+        {
+            livre = i;
+        }
+    }
+
+    // Com a tabela cheia, uma entrada é reaproveitada: no pior caso uma repetição deixa de ser detectada
+    if (livre < 0)
+    {
+        livre = hash % MAX_ORIGENS;
+    }
+
+    origens[livre].id_no = origem;
+    origens[livre].hash_sala = hash;
+    origens[livre].ultima_seq = sequencia;
+
+    return 1;
+}
+
+// Guarda a mensagem no histórico e retorna a sequência atribuída a ela
+unsigned long long registra_historico(unsigned long long token_remetente, const char sala[], char buffer[])
+{
+    Historico *entrada = &historico[++sequencia_historico % TAMANHO_HISTORICO];
+
+    entrada->sequencia = sequencia_historico;
+    entrada->token_remetente = token_remetente;
+    strncpy(entrada->sala, sala, TAMANHO_SALA - 1);
+    entrada->sala[TAMANHO_SALA - 1] = '\0';
+    strncpy(entrada->texto, buffer, TAMANHO_BUFFER - 1);
+    entrada->texto[TAMANHO_BUFFER - 1] = '\0';
+
+    return sequencia_historico;
+}
+
+// Envia uma mensagem da sala ao cliente. Clientes com sessão retomável recebem também a sequência,
+// que informam ao retomar a sessão
+int envia_mensagem_sala(Cliente *cliente, unsigned long long sequencia, char buffer[])
+{
+    char mensagem[TAMANHO_BUFFER_PAR];
+
+    if (cliente->token == 0)
+    {
+        return enfileira_lote(cliente->socket, buffer, strlen(buffer));
+    }
+
+    snprintf(mensagem, TAMANHO_BUFFER_PAR, MARCA_MENSAGEM "%llu %s", sequencia, buffer);
+
+    return enfileira_lote(cliente->socket, mensagem, strlen(mensagem));
+}
+
+// Gera um token de retomada imprevisível e diferente de zero
+unsigned long long gera_token()
+{
+    unsigned long long token = 0;
+
+    while (token == 0)
+    {
+        if (getrandom(&token, sizeof(token), 0) != sizeof(token))
+        {
+            token = ((unsigned long long)rand() << 32) ^ rand() ^ agora_ms();
+        }
+    }
+
+    return token;
+}
+
+// Guarda a sessão do cliente que se desconectou para que ela possa ser retomada dentro do prazo
+void suspende_sessao(Cliente *cliente)
+{
+    int i, escolhida = 0;
+    long long agora = agora_ms();
+
+    if (cliente->token == 0 || cliente->nome[0] == '\0')
+    {
+        return;
+    }
+
+    // Usa uma posição livre ou expirada; sem nenhuma, substitui a que expira primeiro
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (suspensas[i].token == 0 || suspensas[i].expira_ms <= agora)
+        {
+            escolhida = i;
+            break;
+        }
+
+        if (suspensas[i].expira_ms < suspensas[escolhida].expira_ms)
+        {
+            escolhida = i;
+        }
+    }
+
+    suspensas[escolhida].token = cliente->token;
+    troca_nome(&suspensas[escolhida].nome, cliente->nome);
+    troca_nome(&suspensas[escolhida].sala, cliente->sala);
+    suspensas[escolhida].ultimo_ack = cliente->ultimo_ack;
+    suspensas[escolhida].expira_ms = agora + PRAZO_RETOMADA_MS;
+
+#ifdef MODO_DEBUGER
+    printf("\n Sessão de %s suspensa para retomada\n", cliente->nome);
+#endif
+}
+
+// Envia ao cliente que retomou a sessão as mensagens da sua sala posteriores à última sequência que ele recebeu
+int envia_lacuna(Cliente *cliente, unsigned long long ultima_seq)
+{
+    unsigned long long sequencia, primeira = ultima_seq + 1;
+    char aviso[TAMANHO_BUFFER];
+    Historico *entrada;
+
+    if (sequencia_historico >= TAMANHO_HISTORICO && primeira <= sequencia_historico - TAMANHO_HISTORICO)
+    {
+        primeira = sequencia_historico - TAMANHO_HISTORICO + 1;
+        strncpy(aviso, "Algumas mensagens enviadas durante a desconexão não estão mais disponíveis.", TAMANHO_BUFFER);
+
+        if (envia_mensagem(cliente->socket, aviso, strlen(aviso)) <= 0)
+        {
+            return -1;
+        }
+    }
+
+    for (sequencia = primeira; sequencia <= sequencia_historico; sequencia++)
+    {
+        entrada = &historico[sequencia % TAMANHO_HISTORICO];
+
+        if (entrada->sequencia != sequencia || entrada->token_remetente == cliente->token || strcmp(entrada->sala, cliente->sala))
+        {
+            continue;
+        }
+
+        if (envia_mensagem_sala(cliente, sequencia, entrada->texto) <= 0)
+        {
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+// Envia a mensagem aos clientes deste servidor que estão na sala, exceto ao remetente, e a guarda no histórico e no log da busca.
+// O remetente é reconhecido pela posição e pelo identificador da conexão, e não pelo descritor, que pode já ter
+// sido reusado por outro cliente quando a mensagem sai da pool; -1 como posição não exclui ninguém
+void broadcast_sala(int indice_remetente, unsigned int conexao_remetente, unsigned long long token_remetente, const char sala[], char buffer[], Cliente clientes_aprovados[])
+{
+    int i, dest_socket;
+    unsigned long long sequencia = registra_historico(token_remetente, sala, buffer);
+
+    registra_busca(sala, buffer);
+
+    for (i = 0; i < limite_clientes; i++)
+    {
+        dest_socket = clientes_aprovados[i].socket;
+        if (dest_socket == 0 || (i == indice_remetente && identificador_conexao[i] == conexao_remetente) || strcmp(clientes_aprovados[i].sala, sala))
+        {
+            continue;
+        }
+        if (envia_mensagem_sala(&clientes_aprovados[i], sequencia, buffer) <= 0)
+        {
+            derruba_destinatario(dest_socket);
+        }
+    }
+}
+
+// Encaminha a mensagem de uma sala pela federação. Um servidor que não é casa da sala envia apenas à casa;
+// a casa repassa a cada servidor assinante, exceto ao de origem. Assim o tráfego entre servidores
+// cresce com o número de servidores que têm membros na sala, e não com o tamanho da federação
+void encaminha_sala(int origem, unsigned long long sequencia, const char sala[], char buffer[])
+{
+    int i, indice_par, casa = dono_sala(sala);
+    char mensagem[TAMANHO_BUFFER_PAR];
+
+    snprintf(mensagem, TAMANHO_BUFFER_PAR, "MSG %d %llu %s %s", origem, sequencia, sala, buffer);
+
+    if (casa != id_no)
+    {
+        if (origem == id_no && (indice_par = indice_par_no(casa)) >= 0)
+        {
+            envia_par(indice_par, mensagem);
+        }
+        return;
+    }
+
+    for (i = 0; i < MAX_ASSINATURAS; i++)
+    {
+        if (assinaturas[i].id_no == 0 || assinaturas[i].id_no == origem || strcmp(assinaturas[i].sala, sala))
+        {
+            continue;
+        }
+
+        if ((indice_par = indice_par_no(assinaturas[i].id_no)) >= 0)
+        {
+            envia_par(indice_par, mensagem);
+        }
+    }
+}
+
+// Move o cliente para outra sala, atualizando as assinaturas nas casas das salas envolvidas
+void entra_sala(int indice_cliente, const char sala[], Cliente clientes_aprovados[])
+{
+    char sala_anterior[TAMANHO_SALA];
+
+    snprintf(sala_anterior, TAMANHO_SALA, "%s", clientes_aprovados[indice_cliente].sala);
+    troca_nome(&clientes_aprovados[indice_cliente].sala, sala);
+
+    if (sala_anterior[0] != '\0' && membros_locais_sala(sala_anterior, clientes_aprovados) == 0)
+    {
+        envia_assinatura("CANCELA", sala_anterior);
+    }
+
+    if (membros_locais_sala(sala, clientes_aprovados) == 1)
+    {
+        envia_assinatura("ASSINA", sala);
+    }
+}
+
+// Retira o cliente da sala em que está, cancelando a assinatura se ele era o último membro local
+void sai_sala(int indice_cliente, Cliente clientes_aprovados[])
+{
+    char sala_anterior[TAMANHO_SALA];
+
+    snprintf(sala_anterior, TAMANHO_SALA, "%s", clientes_aprovados[indice_cliente].sala);
+    troca_nome(&clientes_aprovados[indice_cliente].sala, "");
+
+    if (sala_anterior[0] != '\0' && membros_locais_sala(sala_anterior, clientes_aprovados) == 0)
+    {
+        envia_assinatura("CANCELA", sala_anterior);
+    }
+}
+
+// Envia ao link recém estabelecido a identificação deste servidor e seus usuários aprovados
+void apresenta_no(int indice_par, Cliente clientes_aprovados[])
+{
+    int i;
+    char mensagem[TAMANHO_BUFFER_PAR];
+
+    snprintf(mensagem, TAMANHO_BUFFER_PAR, "%s%d %s", MARCA_PAR, id_no, segredo_pares);
+    envia_par(indice_par, mensagem);
+
+    for (i = 0; i < limite_clientes && pares[indice_par].socket > 0; i++)
+    {
+        if (clientes_aprovados[i].socket == 0)
+        {
+            continue;
+        }
+
+        snprintf(mensagem, TAMANHO_BUFFER_PAR, "ENTRA %d %s", id_no, clientes_aprovados[i].nome);
+        envia_par(indice_par, mensagem);
+    }
+}
+
+// Registra um par configurado com -P no formato endereco:porta
+void adiciona_par_configurado(char *endereco_porta)
+{
+    int i;
+    char *separador = strrchr(endereco_porta, ':');
+
+    if (separador == NULL)
+    {
+        fprintf(stderr, "Par inválido, use endereco:porta: %s\n", endereco_porta);
+        exit(1);
+    }
+
+    for (i = 0; i < MAX_PARES; i++)
+    {
+        if (pares[i].endereco[0] != '\0')
+        {
+            continue;
+        }
+
+        *separador = '\0';
+        strncpy(pares[i].endereco, endereco_porta, TAMANHO_NOME - 1);
+        pares[i].porta = atoi(separador + 1);
+        return;
+    }
+
+    fprintf(stderr, "Limite de %d pares atingido\n", MAX_PARES);
+    exit(1);
+}
+
+// Inicia a conexão com os pares configurados que estão sem link. O connect não bloqueia e o restante do
+// estabelecimento segue pelos eventos do select, em trata_conexoes_pares; um par indisponível é tentado de novo mais tarde
+void conecta_pares()
+{
+    int i, socket_par;
+    char porta[16];
+    struct addrinfo dicas, *enderecos;
+
+    if (agora_ms() < proxima_conexao_pares)
+    {
+        return;
+    }
+
+    proxima_conexao_pares = agora_ms() + INTERVALO_RECONEXAO_PAR_MS;
+
+    memset(&dicas, 0, sizeof(dicas));
+    dicas.ai_family = AF_INET;
+    dicas.ai_socktype = SOCK_STREAM;
+
+    for (i = 0; i < MAX_PARES; i++)
+    {
+        if (pares[i].endereco[0] == '\0' || pares[i].socket > 0 || pares[i].socket_conexao > 0)
+        {
+            continue;
+        }
+
+        snprintf(porta, sizeof(porta), "%d", pares[i].porta);
+        if (getaddrinfo(pares[i].endereco, porta, &dicas, &enderecos) != 0)
+        {
+            continue;
+        }
+
+        socket_par = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (socket_par < 0 || (connect(socket_par, enderecos->ai_addr, enderecos->ai_addrlen) < 0 && errno != EINPROGRESS))
+        {
+            if (socket_par >= 0)
+            {
+                close(socket_par);
+            }
+            freeaddrinfo(enderecos);
+            continue;
+        }
+
+        freeaddrinfo(enderecos);
+
+        // Mesmo um connect concluído de imediato passa pelo select, que o informa como pronto para escrita
+        pares[i].socket_conexao = socket_par;
+        pares[i].etapa_conexao = PAR_CONECTANDO;
+        pares[i].prazo_conexao_ms = agora_ms() + PRAZO_CONEXAO_PAR_MS;
+    }
+}
+
+// Acrescenta ao select os links com pares em estabelecimento: para escrita enquanto o connect não
+// termina, conforme o que o handshake TLS aguarda, e para leitura enquanto as boas vindas não chegam
+void prepara_conexoes_pares(fd_set *readfds, fd_set *writefds, int *max_socket_cliente)
+{
+    int i, escrita;
+
+    for (i = 0; i < MAX_PARES; i++)
+    {
+        if (pares[i].socket_conexao <= 0)
+        {
+            continue;
+        }
+
+        escrita = pares[i].etapa_conexao == PAR_CONECTANDO || (pares[i].etapa_conexao == PAR_TLS && pares[i].tls_quer_escrita);
+        FD_SET(pares[i].socket_conexao, escrita ? writefds : readfds);
+        if (pares[i].socket_conexao > *max_socket_cliente)
+        {
+            *max_socket_cliente = pares[i].socket_conexao;
+        }
+    }
+}
+
+// Desiste de um link com par em estabelecimento; o par é tentado de novo na próxima reconexão
+void desiste_conexao_par(int indice_par)
+{
+#ifdef MODO_DEBUGER
+    printf("\n Não consegui conectar ao servidor par %s:%d\n", pares[indice_par].endereco, pares[indice_par].porta);
+#endif
+
+    fecha_socket(pares[indice_par].socket_conexao);
+    pares[indice_par].socket_conexao = 0;
+}
+
+// Avança os links com pares em estabelecimento conforme os eventos do select. Concluídos o connect e o
+// handshake TLS, o socket volta ao modo bloqueante, como os demais lidos pelo laço; as boas vindas do outro
+// servidor, que trata a conexão como um cliente novo, chegam como uma leitura qualquer e são descartadas.
+// Um link que não se estabelece no prazo é desfeito e tentado de novo
+void trata_conexoes_pares(fd_set *readfds, fd_set *writefds, Cliente clientes_aprovados[])
+{
+    int i, socket_par, erro;
+    socklen_t tamanho_erro;
+    char boas_vindas[TAMANHO_BUFFER_PAR];
+
+    for (i = 0; i < MAX_PARES; i++)
+    {
+        socket_par = pares[i].socket_conexao;
+        if (socket_par <= 0)
+        {
+            continue;
+        }
+
+        if (agora_ms() >= pares[i].prazo_conexao_ms)
+        {
+            desiste_conexao_par(i);
+            continue;
+        }
+
+        if (pares[i].etapa_conexao == PAR_CONECTANDO)
+        {
+            if (FD_ISSET(socket_par, writefds) == 0)
+            {
+                continue;
+            }
+
+            tamanho_erro = sizeof(erro);
+            if (getsockopt(socket_par, SOL_SOCKET, SO_ERROR, &erro, &tamanho_erro) < 0 || erro != 0)
+            {
+                desiste_conexao_par(i);
+                continue;
+            }
+
+#ifdef COM_TLS
+            // Com TLS ativo, a federação inteira usa TLS: os links com os pares também são cifrados
+            if (tls_contexto_pares != NULL)
+            {
+                if (inicia_handshake(socket_par, tls_contexto_pares, 0) < 0)
+                {
+                    desiste_conexao_par(i);
+                    continue;
+                }
+
+                // O socket acabou de ficar pronto para escrita, e o ClientHello segue no próximo select
+                pares[i].etapa_conexao = PAR_TLS;
+                pares[i].tls_quer_escrita = 1;
+                continue;
+            }
+#endif
+
+            fcntl(socket_par, F_SETFL, fcntl(socket_par, F_GETFL) & ~O_NONBLOCK);
+            pares[i].etapa_conexao = PAR_BOAS_VINDAS;
+            continue;
+        }
+
+#ifdef COM_TLS
+        if (pares[i].etapa_conexao == PAR_TLS)
+        {
+            if (FD_ISSET(socket_par, pares[i].tls_quer_escrita ? writefds : readfds) == 0)
+            {
+                continue;
+            }
+
+            erro = avanca_handshake(socket_par, &pares[i].tls_quer_escrita);
+            if (erro < 0)
+            {
+                desiste_conexao_par(i);
+            }
+            else if (erro == 1)
+            {
+                pares[i].etapa_conexao = PAR_BOAS_VINDAS;
+            }
+            continue;
+        }
+#endif
+
+        if (FD_ISSET(socket_par, readfds) == 0)
+        {
+            continue;
+        }
+
+        memset(boas_vindas, 0, TAMANHO_BUFFER_PAR);
+        if (recebe_mensagem(socket_par, boas_vindas, TAMANHO_BUFFER_PAR, NULL) <= 0)
+        {
+            desiste_conexao_par(i);
+            continue;
+        }
+
+#ifdef MODO_DEBUGER
+        printf("\n Conectei ao servidor par %s:%d\n", pares[i].endereco, pares[i].porta);
+#endif
+
+        pares[i].socket_conexao = 0;
+        pares[i].socket = socket_par;
+        pares[i].id_no = 0;
+        apresenta_no(i, clientes_aprovados);
+    }
+}
+
+// Confere a identificação de um servidor par, "\001PAR <id> <segredo>". Retorna o id do par, ou 0 se este
+// servidor não aceita pares (sem -K), se o segredo não confere ou se o id é inválido
+int identifica_par(const char buffer[])
+{
+    int no, inicio_segredo = 0;
+    size_t i, tamanho_segredo;
+    unsigned char diferenca = 0;
+    const char *segredo;
+
+    if (segredo_pares == NULL || sscanf(buffer + strlen(MARCA_PAR), "%d %n", &no, &inicio_segredo) != 1 || inicio_segredo == 0 || no <= 0 || no == id_no)
+    {
+        return 0;
+    }
+
+    segredo = buffer + strlen(MARCA_PAR) + inicio_segredo;
+    tamanho_segredo = strlen(segredo_pares);
+    if (strlen(segredo) != tamanho_segredo)
+    {
+        return 0;
+    }
+
+    // Comparação em tempo constante, para o tempo da resposta não revelar quantos caracteres conferem
+    for (i = 0; i < tamanho_segredo; i++)
+    {
+        diferenca |= segredo[i] ^ segredo_pares[i];
+    }
+
+    return diferenca == 0 ? no : 0;
+}
+
+// Converte a conexão de um cliente pendente que se identificou como servidor par em link da federação
+void promove_par(int indice_cliente, int clientes_pendentes[], Cliente clientes_aprovados[], int no)
+{
+    int i, socket_par = clientes_pendentes[indice_cliente];
+
+    libera_posicao_cliente(indice_cliente);
+    clientes_pendentes[indice_cliente] = 0;
+    clientes_aprovados[indice_cliente].socket = 0;
+    troca_nome(&clientes_aprovados[indice_cliente].nome, "");
+
+    for (i = 0; i < MAX_PARES; i++)
+    {
+        if (pares[i].socket == 0 && pares[i].endereco[0] == '\0')
+        {
+            break;
+        }
+    }
+
+    if (i == MAX_PARES)
+    {
+        perror("\n Limite de servidores pares atingido");
+        fecha_socket(socket_par);
+        return;
+    }
+
+    pares[i].socket = socket_par;
+    pares[i].id_no = no;
+    anel_desatualizado = 1;
+
+#ifdef MODO_DEBUGER
+    printf("\n Servidor %d se conectou como par\n", pares[i].id_no);
+#endif
+
+    apresenta_no(i, clientes_aprovados);
+}
+
+// Trata uma mensagem recebida de um servidor par: identificação, entrada e saída de usuários ou repasse de mensagens
+void trata_mensagem_par(int indice_par, char buffer[])
+{
+    int i, origem, deslocamento;
+    unsigned long long sequencia;
+    char nome[TAMANHO_NOME];
+    char sala[TAMANHO_SALA];
+
+    // O outro lado também prova que pertence à federação, e nada é aceito de um link antes disso
+    if (!strncmp(buffer, MARCA_PAR, strlen(MARCA_PAR)) || pares[indice_par].id_no == 0)
+    {
+        origem = !strncmp(buffer, MARCA_PAR, strlen(MARCA_PAR)) ? identifica_par(buffer) : 0;
+        if (origem == 0)
+        {
+            perror("\n Servidor par não se identificou com o segredo da federação");
+            desfaz_link_par(indice_par);
+            return;
+        }
+
+        pares[indice_par].id_no = origem;
+        anel_desatualizado = 1;
+        return;
+    }
+
+    if (sscanf(buffer, "MSG %d %llu %32s %n", &origem, &sequencia, sala, &deslocamento) == 3)
+    {
+        // Mensagens próprias ou já entregues são descartadas, evitando laços durante mudanças no anel
+        if (origem == id_no || !registra_sequencia(origem, sala, sequencia))
+        {
+            return;
+        }
+
+        broadcast_sala(-1, 0, 0, sala, buffer + deslocamento, clientes_aprovados);
+        encaminha_sala(origem, sequencia, sala, buffer + deslocamento);
+        return;
+    }
+
+    if (sscanf(buffer, "ASSINA %d %32s", &origem, sala) == 2)
+    {
+        atualiza_assinatura(origem, sala, 1);
+        return;
+    }
+
+    if (sscanf(buffer, "CANCELA %d %32s", &origem, sala) == 2)
+    {
+        atualiza_assinatura(origem, sala, 0);
+        return;
+    }
+
+    if (sscanf(buffer, "ENTRA %d %100[^\n]", &origem, nome) == 2)
+    {
+        // Com mais de um link com o mesmo servidor, como entre pares que se configuram mutuamente, a
+        // apresentação chega por todos eles
+        for (i = 0; i < MAX_REMOTOS; i++)
+        {
+            if (remotos[i].id_no == origem && !strcmp(remotos[i].nome, nome))
+            {
+                return;
+            }
+        }
+
+        for (i = 0; i < MAX_REMOTOS; i++)
+        {
+            if (remotos[i].id_no == 0)
+            {
+                remotos[i].id_no = origem;
+                strncpy(remotos[i].nome, nome, TAMANHO_NOME);
+                diretorio_insere(nome);
+                break;
+            }
+        }
+        return;
+    }
+
+    if (sscanf(buffer, "SAI %d %100[^\n]", &origem, nome) == 2)
+    {
+        for (i = 0; i < MAX_REMOTOS; i++)
+        {
+            if (remotos[i].id_no == origem && !strcmp(remotos[i].nome, nome))
+            {
+                diretorio_remove(nome);
+                remotos[i].id_no = 0;
+                remotos[i].nome[0] = '\0';
+                break;
+            }
+        }
+    }
+}
+
+// Verifica se há mensagens nos links com os servidores pares
+void trata_pares(fd_set *readfds)
+{
+    int i;
+    char buffer[TAMANHO_BUFFER_PAR];
+
+    for (i = 0; i < MAX_PARES; i++)
+    {
+        if (pares[i].socket <= 0 || FD_ISSET(pares[i].socket, readfds) == 0)
+        {
+            continue;
+        }
+
+        memset(buffer, 0, TAMANHO_BUFFER_PAR);
+
+        if (recebe_mensagem(pares[i].socket, buffer, TAMANHO_BUFFER_PAR, NULL) <= 0)
+        {
+            desfaz_link_par(i);
+            continue;
+        }
+
+#ifdef MODO_DEBUGER
+        printf("\n Mensagem do servidor par %d: %s\n", pares[i].id_no, buffer);
+#endif
+
+        trata_mensagem_par(i, buffer);
+    }
+}
+
+// Cria o barramento em memória compartilhada e o eventfd de cada worker, antes do fork
+void cria_barramento()
+{
+    int i, memoria;
+
+    memoria = memfd_create("server_chat_v1.barramento", MFD_CLOEXEC);
+    if (memoria < 0 || ftruncate(memoria, sizeof(Barramento)) < 0)
+    {
+        error("\n Erro ao criar a memória do barramento\n ");
+    }
+
+    barramento = mmap(NULL, sizeof(Barramento), PROT_READ | PROT_WRITE, MAP_SHARED, memoria, 0);
+    if (barramento == MAP_FAILED)
+    {
+        error("\n Erro ao mapear o barramento\n ");
+    }
+
+    // O mapeamento continua válido, e é herdado pelos workers, sem o descritor. O memfd começa zerado, e
+    // com ele as filas vazias
+    close(memoria);
+
+    for (i = 0; i < total_workers; i++)
+    {
+        eventos_workers[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (eventos_workers[i] < 0)
+        {
+            error("\n Erro ao criar o eventfd do worker\n ");
+        }
+    }
+}
+
+// Coloca um lote de referências na fila deste worker para o worker indicado, publicando o lote inteiro com
+// uma única escrita da cauda. Com a fila cheia (worker lento ou caído), o lote é descartado para esse worker
+void enfileira_worker(int worker, unsigned long long referencias[], int quantidade)
+{
+    int i;
+    unsigned long long cauda, um = 1;
+    FilaWorker *fila = &barramento->filas[worker][indice_worker];
+
+    cauda = atomic_load_explicit(&fila->cauda, memory_order_relaxed);
+
+    if (cauda + quantidade - atomic_load_explicit(&fila->cabeca, memory_order_acquire) > TAMANHO_FILA_WORKER)
+    {
+        fprintf(stderr, "\n Fila do worker %d cheia, %d mensagens descartadas para ele\n", worker, quantidade);
+        return;
+    }
+
+    for (i = 0; i < quantidade; i++)
+    {
+        fila->referencias[(cauda + i) % TAMANHO_FILA_WORKER] = referencias[i];
+    }
+
+    atomic_store_explicit(&fila->cauda, cauda + quantidade, memory_order_release);
+
+    // Só o primeiro produtor desde o último consumo acorda o dono; enquanto ele não consome, novos lotes não geram escrita
+    if (!atomic_exchange(&barramento->avisados[worker], 1))
+    {
+        if (write(eventos_workers[worker], &um, sizeof(um)) < 0 && errno != EAGAIN)
+        {
+            perror("\n Erro ao acordar worker");
+        }
+    }
+}
+
+// Entrega aos demais workers as referências publicadas nesta rodada, um único lote por worker
+void entrega_lote_barramento()
+{
+    int i;
+
+    if (barramento == NULL || tamanho_lote_barramento == 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < total_workers; i++)
+    {
+        if (i != indice_worker)
+        {
+            enfileira_worker(i, lote_barramento, tamanho_lote_barramento);
+        }
+    }
+
+    tamanho_lote_barramento = 0;
+}
+
+// Codifica a mensagem de sala uma única vez no anel de mensagens e guarda a referência no lote da rodada.
+// A posição é reservada com uma soma atômica, de modo que vários workers publicam ao mesmo tempo sem trava
+void publica_barramento(const char sala[], char buffer[])
+{
+    unsigned long long posicao;
+    EntradaBarramento *entrada;
+
+    if (barramento == NULL)
+    {
+        return;
+    }
+
+    posicao = atomic_fetch_add(&barramento->cabeca, 1);
+    entrada = &barramento->entradas[posicao % TAMANHO_BARRAMENTO];
+
+    atomic_store_explicit(&entrada->sequencia, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    entrada->worker = indice_worker;
+    strncpy(entrada->sala, sala, TAMANHO_SALA - 1);
+    entrada->sala[TAMANHO_SALA - 1] = '\0';
+    strncpy(entrada->texto, buffer, TAMANHO_BUFFER - 1);
+    entrada->texto[TAMANHO_BUFFER - 1] = '\0';
+
+    atomic_store_explicit(&entrada->sequencia, posicao + 1, memory_order_release);
+
+    lote_barramento[tamanho_lote_barramento++] = posicao;
+    if (tamanho_lote_barramento == TAMANHO_FILA_WORKER)
+    {
+        entrega_lote_barramento();
+    }
+}
+
+// Lê a mensagem referenciada no anel de mensagens. Retorna 0 se ela já foi sobrescrita por uma volta
+// seguinte do anel, o que só ocorre com um worker atrasado em mais de TAMANHO_BARRAMENTO mensagens
+int le_mensagem_barramento(unsigned long long referencia, char sala[], char texto[])
+{
+    EntradaBarramento *entrada = &barramento->entradas[referencia % TAMANHO_BARRAMENTO];
+
+    if (atomic_load_explicit(&entrada->sequencia, memory_order_acquire) != referencia + 1)
+    {
+        return 0;
+    }
+
+    memcpy(sala, entrada->sala, TAMANHO_SALA);
+    memcpy(texto, entrada->texto, TAMANHO_BUFFER);
+
+    // A cópia só vale se a entrada não foi reescrita enquanto era lida
+    atomic_thread_fence(memory_order_acquire);
+
+    return atomic_load_explicit(&entrada->sequencia, memory_order_relaxed) == referencia + 1;
+}
+
+// Consome as filas deste worker, entregando as mensagens aos seus clientes. Com entregar 0 as referências
+// são apenas descartadas, como ao recriar um worker que caiu
+void consome_barramento(Cliente clientes_aprovados[], int entregar)
+{
+    int produtor;
+    unsigned long long referencia, cabeca, cauda;
+    char sala[TAMANHO_SALA];
+    char texto[TAMANHO_BUFFER];
+    FilaWorker *fila;
+
+    if (barramento == NULL)
+    {
+        return;
+    }
+
+    // O aviso é desfeito antes do consumo: um lote publicado depois disso escreve de novo no eventfd
+    atomic_store(&barramento->avisados[indice_worker], 0);
+
+    for (produtor = 0; produtor < total_workers; produtor++)
+    {
+        if (produtor == indice_worker)
+        {
+            continue;
+        }
+
+        fila = &barramento->filas[indice_worker][produtor];
+        cabeca = atomic_load_explicit(&fila->cabeca, memory_order_relaxed);
+        cauda = atomic_load_explicit(&fila->cauda, memory_order_acquire);
+
+        while (cabeca < cauda)
+        {
+            referencia = fila->referencias[cabeca % TAMANHO_FILA_WORKER];
+
+            // Libera a posição para o produtor
+            atomic_store_explicit(&fila->cabeca, ++cabeca, memory_order_release);
+
+            if (!entregar)
+            {
+                continue;
+            }
+
+            if (!le_mensagem_barramento(referencia, sala, texto))
+            {
+                perror("\n Worker atrasado no barramento, mensagem perdida");
+                continue;
+            }
+
+            broadcast_sala(-1, 0, 0, sala, texto, clientes_aprovados);
+        }
+    }
+}
+
+// Informa se há referências nas filas deste worker, caso em que o select não deve bloquear. As filas são
+// conferidas diretamente, de modo que nem um produtor que caiu antes de escrever no eventfd as deixa esquecidas
+int barramento_pendente()
+{
+    int produtor;
+    FilaWorker *fila;
+
+    if (barramento == NULL)
+    {
+        return 0;
+    }
+
+    for (produtor = 0; produtor < total_workers; produtor++)
+    {
+        fila = &barramento->filas[indice_worker][produtor];
+        if (atomic_load_explicit(&fila->cauda, memory_order_acquire) != atomic_load_explicit(&fila->cabeca, memory_order_relaxed))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Limpa o eventfd deste worker quando ele foi acordado e consome a sua fila
+void trata_barramento(fd_set *readfds, Cliente clientes_aprovados[])
+{
+    unsigned long long contador;
+
+    if (barramento == NULL)
+    {
+        return;
+    }
+
+    if (FD_ISSET(eventos_workers[indice_worker], readfds) && read(eventos_workers[indice_worker], &contador, sizeof(contador)) < 0 && errno != EAGAIN)
+    {
+        perror("\n Erro ao ler o eventfd do worker");
+    }
+
+    consome_barramento(clientes_aprovados, 1);
+}
+
+// Guarda o evento efêmero do cliente. Só o último estado de cada usuário é mantido até o fim da janela,
+// de modo que eventos repetidos (teclas, batimentos de presença) não multiplicam o tráfego da sala
+void registra_evento(int indice_cliente, const char evento[], Cliente clientes_aprovados[])
+{
+    Cliente *cliente = &clientes_aprovados[indice_cliente];
+
+    strncpy(cliente->evento, evento, TAMANHO_EVENTO - 1);
+    cliente->evento[TAMANHO_EVENTO - 1] = '\0';
+    cliente->evento[strcspn(cliente->evento, "\t\n")] = '\0';
+    cliente->evento_pendente = 1;
+    cliente->recebe_eventos = 1;
+
+    if (despacho_eventos_ms == 0)
+    {
+        despacho_eventos_ms = agora_ms() + JANELA_EVENTOS_MS;
+    }
+}
+
+// Ao fim da janela, envia a cada participante de cada sala com eventos pendentes um único lote com o último
+// estado de cada usuário. Eventos são efêmeros: não entram no histórico nem são reenviados
+void despacha_eventos(Cliente clientes_aprovados[])
+{
+    int i, j, tamanho;
+    static char lote[TAMANHO_LOTE_EVENTOS];
+
+    if (despacho_eventos_ms == 0 || agora_ms() < despacho_eventos_ms)
+    {
+        return;
+    }
+
+    despacho_eventos_ms = 0;
+
+    for (i = 0; i < limite_clientes; i++)
+    {
+        if (clientes_aprovados[i].socket == 0 || !clientes_aprovados[i].evento_pendente)
+        {
+            continue;
+        }
+
+        // Reúne os eventos pendentes da sala deste cliente; os clientes seguintes da mesma sala já entram aqui
+        tamanho = snprintf(lote, TAMANHO_LOTE_EVENTOS, "%s", MARCA_EVENTOS);
+
+        for (j = i; j < limite_clientes; j++)
+        {
+            if (clientes_aprovados[j].socket == 0 || !clientes_aprovados[j].evento_pendente || strcmp(clientes_aprovados[j].sala, clientes_aprovados[i].sala))
+            {
+                continue;
+            }
+
+            tamanho += snprintf(lote + tamanho, TAMANHO_LOTE_EVENTOS - tamanho, "%s\t%s\n", clientes_aprovados[j].nome, clientes_aprovados[j].evento);
+            clientes_aprovados[j].evento_pendente = 0;
+        }
+
+        for (j = 0; j < limite_clientes; j++)
+        {
+            if (clientes_aprovados[j].socket == 0 || !clientes_aprovados[j].recebe_eventos || strcmp(clientes_aprovados[j].sala, clientes_aprovados[i].sala))
+            {
+                continue;
+            }
+
+            // Perder um lote não tem consequência: o próximo evento do usuário traz o estado atual
+            envia_mensagem(clientes_aprovados[j].socket, lote, tamanho);
+        }
+    }
+}
+
+// Executa as etapas de processamento sobre a mensagem. Roda numa thread da pool ou, sem a pool, no laço principal
+int processa_mensagem(char texto[], const char sala[])
+{
+    int i;
+
+    for (i = 0; i < total_etapas; i++)
+    {
+        if (!etapas_mensagem[i](texto, sala))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Retira uma tarefa do deque. A dona retira do fim e as outras threads roubam do início. Retorna -1 se vazio
+int retira_deque(DequePool *deque, int roubo)
+{
+    int tarefa = -1;
+
+    pthread_mutex_lock(&deque->trava);
+
+    if (deque->tamanho > 0)
+    {
+        if (roubo)
+        {
+            tarefa = deque->tarefas[deque->inicio];
+            deque->inicio = (deque->inicio + 1) % MAX_TAREFAS_POOL;
+        }
+        else
+        {
+            tarefa = deque->tarefas[(deque->inicio + deque->tamanho - 1) % MAX_TAREFAS_POOL];
+        }
+        deque->tamanho--;
+    }
+
+    pthread_mutex_unlock(&deque->trava);
+
+    if (tarefa >= 0)
+    {
+        atomic_fetch_sub(&tarefas_enfileiradas, 1);
+    }
+
+    return tarefa;
+}
+
+// Procura trabalho: primeiro no próprio deque (indice >= 0) e depois roubando de deques sorteados. Cada
+// deque é visitado uma vez, a partir de uma posição aleatória. Retorna -1 se não há tarefas
+int procura_tarefa(int indice, unsigned int *semente)
+{
+    int i, vitima, tarefa;
+
+    if (indice >= 0 && (tarefa = retira_deque(&deques_pool[indice], 0)) >= 0)
+    {
+        return tarefa;
+    }
+
+    vitima = rand_r(semente) % total_threads_pool;
+
+    for (i = 0; i < total_threads_pool; i++, vitima = (vitima + 1) % total_threads_pool)
+    {
+        if (vitima != indice && (tarefa = retira_deque(&deques_pool[vitima], 1)) >= 0)
+        {
+            return tarefa;
+        }
+    }
+
+    return -1;
+}
+
+// Processa a tarefa e avisa o laço principal, que entrega os resultados na ordem de cada conexão
+void executa_tarefa(int indice_tarefa)
+{
+    unsigned long long um = 1;
+    Tarefa *tarefa = &tarefas_pool[indice_tarefa];
+
+    tarefa->entregar = processa_mensagem(tarefa->texto, tarefa->sala);
+    atomic_store_explicit(&tarefa->concluida, 1, memory_order_release);
+
+    if (write(eventos_pool, &um, sizeof(um)) < 0 && errno != EAGAIN)
+    {
+        perror("\n Erro ao acordar o laço principal");
+    }
+}
+
+// Laço de uma thread da pool: executa as tarefas do seu deque, rouba das outras quando ele esvazia e
+// dorme quando não há nenhuma tarefa enfileirada
+void *thread_pool(void *argumento)
+{
+    int indice = (int)(long)argumento, tarefa;
+    unsigned int semente = (unsigned int)time(NULL) ^ (indice * 2654435761u);
+
+    while (1)
+    {
+        if ((tarefa = procura_tarefa(indice, &semente)) >= 0)
+        {
+            executa_tarefa(tarefa);
+            continue;
+        }
+
+        pthread_mutex_lock(&trava_pool);
+        while (atomic_load(&tarefas_enfileiradas) == 0)
+        {
+            pthread_cond_wait(&tarefa_disponivel, &trava_pool);
+        }
+        pthread_mutex_unlock(&trava_pool);
+    }
+
+    return NULL;
+}
+
+// Cria as threads da pool. Deve ser chamada depois de criados os workers, pois as threads não sobrevivem ao fork
+void inicia_pool()
+{
+    int i;
+    pthread_t thread;
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        primeira_tarefa[i] = -1;
+        ultima_tarefa[i] = -1;
+    }
+
+    if (total_threads_pool == 0)
+    {
+        return;
+    }
+
+    for (i = MAX_TAREFAS_POOL - 1; i >= 0; i--)
+    {
+        tarefas_pool[i].proxima = tarefas_livres;
+        tarefas_livres = i;
+    }
+
+    eventos_pool = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventos_pool < 0)
+    {
+        error("\n Erro ao criar o eventfd da pool\n ");
+    }
+
+    for (i = 0; i < total_threads_pool; i++)
+    {
+        pthread_mutex_init(&deques_pool[i].trava, NULL);
+
+        if (pthread_create(&thread, NULL, thread_pool, (void *)(long)i) != 0)
+        {
+            error("\n Erro ao criar thread da pool\n ");
+        }
+        pthread_detach(thread);
+    }
+
+#ifdef MODO_DEBUGER
+    printf("\n Pool de processamento com %d threads\n", total_threads_pool);
+#endif
+}
+
+// Entrega a mensagem já processada aos clientes da sala, neste e nos demais workers e servidores da federação
+void entrega_mensagem_sala(int indice_remetente, unsigned int conexao_remetente, unsigned long long token_remetente, const char sala[], char buffer[], Cliente clientes_aprovados[])
+{
+    broadcast_sala(indice_remetente, conexao_remetente, token_remetente, sala, buffer, clientes_aprovados);
+    publica_barramento(sala, buffer);
+    encaminha_sala(id_no, ++sequencia_no, sala, buffer);
+}
+
+// Entrega os resultados das tarefas concluídas. Cada conexão só avança enquanto a sua tarefa mais antiga
+// estiver concluída, de modo que as mensagens de um cliente saem na ordem em que foram enviadas, ainda que
+// processadas fora de ordem pelas threads
+void entrega_resultados_pool(Cliente clientes_aprovados[])
+{
+    int i, indice_tarefa;
+    Tarefa *tarefa;
+
+    for (i = 0; i < limite_clientes; i++)
+    {
+        while ((indice_tarefa = primeira_tarefa[i]) >= 0)
+        {
+            tarefa = &tarefas_pool[indice_tarefa];
+
+            if (!atomic_load_explicit(&tarefa->concluida, memory_order_acquire))
+            {
+                break;
+            }
+
+            if (tarefa->entregar)
+            {
+                entrega_mensagem_sala(i, tarefa->conexao, tarefa->token, tarefa->sala, tarefa->texto, clientes_aprovados);
+            }
+
+            primeira_tarefa[i] = tarefa->proxima;
+            if (primeira_tarefa[i] < 0)
+            {
+                ultima_tarefa[i] = -1;
+            }
+
+            tarefa->proxima = tarefas_livres;
+            tarefas_livres = indice_tarefa;
+        }
+    }
+}
+
+// Reserva uma tarefa livre. Com todas em uso, o laço principal ajuda a pool a processá-las até liberar alguma
+int reserva_tarefa(Cliente clientes_aprovados[])
+{
+    int tarefa;
+    unsigned int semente = (unsigned int)agora_ms();
+
+    while (tarefas_livres < 0)
+    {
+        if ((tarefa = procura_tarefa(-1, &semente)) >= 0)
+        {
+            executa_tarefa(tarefa);
+        }
+        else
+        {
+            sched_yield();
+        }
+
+        entrega_resultados_pool(clientes_aprovados);
+    }
+
+    tarefa = tarefas_livres;
+    tarefas_livres = tarefas_pool[tarefa].proxima;
+
+    return tarefa;
+}
+
+// Processa e entrega a mensagem de sala do cliente. Com a pool ativa, a mensagem segue para o deque de uma
+// thread, em rodízio, e o laço principal volta a atender os clientes sem esperar pelas etapas
+void envia_mensagem_processada(int indice_cliente, char buffer[], Cliente clientes_aprovados[])
+{
+    int indice_tarefa;
+    Tarefa *tarefa;
+    DequePool *deque;
+
+    if (total_threads_pool == 0)
+    {
+        if (processa_mensagem(buffer, clientes_aprovados[indice_cliente].sala))
+        {
+            entrega_mensagem_sala(indice_cliente, identificador_conexao[indice_cliente], clientes_aprovados[indice_cliente].token,
+                                  clientes_aprovados[indice_cliente].sala, buffer, clientes_aprovados);
+        }
+        return;
+    }
+
+    indice_tarefa = reserva_tarefa(clientes_aprovados);
+    tarefa = &tarefas_pool[indice_tarefa];
+
+    tarefa->conexao = identificador_conexao[indice_cliente];
+    tarefa->token = clientes_aprovados[indice_cliente].token;
+    strcpy(tarefa->sala, clientes_aprovados[indice_cliente].sala);
+    strncpy(tarefa->texto, buffer, TAMANHO_BUFFER - 1);
+    tarefa->texto[TAMANHO_BUFFER - 1] = '\0';
+    tarefa->proxima = -1;
+    atomic_store_explicit(&tarefa->concluida, 0, memory_order_relaxed);
+
+    // A tarefa entra no fim da fila da conexão, que define a ordem de entrega
+    if (ultima_tarefa[indice_cliente] >= 0)
+    {
+        tarefas_pool[ultima_tarefa[indice_cliente]].proxima = indice_tarefa;
+    }
+    else
+    {
+        primeira_tarefa[indice_cliente] = indice_tarefa;
+    }
+    ultima_tarefa[indice_cliente] = indice_tarefa;
+
+    deque = &deques_pool[proximo_deque];
+    proximo_deque = (proximo_deque + 1) % total_threads_pool;
+
+    pthread_mutex_lock(&deque->trava);
+    deque->tarefas[(deque->inicio + deque->tamanho) % MAX_TAREFAS_POOL] = indice_tarefa;
+    deque->tamanho++;
+    pthread_mutex_unlock(&deque->trava);
+
+    atomic_fetch_add(&tarefas_enfileiradas, 1);
+
+    pthread_mutex_lock(&trava_pool);
+    pthread_cond_signal(&tarefa_disponivel);
+    pthread_mutex_unlock(&trava_pool);
+}
+
+// Limpa o eventfd da pool quando alguma tarefa foi concluída e entrega os resultados
+void trata_pool(fd_set *readfds, Cliente clientes_aprovados[])
+{
+    unsigned long long contador;
+
+    if (total_threads_pool == 0 || FD_ISSET(eventos_pool, readfds) == 0)
+    {
+        return;
+    }
+
+    if (read(eventos_pool, &contador, sizeof(contador)) < 0 && errno != EAGAIN)
+    {
+        perror("\n Erro ao ler o eventfd da pool");
+    }
+
+    entrega_resultados_pool(clientes_aprovados);
+}
+
+// Envia ao lado da transferência uma resposta de controle
+void responde_transferencia(int socket_dados, const char mensagem[])
+{
+    if (envia_mensagem(socket_dados, (char *)mensagem, strlen(mensagem)) <= 0)
+    {
+        perror("\n Erro ao responder na conexão de dados");
+    }
+}
+
+// Fecha as conexões de dados e descarta os bytes em trânsito. Se o arquivo não foi inteiramente entregue,
+// a transferência aguarda a retomada pelos dois lados; caso contrário, a posição é liberada
+void interrompe_transferencia(Transferencia *transferencia)
+{
+    if (transferencia->socket_envio > 0)
+    {
+        fecha_socket(transferencia->socket_envio);
+        transferencia->socket_envio = 0;
+    }
+
+    if (transferencia->socket_recebimento > 0)
+    {
+        fecha_socket(transferencia->socket_recebimento);
+        transferencia->socket_recebimento = 0;
+    }
+
+    if (transferencia->iniciada)
+    {
+        close(transferencia->canal[0]);
+        close(transferencia->canal[1]);
+        transferencia->iniciada = 0;
+        transferencia->no_canal = 0;
+    }
+
+    if (transferencia->entregue == transferencia->tamanho)
+    {
+#ifdef MODO_DEBUGER
+        printf("\n Transferência %016llx concluída (%lld bytes)\n", transferencia->id, transferencia->tamanho);
+#endif
+        transferencia->id = 0;
+        return;
+    }
+
+    transferencia->expira_ms = agora_ms() + PRAZO_RETOMADA_MS;
+}
+
+// Com os dois lados conectados, informa a ambos o deslocamento recebido do destinatário e começa o repasse;
+// depois dessa mensagem, o destinatário recebe apenas os bytes do arquivo. Os sockets de dados passam a não
+// bloqueantes, pois o repasse avança conforme o select
+void inicia_transferencia(Transferencia *transferencia)
+{
+    char resposta[TAMANHO_BUFFER];
+
+    if (transferencia->socket_envio == 0 || transferencia->socket_recebimento == 0 || transferencia->iniciada)
+    {
+        return;
+    }
+
+    if (transferencia->entregue == transferencia->tamanho)
+    {
+        responde_transferencia(transferencia->socket_envio, MARCA_CONCLUIDA);
+        responde_transferencia(transferencia->socket_recebimento, MARCA_CONCLUIDA);
+        interrompe_transferencia(transferencia);
+        return;
+    }
+
+    if (pipe2(transferencia->canal, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        perror("\n Erro ao criar o pipe da transferência");
+        interrompe_transferencia(transferencia);
+        return;
+    }
+
+    transferencia->iniciada = 1;
+    transferencia->no_canal = 0;
+
+    snprintf(resposta, TAMANHO_BUFFER, MARCA_DESDE "%lld", transferencia->entregue);
+    responde_transferencia(transferencia->socket_envio, resposta);
+    responde_transferencia(transferencia->socket_recebimento, resposta);
+
+    fcntl(transferencia->socket_envio, F_SETFL, fcntl(transferencia->socket_envio, F_GETFL) | O_NONBLOCK);
+    fcntl(transferencia->socket_recebimento, F_SETFL, fcntl(transferencia->socket_recebimento, F_GETFL) | O_NONBLOCK);
+
+#ifdef MODO_DEBUGER
+    printf("\n Transferência %016llx iniciada a partir do byte %lld\n", transferencia->id, transferencia->entregue);
+#endif
+}
+
+// Associa a conexão de dados do remetente à transferência, criando-a e avisando o destinatário na primeira
+// vez. O remetente é autenticado pelo token da sua sessão retomável. Retorna a mensagem de recusa, ou NULL
+const char *trata_envio_arquivo(int socket_dados, char buffer[], Cliente clientes_aprovados[])
+{
+    int i, remetente = -1, destinatario = -1, livre = -1;
+    unsigned long long id, token;
+    long long tamanho;
+    char nome_destinatario[TAMANHO_NOME], nome_arquivo[TAMANHO_NOME], aviso[TAMANHO_BUFFER_PAR];
+    Transferencia *transferencia = NULL;
+
+    if (sscanf(buffer + strlen(MARCA_ENVIA), "%llx %llx %100s %lld %100[^\n]", &id, &token, nome_destinatario, &tamanho, nome_arquivo) != 5 || id == 0 || token == 0 || tamanho < 0)
+    {
+        return MARCA_RECUSADA "pedido inválido";
+    }
+
+    for (i = 0; i < MAX_TRANSFERENCIAS; i++)
+    {
+        if (transferencias[i].id == id)
+        {
+            transferencia = &transferencias[i];
+        }
+        else if (transferencias[i].id == 0 && livre < 0)
+        {
+            livre = i;
+        }
+    }
+
+    // Retomada: basta o token do remetente, que continua valendo depois de uma reconexão
+    if (transferencia != NULL)
+    {
+        if (transferencia->token_remetente != token || transferencia->tamanho != tamanho)
+        {
+            return MARCA_RECUSADA "transferência de outro remetente";
+        }
+
+        if (transferencia->socket_envio > 0)
+        {
+            interrompe_transferencia(transferencia);
+        }
+
+        transferencia->socket_envio = socket_dados;
+        inicia_transferencia(transferencia);
+        return NULL;
+    }
+
+    for (i = 0; i < limite_clientes; i++)
+    {
+        if (clientes_aprovados[i].socket == 0)
+        {
+            continue;
+        }
+        if (clientes_aprovados[i].token == token)
+        {
+            remetente = i;
+        }
+        if (destinatario < 0 && !strcmp(clientes_aprovados[i].nome, nome_destinatario))
+        {
+            destinatario = i;
+        }
+    }
+
+    if (remetente < 0)
+    {
+        return MARCA_RECUSADA "sessão do remetente desconhecida";
+    }
+
+    if (destinatario < 0 || clientes_aprovados[destinatario].token == 0)
+    {
+        return MARCA_RECUSADA "destinatário não está conectado a este servidor com sessão retomável";
+    }
+
+    if (livre < 0)
+    {
+        return MARCA_RECUSADA "limite de transferências atingido";
+    }
+
+    transferencia = &transferencias[livre];
+    memset(transferencia, 0, sizeof(Transferencia));
+    transferencia->id = id;
+    transferencia->token_remetente = token;
+    transferencia->token_destinatario = clientes_aprovados[destinatario].token;
+    transferencia->tamanho = tamanho;
+    transferencia->socket_envio = socket_dados;
+
+    snprintf(aviso, TAMANHO_BUFFER_PAR, MARCA_ARQUIVO "%016llx %lld %s %s", id, tamanho, clientes_aprovados[remetente].nome, nome_arquivo);
+    envia_mensagem(clientes_aprovados[destinatario].socket, aviso, strlen(aviso));
+
+#ifdef MODO_DEBUGER
+    printf("\n Transferência %016llx de %s para %s: %s (%lld bytes)\n", id, clientes_aprovados[remetente].nome, nome_destinatario, nome_arquivo, tamanho);
+#endif
+
+    return NULL;
+}
+
+// Associa a conexão de dados do destinatário à transferência, a partir do deslocamento que ele já tem
+const char *trata_recebimento_arquivo(int socket_dados, char buffer[])
+{
+    int i;
+    unsigned long long id, token;
+    long long deslocamento;
+    Transferencia *transferencia = NULL;
+
+    if (sscanf(buffer + strlen(MARCA_RECEBE), "%llx %llx %lld", &id, &token, &deslocamento) != 3 || id == 0)
+    {
+        return MARCA_RECUSADA "pedido inválido";
+    }
+
+    for (i = 0; i < MAX_TRANSFERENCIAS; i++)
+    {
+        if (transferencias[i].id == id)
+        {
+            transferencia = &transferencias[i];
+            break;
+        }
+    }
+
+    if (transferencia == NULL || transferencia->token_destinatario != token)
+    {
+        return MARCA_RECUSADA "transferência desconhecida";
+    }
+
+    if (deslocamento < 0 || deslocamento > transferencia->tamanho)
+    {
+        return MARCA_RECUSADA "deslocamento inválido";
+    }
+
+    // Uma nova conexão do destinatário substitui a anterior, e o remetente recomeça do novo deslocamento
+    if (transferencia->socket_recebimento > 0)
+    {
+        interrompe_transferencia(transferencia);
+    }
+
+    transferencia->socket_recebimento = socket_dados;
+    transferencia->entregue = deslocamento;
+    inicia_transferencia(transferencia);
+
+    return NULL;
+}
+
+// Converte a conexão de um cliente pendente que se identificou como conexão de dados de uma transferência
+void promove_transferencia(int indice_cliente, int clientes_pendentes[], Cliente clientes_aprovados[], char buffer[])
+{
+    int socket_dados = clientes_pendentes[indice_cliente];
+    const char *recusa;
+
+    libera_posicao_cliente(indice_cliente);
+    clientes_pendentes[indice_cliente] = 0;
+    clientes_aprovados[indice_cliente].socket = 0;
+    troca_nome(&clientes_aprovados[indice_cliente].nome, "");
+
+    // O splice só alcança os bytes que passam pelo kernel, o que exclui TLS em espaço de usuário; com workers,
+    // as duas conexões de dados podem ser aceitas por processos diferentes
+    if (total_workers > 0)
+    {
+        recusa = MARCA_RECUSADA "transferências indisponíveis com workers";
+    }
+    else if (!socket_transferivel(socket_dados))
+    {
+        recusa = MARCA_RECUSADA "conexão de dados exige kTLS";
+    }
+    else if (!strncmp(buffer, MARCA_ENVIA, strlen(MARCA_ENVIA)))
+    {
+        recusa = trata_envio_arquivo(socket_dados, buffer, clientes_aprovados);
+    }
+    else
+    {
+        recusa = trata_recebimento_arquivo(socket_dados, buffer);
+    }
+
+    if (recusa != NULL)
+    {
+#ifdef MODO_DEBUGER
+        printf("\n Conexão de dados %d recusada: %s\n", socket_dados, recusa + strlen(MARCA_RECUSADA));
+#endif
+        responde_transferencia(socket_dados, recusa);
+        fecha_socket(socket_dados);
+    }
+}
+
+// Acrescenta os sockets das transferências aos conjuntos do select. O remetente só é lido enquanto há
+// espaço no pipe, e o destinatário só é aguardado para escrita enquanto há bytes no pipe: o repasse segue o
+// ritmo do destinatário, e o que não cabe no pipe espera no socket do remetente
+void prepara_transferencias(fd_set *readfds, fd_set *writefds, int *max_socket_cliente)
+{
+    int i;
+    Transferencia *transferencia;
+
+    FD_ZERO(writefds);
+
+    for (i = 0; i < MAX_TRANSFERENCIAS; i++)
+    {
+        transferencia = &transferencias[i];
+        if (transferencia->id == 0)
+        {
+            continue;
+        }
+
+        // Antes do início, o select só precisa notar quando o lado que aguarda desiste
+        if (transferencia->socket_envio > 0 && (!transferencia->iniciada || transferencia->no_canal < TAMANHO_CANAL))
+        {
+            FD_SET(transferencia->socket_envio, readfds);
+            if (transferencia->socket_envio > *max_socket_cliente)
+            {
+                *max_socket_cliente = transferencia->socket_envio;
+            }
+        }
+
+        if (transferencia->socket_recebimento > 0)
+        {
+            FD_SET(transferencia->socket_recebimento, readfds);
+            if (transferencia->no_canal > 0)
+            {
+                FD_SET(transferencia->socket_recebimento, writefds);
+            }
+            if (transferencia->socket_recebimento > *max_socket_cliente)
+            {
+                *max_socket_cliente = transferencia->socket_recebimento;
+            }
+        }
+    }
+}
+
+// Informa se o lado da conexão de dados, que não deveria enviar nada naquele momento, fechou a conexão
+int lado_encerrou(int socket_dados)
+{
+    char descarte[64];
+    int recebidos = recv(socket_dados, descarte, sizeof(descarte), MSG_DONTWAIT);
+
+    return recebidos == 0 || (recebidos < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+// Fecha um lado da transferência que ainda aguardava o outro
+void desiste_transferencia(Transferencia *transferencia, int *socket_dados)
+{
+    fecha_socket(*socket_dados);
+    *socket_dados = 0;
+    transferencia->expira_ms = agora_ms() + PRAZO_RETOMADA_MS;
+}
+
+// Avança as transferências, do socket do remetente para o pipe e do pipe para o socket do destinatário,
+// ambos por splice, e libera as transferências que não foram retomadas dentro do prazo
+void trata_transferencias(fd_set *readfds, fd_set *writefds)
+{
+    int i;
+    ssize_t movidos;
+    long long restante;
+    Transferencia *transferencia;
+
+    for (i = 0; i < MAX_TRANSFERENCIAS; i++)
+    {
+        transferencia = &transferencias[i];
+        if (transferencia->id == 0)
+        {
+            continue;
+        }
+
+        if (transferencia->socket_envio == 0 && transferencia->socket_recebimento == 0)
+        {
+            if (transferencia->expira_ms != 0 && transferencia->expira_ms < agora_ms())
+            {
+#ifdef MODO_DEBUGER
+                printf("\n Transferência %016llx expirou\n", transferencia->id);
+#endif
+                transferencia->id = 0;
+            }
+            continue;
+        }
+
+        if (!transferencia->iniciada)
+        {
+            if (transferencia->socket_envio > 0 && FD_ISSET(transferencia->socket_envio, readfds) && lado_encerrou(transferencia->socket_envio))
+            {
+                desiste_transferencia(transferencia, &transferencia->socket_envio);
+            }
+            if (transferencia->socket_recebimento > 0 && FD_ISSET(transferencia->socket_recebimento, readfds) && lado_encerrou(transferencia->socket_recebimento))
+            {
+                desiste_transferencia(transferencia, &transferencia->socket_recebimento);
+            }
+            continue;
+        }
+
+        if (FD_ISSET(transferencia->socket_envio, readfds))
+        {
+            restante = transferencia->tamanho - transferencia->entregue - transferencia->no_canal;
+            if (restante > TAMANHO_CANAL - transferencia->no_canal)
+            {
+                restante = TAMANHO_CANAL - transferencia->no_canal;
+            }
+
+            // Com o arquivo inteiro já lido, o remetente não deveria enviar mais nada
+            if (restante == 0)
+            {
+                movidos = lado_encerrou(transferencia->socket_envio) ? 0 : -1;
+                errno = movidos == 0 ? 0 : EAGAIN;
+            }
+            else
+            {
+                movidos = splice(transferencia->socket_envio, NULL, transferencia->canal[1], NULL, restante, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            }
+
+            if (movidos > 0)
+            {
+                transferencia->no_canal += movidos;
+            }
+            else if (movidos == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                perror("\n Remetente da transferência desconectou");
+                interrompe_transferencia(transferencia);
+                continue;
+            }
+        }
+
+        if (FD_ISSET(transferencia->socket_recebimento, writefds))
+        {
+            movidos = splice(transferencia->canal[0], NULL, transferencia->socket_recebimento, NULL, transferencia->no_canal, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+
+            if (movidos < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("\n Destinatário da transferência desconectou");
+                interrompe_transferencia(transferencia);
+                continue;
+            }
+
+            if (movidos > 0)
+            {
+                transferencia->no_canal -= movidos;
+                transferencia->entregue += movidos;
+            }
+
+            if (transferencia->entregue == transferencia->tamanho)
+            {
+                responde_transferencia(transferencia->socket_envio, MARCA_CONCLUIDA);
+                interrompe_transferencia(transferencia);
+                continue;
+            }
+        }
+
+        if (FD_ISSET(transferencia->socket_recebimento, readfds) && lado_encerrou(transferencia->socket_recebimento))
+        {
+            perror("\n Destinatário da transferência desconectou");
+            interrompe_transferencia(transferencia);
+        }
+    }
+}
+
+// Mapeia o segmento de caixa postal de número informado, criando o arquivo quando criar != 0. Retorna a
+// posição do segmento na tabela ou -1 em caso de erro
+int abre_segmento_caixa(unsigned int numero, int criar)
+{
+    int i, arquivo;
+    char caminho[PATH_MAX];
+    char *mapa;
+
+    for (i = 0; i < MAX_SEGMENTOS_CAIXA && segmentos_caixa[i].mapa != NULL; i++)
+    {
+    }
+
+    if (i == MAX_SEGMENTOS_CAIXA)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    snprintf(caminho, sizeof(caminho), "%s/caixa.%08u", diretorio_caixas, numero);
+
+    arquivo = open(caminho, O_RDWR | O_CLOEXEC | (criar ? O_CREAT | O_EXCL : 0), 0600);
+    if (arquivo < 0)
+    {
+        return -1;
+    }
+
+    if (criar && ftruncate(arquivo, TAMANHO_SEGMENTO_CAIXA) < 0)
+    {
+        close(arquivo);
+        unlink(caminho);
+        return -1;
+    }
+
+    mapa = mmap(NULL, TAMANHO_SEGMENTO_CAIXA, PROT_READ | PROT_WRITE, MAP_SHARED, arquivo, 0);
+    close(arquivo);
+
+    if (mapa == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    segmentos_caixa[i].mapa = mapa;
+    segmentos_caixa[i].numero = numero;
+    segmentos_caixa[i].usado = 0;
+    segmentos_caixa[i].total = 0;
+    segmentos_caixa[i].vivas = 0;
+
+    return i;
+}
+
+// Procura a caixa postal do usuário na tabela de espalhamento, com sondagem linear. Com criar != 0, ocupa
+// uma posição livre quando o usuário ainda não tem caixa. Retorna a posição ou -1
+int procura_caixa(const char nome[], int criar)
+{
+    int i, tentativas;
+
+    i = hash_texto(nome) % MAX_CAIXAS;
+
+    for (tentativas = 0; tentativas < MAX_CAIXAS; tentativas++, i = (i + 1) % MAX_CAIXAS)
+    {
+        if (caixas_postais[i].nome[0] == '\0')
+        {
+            if (!criar)
+            {
+                return -1;
+            }
+
+            strcpy(caixas_postais[i].nome, nome);
+            caixas_postais[i].primeira = -1;
+            caixas_postais[i].ultima = -1;
+            caixas_postais[i].pendentes = 0;
+            return i;
+        }
+
+        if (!strcmp(caixas_postais[i].nome, nome))
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Remove a caixa vazia da tabela, trazendo para trás as caixas seguintes da mesma sequência de sondagem
+void remove_caixa(int i)
+{
+    int j = i, k;
+
+    while (1)
+    {
+        j = (j + 1) % MAX_CAIXAS;
+        if (caixas_postais[j].nome[0] == '\0')
+        {
+            break;
+        }
+
+        // A caixa em j pode ocupar i se a sua posição de origem k não estiver entre i e j
+        k = hash_texto(caixas_postais[j].nome) % MAX_CAIXAS;
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j))
+        {
+            caixas_postais[i] = caixas_postais[j];
+            i = j;
+        }
+    }
+
+    caixas_postais[i].nome[0] = '\0';
+}
+
+// Acrescenta um registro pendente no fim do segmento ativo, abrindo o próximo segmento quando ele enche.
+// O tamanho é escrito por último: um registro interrompido por uma queda tem tamanho 0 e encerra o segmento.
+// Deve ser chamada com trava_caixas. Retorna -1 em caso de erro
+int acrescenta_registro_caixa(const char nome[], const char texto[], int tamanho_texto, unsigned long long ordem, int *segmento, int *deslocamento)
+{
+    int tamanho = (sizeof(RegistroCaixa) + strlen(nome) + tamanho_texto + 7) & ~7;
+    int novo;
+    RegistroCaixa *registro;
+
+    if (segmento_ativo_caixa < 0 || segmentos_caixa[segmento_ativo_caixa].usado + tamanho > TAMANHO_SEGMENTO_CAIXA)
+    {
+        novo = abre_segmento_caixa(segmento_ativo_caixa < 0 ? 1 : segmentos_caixa[segmento_ativo_caixa].numero + 1, 1);
+        if (novo < 0)
+        {
+            return -1;
+        }
+
+        segmento_ativo_caixa = novo;
+    }
+
+    *segmento = segmento_ativo_caixa;
+    *deslocamento = segmentos_caixa[segmento_ativo_caixa].usado;
+
+    registro = (RegistroCaixa *)(segmentos_caixa[*segmento].mapa + *deslocamento);
+    registro->estado = CAIXA_PENDENTE;
+    registro->tamanho_nome = strlen(nome);
+    registro->tamanho_texto = tamanho_texto;
+    registro->ordem = ordem;
+    memcpy((char *)(registro + 1), nome, registro->tamanho_nome);
+    memcpy((char *)(registro + 1) + registro->tamanho_nome, texto, tamanho_texto);
+    atomic_thread_fence(memory_order_release);
+    registro->tamanho = tamanho;
+
+    segmentos_caixa[*segmento].usado += tamanho;
+    segmentos_caixa[*segmento].total++;
+    segmentos_caixa[*segmento].vivas++;
+
+    return 0;
+}
+
+unsigned long long ordem_referencia_caixa(int referencia)
+{
+    return ((RegistroCaixa *)(segmentos_caixa[referencias_caixas[referencia].segmento].mapa + referencias_caixas[referencia].deslocamento))->ordem;
+}
+
+// Inclui a mensagem na lista da caixa postal do usuário, na ordem de chegada: no fim, para as mensagens novas,
+// ou no meio, para as copiadas pela compactação quando o índice é refeito. Deve ser chamada com trava_caixas.
+// Retorna -1 com a caixa ou o índice cheios
+int indexa_mensagem_caixa(int caixa, int segmento, int deslocamento)
+{
+    int referencia = referencias_livres_caixas, anterior = -1, seguinte;
+    unsigned long long ordem;
+
+    if (referencia < 0 || caixas_postais[caixa].pendentes >= MAX_PENDENTES_CAIXA)
+    {
+        return -1;
+    }
+
+    referencias_livres_caixas = referencias_caixas[referencia].proxima;
+
+    referencias_caixas[referencia].segmento = segmento;
+    referencias_caixas[referencia].deslocamento = deslocamento;
+    ordem = ordem_referencia_caixa(referencia);
+
+    if (caixas_postais[caixa].ultima >= 0 && ordem_referencia_caixa(caixas_postais[caixa].ultima) < ordem)
+    {
+        anterior = caixas_postais[caixa].ultima;
+    }
+    else
+    {
+        for (seguinte = caixas_postais[caixa].primeira; seguinte >= 0 && ordem_referencia_caixa(seguinte) < ordem; seguinte = referencias_caixas[seguinte].proxima)
+        {
+            anterior = seguinte;
+        }
+    }
+
+    referencias_caixas[referencia].proxima = anterior >= 0 ? referencias_caixas[anterior].proxima : caixas_postais[caixa].primeira;
+
+    if (anterior >= 0)
+    {
+        referencias_caixas[anterior].proxima = referencia;
+    }
+    else
+    {
+        caixas_postais[caixa].primeira = referencia;
+    }
+
+    if (referencias_caixas[referencia].proxima < 0)
+    {
+        caixas_postais[caixa].ultima = referencia;
+    }
+    caixas_postais[caixa].pendentes++;
+
+    return 0;
+}
+
+// Guarda a mensagem privada para um usuário desconectado. Retorna -1 se a caixa postal está cheia ou se o
+// segmento não pôde ser gravado
+int guarda_mensagem_caixa(const char destinatario[], const char texto[])
+{
+    int caixa, segmento, deslocamento, retorno = -1;
+
+    pthread_mutex_lock(&trava_caixas);
+
+    caixa = procura_caixa(destinatario, 1);
+    if (caixa >= 0 && referencias_livres_caixas >= 0 && caixas_postais[caixa].pendentes < MAX_PENDENTES_CAIXA &&
+        acrescenta_registro_caixa(destinatario, texto, strlen(texto), proxima_ordem_caixa++, &segmento, &deslocamento) == 0)
+    {
+        retorno = indexa_mensagem_caixa(caixa, segmento, deslocamento);
+    }
+
+    if (caixa >= 0 && caixas_postais[caixa].pendentes == 0)
+    {
+        remove_caixa(caixa);
+    }
+
+    pthread_mutex_unlock(&trava_caixas);
+
+    return retorno;
+}
+
+// Entrega numa única escrita as mensagens guardadas para o usuário recém aprovado. A rajada é montada com
+// trava_caixas, mas escrita sem ela, para a faxina não esperar por um cliente lento. Depois da escrita, só
+// as mensagens escritas por inteiro são marcadas como entregues nos segmentos; as demais continuam na caixa
+void entrega_caixa_postal(int indice_cliente, Cliente clientes_aprovados[])
+{
+    int caixa, referencia, incluidas = 0, entregues = 0, tamanho = 0, enviado = 0, fim_quadro = 0, escrito, tamanho_texto;
+    int socket_cliente = clientes_aprovados[indice_cliente].socket;
+    char *rajada;
+    RegistroCaixa *registro;
+    SegmentoCaixa *segmento;
+
+    if (diretorio_caixas == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&trava_caixas);
+
+    caixa = procura_caixa(clientes_aprovados[indice_cliente].nome, 0);
+    if (caixa < 0)
+    {
+        pthread_mutex_unlock(&trava_caixas);
+        return;
+    }
+
+    rajada = malloc(caixas_postais[caixa].pendentes * (sizeof(int) + TAMANHO_BUFFER));
+    if (rajada == NULL)
+    {
+        pthread_mutex_unlock(&trava_caixas);
+        return;
+    }
+
+    // Mesmo enquadramento de envia_mensagem, com as mensagens uma após a outra
+    for (referencia = caixas_postais[caixa].primeira; referencia >= 0; referencia = referencias_caixas[referencia].proxima)
+    {
+        segmento = &segmentos_caixa[referencias_caixas[referencia].segmento];
+        registro = (RegistroCaixa *)(segmento->mapa + referencias_caixas[referencia].deslocamento);
+
+        tamanho_texto = registro->tamanho_texto;
+        memcpy(rajada + tamanho, &tamanho_texto, sizeof(int));
+        memcpy(rajada + tamanho + sizeof(int), (char *)(registro + 1) + registro->tamanho_nome, registro->tamanho_texto);
+        tamanho += sizeof(int) + registro->tamanho_texto;
+        incluidas++;
+    }
+
+#ifdef MODO_DEBUGER
+    printf("\n Entregando %d mensagens guardadas para %s\n", incluidas, caixas_postais[caixa].nome);
+#endif
+
+    pthread_mutex_unlock(&trava_caixas);
+
+    // As mensagens guardadas passam à frente das mensagens de sala retidas, como as demais mensagens diretas
+    if (conclui_quadro_lote(socket_cliente) == 0)
+    {
+        while (enviado < tamanho)
+        {
+            escrito = escreve_socket(socket_cliente, rajada + enviado, tamanho - enviado);
+            if (escrito <= 0)
+            {
+                break;
+            }
+
+            enviado += escrito;
+        }
+    }
+
+    free(rajada);
+
+    // Uma mensagem escrita pela metade deixa o cliente sem como separar as seguintes
+    if (enviado > 0 && enviado < tamanho)
+    {
+        derruba_destinatario(socket_cliente);
+    }
+
+    if (enviado == 0)
+    {
+        return;
+    }
+
+    // Só o laço principal acrescenta e entrega mensagens, então as incluídas ainda estão no início da lista;
+    // a faxina pode apenas tê-las movido de segmento
+    pthread_mutex_lock(&trava_caixas);
+
+    caixa = procura_caixa(clientes_aprovados[indice_cliente].nome, 0);
+
+    while (caixa >= 0 && entregues < incluidas && (referencia = caixas_postais[caixa].primeira) >= 0)
+    {
+        segmento = &segmentos_caixa[referencias_caixas[referencia].segmento];
+        registro = (RegistroCaixa *)(segmento->mapa + referencias_caixas[referencia].deslocamento);
+
+        fim_quadro += sizeof(int) + registro->tamanho_texto;
+        if (fim_quadro > enviado)
+        {
+            break;
+        }
+
+        registro->estado = CAIXA_ENTREGUE;
+        segmento->vivas--;
+
+        caixas_postais[caixa].primeira = referencias_caixas[referencia].proxima;
+        caixas_postais[caixa].pendentes--;
+
+        referencias_caixas[referencia].proxima = referencias_livres_caixas;
+        referencias_livres_caixas = referencia;
+        entregues++;
+    }
+
+    if (caixa >= 0 && caixas_postais[caixa].primeira < 0)
+    {
+        remove_caixa(caixa);
+    }
+
+    // A faxina descarta os segmentos que ficaram sem mensagens pendentes
+    if (entregues > 0)
+    {
+        caixas_alteradas = 1;
+        pthread_cond_signal(&faxina_caixas);
+    }
+
+    pthread_mutex_unlock(&trava_caixas);
+}
+
+// Retira o segmento da tabela, desfaz o mapeamento e apaga o arquivo. Deve ser chamada com trava_caixas,
+// que é liberada durante a remoção do arquivo
+void descarta_segmento_caixa(int segmento)
+{
+    char caminho[PATH_MAX];
+    char *mapa = segmentos_caixa[segmento].mapa;
+
+    snprintf(caminho, sizeof(caminho), "%s/caixa.%08u", diretorio_caixas, segmentos_caixa[segmento].numero);
+    segmentos_caixa[segmento].mapa = NULL;
+
+    pthread_mutex_unlock(&trava_caixas);
+
+    munmap(mapa, TAMANHO_SEGMENTO_CAIXA);
+    unlink(caminho);
+
+#ifdef MODO_DEBUGER
+    printf("\n Segmento de caixa postal %s descartado\n", caminho);
+#endif
+
+    pthread_mutex_lock(&trava_caixas);
+}
+
+// Copia para o segmento ativo as mensagens ainda pendentes de um segmento quase todo entregue, atualizando o
+// índice, para que o segmento possa ser descartado. Deve ser chamada com trava_caixas, que é liberada entre
+// uma mensagem e outra para não atrasar o laço principal
+void compacta_segmento_caixa(int segmento)
+{
+    int deslocamento = 0, caixa, referencia, novo_segmento, novo_deslocamento;
+    char nome[TAMANHO_NOME];
+    RegistroCaixa *registro;
+
+    while (deslocamento < segmentos_caixa[segmento].usado && segmentos_caixa[segmento].vivas > 0 && segmento != segmento_ativo_caixa)
+    {
+        registro = (RegistroCaixa *)(segmentos_caixa[segmento].mapa + deslocamento);
+
+        if (registro->estado == CAIXA_PENDENTE)
+        {
+            memcpy(nome, registro + 1, registro->tamanho_nome);
+            nome[registro->tamanho_nome] = '\0';
+
+            caixa = procura_caixa(nome, 0);
+            for (referencia = caixa >= 0 ? caixas_postais[caixa].primeira : -1; referencia >= 0; referencia = referencias_caixas[referencia].proxima)
+            {
+                if (referencias_caixas[referencia].segmento == segmento && referencias_caixas[referencia].deslocamento == deslocamento)
+                {
+                    break;
+                }
+            }
+
+            // A cópia é gravada antes de a original ser marcada; uma queda entre as duas entrega a mensagem
+            // duas vezes, mas não a perde
+            if (referencia >= 0 && acrescenta_registro_caixa(nome, (char *)(registro + 1) + registro->tamanho_nome, registro->tamanho_texto, registro->ordem, &novo_segmento, &novo_deslocamento) == 0)
+            {
+                referencias_caixas[referencia].segmento = novo_segmento;
+                referencias_caixas[referencia].deslocamento = novo_deslocamento;
+                registro->estado = CAIXA_ENTREGUE;
+                segmentos_caixa[segmento].vivas--;
+            }
+            else if (referencia < 0)
+            {
+                registro->estado = CAIXA_ENTREGUE;
+                segmentos_caixa[segmento].vivas--;
+            }
+            else
+            {
+                return; // sem espaço para a cópia; tenta de novo na próxima faxina
+            }
+        }
+
+        deslocamento += registro->tamanho;
+
+        pthread_mutex_unlock(&trava_caixas);
+        pthread_mutex_lock(&trava_caixas);
+    }
+}
+
+// Thread de faxina das caixas postais: a cada entrega, descarta os segmentos sem mensagens pendentes e
+// compacta os que têm menos de um quarto das mensagens ainda pendentes
+void *thread_faxina_caixas(void *argumento)
+{
+    int i;
+
+    pthread_mutex_lock(&trava_caixas);
+
+    while (1)
+    {
+        while (!caixas_alteradas)
+        {
+            pthread_cond_wait(&faxina_caixas, &trava_caixas);
+        }
+
+        caixas_alteradas = 0;
+
+        for (i = 0; i < MAX_SEGMENTOS_CAIXA; i++)
+        {
+            if (segmentos_caixa[i].mapa == NULL || i == segmento_ativo_caixa)
+            {
+                continue;
+            }
+
+            if (segmentos_caixa[i].vivas > 0 && segmentos_caixa[i].vivas * 4 < segmentos_caixa[i].total)
+            {
+                compacta_segmento_caixa(i);
+            }
+
+            if (segmentos_caixa[i].mapa != NULL && segmentos_caixa[i].vivas == 0 && i != segmento_ativo_caixa)
+            {
+                descarta_segmento_caixa(i);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int compara_numeros(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Abre os segmentos existentes no diretório das caixas postais, em ordem, refaz o índice das mensagens
+// pendentes e inicia a thread de faxina. Chamada depois de herdar as conexões, quando o binário anterior
+// já não grava mais nos segmentos
+void inicia_caixas_postais()
+{
+    int i, segmento, deslocamento, caixa, total_numeros = 0, pendentes = 0;
+    unsigned int numero, numeros[MAX_SEGMENTOS_CAIXA];
+    char nome[TAMANHO_NOME];
+    DIR *diretorio;
+    struct dirent *entrada;
+    RegistroCaixa *registro;
+    pthread_t thread;
+
+    if (diretorio_caixas == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < MAX_MENSAGENS_CAIXAS; i++)
+    {
+        referencias_caixas[i].proxima = i + 1 < MAX_MENSAGENS_CAIXAS ? i + 1 : -1;
+    }
+    referencias_livres_caixas = 0;
+
+    diretorio = opendir(diretorio_caixas);
+    if (diretorio == NULL)
+    {
+        error("\n Erro ao abrir o diretório das caixas postais");
+    }
+
+    while ((entrada = readdir(diretorio)) != NULL && total_numeros < MAX_SEGMENTOS_CAIXA)
+    {
+        if (sscanf(entrada->d_name, "caixa.%u", &numero) == 1)
+        {
+            numeros[total_numeros++] = numero;
+        }
+    }
+
+    closedir(diretorio);
+
+    qsort(numeros, total_numeros, sizeof(unsigned int), compara_numeros);
+
+    for (i = 0; i < total_numeros; i++)
+    {
+        segmento = abre_segmento_caixa(numeros[i], 0);
+        if (segmento < 0)
+        {
+            error("\n Erro ao abrir um segmento de caixa postal");
+        }
+
+        deslocamento = 0;
+        while (deslocamento + (int)sizeof(RegistroCaixa) <= TAMANHO_SEGMENTO_CAIXA)
+        {
+            registro = (RegistroCaixa *)(segmentos_caixa[segmento].mapa + deslocamento);
+            if (registro->tamanho == 0)
+            {
+                break;
+            }
+
+            segmentos_caixa[segmento].total++;
+
+            if (registro->ordem >= proxima_ordem_caixa)
+            {
+                proxima_ordem_caixa = registro->ordem + 1;
+            }
+
+            if (registro->estado == CAIXA_PENDENTE)
+            {
+                memcpy(nome, registro + 1, registro->tamanho_nome);
+                nome[registro->tamanho_nome] = '\0';
+
+                caixa = procura_caixa(nome, 1);
+                if (caixa < 0 || indexa_mensagem_caixa(caixa, segmento, deslocamento) < 0)
+                {
+                    error("\n Índice das caixas postais cheio");
+                }
+
+                segmentos_caixa[segmento].vivas++;
+                pendentes++;
+            }
+
+            deslocamento += registro->tamanho;
+        }
+
+        segmentos_caixa[segmento].usado = deslocamento;
+        segmento_ativo_caixa = segmento;
+    }
+
+#ifdef MODO_DEBUGER
+    printf("\n Caixas postais em %s: %d segmentos, %d mensagens pendentes\n", diretorio_caixas, total_numeros, pendentes);
+#endif
+
+    if (pthread_create(&thread, NULL, thread_faxina_caixas, NULL) != 0)
+    {
+        error("\n Erro ao criar a thread de faxina das caixas postais");
+    }
+
+    // Segmentos entregues antes da última parada são descartados logo
+    caixas_alteradas = 1;
+    pthread_cond_signal(&faxina_caixas);
+}
+
+// Envia a mensagem privada aos usuários conectados com o nome do destinatário ou, se não há nenhum, guarda
+// a mensagem na caixa postal do destinatário
+void envia_mensagem_privada(int indice_cliente, const char destinatario[], const char texto[], Cliente clientes_aprovados[])
+{
+    int i, entregues = 0;
+    char mensagem[TAMANHO_BUFFER + TAMANHO_NOME + 32];
+
+    // Com o prefixo, a mensagem pode passar do tamanho máximo; o corte não separa os bytes de um caractere
+    if (snprintf(mensagem, sizeof(mensagem), "[privada de %s] %s", clientes_aprovados[indice_cliente].nome, texto) >= TAMANHO_BUFFER)
+    {
+        for (i = TAMANHO_BUFFER - 1; i > 0 && (mensagem[i] & 0xc0) == 0x80; i--)
+        {
+        }
+        mensagem[i] = '\0';
+    }
+
+    for (i = 0; i < limite_clientes; i++)
+    {
+        if (clientes_aprovados[i].socket != 0 && !strcmp(clientes_aprovados[i].nome, destinatario))
+        {
+            enfileira_lote(clientes_aprovados[i].socket, mensagem, strlen(mensagem));
+            entregues++;
+        }
+    }
+
+    if (entregues > 0)
+    {
+        return;
+    }
+
+    if (diretorio_caixas == NULL)
+    {
+        snprintf(mensagem, sizeof(mensagem), "Usuário %s não está conectado.", destinatario);
+    }
+    else if (guarda_mensagem_caixa(destinatario, mensagem) < 0)
+    {
+        snprintf(mensagem, sizeof(mensagem), "Caixa postal de %s cheia; mensagem não entregue.", destinatario);
+    }
+    else
+    {
+        snprintf(mensagem, sizeof(mensagem), "Usuário %s desconectado; a mensagem será entregue quando o usuário entrar.", destinatario);
+    }
+
+    envia_mensagem(clientes_aprovados[indice_cliente].socket, mensagem, strlen(mensagem));
+}
+
+// Trata os comandos enviados por clientes aprovados. Retorna 1 se a mensagem era um comando
+int trata_comando(int indice_cliente, char buffer[], Cliente clientes_aprovados[])
+{
+    int pagina = 1, inicio_texto = 0;
+    unsigned long long sequencia;
+    char sala[TAMANHO_SALA];
+    char prefixo[TAMANHO_NOME] = "";
+    char resposta[TAMANHO_BUFFER];
+
+    if (sscanf(buffer, "/sala %32s", sala) == 1)
+    {
+        entra_sala(indice_cliente, sala, clientes_aprovados);
+        snprintf(resposta, TAMANHO_BUFFER, "Você entrou na sala %s.", sala);
+        envia_mensagem(clientes_aprovados[indice_cliente].socket, resposta, strlen(resposta));
+        return 1;
+    }
+
+    // "/quem", "/quem <prefixo>" ou "/quem <prefixo> <página>"; "/who" é aceito como sinônimo
+    if ((!strncmp(buffer, "/quem", 5) && (buffer[5] == '\0' || buffer[5] == ' ')) || (!strncmp(buffer, "/who", 4) && (buffer[4] == '\0' || buffer[4] == ' ')))
+    {
+        sscanf(buffer + (buffer[1] == 'q' ? 5 : 4), "%100s %d", prefixo, &pagina);
+        consulta_diretorio(clientes_aprovados[indice_cliente].socket, prefixo, pagina);
+        return 1;
+    }
+
+    // "/msg <usuário> <texto>": mensagem privada, guardada na caixa postal se o usuário estiver desconectado
+    if (sscanf(buffer, "/msg %100s %n", prefixo, &inicio_texto) == 1 && inicio_texto > 0 && buffer[inicio_texto] != '\0')
+    {
+        envia_mensagem_privada(indice_cliente, prefixo, buffer + inicio_texto, clientes_aprovados);
+        return 1;
+    }
+
+    // "/busca <termos>": mensagens de sala com todos os termos, respondida pela thread de busca; "/search" é
+    // aceito como sinônimo
+    if ((!strncmp(buffer, "/busca", 6) && (buffer[6] == '\0' || buffer[6] == ' ')) || (!strncmp(buffer, "/search", 7) && (buffer[7] == '\0' || buffer[7] == ' ')))
+    {
+        pede_busca(indice_cliente, buffer + (buffer[1] == 'b' ? 6 : 7), clientes_aprovados);
+        return 1;
+    }
+
+    // Pedido de sessão retomável: a partir daqui as mensagens da sala chegam com a sequência
+    if (!strcmp(buffer, MARCA_SESSAO))
+    {
+        if (clientes_aprovados[indice_cliente].token == 0)
+        {
+            clientes_aprovados[indice_cliente].token = gera_token();
+        }
+
+        snprintf(resposta, TAMANHO_BUFFER, MARCA_SESSAO " %016llx %llu", clientes_aprovados[indice_cliente].token, sequencia_historico);
+        envia_mensagem(clientes_aprovados[indice_cliente].socket, resposta, strlen(resposta));
+        return 1;
+    }
+
+    if (!strncmp(buffer, MARCA_EVENTO, strlen(MARCA_EVENTO)))
+    {
+        registra_evento(indice_cliente, buffer + strlen(MARCA_EVENTO), clientes_aprovados);
+        return 1;
+    }
+
+    // Confirmação cumulativa: basta guardar a maior sequência confirmada, que só avança
+    if (!strncmp(buffer, MARCA_CONFIRMACAO, strlen(MARCA_CONFIRMACAO)))
+    {
+        if (sscanf(buffer + strlen(MARCA_CONFIRMACAO), "%llu", &sequencia) == 1 && sequencia > clientes_aprovados[indice_cliente].ultimo_ack &&
+            sequencia <= sequencia_historico)
+        {
+            clientes_aprovados[indice_cliente].ultimo_ack = sequencia;
+        }
+
+#ifdef MODO_DEBUGER
+        printf("\n Cliente %d confirmou até a sequência %llu\n", clientes_aprovados[indice_cliente].socket, clientes_aprovados[indice_cliente].ultimo_ack);
+#endif
+        return 1;
+    }
+
+    return 0;
+}
+
+// Verifica se há novas mensagens em algum socket de cliente aprovado. Se houver, verifica recebimento de nome de usuário válido recebido e envia mensagem recebida para outros clientes
+void trata_clientes_aprovados(int clientes_sockets[], Cliente clientes_aprovados[], int maxClients, fd_set *readfds, char buffer[], int tamanho_buffer)
+{
+    int i, socket_cliente, tamanho;
+    char string_erro_cliente[100];
+
+    for (i = 0; i < maxClients; i++)
+    {
+        if (clientes_aprovados[i].socket == 0)
+        {
+            continue;
+        }
+
+        socket_cliente = clientes_aprovados[i].socket;
+
+        if (FD_ISSET(socket_cliente, readfds) == 0)
+        {
+            continue;
+        }
+
+#ifdef MODO_DEBUGER
+        printf("\n Há atividade no cliente %d\n", socket_cliente);
+#endif
+
+        // Receber a mensagem do cliente
+        memset(buffer, 0, tamanho_buffer);
+
+        if (recebe_mensagem(socket_cliente, buffer, tamanho_buffer, &tamanho) <= 0)
+        {
+            snprintf(string_erro_cliente, TAMANHO_BUFFER, "\n Erro ao receber a mensagem, desconectando cliente %d", socket_cliente);
+
+            perror(string_erro_cliente);
+
+            // Desconectar o cliente
+            fecha_socket(socket_cliente);
+            libera_posicao_cliente(i);
+            clientes_aprovados[i].socket = 0;
+            suspende_sessao(&clientes_aprovados[i]);
+            sai_sala(i, clientes_aprovados);
+            anuncia_usuario("SAI", clientes_aprovados[i].nome);
+            diretorio_remove(clientes_aprovados[i].nome);
+            troca_nome(&clientes_aprovados[i].nome, "");
+            clientes_aprovados[i].token = 0;
+            clientes_aprovados[i].ultimo_ack = 0;
+            clientes_aprovados[i].evento_pendente = 0;
+            clientes_aprovados[i].recebe_eventos = 0;
+            continue;
+        }
+
+        registra_captura(i, CAPTURA_QUADRO, buffer, tamanho);
+
+        // Mensagens vazias não têm o que entregar
+        if (tamanho == 0)
+        {
+            continue;
+        }
+
+        // Validada uma única vez aqui, a mensagem segue adiante sem bytes nulos nem caracteres de controle
+        if (valida_mensagem(buffer, tamanho) < 0)
+        {
+#ifdef MODO_DEBUGER
+            printf("\n Mensagem com UTF-8 inválido do cliente %d descartada\n", socket_cliente);
+#endif
+            envia_mensagem(socket_cliente, "Mensagem descartada: UTF-8 inválido.", strlen("Mensagem descartada: UTF-8 inválido."));
+            continue;
+        }
+
+#ifdef MODO_DEBUGER
+        printf("\n Mensagem recebida: %s\n", buffer);
+#endif
+
+        if (trata_comando(i, buffer, clientes_aprovados))
+        {
+            continue;
+        }
+
+        // Enviar a mensagem para os outros clientes da sala, neste e nos demais servidores da federação,
+        // depois das etapas de processamento
+        envia_mensagem_processada(i, buffer, clientes_aprovados);
+    }
+}
+
+// Verifica se há novas mensagens em algum socket de cliente. Se houver, envia mensagem recebida para outros clientes
+void recebe_envia_mensagens_clientes(int clientes_sockets[], Cliente clientes_aprovados[], int maxClients, fd_set *readfds, char buffer[], int tamanho_buffer)
+{
+    int i, socket_cliente, tamanho;
+    char string_erro_cliente[100];
+
+    for (i = 0; i < maxClients; i++)
+    {
+        socket_cliente = clientes_aprovados[i].socket;
+
+        if (FD_ISSET(socket_cliente, readfds) == 0)
+        {
+            continue;
+        }
+
+#ifdef MODO_DEBUGER
+        printf("\n Há atividade no cliente %d\n", socket_cliente);
+#endif
+
+        // Receber a mensagem do cliente
+        memset(buffer, 0, tamanho_buffer);
+
+        if (recebe_mensagem(socket_cliente, buffer, tamanho_buffer, &tamanho) <= 0 || valida_mensagem(buffer, tamanho) < 0)
+        {
+            snprintf(string_erro_cliente, TAMANHO_BUFFER, "\n Erro ao receber a mensagem, desconectando cliente %d", socket_cliente);
+
+            perror(string_erro_cliente);
+
+            // Desconectar o cliente
+            fecha_socket(socket_cliente);
+            libera_posicao_cliente(i);
+            clientes_aprovados[i].socket = 0;
+            troca_nome(&clientes_aprovados[i].nome, "");
+            continue;
+        }
+
+#ifdef MODO_DEBUGER
+        printf("\n Mensagem recebida: %s\n", buffer);
+#endif
+
+        // Enviar a mensagem para os outros clientes conectados
+        broadcast_message(socket_cliente, buffer, tamanho, clientes_sockets, maxClients);
+    }
+}
+
+// Confirma se a mensagem de boas vindas que o cliente recebeu estava correta e, estando, o aprova para comunicação
+int confirma_mensagem_aprovacao(int indice_cliente, int clientes_pendentes[], char buffer[], Cliente clientes_aprovados[])
+{
+    int i;
+    int retorno_cliente;
+    char mensagem_aprovacao[TAMANHO_BUFFER];
+
+    snprintf(mensagem_aprovacao, TAMANHO_BUFFER, "Usuário %s aprovado!", clientes_aprovados[indice_cliente].nome);
+
+#ifdef MODO_DEBUGER
+    printf("\n Usuário aceitou aprovação?\n");
+    printf(" Buffer: %s\n", buffer);
+    printf(" Mensagem_aprovacao: %s\n", mensagem_aprovacao);
+#endif
+
+    if (strcmp(buffer, mensagem_aprovacao))
+    {
+        return -2;
+    }
+
+#ifdef MODO_DEBUGER
+    printf("\n Sim!\n");
+#endif
+
+    clientes_aprovados[indice_cliente].socket = clientes_pendentes[indice_cliente];
+
+    snprintf(mensagem_aprovacao, TAMANHO_BUFFER, "Seja bem vindo ao comunicador! Segue abaixo a lista de usuarios ativos no sistema para envio de mensagens:", buffer);
+
+    retorno_cliente = envia_mensagem(clientes_aprovados[indice_cliente].socket, mensagem_aprovacao, strlen(mensagem_aprovacao));
+
+    if (retorno_cliente <= 0)
+    {
+        return retorno_cliente;
+    }
+
+    strncpy(mensagem_aprovacao, "0 - Envio a todos os usuários", TAMANHO_BUFFER);
+
+    retorno_cliente = envia_mensagem(clientes_aprovados[indice_cliente].socket, mensagem_aprovacao, strlen(mensagem_aprovacao));
+
+    if (retorno_cliente <= 0)
+    {
+        return retorno_cliente;
+    }
+
+    for (i = 0; i < limite_clientes; i++)
+    {
+        if ((clientes_aprovados[i].socket == 0) || (i == indice_cliente))
+        {
+            continue;
+        }
+
+        snprintf(mensagem_aprovacao, TAMANHO_BUFFER, "%d - %s", clientes_aprovados[i].socket, clientes_aprovados[i].nome);
+
+        retorno_cliente = envia_mensagem(clientes_aprovados[indice_cliente].socket, mensagem_aprovacao, strlen(mensagem_aprovacao));
+
+        if (retorno_cliente <= 0)
+        {
+            return retorno_cliente;
+        }
+    }
+
+    // Usuários conectados em outros servidores da federação
+    for (i = 0; i < MAX_REMOTOS; i++)
+    {
+        if (remotos[i].id_no == 0)
+        {
+            continue;
+        }
+
+        snprintf(mensagem_aprovacao, TAMANHO_BUFFER, "%s (servidor %d)", remotos[i].nome, remotos[i].id_no);
+
+        retorno_cliente = envia_mensagem(clientes_aprovados[indice_cliente].socket, mensagem_aprovacao, strlen(mensagem_aprovacao));
+
+        if (retorno_cliente <= 0)
+        {
+            return retorno_cliente;
+        }
+    }
+
+    strncpy(mensagem_aprovacao, "Para enviar mensagens através deste comunicador, primeiro envie o número identificador do usuário e, logo após, a mensagem desejada. Você está na sala " SALA_PADRAO "; use /sala <nome> para trocar de sala.", TAMANHO_BUFFER);
+
+    retorno_cliente = envia_mensagem(clientes_aprovados[indice_cliente].socket, mensagem_aprovacao, strlen(mensagem_aprovacao));
+
+    if (retorno_cliente <= 0)
+    {
+        return retorno_cliente;
+    }
+
+    return -7; // Caso de aprovação aproveitando valor de retorno negativo livre
+}
+
+// Retoma a sessão suspensa indicada no pedido "RETOMAR <token> <última sequência recebida>", dispensando a
+// aprovação do nome, e envia as mensagens da sala que o cliente perdeu. Se a sessão não existir mais, o
+// cliente é avisado e segue pela aprovação normal do nome
+int retoma_sessao(int indice_cliente, int clientes_pendentes[], char buffer[], Cliente clientes_aprovados[])
+{
+    int i, retorno_cliente;
+    unsigned long long token = 0, ultima_seq;
+    long long agora = agora_ms();
+    char resposta[TAMANHO_BUFFER];
+    Cliente *cliente = &clientes_aprovados[indice_cliente];
+
+    if (sscanf(buffer + strlen(MARCA_RETOMAR), "%llx %llu", &token, &ultima_seq) != 2)
+    {
+        token = 0;
+    }
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+        if (token != 0 && suspensas[i].token == token && suspensas[i].expira_ms > agora)
+        {
+            break;
+        }
+    }
+
+    if (i == MAX_CLIENTS)
+    {
+#ifdef MODO_DEBUGER
+        printf("\n Sessão %llx desconhecida ou expirada\n", token);
+#endif
+        retorno_cliente = envia_mensagem(clientes_pendentes[indice_cliente], MARCA_EXPIRADA, strlen(MARCA_EXPIRADA));
+
+        return retorno_cliente <= 0 ? retorno_cliente : 1;
+    }
+
+    troca_nome(&cliente->nome, suspensas[i].nome);
+    troca_nome(&cliente->sala, suspensas[i].sala);
+    cliente->token = token;
+    cliente->ultimo_ack = suspensas[i].ultimo_ack;
+    troca_nome(&suspensas[i].nome, "");
+    troca_nome(&suspensas[i].sala, "");
+    cliente->socket = clientes_pendentes[indice_cliente];
+    suspensas[i].token = 0;
+
+    // Mensagens recebidas mas não confirmadas como processadas também são reenviadas
+    if (cliente->ultimo_ack != 0 && cliente->ultimo_ack < ultima_seq)
+    {
+        ultima_seq = cliente->ultimo_ack;
+    }
+
+#ifdef MODO_DEBUGER
+    printf("\n Sessão de %s retomada a partir da sequência %llu\n", cliente->nome, ultima_seq);
+#endif
+
+    snprintf(resposta, TAMANHO_BUFFER, MARCA_SESSAO " %016llx %llu", token, sequencia_historico);
+
+    if (envia_mensagem(cliente->socket, resposta, strlen(resposta)) <= 0 || envia_lacuna(cliente, ultima_seq) < 0)
+    {
+        cliente->socket = 0;
+        return -1;
+    }
+
+    return -7;
+}
+
+// Verifica recebimento de nomes válidos dos novos funcionários. Se o nome for aprovado, chama função para enviar mensagem de boas vindas e a lista de usuários aprovados.
+void trata_aprovacao_clientes(int clientes_sockets[], int clientes_pendentes[], Cliente clientes_aprovados[], int maxClients, fd_set *readfds, char buffer[], int tamanho_nome)
+{
+    int i, retorno_cliente, tamanho, no_par;
+    char mensagem_aprovacao[TAMANHO_BUFFER];
+    char string_erro_cliente[100];
+
+    for (i = 0; i < maxClients; i++)
+    {
+        if (clientes_pendentes[i] == 0)
+        {
+            continue;
+        }
+
+        if (FD_ISSET(clientes_pendentes[i], readfds) == 0)
+        {
+            continue;
+        }
+
+#ifdef MODO_DEBUGER
+        printf("\n Há atividade no cliente %d\n", clientes_pendentes[i]);
+#endif
+
+        memset(buffer, 0, TAMANHO_BUFFER);
+
+        if (recebe_mensagem(clientes_pendentes[i], buffer, tamanho_nome, &tamanho) <= 0)
+        {
+            snprintf(string_erro_cliente, TAMANHO_BUFFER, "\n Erro ao receber a mensagem, desconectando cliente %d", clientes_pendentes[i]);
+
+            perror(string_erro_cliente);
+
+            deconecta_cliente(i, clientes_sockets, clientes_pendentes, clientes_aprovados);
+            continue;
+        }
+
+#ifdef MODO_DEBUGER
+        printf("\n Nome recebido do cliente: %s\n", buffer);
+#endif
+
+        // Só quem apresenta o segredo da federação vira par; qualquer outro pedido derruba a conexão
+        if (clientes_aprovados[i].nome[0] == '\0' && !strncmp(buffer, MARCA_PAR, strlen(MARCA_PAR)))
+        {
+            FD_CLR(clientes_pendentes[i], readfds);
+            no_par = identifica_par(buffer);
+            if (no_par == 0)
+            {
+                snprintf(string_erro_cliente, sizeof(string_erro_cliente), "\n Identificação de servidor par recusada, desconectando cliente %d", clientes_pendentes[i]);
+                perror(string_erro_cliente);
+                deconecta_cliente(i, clientes_sockets, clientes_pendentes, clientes_aprovados);
+                continue;
+            }
+
+            promove_par(i, clientes_pendentes, clientes_aprovados, no_par);
+            continue;
+        }
+
+        if (clientes_aprovados[i].nome[0] == '\0' && (!strncmp(buffer, MARCA_ENVIA, strlen(MARCA_ENVIA)) || !strncmp(buffer, MARCA_RECEBE, strlen(MARCA_RECEBE))))
+        {
+            FD_CLR(clientes_pendentes[i], readfds);
+            promove_transferencia(i, clientes_pendentes, clientes_aprovados, buffer);
+            continue;
+        }
+
+        // Links de servidores e conexões de dados ficam fora da captura, que reproduz apenas os clientes
+        registra_captura(i, CAPTURA_QUADRO, buffer, tamanho);
+
+        if (clientes_aprovados[i].nome[0] == '\0' && !strncmp(buffer, MARCA_RETOMAR, strlen(MARCA_RETOMAR)))
+        {
+            retorno_cliente = retoma_sessao(i, clientes_pendentes, buffer, clientes_aprovados);
+        }
+        else if (clientes_aprovados[i].nome[0] == '\0')
+        {
+            troca_nome(&clientes_aprovados[i].nome, buffer);
+            snprintf(mensagem_aprovacao, TAMANHO_BUFFER, "Usuário %s aprovado!", buffer);
+
+            retorno_cliente = envia_mensagem(clientes_pendentes[i], mensagem_aprovacao, strlen(mensagem_aprovacao));
+        }
+        else
+        {
+            retorno_cliente = confirma_mensagem_aprovacao(i, clientes_pendentes, buffer, clientes_aprovados);
+        }
+
+        switch (retorno_cliente)
+        {
+        case 0:
+            snprintf(string_erro_cliente, TAMANHO_BUFFER, "\n Conexão encerrada, desconectando cliente %d", clientes_pendentes[i]);
+            perror(string_erro_cliente);
+
+            deconecta_cliente(i, clientes_sockets, clientes_pendentes, clientes_aprovados);
+            break;
+
+        case -1:
+            snprintf(string_erro_cliente, TAMANHO_BUFFER, "\n Erro ao enviar a mensagem, desconectando cliente %d", clientes_pendentes[i]);
+            perror(string_erro_cliente);
+
+            deconecta_cliente(i, clientes_sockets, clientes_pendentes, clientes_aprovados);
+            break;
+
+        case -2:
+            snprintf(string_erro_cliente, TAMANHO_BUFFER, "\n Mensagem de confirmação diferente do que o esperado, desconectando cliente %d", clientes_pendentes[i]);
+            perror(string_erro_cliente);
+
+            deconecta_cliente(i, clientes_sockets, clientes_pendentes, clientes_aprovados);
+            break;
+
+        case -7:
+            // Caso de aprovação aproveitando valor de retorno negativo livre
+#ifdef MODO_DEBUGER
+            printf("\n Usuário aprovado\n");
+#endif
+            // O cliente deixa de ser pendente e a mensagem já consumida não deve ser lida de novo nesta rodada
+            FD_CLR(clientes_pendentes[i], readfds);
+            clientes_pendentes[i] = 0;
+            anuncia_usuario("ENTRA", clientes_aprovados[i].nome);
+            diretorio_insere(clientes_aprovados[i].nome);
+            // O cliente que retomou a sessão volta para a sala em que estava
+            entra_sala(i, clientes_aprovados[i].sala[0] != '\0' ? clientes_aprovados[i].sala : SALA_PADRAO, clientes_aprovados);
+            entrega_caixa_postal(i, clientes_aprovados);
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+// Envia um descritor de arquivo pelo socket Unix, junto com os dados que o acompanham
+int envia_descritor(int canal, int descritor, void *dados, int tamanho)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char controle[CMSG_SPACE(sizeof(int))];
+
+    memset(&msg, 0, sizeof(msg));
+    memset(controle, 0, sizeof(controle));
+
+    iov.iov_base = dados;
+    iov.iov_len = tamanho;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = controle;
+    msg.msg_controllen = sizeof(controle);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &descritor, sizeof(int));
+
+    return sendmsg(canal, &msg, 0);
+}
+
+// Recebe um descritor de arquivo pelo socket Unix, junto com os dados que o acompanham
+int recebe_descritor(int canal, int *descritor, void *dados, int tamanho)
+{
+    int recebido;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char controle[CMSG_SPACE(sizeof(int))];
+
+    memset(&msg, 0, sizeof(msg));
+
+    iov.iov_base = dados;
+    iov.iov_len = tamanho;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = controle;
+    msg.msg_controllen = sizeof(controle);
+
+    recebido = recvmsg(canal, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (recebido != tamanho)
+    {
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        return -1;
+    }
+
+    memcpy(descritor, CMSG_DATA(cmsg), sizeof(int));
+
+    // O descritor é usado pelo processo inteiro, não apenas até o próximo exec
+    fcntl(*descritor, F_SETFD, 0);
+
+    return recebido;
+}
+
+// Cria o socket Unix no qual um novo binário pode pedir a transferência das conexões
+void cria_socket_troca()
+{
+    struct sockaddr_un troca_addr;
+
+    trocafd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (trocafd < 0)
+    {
+        error("\n Erro ao criar o socket de troca\n ");
+    }
+
+    memset(&troca_addr, 0, sizeof(troca_addr));
+    troca_addr.sun_family = AF_UNIX;
+    strncpy(troca_addr.sun_path, caminho_troca, sizeof(troca_addr.sun_path) - 1);
+
+    unlink(caminho_troca);
+
+    if (bind(trocafd, (struct sockaddr *)&troca_addr, sizeof(troca_addr)) < 0)
+    {
+        error("\n Erro ao vincular o socket de troca\n ");
+    }
+
+    if (listen(trocafd, 1) < 0)
+    {
+        error("\n Erro ao aguardar pedidos de troca\n ");
+    }
+}
+
+// Transfere o socket do servidor e as sessões dos clientes ao novo binário. Retorna 0 se o novo
+// binário confirmou o recebimento, ou -1 se a troca falhou e este processo deve continuar atendendo
+int transfere_estado(int canal, int clientes_pendentes[], Cliente clientes_aprovados[])
+{
+    int i, total_sessoes = 0;
+    int tem_socket_unix = sockfd_unix > 0;
+    char confirmacao;
+    struct timeval prazo = {PRAZO_TROCA_MS / 1000, (PRAZO_TROCA_MS % 1000) * 1000};
+    EstadoSessao sessao;
+
+    // Um novo binário travado não pode deixar este processo parado para sempre sem atender ninguém
+    if (setsockopt(canal, SOL_SOCKET, SO_SNDTIMEO, &prazo, sizeof(prazo)) < 0 ||
+        setsockopt(canal, SOL_SOCKET, SO_RCVTIMEO, &prazo, sizeof(prazo)) < 0)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < limite_clientes; i++)
+    {
+        if (clientes_sockets[i] == 0)
+        {
+            continue;
+        }
+
+        // Sessões TLS cifradas em espaço de usuário têm estado que não acompanha o descritor
+        if (!socket_transferivel(clientes_sockets[i]))
+        {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+
+        total_sessoes++;
+    }
+
+    // O primeiro envio leva o socket do servidor e o número de sessões que virão em seguida
+    if (envia_descritor(canal, sockfd, &total_sessoes, sizeof(total_sessoes)) < 0)
+    {
+        return -1;
+    }
+
+    // O segundo envio informa se há socket Unix do servidor e, havendo, o leva junto
+    if (send(canal, &tem_socket_unix, sizeof(tem_socket_unix), 0) != sizeof(tem_socket_unix))
+    {
+        return -1;
+    }
+
+    if (tem_socket_unix && envia_descritor(canal, sockfd_unix, &tem_socket_unix, sizeof(tem_socket_unix)) < 0)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < limite_clientes; i++)
+    {
+        if (clientes_sockets[i] == 0)
+        {
+            continue;
+        }
+
+        memset(&sessao, 0, sizeof(sessao));
+        sessao.indice = i;
+        sessao.socket_original = clientes_sockets[i];
+        sessao.pendente = clientes_pendentes[i] != 0;
+        sessao.aprovado = clientes_aprovados[i].socket != 0;
+        strncpy(sessao.nome, clientes_aprovados[i].nome, TAMANHO_NOME - 1);
+        strncpy(sessao.sala, clientes_aprovados[i].sala, TAMANHO_SALA - 1);
+        sessao.token = clientes_aprovados[i].token;
+        sessao.ultimo_ack = clientes_aprovados[i].ultimo_ack;
+
+        if (envia_descritor(canal, clientes_sockets[i], &sessao, sizeof(sessao)) < 0)
+        {
+            return -1;
+        }
+    }
+
+    // Só encerra depois que o novo binário confirmar que assumiu todas as sessões
+    if (recv(canal, &confirmacao, 1, MSG_WAITALL) == 1)
+    {
+        return 0;
+    }
+
+    // Esgotado o prazo, o shutdown faz a confirmação que ainda viria falhar, e o novo binário desiste da troca.
+    // Uma confirmação que chegou entre o fim do prazo e o shutdown ainda vale, para os dois não atenderem juntos
+    shutdown(canal, SHUT_RDWR);
+    if (recv(canal, &confirmacao, 1, MSG_DONTWAIT) == 1)
+    {
+        return 0;
+    }
+
+    return -1;
+}
+
+// Verifica se um novo binário pediu a transferência das conexões. Se a troca for concluída, este processo
+// sai sem encerrar as conexões, que continuam abertas no novo binário
+void verifica_pedido_troca(fd_set *readfds, int clientes_pendentes[], Cliente clientes_aprovados[])
+{
+    int canal;
+
+    if (trocafd <= 0 || FD_ISSET(trocafd, readfds) == 0)
+    {
+        return;
+    }
+
+    canal = accept(trocafd, NULL, NULL);
+    if (canal < 0)
+    {
+        return;
+    }
+
+#ifdef MODO_DEBUGER
+    printf("\n Novo binário pediu a transferência das conexões\n");
+#endif
+
+    // Os lotes ficam na memória deste processo e precisam sair antes de os sockets mudarem de dono
+    despacha_lotes(1, NULL);
+
+    // O novo binário abre o log da busca assim que recebe as conexões; até lá, este já deve tê-lo fechado
+    encerra_busca();
+
+    if (transfere_estado(canal, clientes_pendentes, clientes_aprovados) < 0)
+    {
+        perror("\n Erro ao transferir as conexões, continuarei atendendo");
+        close(canal);
+        inicia_busca();
+        return;
+    }
+
+#ifdef MODO_DEBUGER
+    printf("\n Conexões transferidas ao novo binário, encerrando\n");
+#endif
+
+    encerra_captura();
+
+    // O caminho do socket de troca agora pertence ao novo binário e não é removido
+    exit(0);
+}
+
+// Recebe do binário em execução o socket do servidor e as sessões dos clientes
+void herda_estado(int clientes_pendentes[], Cliente clientes_aprovados[])
+{
+    int i, canal, total_sessoes, descritor, tem_socket_unix;
+    char confirmacao = 1;
+    struct sockaddr_un troca_addr;
+    EstadoSessao sessao;
+
+    canal = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (canal < 0)
+    {
+        error("\n Erro ao criar o socket de troca\n ");
+    }
+
+    memset(&troca_addr, 0, sizeof(troca_addr));
+    troca_addr.sun_family = AF_UNIX;
+    strncpy(troca_addr.sun_path, caminho_troca, sizeof(troca_addr.sun_path) - 1);
+
+    if (connect(canal, (struct sockaddr *)&troca_addr, sizeof(troca_addr)) < 0)
+    {
+        error("\n Erro ao conectar ao binário em execução\n ");
+    }
+
+    if (recebe_descritor(canal, &sockfd, &total_sessoes, sizeof(total_sessoes)) < 0)
+    {
+        error("\n Erro ao receber o socket do servidor\n ");
+    }
+
+    if (recv(canal, &tem_socket_unix, sizeof(tem_socket_unix), MSG_WAITALL) != sizeof(tem_socket_unix))
+    {
+        error("\n Erro ao receber o socket Unix do servidor\n ");
+    }
+
+    if (tem_socket_unix && recebe_descritor(canal, &sockfd_unix, &tem_socket_unix, sizeof(tem_socket_unix)) < 0)
+    {
+        error("\n Erro ao receber o socket Unix do servidor\n ");
+    }
+
+    for (i = 0; i < total_sessoes; i++)
+    {
+        if (recebe_descritor(canal, &descritor, &sessao, sizeof(sessao)) < 0 || sessao.indice < 0 || sessao.indice >= MAX_CLIENTS)
+        {
+            error("\n Erro ao receber uma sessão\n ");
+        }
+
+        // Mantém o mesmo número de descritor, que é o ID conhecido pelos usuários, quando ele estiver livre
+        if (descritor != sessao.socket_original && fcntl(sessao.socket_original, F_GETFD) < 0 && errno == EBADF)
+        {
+            if (dup2(descritor, sessao.socket_original) >= 0)
+            {
+                close(descritor);
+                descritor = sessao.socket_original;
+            }
+        }
+
+        clientes_sockets[sessao.indice] = descritor;
+        clientes_pendentes[sessao.indice] = sessao.pendente ? descritor : 0;
+        clientes_aprovados[sessao.indice].socket = sessao.aprovado ? descritor : 0;
+        sessao.nome[TAMANHO_NOME - 1] = '\0';
+        sessao.sala[TAMANHO_SALA - 1] = '\0';
+        troca_nome(&clientes_aprovados[sessao.indice].nome, sessao.nome);
+        troca_nome(&clientes_aprovados[sessao.indice].sala, sessao.sala);
+        clientes_aprovados[sessao.indice].token = sessao.token;
+        clientes_aprovados[sessao.indice].ultimo_ack = sessao.ultimo_ack;
+
+        if (sessao.aprovado)
+        {
+            diretorio_insere(sessao.nome);
+        }
+
+#ifdef MODO_DEBUGER
+        printf("\n Herdei o cliente %d (%s)\n", descritor, sessao.nome);
+#endif
+    }
+
+    // As sessões herdadas ocupam as mesmas posições que tinham no processo antigo
+    refaz_posicoes_livres();
+
+    if (send(canal, &confirmacao, 1, 0) != 1)
+    {
+        error("\n Erro ao confirmar a transferência\n ");
+    }
+
+    close(canal);
+}
+
+// Prepara descritor de arquivos com os sockets do servidor e dos clientes para o select
+// Marca como prontos os sockets com dados TLS já decifrados em memória. Retorna quantos foram marcados
+int marca_tls_pendentes(fd_set *readfds)
+{
+    int i, marcados = 0;
+
+    for (i = 0; i < limite_clientes; i++)
+    {
+        if (clientes_sockets[i] > 0 && tls_pendente(clientes_sockets[i]))
+        {
+            FD_SET(clientes_sockets[i], readfds);
+            marcados++;
+        }
+    }
+
+    for (i = 0; i < MAX_PARES; i++)
+    {
+        if (pares[i].socket > 0 && tls_pendente(pares[i].socket))
+        {
+            FD_SET(pares[i].socket, readfds);
+            marcados++;
+        }
+
+        if (pares[i].socket_conexao > 0 && pares[i].etapa_conexao == PAR_BOAS_VINDAS && tls_pendente(pares[i].socket_conexao))
+        {
+            FD_SET(pares[i].socket_conexao, readfds);
+            marcados++;
+        }
+    }
+
+    return marcados;
+}
+
+void prepara_descritor_arquivos(int clientes_sockets[], fd_set *readfds, int *max_socket_cliente)
+{
+    int i, socket_cliente;
+
+    // Limpar os conjuntos de descritores
+    FD_ZERO(readfds);
+    FD_SET(sockfd, readfds);
+    FD_SET(sinalfd, readfds);
+    *max_socket_cliente = sockfd > sinalfd ? sockfd : sinalfd;
+
+    if (trocafd > 0)
+    {
+        FD_SET(trocafd, readfds);
+        if (trocafd > *max_socket_cliente)
+        {
+            *max_socket_cliente = trocafd;
+        }
+    }
+
+    if (barramento != NULL)
+    {
+        FD_SET(eventos_workers[indice_worker], readfds);
+        if (eventos_workers[indice_worker] > *max_socket_cliente)
+        {
+            *max_socket_cliente = eventos_workers[indice_worker];
+        }
+    }
+
+    if (total_threads_pool > 0)
+    {
+        FD_SET(eventos_pool, readfds);
+        if (eventos_pool > *max_socket_cliente)
+        {
+            *max_socket_cliente = eventos_pool;
+        }
+    }
+
+    if (busca_ativa)
+    {
+        FD_SET(eventos_busca, readfds);
+        if (eventos_busca > *max_socket_cliente)
+        {
+            *max_socket_cliente = eventos_busca;
+        }
+    }
+
+    if (sockfd_unix > 0)
+    {
+        FD_SET(sockfd_unix, readfds);
+        if (sockfd_unix > *max_socket_cliente)
+        {
+            *max_socket_cliente = sockfd_unix;
+        }
+    }
+
+    for (i = 0; i < MAX_PARES; i++)
+    {
+        if (pares[i].socket <= 0)
+        {
+            continue;
+        }
+
+        FD_SET(pares[i].socket, readfds);
+        if (pares[i].socket > *max_socket_cliente)
+        {
+            *max_socket_cliente = pares[i].socket;
+        }
+    }
+
+    for (i = 0; i < limite_clientes; i++)
+    {
+        socket_cliente = clientes_sockets[i];
+        if (socket_cliente > 0)
+        {
+            FD_SET(socket_cliente, readfds);
+        }
+        if (socket_cliente > *max_socket_cliente)
+        {
+            *max_socket_cliente = socket_cliente;
+        }
+    }
+}
+
+// Ajusta o socket de um cliente recém conectado: limita os bytes não enviados guardados no kernel e, no
+// perfil de baixa latência, desliga o algoritmo de Nagle, fixa o tamanho dos buffers em vez do ajuste
+// automático do kernel e ativa a espera ativa nas leituras. As opções de TCP falham em silêncio nos sockets Unix
+void configura_socket_cliente(int socket_cliente)
 {
-    char nome[TAMANHO_NOME];
-    int socket;
-} Cliente;
+    int opcao;
 
-// Realiza fechamento seguro do comunicador na ocorrência de erros
-void error(const char *msg)
-{
-    int i;
+    // O kernel aceita só um pouco além do que já está em trânsito; o excedente das mensagens de sala fica
+    // retido na faixa de volume, e as demais mensagens não esperam atrás dele. Sem efeito em sockets Unix
+    opcao = LIMITE_NAO_ENVIADO;
+    setsockopt(socket_cliente, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opcao, sizeof(opcao));
 
-    if (sockfd > 0)
+    if (nucleo_baixa_latencia < 0)
     {
-        close(sockfd);
+        return;
     }
 
-    for (i = 0; i < MAX_CLIENTS; i++)
-    {
-        if (clientes_sockets[i] > 0)
-        {
-            close(clientes_sockets[i]);
-        }
-    }
+    opcao = 1;
+    setsockopt(socket_cliente, IPPROTO_TCP, TCP_NODELAY, &opcao, sizeof(opcao));
 
-    perror(msg);
-    exit(1);
+    opcao = BUFFER_SOCKET_BAIXA_LATENCIA;
+    setsockopt(socket_cliente, SOL_SOCKET, SO_SNDBUF, &opcao, sizeof(opcao));
+    setsockopt(socket_cliente, SOL_SOCKET, SO_RCVBUF, &opcao, sizeof(opcao));
+
+    // Valores acima de net.core.busy_read exigem CAP_NET_ADMIN; sem a permissão, fica a espera do select
+    opcao = ESPERA_BUSY_POLL_US;
+    setsockopt(socket_cliente, SOL_SOCKET, SO_BUSY_POLL, &opcao, sizeof(opcao));
 }
 
-// Realiza fechamento seguro do comunicador na ocorrência de sinais do sistema operacional
-void fecha_conexao()
+// Adiciona um novo socket de cliente aos arrays para aguardar aprovação
+// Retorna a posição ocupada, ou -1 se a tabela está cheia ou o descritor não cabe no select
+int adiciona_novo_cliente(int new_sockfd, int clientes_sockets[], int clientes_pendentes[])
 {
     int i;
 
-#ifdef MODO_DEBUGER
-    printf("\n Vou fechar as conexões\n");
-#endif
-    if (sockfd > 0)
+    if (new_sockfd >= FD_SETSIZE)
     {
-        close(sockfd);
+        return -1;
     }
 
-    for (i = 0; i < MAX_CLIENTS; i++)
+    i = reserva_posicao_cliente();
+    if (i < 0)
     {
-        if (clientes_sockets[i] > 0)
-        {
-            close(clientes_sockets[i]);
-        }
+        return -1;
     }
 
-    exit(1);
-}
+    clientes_sockets[i] = new_sockfd;
+    clientes_pendentes[i] = new_sockfd;
 
-// Desconecta o cliente que em algum momento apresentou falhas de comunicação
-void deconecta_cliente(int indice_cliente, int clientes_sockets[], int clientes_pendentes[], Cliente clientes_aprovados[])
-{
-#ifdef MODO_DEBUGER
-    printf("\n Vou desconectar o cliente %d\n", clientes_sockets[indice_cliente]);
-#endif
+    identificador_conexao[i] = proximo_identificador_conexao++;
+    registra_captura(i, CAPTURA_ABERTURA, NULL, 0);
 
-    close(clientes_sockets[indice_cliente]);
-    clientes_sockets[indice_cliente] = 0;
-    clientes_pendentes[indice_cliente] = 0;
-    clientes_aprovados[indice_cliente].socket = 0;
-    clientes_aprovados[indice_cliente].nome[0] = '\0';
+    return i;
 }
 
-// Envia uma mensagem pela rede
-int envia_mensagem(int dest_socket, char buffer[], int tamanho)
+// Admite uma conexão pronta para a aprovação: ocupa uma posição pendente e recebe as boas vindas
+void admite_cliente(int new_sockfd, int clientes_sockets[], int clientes_pendentes[], char buffer[], int tamanho_buffer)
 {
-    int enviado; // número de bytes enviados em cada chamada
-
-    // Enviar o tamanho da mensagem
+    // Adicionar o novo socket dos clientes ao array
+    if (adiciona_novo_cliente(new_sockfd, clientes_sockets, clientes_pendentes) < 0)
+    {
 #ifdef MODO_DEBUGER
-    printf("\n Tamanho da mensagem: %d", tamanho);
-    printf("\n Tamanho do tamanho: %d\n", sizeof(tamanho));
+        printf("\n Tabela de conexões cheia, recusando o cliente %d\n", new_sockfd);
 #endif
+        fecha_socket(new_sockfd);
+        return;
+    }
 
-    enviado = send(dest_socket, (char *)&tamanho, sizeof(tamanho), 0);
+    configura_socket_cliente(new_sockfd);
 
-#ifdef MODO_DEBUGER
-    printf("\n Tamanho enviado: %d\n", enviado);
-#endif
+    // Armazena e envia a mensagem de boas vindas para o cliente recém conectado
+    snprintf(buffer, tamanho_buffer, "Bem vindo, cliente %d! Digite seu nome de usuário com até 100 caracteres para ser aprovado no comunicador.", new_sockfd);
 
-    if (enviado <= 0)
+    // A conexão já ocupa uma posição pendente, liberada pelo caminho normal de desconexão
+    if (envia_mensagem(new_sockfd, buffer, strlen(buffer)) < 0)
     {
-        return enviado; // erro ao enviar tamanho
+        derruba_destinatario(new_sockfd);
     }
 
-    // Enviar a mensagem
 #ifdef MODO_DEBUGER
-    printf("\n Mensagem: %s\n", buffer);
+    printf("\n Adicionei novo socket de clientes\n");
 #endif
+}
 
-    enviado = send(dest_socket, buffer, tamanho, 0);
+// Acrescenta ao select as conexões aceitas com handshake TLS em andamento, com o evento que cada uma
+// aguarda. Retorna quantas são, para o select acordar periodicamente e descartar as que estourarem o prazo
+int prepara_handshakes(fd_set *readfds, fd_set *writefds, int *max_socket_cliente)
+{
+#ifdef COM_TLS
+    int i;
 
-#ifdef MODO_DEBUGER
-    printf("\n Tamanho enviado: %d\n", enviado);
-#endif
+    for (i = 0; i < total_handshakes; i++)
+    {
+        FD_SET(handshakes[i].socket, handshakes[i].quer_escrita ? writefds : readfds);
+        if (handshakes[i].socket > *max_socket_cliente)
+        {
+            *max_socket_cliente = handshakes[i].socket;
+        }
+    }
 
-    return enviado; // sucesso ao enviar mensagem ou erro se enviado <= 0
+    return total_handshakes;
+#else
+    return 0;
+#endif
 }
 
-// Recebe uma mensagem pela rede
-int recebe_mensagem(int client_socket, char buffer[], int tamanho_buffer)
+// Avança os handshakes TLS das conexões aceitas conforme os eventos do select. Concluído o handshake, a
+// conexão é admitida; com erro ou fora do prazo, como a de quem conecta e nunca envia o ClientHello, é descartada
+void trata_handshakes(fd_set *readfds, fd_set *writefds, int clientes_sockets[], int clientes_pendentes[], char buffer[], int tamanho_buffer)
 {
-    int total = 0;               // total de bytes recebidos
-    int bytesLeft = sizeof(int); // bytes restantes para receber o tamanho
-    int n;                       // número de bytes recebidos em cada chamada
-    int size;                    // tamanho da mensagem na ordem de bytes do host
+#ifdef COM_TLS
+    int i = 0, retorno, socket_cliente;
+    long long agora = agora_ms();
 
-    // Receber o tamanho da mensagem
-    while (total < sizeof(int))
+    while (i < total_handshakes)
     {
-#ifdef MODO_DEBUGER
-        printf("\n Receber tamanho da mensagem do cliente %d\n", client_socket);
-#endif
+        socket_cliente = handshakes[i].socket;
+        retorno = 0;
 
-        n = recv(client_socket, (char *)&size + total, bytesLeft, 0);
+        if (FD_ISSET(socket_cliente, handshakes[i].quer_escrita ? writefds : readfds))
+        {
+            retorno = avanca_handshake(socket_cliente, &handshakes[i].quer_escrita);
+        }
 
-        if (n <= 0)
+        if (retorno == 0 && agora < handshakes[i].prazo_ms)
         {
-            return n; // erro ao receber tamanho ou conexão fechada pelo outro lado
+            i++;
+            continue;
         }
 
-        total += n;
-        bytesLeft -= n;
+        // A última entrada ocupa a posição liberada
+        handshakes[i] = handshakes[--total_handshakes];
 
+        if (retorno < 1)
+        {
 #ifdef MODO_DEBUGER
-        printf("\n N: %d", n);
-        printf("\n Tamanho: %d", size);
-        printf("\n Total: %d", total);
-        printf("\n BytesLeft: %d\n", bytesLeft);
+            printf("\n Handshake TLS com %d falhou ou estourou o prazo, descartando a conexão\n", socket_cliente);
 #endif
-    }
-
-    // size = ntohl(size); // converter o tamanho da mensagem para a ordem de bytes do host
-
-    // buffer = malloc(size); // alocar memória para a mensagem
+            fecha_socket(socket_cliente);
+            continue;
+        }
 
-    if (buffer == NULL)
-    {
-        return -3; // erro ao alocar memória
+        // O evento de leitura foi consumido pelo handshake; a aprovação só lê a conexão a partir do próximo select
+        FD_CLR(socket_cliente, readfds);
+        admite_cliente(socket_cliente, clientes_sockets, clientes_pendentes, buffer, tamanho_buffer);
     }
+#endif
+}
 
-    total = 0;        // reiniciar o total de bytes recebidos
-    bytesLeft = size; // bytes restantes para receber a mensagem
+// Verifica se há uma nova conexão
+void verifica_novas_conexoes(int sockfd, int usar_tls, int clientes_sockets[], int clientes_pendentes[], fd_set *readfds, char buffer[], int tamanho_buffer)
+{
+    int new_sockfd;
+    struct sockaddr_storage client_addr; // comporta tanto clientes TCP quanto clientes Unix
+    socklen_t client_len = sizeof(client_addr);
 
-    // Receber a mensagem
-    while (total < size)
+    if (sockfd > 0 && FD_ISSET(sockfd, readfds))
     {
-#ifdef MODO_DEBUGER
-        printf("\n Receber mensagem do cliente %d\n", client_socket);
-#endif
-        n = recv(client_socket, buffer + total, bytesLeft, 0);
+        new_sockfd = accept(sockfd, (struct sockaddr *)&client_addr, &client_len);
 
-        if (n <= 0)
+        // Com workers, o socket do servidor é compartilhado e outro worker pode ter aceitado a conexão antes
+        if (new_sockfd < 0 && total_workers > 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
         {
-            // free(buffer); // liberar a memória alocada
-            return n; // erro ao receber mensagem ou conexão fechada pelo outro lado
+            return;
         }
 
-        total += n;
-        bytesLeft -= n;
+        // Falta de descritores ou conexão abortada antes do accept não devem encerrar o servidor
+        if (new_sockfd < 0)
+        {
+            perror("\n Erro ao aceitar a conexão");
+            return;
+        }
 
-#ifdef MODO_DEBUGER
-        printf("\n N: %d", n);
-        printf("\n Buffer: %s", buffer);
-        printf("\n Total: %d", total);
-        printf("\n BytesLeft: %d\n", bytesLeft);
+#ifdef COM_TLS
+        // O handshake segue pelos eventos do select, em trata_handshakes, para que um cliente lento ou mudo não
+        // trave o laço; a conexão só é admitida depois dele. Sem espaço ou com falha, descarta apenas esta conexão
+        if (usar_tls)
+        {
+            if (new_sockfd >= FD_SETSIZE || total_handshakes == MAX_HANDSHAKES || inicia_handshake(new_sockfd, tls_contexto, 1) < 0)
+            {
+                close(new_sockfd);
+                return;
+            }
+
+            handshakes[total_handshakes].socket = new_sockfd;
+            handshakes[total_handshakes].quer_escrita = 0;
+            handshakes[total_handshakes].prazo_ms = agora_ms() + PRAZO_HANDSHAKE_MS;
+            total_handshakes++;
+            return;
+        }
 #endif
-    }
 
-    // free(buffer); // liberar a memória alocada
-    return n; // sucesso ao receber
+        admite_cliente(new_sockfd, clientes_sockets, clientes_pendentes, buffer, tamanho_buffer);
+    }
+#ifdef MODO_DEBUGER
+    else
+    {
+        printf("\n Nenhum novo cliente. Vou verificar recebimento e tratamento de mensagens.\n");
+    }
+#endif
 }
 
-// Envia uma mensagem para todos os outros clientes conectados
-void broadcast_message(int socket_cliente, char buffer[], int clientes_sockets[], int max_clients)
+// Cria o socket TCP do servidor, vincula ao endereço e começa a esperar por conexões
+void cria_socket_servidor()
 {
-    int i, dest_socket;
+    int optval = 1; // valor da opção SO_REUSEADDR
+    struct sockaddr_in server_addr;
+
+    // Criar o socket
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+    {
+        error("\n Erro ao criar o socket\n ");
+    }
 
 #ifdef MODO_DEBUGER
-    printf("\n Mensagem recebida broadcast: %s", buffer);
-    printf("\n Tamanho da mensagem broadcast: %d\n", strlen(buffer));
+    printf("\n Criei o socket %d do servidor\n", sockfd);
 #endif
 
-    for (i = 0; i < max_clients; i++)
+    // Configurar o endereço do servidor
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(porta_servidor);
+
+    // Configurar a opção SO_REUSEADDR
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0)
     {
-        dest_socket = clientes_sockets[i];
-        if (dest_socket == 0 || dest_socket == socket_cliente)
-        {
-            continue;
-        }
-        if (envia_mensagem(dest_socket, buffer, strlen(buffer)) <= 0)
-        {
-            error("\n Erro ao enviar a mensagem para outro cliente \n ");
-        }
+        error("\n Erro ao configurar a opção SO_REUSEADDR\n ");
+    }
+
+    // Vincular o socket ao endereço
+    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        error("\n Erro ao vincular o socket ao endereço\n ");
+    }
+
+#ifdef MODO_DEBUGER
+    printf("\n Vinculei o socket ao endereço e vou esperar conexões\n");
+#endif
+
+    // Esperar por conexões
+    if (listen(sockfd, MAX_CLIENTS) < 0)
+    {
+        error("\n Erro ao aguardar por conexões\n ");
     }
 }
 
-// Verifica se há novas mensagens em algum socket de cliente aprovado. Se houver, verifica recebimento de nome de usuário válido recebido e envia mensagem recebida para outros clientes
-void trata_clientes_aprovados(int clientes_sockets[], Cliente clientes_aprovados[], int maxClients, fd_set *readfds, char buffer[], int tamanho_buffer)
+// Cria o socket Unix do servidor, que atende com o mesmo protocolo dos clientes TCP
+void cria_socket_unix()
 {
-    int i, socket_cliente;
-    char string_erro_cliente[100];
+    struct sockaddr_un unix_addr;
+    socklen_t tamanho_endereco = chat_monta_endereco_unix(caminho_unix, &unix_addr);
 
-    for (i = 0; i < maxClients; i++)
+    sockfd_unix = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd_unix < 0)
     {
-        if (clientes_aprovados[i].socket == 0)
-        {
-            continue;
-        }
+        error("\n Erro ao criar o socket Unix\n ");
+    }
 
-        socket_cliente = clientes_aprovados[i].socket;
+    if (caminho_unix[0] != '@')
+    {
+        unlink(caminho_unix);
+    }
 
-        if (FD_ISSET(socket_cliente, readfds) == 0)
-        {
-            continue;
-        }
+    if (bind(sockfd_unix, (struct sockaddr *)&unix_addr, tamanho_endereco) < 0)
+    {
+        error("\n Erro ao vincular o socket Unix ao caminho\n ");
+    }
+
+    if (listen(sockfd_unix, MAX_CLIENTS) < 0)
+    {
+        error("\n Erro ao aguardar por conexões no socket Unix\n ");
+    }
 
 #ifdef MODO_DEBUGER
-        printf("\n Há atividade no cliente %d\n", socket_cliente);
+    printf("\n Criei o socket Unix %d do servidor em %s\n", sockfd_unix, caminho_unix);
 #endif
+}
 
-        // Receber a mensagem do cliente
-        memset(buffer, 0, tamanho_buffer);
+// Cria o worker na posição indicada. Retorna 1 no processo worker, que segue para o laço principal,
+// e 0 no supervisor
+int cria_worker(int indice)
+{
+    pid_t pid;
+    sigset_t sinais_filho;
 
-        if (recebe_mensagem(socket_cliente, buffer, tamanho_buffer) <= 0)
-        {
-            snprintf(string_erro_cliente, TAMANHO_BUFFER, "\n Erro ao receber a mensagem, desconectando cliente %d", socket_cliente);
+    pid = fork();
+    if (pid < 0)
+    {
+        perror("\n Erro ao criar worker");
+        return 0;
+    }
 
-            perror(string_erro_cliente);
+    if (pid == 0)
+    {
+        indice_worker = indice;
+        tamanho_lote_barramento = 0;
 
-            // Desconectar o cliente
-            close(socket_cliente);
-            clientes_sockets[i] = 0;
-            clientes_aprovados[i].socket = 0;
-            continue;
-        }
+        // Referências deixadas na fila pelo worker que caiu são de clientes que já não estão aqui
+        consome_barramento(clientes_aprovados, 0);
+
+        sigemptyset(&sinais_filho);
+        sigaddset(&sinais_filho, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &sinais_filho, NULL);
 
 #ifdef MODO_DEBUGER
-        printf("\n Mensagem recebida: %s\n", buffer);
+        printf("\n Worker %d iniciado (pid %d)\n", indice, getpid());
 #endif
-
-        // Enviar a mensagem para os outros clientes conectados
-        broadcast_message(socket_cliente, buffer, clientes_sockets, maxClients);
+        return 1;
     }
+
+    pids_workers[indice] = pid;
+
+    return 0;
 }
 
-// Verifica se há novas mensagens em algum socket de cliente. Se houver, envia mensagem recebida para outros clientes
-void recebe_envia_mensagens_clientes(int clientes_sockets[], Cliente clientes_aprovados[], int maxClients, fd_set *readfds, char buffer[], int tamanho_buffer)
+// Laço do supervisor: recria os workers que caem, de modo que a queda de um worker desconecta apenas os
+// seus clientes, e repassa SIGINT/SIGTERM/SIGHUP aos workers, que encerram gradualmente. Retorna apenas no
+// processo de um worker recriado
+void supervisiona_workers()
 {
-    int i, socket_cliente;
-    char string_erro_cliente[100];
-
-    for (i = 0; i < maxClients; i++)
+    int i, status, ativos = total_workers, encerrando = 0;
+    pid_t pid;
+    sigset_t sinais;
+    siginfo_t info;
+
+    sigemptyset(&sinais);
+    sigaddset(&sinais, SIGINT);
+    sigaddset(&sinais, SIGTERM);
+    sigaddset(&sinais, SIGCHLD);
+    sigaddset(&sinais, SIGHUP);
+
+    while (ativos > 0)
     {
-        socket_cliente = clientes_aprovados[i].socket;
-
-        if (FD_ISSET(socket_cliente, readfds) == 0)
+        if (sigwaitinfo(&sinais, &info) < 0)
         {
             continue;
         }
 
-#ifdef MODO_DEBUGER
-        printf("\n Há atividade no cliente %d\n", socket_cliente);
-#endif
+        // Cada worker recarrega a sua moderação
+        if (info.si_signo == SIGHUP)
+        {
+            for (i = 0; i < total_workers; i++)
+            {
+                if (pids_workers[i] > 0)
+                {
+                    kill(pids_workers[i], SIGHUP);
+                }
+            }
+            continue;
+        }
 
-        // Receber a mensagem do cliente
-        memset(buffer, 0, tamanho_buffer);
+        if (info.si_signo != SIGCHLD)
+        {
+            encerrando = 1;
+            for (i = 0; i < total_workers; i++)
+            {
+                if (pids_workers[i] > 0)
+                {
+                    kill(pids_workers[i], SIGTERM);
+                }
+            }
+            continue;
+        }
 
-        if (recebe_mensagem(socket_cliente, buffer, tamanho_buffer) <= 0)
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
         {
-            snprintf(string_erro_cliente, TAMANHO_BUFFER, "\n Erro ao receber a mensagem, desconectando cliente %d", socket_cliente);
+            for (i = 0; i < total_workers && pids_workers[i] != pid; i++)
+                ;
 
-            perror(string_erro_cliente);
+            if (i == total_workers)
+            {
+                continue;
+            }
+
+            pids_workers[i] = 0;
+
+            if (!encerrando && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+            {
+                fprintf(stderr, "\n Worker %d caiu; apenas os seus clientes foram desconectados. Vou recriá-lo\n", i);
+
+                if (cria_worker(i))
+                {
+                    return;
+                }
+
+                if (pids_workers[i] > 0)
+                {
+                    continue;
+                }
+            }
 
-            // Desconectar o cliente
-            close(socket_cliente);
-            clientes_sockets[i] = 0;
-            clientes_aprovados[i].socket = 0;
-            continue;
+            ativos--;
         }
+    }
 
 #ifdef MODO_DEBUGER
-        printf("\n Mensagem recebida: %s\n", buffer);
+    printf("\n Todos os workers encerraram\n");
 #endif
 
-        // Enviar a mensagem para os outros clientes conectados
-        broadcast_message(socket_cliente, buffer, clientes_sockets, maxClients);
-    }
+    exit(0);
 }
 
-// Confirma se a mensagem de boas vindas que o cliente recebeu estava correta e, estando, o aprova para comunicação
-int confirma_mensagem_aprovacao(int indice_cliente, int clientes_pendentes[], char buffer[], Cliente clientes_aprovados[])
+// Divide o atendimento entre workers pré-criados que compartilham o socket do servidor. Cada worker
+// aceita e atende as suas conexões, e as mensagens de sala passam de um worker aos demais pelo barramento.
+// Retorna apenas nos processos worker
+void inicia_workers()
 {
     int i;
-    int retorno_cliente;
-    char mensagem_aprovacao[TAMANHO_BUFFER];
+    sigset_t sinais;
 
-    snprintf(mensagem_aprovacao, TAMANHO_BUFFER, "Usuário %s aprovado!", clientes_aprovados[indice_cliente].nome);
-
-#ifdef MODO_DEBUGER
-    printf("\n Usuário aceitou aprovação?\n");
-    printf(" Buffer: %s\n", buffer);
-    printf(" Mensagem_aprovacao: %s\n", mensagem_aprovacao);
-#endif
+    cria_barramento();
 
-    if (strcmp(buffer, mensagem_aprovacao))
+    // Vários workers esperam no mesmo socket; quem não conseguir aceitar a conexão segue adiante
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    if (sockfd_unix > 0)
     {
-        return -2;
+        fcntl(sockfd_unix, F_SETFL, fcntl(sockfd_unix, F_GETFL) | O_NONBLOCK);
     }
 
-#ifdef MODO_DEBUGER
-    printf("\n Sim!\n");
-#endif
-
-    clientes_aprovados[indice_cliente].socket = clientes_pendentes[indice_cliente];
-
-    snprintf(mensagem_aprovacao, TAMANHO_BUFFER, "Seja bem vindo ao comunicador! Segue abaixo a lista de usuarios ativos no sistema para envio de mensagens:", buffer);
-
-    retorno_cliente = envia_mensagem(clientes_aprovados[indice_cliente].socket, mensagem_aprovacao, strlen(mensagem_aprovacao));
+    sigemptyset(&sinais);
+    sigaddset(&sinais, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sinais, NULL);
 
-    if (retorno_cliente <= 0)
+    for (i = 0; i < total_workers; i++)
     {
-        return retorno_cliente;
+        if (cria_worker(i))
+        {
+            return;
+        }
     }
 
-    strncpy(mensagem_aprovacao, "0 - Envio a todos os usuários", TAMANHO_BUFFER);
+    supervisiona_workers();
+}
 
-    retorno_cliente = envia_mensagem(clientes_aprovados[indice_cliente].socket, mensagem_aprovacao, strlen(mensagem_aprovacao));
+// Fixa a thread do laço principal no núcleo do perfil de baixa latência; cada worker usa o núcleo seguinte
+// ao do anterior. Chamada depois de criar a pool, cujas threads herdariam a afinidade
+void fixa_nucleo()
+{
+    cpu_set_t nucleos;
+    int nucleo = nucleo_baixa_latencia + (indice_worker > 0 ? indice_worker : 0);
 
-    if (retorno_cliente <= 0)
+    if (nucleo_baixa_latencia < 0)
     {
-        return retorno_cliente;
+        return;
     }
 
-    for (i = 0; i < MAX_CLIENTS; i++)
+    CPU_ZERO(&nucleos);
+    CPU_SET(nucleo, &nucleos);
+
+    if (sched_setaffinity(0, sizeof(nucleos), &nucleos) < 0)
     {
-        if ((clientes_aprovados[i].socket == 0) || (i == indice_cliente))
-        {
-            continue;
-        }
+        error("\n Erro ao fixar o laço principal no núcleo");
+    }
 
-        snprintf(mensagem_aprovacao, TAMANHO_BUFFER, "%d - %s", clientes_aprovados[i].socket, clientes_aprovados[i].nome);
+#ifdef MODO_DEBUGER
+    printf("\n Laço principal fixado no núcleo %d\n", nucleo);
+#endif
+}
 
-        retorno_cliente = envia_mensagem(clientes_aprovados[indice_cliente].socket, mensagem_aprovacao, strlen(mensagem_aprovacao));
+// Aguarda atividade nos descritores. No perfil comum, o select dorme até algum descritor ficar pronto ou a
+// espera vencer. No perfil de baixa latência, o select é repetido sem bloquear até que algo fique pronto: a
+// thread nunca dorme, e a mensagem que chega não espera o escalonador acordá-la. Mesmo retorno do select
+int aguarda_atividade(int max_socket, fd_set *readfds, fd_set *writefds, struct timeval *espera)
+{
+    int prontos;
+    long long prazo_us;
+    fd_set leitura, escrita;
+    struct timeval sem_espera;
 
-        if (retorno_cliente <= 0)
-        {
-            return retorno_cliente;
-        }
+    if (nucleo_baixa_latencia < 0)
+    {
+        return select(max_socket + 1, readfds, writefds, NULL, espera);
     }
 
-    strncpy(mensagem_aprovacao, "Para enviar mensagens através deste comunicador, primeiro envie o número identificador do usuário e, logo após, a mensagem desejada.", TAMANHO_BUFFER);
+    prazo_us = espera != NULL ? agora_us() + espera->tv_sec * 1000000LL + espera->tv_usec : -1;
 
-    retorno_cliente = envia_mensagem(clientes_aprovados[indice_cliente].socket, mensagem_aprovacao, strlen(mensagem_aprovacao));
+    do
+    {
+        leitura = *readfds;
+        escrita = *writefds;
+        sem_espera.tv_sec = 0;
+        sem_espera.tv_usec = 0;
 
-    if (retorno_cliente <= 0)
+        prontos = select(max_socket + 1, &leitura, &escrita, NULL, &sem_espera);
+    } while (prontos == 0 && (prazo_us < 0 || agora_us() < prazo_us));
+
+    if (prontos >= 0)
     {
-        return retorno_cliente;
+        *readfds = leitura;
+        *writefds = escrita;
     }
 
-    return -7; // Caso de aprovação aproveitando valor de retorno negativo livre
+    return prontos;
 }
 
-// Verifica recebimento de nomes válidos dos novos funcionários. Se o nome for aprovado, chama função para enviar mensagem de boas vindas e a lista de usuários aprovados.
-void trata_aprovacao_clientes(int clientes_sockets[], int clientes_pendentes[], Cliente clientes_aprovados[], int maxClients, fd_set *readfds, char buffer[], int tamanho_nome)
+int main(int argc, char *argv[])
 {
-    int i, retorno_cliente;
-    char mensagem_aprovacao[TAMANHO_BUFFER];
-    char string_erro_cliente[100];
+    int opcao, max_socket_cliente, tem_tls_pendente, tem_barramento_pendente, tem_handshake_pendente;
+    long long restante_ms, restante_us;
+    int herdar_conexoes = 0;
+    int usar_tls = 0;
+    char *certificado_tls = NULL, *chave_tls = NULL;
+    static int clientes_pendentes[MAX_CLIENTS]; // estático, para começar zerado como os demais arrays da tabela
 
-    for (i = 0; i < maxClients; i++)
+    char buffer[TAMANHO_BUFFER];
+    fd_set readfds, writefds; // conjuntos de descritores para o select
+    struct timeval espera;
+    sigset_t sinais_tratados;
+
+    // -H: assume as conexões do binário em execução; -t: caminho do socket Unix de troca;
+    // -p: porta do servidor; -n: identificador na federação; -P endereco:porta: servidor par (repetível);
+    // -u: caminho do socket Unix do servidor; -c e -k: certificado e chave para TLS no socket TCP;
+    // -w: número de processos worker; -T: número de threads da pool de processamento das mensagens;
+    // -m: arquivo de termos de moderação; -L núcleo: perfil de baixa latência, com o laço fixado no núcleo;
+    // -g: arquivo de captura dos quadros recebidos, reproduzidos depois com replay_chat;
+    // -b microssegundos: janela máxima dos lotes de mensagens de sala para cada destinatário;
+    // -M diretório: caixas postais das mensagens privadas para usuários desconectados;
+    // -S diretório: log das mensagens de sala e índice da busca
+    while ((opcao = getopt(argc, argv, "Ht:p:n:P:K:u:c:k:w:T:m:L:g:b:M:S:")) != -1)
     {
-        if (clientes_pendentes[i] == 0)
+        switch (opcao)
         {
-            continue;
-        }
+        case 'S':
+            diretorio_busca = optarg;
+            break;
 
-        if (FD_ISSET(clientes_pendentes[i], readfds) == 0)
-        {
-            continue;
-        }
+        case 'M':
+            diretorio_caixas = optarg;
+            break;
 
-#ifdef MODO_DEBUGER
-        printf("\n Há atividade no cliente %d\n", clientes_pendentes[i]);
-#endif
+        case 'b':
+            janela_lote_max_us = atoll(optarg);
+            break;
 
-        memset(buffer, 0, TAMANHO_BUFFER);
+        case 'g':
+            caminho_captura = optarg;
+            break;
 
-        if (recebe_mensagem(clientes_pendentes[i], buffer, tamanho_nome) <= 0)
-        {
-            snprintf(string_erro_cliente, TAMANHO_BUFFER, "\n Erro ao receber a mensagem, desconectando cliente %d", clientes_pendentes[i]);
+        case 'L':
+            nucleo_baixa_latencia = atoi(optarg);
+            break;
 
-            perror(string_erro_cliente);
+        case 'm':
+            caminho_moderacao = optarg;
+            break;
 
-            deconecta_cliente(i, clientes_sockets, clientes_pendentes, clientes_aprovados);
-            continue;
-        }
+        case 'T':
+            total_threads_pool = atoi(optarg);
+            break;
 
-#ifdef MODO_DEBUGER
-        printf("\n Nome recebido do cliente: %s\n", buffer);
-#endif
+        case 'w':
+            total_workers = atoi(optarg);
+            break;
 
-        if (clientes_aprovados[i].nome[0] == '\0')
-        {
-            strncpy(clientes_aprovados[i].nome, buffer, tamanho_nome);
-            snprintf(mensagem_aprovacao, TAMANHO_BUFFER, "Usuário %s aprovado!", buffer);
+        case 'c':
+            certificado_tls = optarg;
+            break;
 
-            retorno_cliente = envia_mensagem(clientes_pendentes[i], mensagem_aprovacao, strlen(mensagem_aprovacao));
-        }
-        else
-        {
-            retorno_cliente = confirma_mensagem_aprovacao(i, clientes_pendentes, buffer, clientes_aprovados);
-        }
+        case 'k':
+            chave_tls = optarg;
+            break;
 
-        switch (retorno_cliente)
-        {
-        case 0:
-            snprintf(string_erro_cliente, TAMANHO_BUFFER, "\n Conexão encerrada, desconectando cliente %d", clientes_pendentes[i]);
-            perror(string_erro_cliente);
+        case 'u':
+            caminho_unix = optarg;
+            break;
 
-            deconecta_cliente(i, clientes_sockets, clientes_pendentes, clientes_aprovados);
+        case 'p':
+            porta_servidor = atoi(optarg);
             break;
 
-        case -1:
-            snprintf(string_erro_cliente, TAMANHO_BUFFER, "\n Erro ao enviar a mensagem, desconectando cliente %d", clientes_pendentes[i]);
-            perror(string_erro_cliente);
+        case 'n':
+            id_no = atoi(optarg);
+            break;
 
-            deconecta_cliente(i, clientes_sockets, clientes_pendentes, clientes_aprovados);
+        case 'P':
+            adiciona_par_configurado(optarg);
             break;
 
-        case -2:
-            snprintf(string_erro_cliente, TAMANHO_BUFFER, "\n Mensagem de confirmação diferente do que o esperado, desconectando cliente %d", clientes_pendentes[i]);
-            perror(string_erro_cliente);
+        case 'K':
+            segredo_pares = optarg;
+            break;
 
-            deconecta_cliente(i, clientes_sockets, clientes_pendentes, clientes_aprovados);
+        case 'H':
+            herdar_conexoes = 1;
             break;
 
-        case -7:
-            // Caso de aprovação aproveitando valor de retorno negativo livre
-#ifdef MODO_DEBUGER
-            printf("\n Usuário aprovado\n");
-#endif
+        case 't':
+            caminho_troca = optarg;
             break;
 
         default:
-            break;
+            fprintf(stderr, "Uso: %s [-H] [-t caminho_troca] [-p porta] [-n id_no] [-P endereco:porta]... [-K segredo_pares] [-u caminho_unix] [-c certificado -k chave] [-w workers] [-T threads] [-m moderacao] [-L nucleo] [-g captura] [-b janela_us] [-M caixas_postais] [-S busca]\n", argv[0]);
+            exit(1);
         }
     }
-}
-
-// Prepara descritor de arquivos com os sockets do servidor e dos clientes para o select
-void prepara_descritor_arquivos(int clientes_sockets[], fd_set *readfds, int *max_socket_cliente)
-{
-    int i, socket_cliente;
-
-    // Limpar os conjuntos de descritores
-    FD_ZERO(readfds);
-    FD_SET(sockfd, readfds);
-    *max_socket_cliente = sockfd;
 
-    for (i = 0; i < MAX_CLIENTS; i++)
+    if (total_workers < 0 || total_workers > MAX_WORKERS || (total_workers > 0 && (herdar_conexoes || pares[0].endereco[0] || diretorio_caixas != NULL)))
     {
-        socket_cliente = clientes_sockets[i];
-        if (socket_cliente > 0)
-        {
-            FD_SET(socket_cliente, readfds);
-        }
-        if (socket_cliente > *max_socket_cliente)
-        {
-            *max_socket_cliente = socket_cliente;
-        }
+        fprintf(stderr, "Use de 1 a %d workers, sem troca do binário (-H), federação (-P) nem caixas postais (-M)\n", MAX_WORKERS);
+        exit(1);
     }
-}
 
-// Adiciona um novo socket de cliente aos arrays para aguardar aprovação
-void adiciona_novo_cliente(int new_sockfd, int clientes_sockets[], int clientes_pendentes[], int max_clients)
-{
-    int i;
+    // O segredo segue numa única palavra na identificação; sem ele, links configurados seriam sempre recusados
+    if ((segredo_pares != NULL && (segredo_pares[0] == '\0' || strlen(segredo_pares) > TAMANHO_SEGREDO_PAR || strpbrk(segredo_pares, " \t\r\n") != NULL)) ||
+        (segredo_pares == NULL && pares[0].endereco[0]))
+    {
+        fprintf(stderr, "A federação (-P) exige o segredo dos pares (-K), com até %d caracteres e sem espaços\n", TAMANHO_SEGREDO_PAR);
+        exit(1);
+    }
 
-    for (i = 0; i < max_clients; i++)
+    if (total_threads_pool < 0 || total_threads_pool > MAX_THREADS_POOL)
     {
-        if (clientes_sockets[i] != 0)
-        {
-            continue;
-        }
+        fprintf(stderr, "Use de 0 a %d threads na pool\n", MAX_THREADS_POOL);
+        exit(1);
+    }
 
-        clientes_sockets[i] = new_sockfd;
-        clientes_pendentes[i] = new_sockfd;
+    if (nucleo_baixa_latencia >= CPU_SETSIZE || (nucleo_baixa_latencia >= 0 && nucleo_baixa_latencia + total_workers > sysconf(_SC_NPROCESSORS_ONLN)))
+    {
+        fprintf(stderr, "O núcleo do perfil de baixa latência (-L) e os dos workers devem existir\n");
+        exit(1);
+    }
 
-        break;
+    if (janela_lote_max_us < 0 || janela_lote_max_us > 1000000)
+    {
+        fprintf(stderr, "Use uma janela de lote (-b) de 0 a 1000000 microssegundos\n");
+        exit(1);
     }
-}
 
-// Verifica se há uma nova conexão
-void verifica_novas_conexoes(int sockfd, int clientes_sockets[], int clientes_pendentes[], fd_set *readfds, char buffer[], int tamanho_buffer)
-{
-    int new_sockfd;
-    struct sockaddr_in client_addr;
-    socklen_t client_len;
+#if defined(__x86_64__) || defined(__i386__)
+    usar_ssse3 = __builtin_cpu_supports("ssse3");
+    usar_avx2 = __builtin_cpu_supports("avx2");
+#endif
 
-    if (FD_ISSET(sockfd, readfds))
+    if (caminho_moderacao != NULL)
     {
-        new_sockfd = accept(sockfd, (struct sockaddr *)&client_addr, &client_len);
-        if (new_sockfd < 0)
+        moderacao_atual = compila_moderacao(caminho_moderacao);
+        if (moderacao_atual == NULL)
         {
-            error("\n Erro ao aceitar a conexão\n ");
+            exit(1);
         }
 
-        // Armazena e envia a mensagem de boas vindas para o cliente recém conectado
-        snprintf(buffer, tamanho_buffer, "Bem vindo, cliente %d! Digite seu nome de usuário com até 100 caracteres para ser aprovado no comunicador.", new_sockfd);
+        etapas_mensagem[total_etapas++] = modera_mensagem;
+    }
 
-        if (envia_mensagem(new_sockfd, buffer, strlen(buffer)) < 0)
+    if (certificado_tls != NULL || chave_tls != NULL)
+    {
+#ifdef COM_TLS
+        if (certificado_tls == NULL || chave_tls == NULL)
         {
-            error("\n Erro ao enviar a mensagem para o cliente conectado\n ");
+            fprintf(stderr, "TLS exige o certificado (-c) e a chave (-k)\n");
+            exit(1);
         }
 
-        // Adicionar o novo socket dos clientes ao array
-        adiciona_novo_cliente(new_sockfd, clientes_sockets, clientes_pendentes, MAX_CLIENTS);
-
-#ifdef MODO_DEBUGER
-        printf("\n Adicionei novo socket de clientes\n");
+        inicia_tls(certificado_tls, chave_tls);
+        usar_tls = 1;
+#else
+        fprintf(stderr, "Servidor compilado sem suporte a TLS (compile com -DCOM_TLS -lssl -lcrypto)\n");
+        exit(1);
 #endif
     }
-#ifdef MODO_DEBUGER
-    else
+
+    if (id_no == 0)
     {
-        printf("\n Nenhum novo cliente. Vou verificar recebimento e tratamento de mensagens.\n");
+        id_no = porta_servidor;
     }
-#endif
-}
 
-int main()
-{
-    int i, max_socket_cliente;
-    int optval = 1; // valor da opção SO_REUSEADDR
-    int clientes_pendentes[MAX_CLIENTS];
+    // A sequência parte do relógio para continuar crescente depois de reinícios deste servidor
+    sequencia_no = (unsigned long long)time(NULL) << 20;
+    sequencia_historico = sequencia_no;
 
-    char buffer[TAMANHO_BUFFER];
-    struct sockaddr_in server_addr;
-    fd_set readfds; // conjunto de descritores para o select
+    // Os arrays da tabela de conexões começam zerados e cada posição é preparada na primeira vez que é
+    // ocupada, de modo que só as posições já usadas ocupam memória residente
 
-    Cliente clientes_aprovados[MAX_CLIENTS];
+    // Tratamento de sinais: SIGINT, SIGTERM e SIGHUP são bloqueados e entregues pelo signalfd ao laço principal
+    sigemptyset(&sinais_tratados);
+    sigaddset(&sinais_tratados, SIGINT);
+    sigaddset(&sinais_tratados, SIGTERM);
+    sigaddset(&sinais_tratados, SIGHUP);
 
-    // Criar o socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
+    if (sigprocmask(SIG_BLOCK, &sinais_tratados, NULL) < 0)
     {
-        error("\n Erro ao criar o socket\n ");
+        error("\n Erro ao bloquear os sinais tratados\n ");
     }
 
-#ifdef MODO_DEBUGER
-    printf("\n Criei o socket %d do servidor\n", sockfd);
-#endif
+    sinalfd = signalfd(-1, &sinais_tratados, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sinalfd < 0)
+    {
+        error("\n Erro ao criar o signalfd\n ");
+    }
 
-    // Configurar o endereço do servidor
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SERVER_PORT);
+    // Envio para cliente que já fechou a conexão é tratado pelo retorno do send, que desconecta apenas esse cliente
+    signal(SIGPIPE, SIG_IGN);
 
-    // Configurar a opção SO_REUSEADDR
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0)
+    if (herdar_conexoes)
     {
-        error("\n Erro ao configurar a opção SO_REUSEADDR\n ");
+        herda_estado(clientes_pendentes, clientes_aprovados);
     }
-
-    // Vincular o socket ao endereço
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    else
     {
-        error("\n Erro ao vincular o socket ao endereço\n ");
+        cria_socket_servidor();
     }
 
-#ifdef MODO_DEBUGER
-    printf("\n Vinculei o socket ao endereço e vou esperar conexões\n");
-#endif
-
-    // Tratamento de sinais
-    sigset(SIGINT, fecha_conexao);
-    sigset(SIGILL, fecha_conexao);
-    sigset(SIGTERM, fecha_conexao);
-    sigset(SIGSEGV, fecha_conexao);
-
-    // Esperar por conexões
-    if (listen(sockfd, MAX_CLIENTS) < 0)
+    // O socket Unix herdado é mantido; ele só é criado se ainda não existir
+    if (caminho_unix != NULL && sockfd_unix == 0)
     {
-        error("\n Erro ao aguardar por conexões\n ");
+        cria_socket_unix();
     }
 
-#ifdef MODO_DEBUGER
-    printf("\n Inicializarei array de sockets\n");
-#endif
-
-    // Inicializar os arrays de sockets
-    for (i = 0; i < MAX_CLIENTS; i++)
+    if (total_workers > 0)
     {
-        clientes_sockets[i] = 0;
-        clientes_pendentes[i] = 0;
-        clientes_aprovados[i].socket = 0;
-        clientes_aprovados[i].nome[0] = '\0';
+        inicia_workers();
     }
+    else
+    {
+        // Aguardar o próximo binário somente depois de herdar, para assumir o caminho de troca do anterior
+        cria_socket_troca();
+    }
+
+    // Cada worker tem a sua pool e a sua captura
+    inicia_pool();
+    inicia_captura();
+    inicia_caixas_postais();
+    inicia_busca();
+
+    fixa_nucleo();
 
     while (1)
     {
+        conecta_pares();
+
+        atualiza_anel(clientes_aprovados);
+
         prepara_descritor_arquivos(clientes_sockets, &readfds, &max_socket_cliente);
 
+        prepara_transferencias(&readfds, &writefds, &max_socket_cliente);
+
+        prepara_conexoes_pares(&readfds, &writefds, &max_socket_cliente);
+
+        tem_handshake_pendente = prepara_handshakes(&readfds, &writefds, &max_socket_cliente);
+
+        prepara_lotes(&writefds, &max_socket_cliente);
+
 #ifdef MODO_DEBUGER
         printf("\n Adicionei sockets de clientes prontos para o select\n");
 #endif
 
-        if (select(max_socket_cliente + 1, &readfds, NULL, NULL, NULL) < 0)
+        // Com pares configurados, o select acorda periodicamente para refazer os links que caíram; com
+        // handshakes TLS em andamento, para descartar os que estourarem o prazo
+        espera.tv_sec = INTERVALO_RECONEXAO_PAR_MS / 1000;
+        espera.tv_usec = (INTERVALO_RECONEXAO_PAR_MS % 1000) * 1000;
+
+        // Com eventos efêmeros pendentes, o select acorda no fim da janela para despachá-los
+        if (despacho_eventos_ms != 0)
+        {
+            restante_ms = despacho_eventos_ms - agora_ms();
+            restante_ms = restante_ms < 0 ? 0 : restante_ms;
+
+            if (restante_ms < INTERVALO_RECONEXAO_PAR_MS)
+            {
+                espera.tv_sec = restante_ms / 1000;
+                espera.tv_usec = (restante_ms % 1000) * 1000;
+            }
+        }
+
+        // Com lotes de mensagens pendentes, o select acorda no fim da janela mais próxima
+        if (proximo_despacho_lotes_us != 0)
+        {
+            restante_us = proximo_despacho_lotes_us - agora_us();
+            restante_us = restante_us < 0 ? 0 : restante_us;
+
+            if (restante_us < espera.tv_sec * 1000000LL + espera.tv_usec)
+            {
+                espera.tv_sec = restante_us / 1000000;
+                espera.tv_usec = restante_us % 1000000;
+            }
+        }
+
+        // Dados TLS já decifrados em memória e mensagens já publicadas no barramento não acordam o select,
+        // que então não deve bloquear
+        tem_tls_pendente = marca_tls_pendentes(&readfds);
+        tem_barramento_pendente = barramento_pendente();
+        if (tem_tls_pendente || tem_barramento_pendente)
+        {
+            espera.tv_sec = 0;
+            espera.tv_usec = 0;
+        }
+
+        if (aguarda_atividade(max_socket_cliente, &readfds, &writefds, (pares[0].endereco[0] || tem_handshake_pendente || tem_tls_pendente || tem_barramento_pendente || despacho_eventos_ms || proximo_despacho_lotes_us) ? &espera : NULL) < 0)
         {
             error("\n Erro ao aguardar por atividade\n ");
         }
 
+        marca_tls_pendentes(&readfds);
+
 #ifdef MODO_DEBUGER
         printf("\n Realizei select\n");
 #endif
 
-        verifica_novas_conexoes(sockfd, clientes_sockets, clientes_pendentes, &readfds, buffer, TAMANHO_BUFFER);
+        verifica_sinais(&readfds);
+
+        verifica_pedido_troca(&readfds, clientes_pendentes, clientes_aprovados);
+
+        trata_pares(&readfds);
+
+        trata_conexoes_pares(&readfds, &writefds, clientes_aprovados);
+
+        trata_barramento(&readfds, clientes_aprovados);
+
+        trata_pool(&readfds, clientes_aprovados);
+
+        trata_busca(&readfds, clientes_aprovados);
 
-        trata_aprovacao_clientes(clientes_sockets, clientes_pendentes, clientes_aprovados, MAX_CLIENTS, &readfds, buffer, TAMANHO_NOME);
+        trata_transferencias(&readfds, &writefds);
 
-        trata_clientes_aprovados(clientes_sockets, clientes_aprovados, MAX_CLIENTS, &readfds, buffer, TAMANHO_BUFFER);
+        trata_handshakes(&readfds, &writefds, clientes_sockets, clientes_pendentes, buffer, TAMANHO_BUFFER);
+
+        verifica_novas_conexoes(sockfd, usar_tls, clientes_sockets, clientes_pendentes, &readfds, buffer, TAMANHO_BUFFER);
+
+        verifica_novas_conexoes(sockfd_unix, 0, clientes_sockets, clientes_pendentes, &readfds, buffer, TAMANHO_BUFFER);
+
+        trata_aprovacao_clientes(clientes_sockets, clientes_pendentes, clientes_aprovados, limite_clientes, &readfds, buffer, TAMANHO_NOME);
+
+        trata_clientes_aprovados(clientes_sockets, clientes_aprovados, limite_clientes, &readfds, buffer, TAMANHO_BUFFER);
+
+        despacha_eventos(clientes_aprovados);
+
+        despacha_lotes(0, &writefds);
+
+        entrega_lote_barramento();
     }
 
     // Fechar o socket do servidor
     close(sockfd);
 
     return 0;
-}
\ No newline at end of file
+}